@@ -18,13 +18,49 @@
  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
 
+#include <avr/sleep.h>
 #include <avr/wdt.h>
-#include <Wire.h>
-#include <LiquidTWI2.h>
+#include <util/atomic.h>
+#include <AsyncTWI.h>
+#include <AsyncUART.h>
+#include <LogTokens.h>
+#include <TwiLCD.h>
+#include <ShadowLCD.h>
 #include <PWM.h>
+#include <AnalogSampler.h>
+#include <FastPin.h>
+#include <FixedPoint.h>
+#include <SampleFilters.h>
+#include <SenseBaseline.h>
+#include <TaskRunner.h>
 #include <EEPROM.h>
 
 #define LCD_I2C_ADDR 0x20 // for adafruit shield or backpack
+// Nothing but the LCD is on the bus.
+#define I2C_CLOCK_HZ TWI_FAST_HZ
+
+// On a Mega (ATmega640, 1280 or 2560), there are the pins and the timers for more than two
+// outlets. They're laid out in the Mega pin assignments below.
+#if defined(__AVR_ATmega640__) || defined(__AVR_ATmega1280__) || defined(__AVR_ATmega2560__)
+#define MEGA_HYDRA
+#endif
+
+// How many outlets? The reference design has two. A Mega Hydra can have three or four.
+#ifdef MEGA_HYDRA
+#define CAR_COUNT 4
+#else
+#define CAR_COUNT 2
+#endif
+
+// Two cars fit on a 16x2 display, under the status line. Any more need a 20x4 one (TwiLCD
+// addresses the bottom two lines the way a 20 column display lays them out).
+#if CAR_COUNT > 2
+#define LCD_COLS 20
+#define LCD_ROWS 4
+#else
+#define LCD_COLS 16
+#define LCD_ROWS 2
+#endif
 
 // By historical accident, car B is actually
 // the lower pin number in most cases.
@@ -56,13 +92,21 @@
 #undef GROUND_TEST
 #endif
 
+// If the LCD shield's MCP23017 has its INTA wired to BUTTON_INT_PIN, then uncomment this,
+// and the buttons will only be read over i2c when one of them changes, not polled.
+//#define BUTTON_INTERRUPT
+
 // After the relay changes state, don't bomb on relay errors for this long.
 #define RELAY_TEST_GRACE_TIME 500
 
 #ifdef GROUND_TEST
 
-// This must be high at all times while charging either car, or else it's a ground failure.
+// This must be high at all times while charging any car, or else it's a ground failure.
+#ifdef MEGA_HYDRA
+#define GROUND_TEST_PIN 30
+#else
 #define GROUND_TEST_PIN 6
+#endif
 
 #endif
 
@@ -75,7 +119,47 @@
 
 #define OUTGOING_PROXIMITY_PIN  4
 
-#ifndef SWAP_CARS
+#ifdef BUTTON_INTERRUPT
+// The LCD shield's MCP23017 pulls its INTA low when a button changes. It has to be
+// wired to a pin on pin change interrupt 2 (see buttonInterrupt()).
+#ifdef MEGA_HYDRA
+#define BUTTON_INT_PIN          A8
+#else
+#define BUTTON_INT_PIN          5
+#endif
+#endif
+
+#ifdef MEGA_HYDRA
+// Timer1 makes the pilots for cars A and B, and Timer4 the ones for cars C and D. Timer4
+// is kept in step with Timer1 (see syncPilotTimers()), because it's Timer1 that starts
+// the pilot sense conversions.
+#define CAR_A_PILOT_OUT_PIN     11
+#define CAR_B_PILOT_OUT_PIN     12
+#define CAR_C_PILOT_OUT_PIN     6
+#define CAR_D_PILOT_OUT_PIN     7
+
+#define CAR_A_RELAY             22
+#define CAR_B_RELAY             23
+#define CAR_C_RELAY             24
+#define CAR_D_RELAY             25
+
+#ifdef RELAY_TEST
+#define CAR_A_RELAY_TEST        26
+#define CAR_B_RELAY_TEST        27
+#define CAR_C_RELAY_TEST        28
+#define CAR_D_RELAY_TEST        29
+#endif
+
+// ---------- ANALOG PINS ----------
+#define CAR_A_PILOT_SENSE_PIN   0
+#define CAR_B_PILOT_SENSE_PIN   1
+#define CAR_C_PILOT_SENSE_PIN   2
+#define CAR_D_PILOT_SENSE_PIN   3
+#define CAR_A_CURRENT_PIN       4
+#define CAR_B_CURRENT_PIN       5
+#define CAR_C_CURRENT_PIN       6
+#define CAR_D_CURRENT_PIN       7
+#elif !defined(SWAP_CARS)
 #define CAR_A_PILOT_OUT_PIN     10
 #define CAR_B_PILOT_OUT_PIN     9
 
@@ -130,14 +214,41 @@
 #define CAR_B_CURRENT_PIN       3
 #endif
 
-// for things like erroring out a car
-#define BOTH                    0
-#define CAR_A                   1
-#define CAR_B                   2
+// ---------- A/d SAMPLER SLOTS ----------
+// The A/d converter runs on its interrupt, visiting each of these in turn. Each car has a
+// pilot slot and a current slot. The pilot slots must come first: they're timed to the
+// pilot PWM, and the others fill in between.
+#define SLOT_PILOT(car)         (car)
+#define SLOT_CURRENT(car)       (CAR_COUNT + (car))
+#define SLOT_COUNT              (2 * CAR_COUNT)
+#define SLOT_PILOT_COUNT        CAR_COUNT
+#if SLOT_COUNT > SAMPLER_MAX_CHANNELS
+#error There are more sampler slots than the sampler has channels
+#endif
 
-// Don't use 0 or 1 because that's the value of LOW and HIGH.
-#define HALF                    3
+// The pilot period, in microseconds.
+#define PILOT_PERIOD_US 1000
+
+// How many microseconds pass (on average) between two samples of the same current pin. Each
+// half pilot period has one pilot conversion and as many current ones as fit after it.
+#define CURRENT_SAMPLE_PERIOD_US (((PILOT_PERIOD_US / 2) / SAMPLER_FREE_CONVERSIONS(PILOT_PERIOD_US)) * (SLOT_COUNT - SLOT_PILOT_COUNT))
+
+// Cars are numbered from 0, which is also their place in cars[].
+#define CAR_A                   0
+#define CAR_B                   1
+#define CAR_C                   2
+#define CAR_D                   3
+// for things like erroring out every car
+#define ALL_CARS                0xff
+// for when it's none of them
+#define NO_CAR                  0xfe
+
+// Don't use 0 or 1 because that's the value of LOW and HIGH. SHARE is a share of the
+// incoming pilot, when it's divided among the cars (see sharePilot()). ALLOT is whatever
+// demand mode has given the car (see allotPilot()).
+#define SHARE                   3
 #define FULL                    4
+#define ALLOT                   5
 
 #define STATE_A                 1
 #define STATE_B                 2
@@ -148,7 +259,8 @@
 
 // These are the expected analogRead() ranges for pilot read-back from the cars.
 // These are calculated from the expected voltages seen through the dividor network,
-// then scaling those voltages for 0-1024.
+// then scaling those voltages for 0-1024. Each car's readings are mapped onto this
+// scale by what's been learned of its own +12 and -12 volt levels first (see SenseBaseline).
 
 // 11 volts
 #define STATE_A_MIN      870
@@ -168,6 +280,15 @@
 #define PILOT_0V         556
 // -10 volts. We're fairly generous.
 #define PILOT_DIODE_MAX  250
+// +12 and -12 volts, as nominal as PILOT_0V (which is halfway between them).
+#define PILOT_12V        898
+#define PILOT_N12V       214
+// The CT bias puts no current at mid-scale, give or take its resistors.
+#define CURRENT_0A       512
+
+// How often (in milliseconds) are the learned sense input levels saved to EEPROM (if they've
+// moved)? Writing takes a while, and the EEPROM wears out, so not too often.
+#define BASELINE_SAVE_INTERVAL 3600000
 
 // This is the amount the incoming pilot needs to change for us to react (in milliamps).
 #define PILOT_FUZZ 500
@@ -187,11 +308,16 @@
 #define ERROR_DELAY 3000
 
 // When a car requests state C while the other car is already in state C, we delay them for
-// this long while the other car transitions to half power. THIS INTERVAL MUST BE LONGER
+// up to this long while the other car transitions to half power. THIS INTERVAL MUST BE LONGER
 // THAN THE OVERDRAW_GRACE_PERIOD! (in milliseconds) The spec says it must be shorter than
 // 5000 ms.
 #define TRANSITION_DELAY 4500
 
+// But most cars cut back much sooner than that. Once every car that's charging has drawn no
+// more than its new pilot allows (plus OVERDRAW_GRACE_AMPS) for this long (in milliseconds),
+// the waiting car can go.
+#define HANDOFF_SETTLE_TIME 500
+
 // This is the current limit (in milliamps) of all of the components on the inlet side of the hydra -
 // the inlet itself, any fuses, and the wiring to the common sides of the relays.
 #define MAXIMUM_INLET_CURRENT 75000
@@ -207,29 +333,47 @@
 // This is the amount of current (in milliamps) we subtract from the inlet before apportioning it to the cars.
 #define INLET_CURRENT_DERATE 0
 
-// Amount of time, in milliseconds, we will analyse the duty cycle of the incoming pilot
-// Default is 200 cycles. We're doing a digitalRead(), so this will be thousands of samples.
-#define PILOT_POLL_INTERVAL 25
+// The incoming pilot is timed from its external interrupt, one edge at a time, with micros().
+// That has a 4 us resolution, which is less than a half a percent of a 1 kHz pilot period.
+// If there have been no edges at all for this long (in microseconds), then the pilot is either steady
+// or gone, and either way, there's no current available.
+#define PILOT_LOSS_TIMEOUT 5000
+
+// The most pilot periods that are added together between looks at them. If loop() is held
+// up for longer than that, only the most recent ones count.
+#define PILOT_MAX_PERIODS 64
+
+// Number of pilot sense samples we look at for positive and negative peaks on the car pilot pins.
+// The pilot sense conversions are started by the PWM timer itself, right in the middle of the high
+// half of the pilot and then right in the middle of the low half, with the cars taking turns.
+// So each car gets a high and a low sample every CAR_COUNT ms, away from the edges and their
+// ringing, and that pair is all it takes to know the car's state.
+#define STATE_CHECK_SAMPLES 2
+#if STATE_CHECK_SAMPLES > SAMPLER_RING_SIZE
+#error STATE_CHECK_SAMPLES is more than the sample ring
+#endif
 
-// Amount of time, in milliseconds, we will look for positive and negative peaks on the car
-// pilot pins. It takes around .1 ms to do one read, so we should get a bit less than 200 chances
-// this way.
-#define STATE_CHECK_INTERVAL 20
+// A single pair is no defence against noise, though, so a car is only taken to be in a new
+// state once this many checks in a row (one every PILOT_TASK_PERIOD, each on a pair of its
+// own) have read it. A glitch then has to last 20 ms to be believed, and a real change is
+// acted on no more than 30 ms after it happens, well inside the 100 ms the car allows for
+// the relay to open when it stops asking for power.
+#define STATE_CHECK_CONFIRM 3
 
-// How often (in milliseconds) is the state of both cars logged?
+// How often (in milliseconds) is the state of every car logged?
 #define STATE_LOG_INTERVAL 60000
 
-// This is the number of duty cycle or ammeter samples we keep to make a rolling average to stabilize
-// the display. The balance here is between stability and responsiveness,
+// This is the number of incoming pilot duty cycle samples we keep to make a rolling average to
+// stabilize the display. The balance here is between stability and responsiveness. The average is
+// kept as a running sum, so a bigger window costs only RAM (4 bytes a sample), not time. It must
+// be at least 1, which turns averaging off.
 #define ROLLING_AVERAGE_SIZE 10
 
-// The maximum number of milliseconds to sample an ammeter pin in order to find three zero-crossings.
-// one and a half cycles at 50 Hz is 30 ms.
-#define CURRENT_SAMPLE_INTERVAL 35
-
-// Once we detect a zero-crossing, we should not look for one for another quarter cycle or so. 1/4
-// cycle at 50 Hz is 5 ms.
-#define CURRENT_ZERO_DEBOUNCE_INTERVAL 5
+// The ammeter is kept by the sampler's interrupt handler, which locks onto the mains frequency
+// (50 or 60 Hz - it works out which by itself) from the CT signal and adds up the squares of the
+// samples over windows of exactly one mains cycle. So there's always the latest cycle's RMS ready
+// to read, and because every reading covers a whole cycle, no more and no less, they're steady
+// enough to display without averaging.
 
 // How often (in milliseconds) is the current draw by a car logged?
 #define CURRENT_LOG_INTERVAL 1000
@@ -262,10 +406,49 @@
 
 // Hardware versions 1.0 and beyond have a 6 pin FTDI compatible port laid out on the board.
 // We're going to use this sort of "log4j" style. The log level is 0 for no logging at all
-// (and if it's 0, the Serial won't be initialized), 1 for info level logging (which will
+// (and if it's 0, the serial port won't be initialized), 1 for info level logging (which will
 // simply include state transitions only), or 2 for debugging.
 #define SERIAL_LOG_LEVEL LOG_INFO
+// Log lines are queued and sent from the UART's interrupt (see lib/AsyncUART). Nothing waits
+// for them: a line that doesn't fit in the queue is dropped, and counted. The faster the port,
+// the fewer that are. 9600 is what the Hydra has always talked at. Since nothing waits on the
+// port any more, 115200 is safe too, and drops far fewer lines. With a 16 MHz crystal, 250000
+// is exact, if your terminal can do it.
 #define SERIAL_BAUD_RATE 9600
+// Define this to log in tokens rather than text (see lib/LogTokens): a handful of bytes for
+// each line, with no formatting done here at all. You'll need host/hydra_logdecode to read them.
+//#define LOG_TOKENS
+
+// loop() runs each of these jobs as a task of its own (see TaskRunner.h). How often (in
+// milliseconds) does each come due, and how late may it start before that counts against it?
+// They're listed in order of importance, which is the order they're run in when more than one
+// is due.
+// Ground and relay tests, and the incoming proximity
+#define SAFETY_TASK_PERIOD 10
+#define SAFETY_TASK_SLACK 5
+// The protocol deadlines (see TaskRunner.h). They don't repeat, so this is only their slack.
+#define DEADLINE_TASK_SLACK 5
+// The incoming pilot, the pilot sense and state transitions
+#define PILOT_TASK_PERIOD 10
+#define PILOT_TASK_SLACK 10
+// The ammeters and overdraw checks. The ammeters are updated once per mains cycle.
+#define CURRENT_TASK_PERIOD 20
+#define CURRENT_TASK_SLACK 20
+// Demand mode's look at what the cars are drawing
+#define DEMAND_TASK_PERIOD DEMAND_INTERVAL
+#define DEMAND_TASK_SLACK 1000
+// The button
+#define BUTTON_TASK_PERIOD 20
+#define BUTTON_TASK_SLACK 30
+// The backlight, the incoming pilot and mode, and the ammeter display
+#define DISPLAY_TASK_PERIOD 250
+#define DISPLAY_TASK_SLACK 250
+// Sending whatever changed on the display to the LCD
+#define LCD_TASK_PERIOD 100
+#define LCD_TASK_SLACK 100
+// The periodic logs
+#define LOG_TASK_PERIOD 1000
+#define LOG_TASK_SLACK 1000
 
 // in shared mode, two cars connected simultaneously will get 50% of the incoming pilot
 #define MODE_SHARED 0
@@ -273,20 +456,51 @@
 // from C/D to B again. When it does, if the other car is in state B1, then it will be given
 // a pilot.
 #define MODE_SEQUENTIAL 1
+// in demand mode, the incoming pilot is divided among the cars that are charging by what
+// they actually draw. A car that's using less than its share keeps DEMAND_HEADROOM over what
+// it draws, and the rest goes to the others (see demandShares()).
+#define MODE_DEMAND 2
 
 // In sequential mode, if both cars are sitting in state B, flip the pilot back and forth between
 // both cars every so often in case one of them changes their mind.
 #define SEQ_MODE_OFFER_TIMEOUT (5 * 60 * 1000L) // 5 minutes
 
+// In sequential mode, once the car with the pilot has drawn less than this percentage of it
+// for SEQ_TAPER_TIME (in milliseconds), it's tapering off. It keeps what it draws plus
+// DEMAND_HEADROOM, and the next car waiting can have the rest, as long as that's at least
+// DEMAND_MINIMUM. If the first car wants more again, it gets it back (see checkTaper()).
+#define SEQ_TAPER_PERCENT 50
+#define SEQ_TAPER_TIME (5 * 60 * 1000L) // 5 minutes
+
+// In sequential mode, a car's turn with the pilot is over once it's been charging for
+// SEQ_TURN_TIME (in milliseconds) or has drawn SEQ_TURN_CHARGE (in milliamp-hours) since its
+// turn started, whichever is first. Set either to 0 to not go by it. Then the pilot moves to
+// the car waiting that's drawn the least since it was plugged in, if that's less than this
+// one has (see checkTurn()).
+#define SEQ_TURN_TIME (2 * 60 * 60 * 1000L) // 2 hours
+#define SEQ_TURN_CHARGE 30000
+
+// In demand mode, how often (in milliseconds) are the shares looked at again? A car's demand
+// is the most it drew over the last interval or so, so it takes up to two of these to notice
+// that a car has tapered off.
+#define DEMAND_INTERVAL 30000L
+// How much (in milliamps) a car keeps over the most it's drawn. This must be more than
+// OVERDRAW_GRACE_AMPS.
+#define DEMAND_HEADROOM 2000
+// The least (in milliamps) a car is offered. The J1772 spec bottoms out at 6A.
+#define DEMAND_MINIMUM 6000
+// Don't move the pilots unless one of them would move by at least this much (in milliamps).
+#define DEMAND_HYSTERESIS 1000
+
 // If we add more modes, set this to the highest numbered one.
-#define LAST_MODE MODE_SEQUENTIAL
+#define LAST_MODE MODE_DEMAND
 
 // Set this to the desired startup mode
 #define DEFAULT_MODE MODE_SHARED
 
 // Which button do we use?
 #define BUTTON BUTTON_SELECT
-// If we see any state change on the button, we ignore all changes for this long
+// The buttons have to have been still for this long before we believe them.
 #define BUTTON_DEBOUNCE_INTERVAL 50
 // How long does the button have to stay down before we call it a LONG push?
 #define BUTTON_LONG_START 250
@@ -297,8 +511,11 @@
 
 // The location in EEPROM to save the operating mode
 #define EEPROM_LOC_MODE 0
-// The location in EEPROM to save the (sequential mode) starting car
+// The location in EEPROM to save the (sequential mode) starting car. It's kept as the car
+// plus one, as it was when car A was 1, so that 0 (or anything past the last car) is none.
 #define EEPROM_LOC_CAR 1
+// The location in EEPROM of the learned sense input levels
+#define EEPROM_BASELINE 2
 
 // Thanks to Gareth Evans at http://todbot.com/blog/2008/06/19/how-to-do-big-strings-in-arduino/
 // Note that you must be careful not to use this macro more than once per "statement", lest you
@@ -309,57 +526,129 @@ char p_buffer[96];
 
 #define VERSION "2.3 (Splitter)"
 
-LiquidTWI2 display(LCD_I2C_ADDR, 1);
+TwiLCD lcd(LCD_I2C_ADDR);
+// Everything is written to this copy of the display, and the LCD task sends the real one
+// whatever changed (see ShadowLCD.h).
+ShadowLCD<TwiLCD, LCD_COLS, LCD_ROWS> display(lcd);
+
+// Everything about one outlet, and the car plugged into it.
+typedef struct car_struct {
+  unsigned int last_state;    // the state the transitions last acted on
+  unsigned int sensed_state;  // what checkStates() last saw
+  unsigned int seen_state;    // what the pilot sense last read, which may not have stuck yet
+  unsigned char seen_count;   // how many checks in a row have read seen_state
+  unsigned int pilot_state;   // LOW, HIGH, SHARE, FULL or ALLOT
+  unsigned int pilot_ways;    // for SHARE, how many ways the incoming pilot is divided
+  unsigned int allotted;      // for ALLOT, what the pilot offers (in milliamps)
+  unsigned int raise_to;      // in demand mode, what it's offered once the others cut back, or 0
+  // What demand mode goes by: the most it drew (in milliamps) since the last look and over
+  // the interval before that, and when the ammeter started on it (or its pilot last went up).
+  unsigned int peak_draw, last_peak;
+  unsigned long demand_since;
+  unsigned long taper_since;  // when it last drew SEQ_TAPER_PERCENT of its pilot (or started)
+  // What it's drawn since it was plugged in (in milliamp-hours, and the part of the next one in
+  // milliamp-milliseconds), and when what's shown was last added in.
+  unsigned long charge, charge_part, metered_at;
+  // In sequential mode, when its turn with the pilot started, and what it had drawn by then.
+  unsigned long turn_since, turn_charge;
+  unsigned int relay_state;
+  // The ammeter readings are put through a median of 3, so that a single wild reading
+  // (like the inrush when a relay closes) doesn't show.
+  MedianFilter<unsigned long, 3> current_spikes;
+  unsigned long shown;        // what the ammeter shows
+  boolean metered;            // ... if anything
+  unsigned long last_current_log;
+  // The protocol deadlines. Each is a one-shot task (see TaskRunner.h); arg is the car.
+  Task overdraw;              // OVERDRAW_GRACE_PERIOD after it started overdrawing
+  Task request;               // TRANSITION_DELAY after it asked for power
+  Task error_delay;           // ERROR_DELAY after its pilot was taken away
+} car_type;
+
+car_type cars[CAR_COUNT];
+
+// A table of one of the pins above, in car order: CAR_PINS(RELAY) is { CAR_A_RELAY, CAR_B_RELAY ... }
+#if CAR_COUNT == 2
+#define CAR_PINS(pin) { CAR_A_##pin, CAR_B_##pin }
+#elif CAR_COUNT == 3
+#define CAR_PINS(pin) { CAR_A_##pin, CAR_B_##pin, CAR_C_##pin }
+#else
+#define CAR_PINS(pin) { CAR_A_##pin, CAR_B_##pin, CAR_C_##pin, CAR_D_##pin }
+#endif
 
-unsigned long incoming_pilot_samples[ROLLING_AVERAGE_SIZE];
-unsigned long car_a_current_samples[ROLLING_AVERAGE_SIZE], car_b_current_samples[ROLLING_AVERAGE_SIZE];
+// The relays and the relay tests go through FastPin, which needs its pin when it's
+// compiled, so those are picked out with a switch instead (see relayWrite()).
+const uint8_t pilot_out_pins[CAR_COUNT] = CAR_PINS(PILOT_OUT_PIN);
+
+MovingAverage<unsigned long, ROLLING_AVERAGE_SIZE> incoming_pilot_average;
 unsigned long incomingPilotMilliamps, lastIncomingPilot;
-unsigned int last_car_a_state, last_car_b_state;
-unsigned long car_a_overdraw_begin, car_b_overdraw_begin;
-unsigned long car_a_request_time, car_b_request_time;
-unsigned long car_a_error_time, car_b_error_time;
-unsigned long last_current_log_car_a, last_current_log_car_b;
+// These volatile ones are touched by the incoming pilot interrupt handler
+volatile unsigned long pilot_last_rise, pilot_last_fall, pilot_last_edge;
+volatile unsigned long pilot_high_sum, pilot_period_sum;
+volatile unsigned int pilot_periods;
+volatile uint8_t pilot_edges; // 0 = none yet, 1 = seen a rise, 2 = seen a rise and then a fall
 unsigned long last_state_log;
-unsigned long relay_change_time;
-unsigned long sequential_pilot_timeout;
-unsigned int relay_state_a, relay_state_b, pilot_state_a, pilot_state_b;
+unsigned long last_baseline_save;
+SenseBaseline baseline;
+Task relay_settle;                           // no function: RELAY_TEST_GRACE_TIME after a relay moved
+Task handoff_settle;                         // no function: HANDOFF_SETTLE_TIME after a car was last over its pilot
+Task sequential_offer;                       // SEQ_MODE_OFFER_TIMEOUT after the offer last moved
+Task demand_raise;                           // TRANSITION_DELAY after demand mode lowered a pilot
+unsigned int seq_overlap;                    // in sequential mode, the car charging alongside a tapering one
 unsigned int lastProximity, operatingMode, sequential_mode_tiebreak;
-unsigned long button_press_time, button_debounce_time;
+unsigned long button_press_time;
+volatile unsigned long button_changed_at;    // when the buttons were last seen to change
+#ifndef BUTTON_INTERRUPT
+unsigned int button_polled;                  // what checkEvent() last read
+#endif
 boolean paused = false;
+Task safety_task, pilot_task, current_task, demand_task, button_task, display_task, lcd_task, log_task;
 #ifdef GROUND_TEST
 unsigned char current_ground_status;
 #endif
 
-void log(unsigned int level, const char * fmt_str, ...) {
-#if SERIAL_LOG_LEVEL > 0
+// Log with LOG(level, "format", args...). The format is a plain string literal, which stays
+// in flash (or, logging in tokens, isn't there at all).
+#ifdef LOG_TOKENS
+#define LOG(level, fmt, ...) logToken((level), __LINE__, LOG_SIGNATURE(fmt), ##__VA_ARGS__)
+#else
+#define LOG(level, fmt, ...) logText((level), PSTR(fmt), ##__VA_ARGS__)
+#endif
+
+void logText(unsigned int level, const char * fmt_str, ...) {
+#if SERIAL_LOG_LEVEL > 0 && !defined(LOG_TOKENS)
   if (level > SERIAL_LOG_LEVEL) return;
   char buf[96]; // Danger, Will Robinson!
-  va_list argptr;
-  va_start(argptr, fmt_str);
-  vsnprintf(buf, sizeof(buf), fmt_str, argptr);
-  va_end(argptr);
-
+  const char *prefix;
   switch(level) {
   case LOG_INFO: 
-    Serial.print(P("INFO: ")); 
+    prefix = PSTR("INFO: ");
     break;
   case LOG_DEBUG: 
-    Serial.print(P("DEBUG: ")); 
+    prefix = PSTR("DEBUG: ");
     break;
   case LOG_TRACE:
-    Serial.print(millis());
-    Serial.print(P(" TRACE: "));
+    Uart.print(millis());
+    prefix = PSTR(" TRACE: ");
     break;
   default: 
-    Serial.print(P("UNKNOWN: ")); 
+    prefix = PSTR("UNKNOWN: ");
     break;
   }
-  Serial.println(buf);
+  strcpy_P(buf, prefix);
+  Uart.print(buf);
+
+  va_list argptr;
+  va_start(argptr, fmt_str);
+  vsnprintf_P(buf, sizeof(buf), fmt_str, argptr);
+  va_end(argptr);
+  Uart.print(buf);
+  Uart.endLine();
 #endif
 }
 
-// Delay, but pet the watchdog while doing it.
+// Delay, but pet the watchdog while doing it. Whatever's on the display is shown while we wait.
 static void Delay(unsigned long ms) {
+  display.flush();
   while(ms > 100) {
     delay(100);
     wdt_reset();
@@ -369,34 +658,49 @@ static void Delay(unsigned long ms) {
   wdt_reset();
 }
 
+#ifdef RELAY_TEST
 static void die() {
-  // set both pilots to -12
-  setPilot(CAR_A, LOW);
-  setPilot(CAR_B, LOW);
-  // make sure both relays are off
-  setRelay(CAR_A, LOW);
-  setRelay(CAR_B, LOW);
+  display.flush();
+  // set all of the pilots to -12
+  for(unsigned int car = 0; car < CAR_COUNT; car++)
+    setPilot(car, LOW);
+  // make sure all of the relays are off
+  for(unsigned int car = 0; car < CAR_COUNT; car++)
+    setRelay(car, LOW);
   // and goodnight
   do {
     wdt_reset(); // keep petting the dog, but do nothing else.
   } while(1);
 }
+#endif
 
 static inline const char *car_str(unsigned int car) {
   switch(car) {
     case CAR_A: return "car A";
     case CAR_B: return "car B";
-    case BOTH: return "both car";
+#if CAR_COUNT > 2
+    case CAR_C: return "car C";
+#endif
+#if CAR_COUNT > 3
+    case CAR_D: return "car D";
+#endif
+    case ALL_CARS: return "all cars";
     default: return "UNKNOWN";
   }
 }
 
+// What the car is called on the display and in the log.
+static inline char car_letter(unsigned int car) {
+  return 'A' + car;
+}
+
 static inline const char *logic_str(unsigned int state) {
   switch(state) {
     case LOW: return "LOW";
     case HIGH: return "HIGH";
-    case HALF: return "HALF";
+    case SHARE: return "SHARE";
     case FULL: return "FULL";
+    case ALLOT: return "ALLOT";
     default: return "UNKNOWN";
   }
 }
@@ -418,137 +722,86 @@ static inline const char* state_str(unsigned int state) {
   }
 }
 
-// Deal in milliamps so that we don't have to use floating point.
-// Convert the microsecond state timings from the incoming pilot into
-// an instantaneous current allowance value. With polling, it's
-// the two sample counts, but the math winds up being exactly the same.
-static inline unsigned long timeToMA(unsigned long samplesHigh, unsigned long samplesLow) {
-  // Calculate the duty cycle in mils (tenths of a percent)
-  unsigned int duty = (samplesHigh * 1000) / (samplesHigh + samplesLow);
-  if (duty < 80) { // < 8% is an error (digital comm not supported)
-    return 0;
-  } else if (duty <= 100) { // 8-10% is 6A - tolerance grace
-    return 6000L;
-  } else if (duty <= 850) { // 10-85% uses the "low" function
-    return duty * 60L;
-  } else if (duty <= 960) { // 85-96% uses the "high" function
-    return (duty - 640) * 250L;
-  } else if (duty <= 980) { // 96-98% is 80A - tolerance grace
-    return 80000L;
-  } else { // > 98% is an error
-    return 0;
-  }
-}
-
-// Convert a milliamp allowance into an outgoing pilot duty cycle.
-// In lieu of floating point, this is duty in mils (tenths of a percent)
-static inline unsigned int MAToDuty(unsigned long milliamps) {
-  if (milliamps < 6000) {
-    return 9999; // illegal - set pilot to "high"
-  } 
-  else if (milliamps < 51000) {
-    return milliamps/60;
-  } 
-  else if (milliamps <= 80000) {
-    return (milliamps / 250) + 640;
-  } 
-  else {
-    return 9999; // illegal - set pilot to "high"
-  }
-}
-
-// Convert a milliamp allowance into a value suitable for
-// pwmWrite - a scale from 0 to 255.
-static inline unsigned int MAtoPwm(unsigned long milliamps) {
-  unsigned int out = MAToDuty(milliamps);
-
-  if (out >= 1000) return 255; // full on
-
-  out = (unsigned int)((out * 256L) / 1000);  
-
-  return out;
-}
-
-// Turn a millamp value into nn.n as amps, with the tenth rounded near.
-char *formatMilliamps(unsigned long milliamps) {
-  static char out[6];
-
-  if (milliamps < 1000) {
-    // truncate the units digit - there's no way we're that accurate.
-    milliamps /= 10;
-    milliamps *= 10;
-
-    sprintf(out, P("%3lumA"), milliamps);
-  } 
-  else {
-    int hundredths = (milliamps / 10) % 100;
-    int tenths = hundredths / 10 + (((hundredths % 10) >= 5)?1:0);
-    int units = milliamps / 1000;
-    if (tenths >= 10) {
-      tenths -= 10;
-      units++;
-    }
-
-    sprintf(out, P("%2d.%01dA"), units, tenths);
-  }
-
-  return out;
+// Each car has an 8 character cell on the display, two to a line under the status line.
+// This puts the cursor there, names the car, and then shows whatever's given.
+static void showCar(unsigned int car, const char *status) {
+  display.setCursor((car % 2) * 8, 1 + car / 2);
+  display.print(car_letter(car));
+  display.print(status);
 }
 
 void error(unsigned int car, char err) {
-  unsigned long now = millis(); // so both cars get the same time.
   // Set the pilot to constant 12: indicates an EVSE error.
   // We can't use -12, because then we'd never detect a return
   // to state A. But the spec says we're allowed to return to B1
   // (that is, turn off the oscillator) whenever we want.
   
   // Stop flipping, one way or another
-  sequential_pilot_timeout = 0;
-  if (car == BOTH || car == CAR_A) {
-    setPilot(CAR_A, HIGH);
-    last_car_a_state = STATE_E;
-    car_a_error_time = now;
-    car_a_request_time = 0;
-  }
-  if (car == BOTH || car == CAR_B) {
-    setPilot(CAR_B, HIGH);
-    last_car_b_state = STATE_E;
-    car_b_error_time = now;
-    car_b_request_time = 0;
+  Tasks.stop(&sequential_offer);
+  for(unsigned int i = 0; i < CAR_COUNT; i++) {
+    if (car != ALL_CARS && car != i) continue;
+    setPilot(i, HIGH);
+    cars[i].last_state = STATE_E;
+    Tasks.start(&cars[i].error_delay, ERROR_DELAY);
+    Tasks.stop(&cars[i].request);
   }
   
   display.setBacklight(RED);
-  if (car == BOTH || car == CAR_A) {
-    display.setCursor(0, 1);
-    display.print(P("A:ERR "));
-    display.print(err);
-    display.print(' ');
-  }
-  if (car == BOTH || car == CAR_B) {
-    display.setCursor(8, 1);
-    display.print(P("B:ERR "));
+  for(unsigned int i = 0; i < CAR_COUNT; i++) {
+    if (car != ALL_CARS && car != i) continue;
+    showCar(i, P(":ERR "));
     display.print(err);
     display.print(' ');
   }
 
-  log(LOG_INFO, P("Error %c on %s"), err, car_str(car));
+  LOG(LOG_INFO, "Error %c on %s", err, car_str(car));
 }
 
-void setRelay(unsigned int car, unsigned int state) {
-  log(LOG_DEBUG, P("Setting %s relay to %s"), car_str(car), logic_str(state));
+// Drive a car's relay.
+static inline void relayWrite(unsigned int car, uint8_t state) {
   switch(car) {
-  case CAR_A:
-    if (relay_state_a == state) return; // Nothing changed
-    digitalWrite(CAR_A_RELAY, state);
-    relay_state_a = state;
-    break;
-  case CAR_B:
-    if (relay_state_b == state) return; // Nothing changed
-    digitalWrite(CAR_B_RELAY, state);
-    relay_state_b = state;
-    break;
+    case CAR_A: FastPin<CAR_A_RELAY>::write(state); break;
+    case CAR_B: FastPin<CAR_B_RELAY>::write(state); break;
+#if CAR_COUNT > 2
+    case CAR_C: FastPin<CAR_C_RELAY>::write(state); break;
+#endif
+#if CAR_COUNT > 3
+    case CAR_D: FastPin<CAR_D_RELAY>::write(state); break;
+#endif
   }
-  relay_change_time = millis();
+}
+
+#ifdef RELAY_TEST
+// Whether there's voltage past a car's relay.
+static inline boolean relayTest(unsigned int car) {
+  switch(car) {
+    case CAR_A: return FastPin<CAR_A_RELAY_TEST>::read() == HIGH;
+    case CAR_B: return FastPin<CAR_B_RELAY_TEST>::read() == HIGH;
+#if CAR_COUNT > 2
+    case CAR_C: return FastPin<CAR_C_RELAY_TEST>::read() == HIGH;
+#endif
+#if CAR_COUNT > 3
+    case CAR_D: return FastPin<CAR_D_RELAY_TEST>::read() == HIGH;
+#endif
+    default: return false;
+  }
+}
+#endif
+
+// Is any car's relay closed?
+static inline boolean anyRelayClosed() {
+  for(unsigned int car = 0; car < CAR_COUNT; car++)
+    if (cars[car].relay_state == HIGH) return true;
+  return false;
+}
+
+void setRelay(unsigned int car, unsigned int state) {
+  LOG(LOG_DEBUG, "Setting %s relay to %s", car_str(car), logic_str(state));
+  if (car >= CAR_COUNT) return;
+  if (cars[car].relay_state == state) return; // Nothing changed
+  relayWrite(car, state);
+  cars[car].relay_state = state;
+  Tasks.start(&relay_settle, RELAY_TEST_GRACE_TIME);
 }
 
 // If it's in an error state, it's not charging (the relay may still be on during error delay).
@@ -556,74 +809,86 @@ void setRelay(unsigned int car, unsigned int state) {
 // Otherwise, check the state of the relay.
 static inline boolean isCarCharging(unsigned int car) {
   if (paused) return false;
-  switch(car) {
-  case CAR_A:
-    if (last_car_a_state == STATE_E) return LOW;
-    if (car_a_request_time != 0) return HIGH;
-    return relay_state_a;
-    break;
-  case CAR_B:
-    if (last_car_b_state == STATE_E) return LOW;
-    if (car_b_request_time != 0) return HIGH;
-    return relay_state_b;
-    break;
-  default:
-    return LOW; // This should not be possible
-  }
+  if (car >= CAR_COUNT) return LOW; // This should not be possible
+  if (cars[car].last_state == STATE_E) return LOW;
+  if (Tasks.running(&cars[car].request)) return HIGH;
+  return cars[car].relay_state;
+}
+
+// How many cars are charging (as isCarCharging() sees it)?
+static unsigned int chargingCount() {
+  unsigned int count = 0;
+  for(unsigned int car = 0; car < CAR_COUNT; car++)
+    if (isCarCharging(car)) count++;
+  return count;
 }
 
-// Set the pilot for the car as appropriate. 'which' is either HALF, FULL, LOW or HIGH.
+// How many ways is the incoming pilot divided for the car's share? 1 for all of it.
+static inline unsigned int pilotWays(unsigned int car) {
+  return (cars[car].pilot_state == SHARE) ? cars[car].pilot_ways : 1;
+}
+
+// What the car's pilot allows it to draw (in milliamps).
+static inline unsigned long pilotMilliamps(unsigned int car) {
+  if (cars[car].pilot_state == ALLOT) return cars[car].allotted;
+  return incomingPilotMilliamps / pilotWays(car);
+}
+
+// What the car's pilot actually offers it (in milliamps).
+static inline unsigned long pilotOffered(unsigned int car) {
+  unsigned long ma = pilotMilliamps(car);
+  return (ma > MAXIMUM_OUTLET_CURRENT) ? MAXIMUM_OUTLET_CURRENT : ma;
+}
+
+// Set the pilot for the car as appropriate. 'which' is either SHARE, FULL, ALLOT, LOW or HIGH.
 // HIGH sets a constant +12v, which is the spec for state A, but we also use it for
-// state E. HALF means that the other car is charging, so we only can have half power.
+// state E. SHARE means that other cars are charging, so we can only have our share
+// (see sharePilot()), and ALLOT that demand mode has decided what we get (see allotPilot()).
 
 void setPilot(unsigned int car, unsigned int which) {
-  log(LOG_DEBUG, P("Setting %s pilot to %s"), car_str(car), logic_str(which));
-  // set the outgoing pilot for the given car to either HALF state, FULL state, or HIGH.
-  int pin;
-  switch(car) {
-    case CAR_A:
-      pin = CAR_A_PILOT_OUT_PIN;
-      pilot_state_a = which;
-      break;
-    case CAR_B:
-      pin = CAR_B_PILOT_OUT_PIN;
-      pilot_state_b = which;
-      break;
-    default: return;
-  }
+  LOG(LOG_DEBUG, "Setting %s pilot to %s", car_str(car), logic_str(which));
+  // set the outgoing pilot for the given car to either SHARE state, FULL state, ALLOT state, or HIGH.
+  if (car >= CAR_COUNT) return;
+  int pin = pilot_out_pins[car];
+  cars[car].pilot_state = which;
   if (which == LOW || which == HIGH) {
     // This is what the pwm library does anyway.
-    log(LOG_TRACE, P("Pin %d to digital %d"), pin, which);
+    LOG(LOG_TRACE, "Pin %d to digital %d", pin, which);
     digitalWrite(pin, which);
   } 
   else {
-    unsigned long ma = incomingPilotMilliamps;
-    if (which == HALF) ma /= 2;
+    unsigned long ma = pilotMilliamps(car);
     if (ma > MAXIMUM_OUTLET_CURRENT) ma = MAXIMUM_OUTLET_CURRENT;
     unsigned int val = MAtoPwm(ma);
-    log(LOG_TRACE, P("Pin %d to PWM %d"), pin, val);
+    LOG(LOG_TRACE, "Pin %d to PWM %d", pin, val);
     pwmWrite(pin, val);
   }
 }
 
-static inline unsigned int pilotState(unsigned int car) {
-  return (car == CAR_A)?pilot_state_a:pilot_state_b;
+// Give the car a pilot for one of 'ways' equal shares of the incoming pilot.
+void sharePilot(unsigned int car, unsigned int ways) {
+  if (ways <= 1) {
+    setPilot(car, FULL);
+    return;
+  }
+  cars[car].pilot_ways = ways;
+  setPilot(car, SHARE);
 }
 
-int checkState(unsigned int car) {
-  // poll the pilot state pin for 10 ms (should be 10 pilot cycles), looking for the low and high.
-  unsigned int low = 9999, high = 0;
-  unsigned int car_pin = (car == CAR_A) ? CAR_A_PILOT_SENSE_PIN : CAR_B_PILOT_SENSE_PIN;
-  unsigned long count = 0;
-  for(unsigned long start = millis(); millis() - start < STATE_CHECK_INTERVAL; ) {
-    unsigned int val = analogRead(car_pin);
-    if (val > high) high = val;
-    if (val < low) low = val;
-    count++;
+// Give the car a pilot that offers it 'ma' (in milliamps). If that's more than it had,
+// what it's drawn so far says nothing about what it wants now.
+void allotPilot(unsigned int car, unsigned long ma) {
+  if (ma > pilotOffered(car)) {
+    cars[car].demand_since = millis();
+    cars[car].peak_draw = cars[car].last_peak = 0;
   }
+  cars[car].allotted = ma;
+  setPilot(car, ALLOT);
+}
 
-  log(LOG_TRACE, P("%s high %u low %u count %lu"), car_str(car), high, low, count);
-  
+
+// Classify a car's pilot from the lowest and highest pilot sense readings.
+static unsigned int pilotStateFrom(unsigned int low, unsigned int high) {
   // If the pilot low was below zero, then that means we must have
   // been oscillating. If we were, then perform the diode check.
   if (low < PILOT_0V && low > PILOT_DIODE_MAX) {
@@ -645,72 +910,59 @@ int checkState(unsigned int car) {
   return STATE_E;
 }
 
-static inline unsigned long ulong_sqrt(unsigned long in) {
-  unsigned long out;
-  // find the last int whose square is not too big
-  // Yes, it's wasteful, but we only theoretically ever have to go to 512.
-  // Removing floating point saves us almost 1K of flash.
-  for(out = 1; out*out <= in; out++) ;
-  return out - 1;
-}
-
-unsigned long readCurrent(unsigned int car) {
-  unsigned int car_pin = (car == CAR_A) ? CAR_A_CURRENT_PIN : CAR_B_CURRENT_PIN;
-  unsigned long sum = 0;
-  unsigned int zero_crossings = 0;
-  unsigned long last_zero_crossing_time = 0, now_ms;
-  long last_sample = -1; // should be impossible - the A/d is 0 to 1023.
-  unsigned int sample_count = 0;
-  for(unsigned long start = millis(); (now_ms = millis()) - start < CURRENT_SAMPLE_INTERVAL; ) {
-    long sample = analogRead(car_pin);
-    // If this isn't the first sample, and if the sign of the value differs from the
-    // sign of the previous value, then count that as a zero crossing.
-    if (last_sample != -1 && ((last_sample > 512) != (sample > 512))) {
-      // Once we've seen a zero crossing, don't look for one for a little bit.
-      // It's possible that a little noise near zero could cause a two-sample
-      // inversion.
-      if (now_ms - last_zero_crossing_time > CURRENT_ZERO_DEBOUNCE_INTERVAL) {
-        zero_crossings++;
-        last_zero_crossing_time = now_ms;
-      }
+// Look at the latest pilot sense samples for the low and high on every car at once.
+// The pilots are sampled in turn by the same converter, so this sees all of the cars
+// over the same CAR_COUNT ms. states[] gets each car's state, which stays what it was
+// until STATE_CHECK_CONFIRM checks in a row agree on a new one.
+void checkStates(unsigned int *states) {
+  uint8_t slots[CAR_COUNT];
+  uint16_t low[CAR_COUNT], high[CAR_COUNT];
+  for(uint8_t i = 0; i < CAR_COUNT; i++) slots[i] = SLOT_PILOT(i);
+  unsigned int count = Sampler.range(slots, CAR_COUNT, STATE_CHECK_SAMPLES, low, high);
+
+  for(uint8_t i = 0; i < CAR_COUNT; i++) {
+    LOG(LOG_TRACE, "Car %c high %u low %u, count %u", car_letter(i), high[i], low[i], count);
+    car_type &c = cars[i];
+    unsigned int state = pilotStateFrom(baseline.pilotReading(i, low[i]), baseline.pilotReading(i, high[i]));
+    if (state != c.seen_state) {
+      c.seen_state = state;
+      c.seen_count = 0;
     }
-    last_sample = sample;
-    switch(zero_crossings) {
-    case 0: 
-      continue; // Still waiting to start sampling
-    case 1:
-    case 2:
-      // Gather the sum-of-the-squares and count how many samples we've collected.
-      sum += (unsigned long)((sample - 512) * (sample - 512));
-      sample_count++;
+    if (c.seen_count < STATE_CHECK_CONFIRM) c.seen_count++;
+    if (c.seen_count < STATE_CHECK_CONFIRM) {
+      states[i] = c.sensed_state;
       continue;
-    case 3:
-      // The answer is the square root of the mean of the squares.
-      // But additionally, that value must be scaled to a real current value.
-      return ulong_sqrt(sum / sample_count) * CURRENT_SCALE_FACTOR;
     }
+    states[i] = state;
+    // Nobody's plugged in, so the high is +12 volts. And if it's oscillating and passed the
+    // diode check, then the low is -12.
+    if (state == STATE_A) baseline.pilotHigh(i, high[i]);
+    if (state != STATE_A && state != STATE_E && low[i] != high[i]) baseline.pilotLow(i, low[i]);
   }
-  // ran out of time. Assume that it's simply not oscillating any. 
-  return 0;
 }
 
-unsigned long rollRollingAverage(unsigned long array[], unsigned long new_value) {
-#if ROLLING_AVERAGE_SIZE == 0
-  return new_value;
-#else
-  unsigned long sum = new_value;
-  for(int i = ROLLING_AVERAGE_SIZE - 1; i >= 1; i--) {
-    array[i] = array[i - 1];
-    sum += array[i];
-  }
-  array[0] = new_value;
-  return (sum / ROLLING_AVERAGE_SIZE);
-#endif
+// With a car's relay open, whatever its CT reads is zero current.
+void learnCurrentZero(unsigned int car) {
+  uint8_t slot = SLOT_CURRENT(car);
+  uint16_t low, high;
+  if (Sampler.range(&slot, 1, SAMPLER_RING_SIZE, &low, &high) == 0) return;
+  baseline.ctIdle(car, (low + high) / 2);
+  Sampler.setRmsZero(slot, baseline.ctZero(car));
+}
+
+unsigned long readCurrent(unsigned int car) {
+  unsigned long sum;
+  // Both of these are in sixteenths of a sample, which cancel out.
+  unsigned int count = Sampler.rms(SLOT_CURRENT(car), &sum);
+  if (count == 0) return 0; // nothing yet
+  // The answer is the square root of the mean of the squares.
+  // But additionally, that value must be scaled to a real current value.
+  return ulong_sqrt(sum / count) * CURRENT_SCALE_FACTOR;
 }
 
 static inline void reportIncomingPilot(unsigned long milliamps) {
 
-  milliamps = rollRollingAverage(incoming_pilot_samples, milliamps);
+  milliamps = incoming_pilot_average.add(milliamps);
   // Clamp to the maximum allowable current
   if (milliamps > MAXIMUM_INLET_CURRENT) milliamps = MAXIMUM_INLET_CURRENT;
 
@@ -719,119 +971,300 @@ static inline void reportIncomingPilot(unsigned long milliamps) {
   incomingPilotMilliamps = milliamps;
 }
 
+// Each rising edge of the incoming pilot ends one period and begins the next.
+// Add the time it spent high and the length of the whole period to the totals.
+void incomingPilotEdge() {
+  unsigned long now = micros();
+  pilot_last_edge = now;
+  if (FastPin<INCOMING_PILOT_PIN>::read() == HIGH) {
+    if (pilot_edges == 2) {
+      if (pilot_periods >= PILOT_MAX_PERIODS) {
+        pilot_high_sum = 0;
+        pilot_period_sum = 0;
+        pilot_periods = 0;
+      }
+      pilot_high_sum += pilot_last_fall - pilot_last_rise;
+      pilot_period_sum += now - pilot_last_rise;
+      pilot_periods++;
+    }
+    pilot_last_rise = now;
+    pilot_edges = 1;
+  } else if (pilot_edges == 1) {
+    pilot_last_fall = now;
+    pilot_edges = 2;
+  }
+}
+
+// Take whatever whole pilot periods the interrupt handler has timed since the last
+// call and turn them into a current. This doesn't wait for anything.
 void pollIncomingPilot() {
-  unsigned long transitions = -1; // ignore the first "transition"
-  int last_state = 99; // neither high nor low
-  unsigned long high_count = 0, low_count = 0;
-  for(unsigned long start = millis(); millis() - start < PILOT_POLL_INTERVAL; ) {
-    int state = digitalRead(INCOMING_PILOT_PIN);
-    if (state != last_state) transitions++;
-    last_state = state;
-    if (state == HIGH)
-      high_count++;
-    else
-      low_count++;
+  unsigned long high_time, period_time, last_edge;
+  unsigned int periods;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    high_time = pilot_high_sum;
+    period_time = pilot_period_sum;
+    periods = pilot_periods;
+    last_edge = pilot_last_edge;
+    pilot_high_sum = 0;
+    pilot_period_sum = 0;
+    pilot_periods = 0;
   }
-  
-  // We assume that the PILOT_POLL_INTERVAL is less than a second, so multiply by the
-  // reciprocal of the "seconds" of polling
-  unsigned long hz = (transitions / 2) * (1000 / PILOT_POLL_INTERVAL);
-  
-  // The spec allows 20% grace for frequency precision.
-  if (hz < 800 || hz > 1200) {
+
+  if (periods == 0) {
+    // Nothing new. That's normal if loop() is quick, but if there haven't been any
+    // edges at all for a while, the pilot is gone. React to that right away.
+    if (micros() - last_edge > PILOT_LOSS_TIMEOUT) {
+      ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        pilot_edges = 0;
+      }
+      incoming_pilot_average.reset();
+      reportIncomingPilot(0);
+    }
+    return;
+  }
+
+  // The spec allows 20% grace for frequency precision. 800-1200 Hz is a
+  // period of 833-1250 us.
+  if (period_time < periods * 833UL || period_time > periods * 1250UL) {
     reportIncomingPilot(0);
     return;
   }
 
-  unsigned long milliamps = timeToMA(high_count, low_count);
+  unsigned long milliamps = timeToMA(high_time, period_time - high_time);
 
   reportIncomingPilot(milliamps);
 
 }
 
+// Sequential mode: remember which car the pilot went to, so that it goes there first
+// after a reset.
+static void saveTiebreak(unsigned int car) {
+  EEPROM.write(EEPROM_LOC_CAR, car + 1);
+}
+
+// Sequential mode: which car has the pilot? There's only ever one with a FULL pilot. While
+// it's tapering off, it has an ALLOT pilot instead, and so does seq_overlap.
+static unsigned int pilotHolder() {
+  for(unsigned int car = 0; car < CAR_COUNT; car++) {
+    if (cars[car].pilot_state == FULL) return car;
+    if (cars[car].pilot_state == ALLOT && car != seq_overlap) return car;
+  }
+  return NO_CAR;
+}
+
+// Sequential mode: the next car after 'from' (going around in order) that's waiting in
+// state B, or NO_CAR.
+static unsigned int nextWaiting(unsigned int from) {
+  if (from >= CAR_COUNT) from = CAR_COUNT - 1;
+  for(unsigned int i = 1; i < CAR_COUNT; i++) {
+    unsigned int car = (from + i) % CAR_COUNT;
+    if (cars[car].last_state == STATE_B) return car;
+  }
+  return NO_CAR;
+}
+
+// Sequential mode: if nobody has the pilot, the next car after 'from' that's waiting for it
+// can have it.
+static void offerPilot(unsigned int from) {
+  if (pilotHolder() != NO_CAR || seq_overlap != NO_CAR) return;
+  unsigned int next = nextWaiting(from);
+  if (next == NO_CAR) return;
+  setPilot(next, FULL);
+  saveTiebreak(next);
+  showCar(next, P(": off  "));
+}
+
+// Sequential mode: while the car with the pilot sits in state B and another one is waiting
+// in state B, too, the offer moves on every SEQ_MODE_OFFER_TIMEOUT. Otherwise, it stays put.
+static void checkOffer() {
+  unsigned int holder = pilotHolder();
+  if (holder == NO_CAR || cars[holder].last_state != STATE_B || nextWaiting(holder) == NO_CAR) {
+    Tasks.stop(&sequential_offer);
+  } else if (!Tasks.running(&sequential_offer)) {
+    Tasks.start(&sequential_offer, SEQ_MODE_OFFER_TIMEOUT);
+  }
+}
+
+// Sequential mode: the car was charging alongside a tapering one, or was the tapering one,
+// and its pilot's gone now. Whichever of them is left gets the whole pilot. Returns whether
+// there was such a thing to end.
+static boolean endOverlap(unsigned int car) {
+  if (seq_overlap == NO_CAR) return false;
+  // If the holder still has its pilot, it's some other car.
+  if (car != seq_overlap && pilotHolder() != NO_CAR) return false;
+  boolean holder_left = car != seq_overlap;
+  seq_overlap = NO_CAR;
+  unsigned int left = pilotHolder();
+  if (left != NO_CAR) {
+    setPilot(left, FULL);
+    if (holder_left) saveTiebreak(left);
+  }
+  else
+    offerPilot(car);
+  return true;
+}
+
+// Sequential mode: the car charging alongside the pilot holder has to stop. It gets
+// ERROR_DELAY to do it, as in a pause.
+static void stopOverlap() {
+  unsigned int car = seq_overlap;
+  setPilot(car, HIGH);
+  showCar(car, P(": wait "));
+  if (cars[car].relay_state == HIGH)
+    Tasks.start(&cars[car].error_delay, ERROR_DELAY);
+  else
+    endOverlap(car);
+}
+
+// Sequential mode: has the car with the pilot tapered off enough to let the next one in on
+// what it isn't using? Or, if it already has, does it want that back? The next car isn't
+// offered anything until the holder has had TRANSITION_DELAY to cut back (see
+// demandRaiseTask()).
+static void checkTaper() {
+  unsigned int holder = pilotHolder();
+  if (holder == NO_CAR || !isCarCharging(holder)) return;
+  car_type &c = cars[holder];
+  unsigned long peak = (c.peak_draw > c.last_peak) ? c.peak_draw : c.last_peak;
+  if (seq_overlap != NO_CAR) {
+    // The first car still comes first. Once it's using up its headroom, the other one stops.
+    if (cars[seq_overlap].pilot_state != ALLOT || peak + DEMAND_HYSTERESIS < pilotOffered(holder)) return;
+    LOG(LOG_INFO, "Car %c wants more again, stopping %s", car_letter(holder), car_str(seq_overlap));
+    stopOverlap();
+    return;
+  }
+  if (!c.metered || millis() - c.taper_since < SEQ_TAPER_TIME) return;
+  unsigned int next = nextWaiting(holder);
+  if (next == NO_CAR) return;
+  unsigned long keep = peak + DEMAND_HEADROOM;
+  if (keep < DEMAND_MINIMUM) keep = DEMAND_MINIMUM;
+  if (keep + DEMAND_MINIMUM > incomingPilotMilliamps) return;
+  LOG(LOG_INFO, "Car %c has tapered off to %lu mA, sharing with %s", car_letter(holder), peak, car_str(next));
+  allotPilot(holder, keep);
+  seq_overlap = next;
+  Tasks.start(&demand_raise, TRANSITION_DELAY);
+}
+
+// Sequential mode: of the cars other than 'except' that are waiting in state B, the one that's
+// drawn the least since it was plugged in, or NO_CAR. A tie goes to the first one after
+// 'except', going around in order.
+static unsigned int leastServed(unsigned int except) {
+  unsigned int least = NO_CAR;
+  for(unsigned int i = 1; i < CAR_COUNT; i++) {
+    unsigned int car = (except + i) % CAR_COUNT;
+    if (cars[car].last_state != STATE_B) continue;
+    if (least == NO_CAR || cars[car].charge < cars[least].charge) least = car;
+  }
+  return least;
+}
+
+// Sequential mode: has the car with the pilot had its turn (see SEQ_TURN_TIME)? If a car
+// that's waiting has drawn less, the holder's pilot is taken away. It gets ERROR_DELAY to
+// stop, as in a pause, and the pilot moves on once it has (see handTurn()).
+static void checkTurn() {
+  unsigned int holder = pilotHolder();
+  if (holder == NO_CAR || seq_overlap != NO_CAR || !isCarCharging(holder)) return;
+  car_type &c = cars[holder];
+  boolean over = false;
+  if (SEQ_TURN_TIME != 0 && millis() - c.turn_since >= SEQ_TURN_TIME) over = true;
+  if (SEQ_TURN_CHARGE != 0 && c.charge - c.turn_charge >= SEQ_TURN_CHARGE) over = true;
+  if (!over) return;
+  unsigned int next = leastServed(holder);
+  if (next == NO_CAR || cars[next].charge >= c.charge) return;
+  LOG(LOG_INFO, "Car %c has had its turn (%lu mAh), moving the pilot to %s", car_letter(holder), c.charge - c.turn_charge, car_str(next));
+  setPilot(holder, HIGH);
+  Tasks.start(&c.error_delay, ERROR_DELAY);
+  showCar(holder, P(": wait "));
+}
+
+// Sequential mode: a turn is over, and the pilot goes to next, unless nobody's waiting or
+// somebody's been given it in the meantime. Returns whether it went.
+static boolean giveTurn(unsigned int next) {
+  if (next == NO_CAR || pilotHolder() != NO_CAR || seq_overlap != NO_CAR) return false;
+  setPilot(next, FULL);
+  saveTiebreak(next);
+  showCar(next, P(": off  "));
+  return true;
+}
+
+// Sequential mode: the car whose turn was over has stopped. The pilot goes to the car waiting
+// that's drawn the least, or back to this one if nobody is.
+static void handTurn(unsigned int car) {
+  Tasks.stop(&cars[car].error_delay);
+  showCar(car, P(": wait "));
+  unsigned int next = leastServed(car);
+  giveTurn(next == NO_CAR ? car : next);
+}
+
 void sequential_mode_transition(unsigned int us, unsigned int car_state) {
-  unsigned int them = (us == CAR_A)?CAR_B:CAR_A;
-  unsigned int *last_car_state = (us == CAR_A)?&last_car_a_state:&last_car_b_state;
-  unsigned int their_state = (us == CAR_A)?last_car_b_state:last_car_a_state;
+  car_type &car = cars[us];
   
   switch(car_state) {
     case STATE_A:
       // No matter what, insure that the pilot and relay are off.
       setRelay(us, LOW);
       setPilot(us, HIGH);
-      // We're not both in state B anymore.
-      sequential_pilot_timeout = 0;
-      // We don't exist. If they're waiting, they can have it.
-      if (their_state == STATE_B)
-      {
-          setPilot(them, FULL);
-          EEPROM.write(EEPROM_LOC_CAR, them);
-          display.setCursor((them == CAR_A)?0:8, 1);
-          display.print((them == CAR_A)?"A":"B");
-          display.print(P(": off  "));
-      }
-      display.setCursor((us == CAR_A)?0:8, 1);
-      display.print((us == CAR_A)?"A":"B");
-      display.print(P(": ---  "));
+      // We don't exist. If someone's waiting, they can have it.
+      if (!endOverlap(us)) offerPilot(us);
+      showCar(us, P(": ---  "));
       break;
     case STATE_B:
       // No matter what, insure that the relay is off.
       setRelay(us, LOW);
-      if (*last_car_state == STATE_C || *last_car_state == STATE_D) {
+      if (car.last_state == STATE_C || car.last_state == STATE_D) {
         // We transitioned from C/D to B. That means we're passing the batton
-        // to the other car, if they want it.
-        if (their_state == STATE_B) {
-          setPilot(them, FULL);
+        // to the next car waiting, if there is one.
+        unsigned int next = nextWaiting(us);
+        if (seq_overlap != NO_CAR) {
+          // We were charging alongside another car, and whichever of us is left gets the
+          // whole pilot. Unless we were stopped to give the first car its pilot back, we're done.
+          boolean stopped = us == seq_overlap && car.pilot_state == HIGH;
+          setPilot(us, HIGH);
+          Tasks.stop(&car.error_delay);
+          endOverlap(us);
+          if (stopped)
+            showCar(us, P(": wait "));
+          else
+            showCar(us, P(": done "));
+        } else if (car.pilot_state == HIGH) {
+          // Our turn was over (see checkTurn()), but we're not done.
+          handTurn(us);
+        } else if (next != NO_CAR) {
+          setPilot(next, FULL);
           setPilot(us, HIGH);
-          EEPROM.write(EEPROM_LOC_CAR, them);
-          display.setCursor((them == CAR_A)?0:8, 1);
-          display.print((them == CAR_A)?"A":"B");
-          display.print(P(": off  "));
-          display.setCursor((us == CAR_A)?0:8, 1);
-          display.print((us == CAR_A)?"A":"B");
-          display.print(P(": done ")); // differentiated from "wait" because a C/D->B transition has occurred.
-          sequential_pilot_timeout = millis(); // We're both now in B. Start flipping.
+          saveTiebreak(next);
+          showCar(next, P(": off  "));
+          showCar(us, P(": done ")); // differentiated from "wait" because a C/D->B transition has occurred.
         } else {
-          display.setCursor((us == CAR_A)?0:8, 1);
-          display.print((us == CAR_A)?"A":"B");
-          display.print(P(": off  "));
-          // their state is not B, so we're not "flipping"
-          sequential_pilot_timeout = 0;
+          showCar(us, P(": off  "));
         }
       } else {
-        if (their_state == STATE_A) {
-          // We can only grab the batton if they're not plugged in at all.
-          setPilot(us, FULL);
-          sequential_pilot_timeout = 0;
-          EEPROM.write(EEPROM_LOC_CAR, us);
-          display.setCursor((us == CAR_A)?0:8, 1);
-          display.print((us == CAR_A)?"A":"B");
-          display.print(P(": off  "));
-          break;
-        } else if (their_state == STATE_B || their_state == DUNNO) {
-          // BUT if we're *both* in state b, then that's a tie. We break the tie with our saved tiebreak value.
-          // If it's not us, then we simply ignore this transition entirely. The other car will wind up in this same place,
-          // we'll turn their pilot on, and then clear the tiebreak. Next time we roll through, we'll go into the other
-          // half of this if/else and we'll get the "wait" display
-          if (sequential_mode_tiebreak != us && sequential_mode_tiebreak != DUNNO) {
+        // Is anyone else in line for the pilot? Someone's got it, or is about to be let go
+        // after an error, or is (or may be) in state B.
+        boolean busy = pilotHolder() != NO_CAR || seq_overlap != NO_CAR, tied = false;
+        for(unsigned int i = 0; i < CAR_COUNT; i++) {
+          if (i == us) continue;
+          if (cars[i].last_state == STATE_E && Tasks.running(&cars[i].error_delay)) busy = true;
+          if (cars[i].last_state == STATE_B || cars[i].last_state == DUNNO) tied = true;
+        }
+        if (!busy) {
+          // We can grab the batton if nobody else is plugged in at all. BUT if others are in
+          // state b too, then that's a tie. We break the tie with our saved tiebreak value.
+          // If it's another car in the tie, then we simply ignore this transition entirely.
+          // That car will wind up in this same place, we'll turn their pilot on, and then clear
+          // the tiebreak. Next time we roll through, we'll see that they have it and get the
+          // "wait" display. If the tiebreak car isn't in the tie at all, we'll do.
+          unsigned int tiebreak = sequential_mode_tiebreak;
+          if (tied && tiebreak != us && tiebreak < CAR_COUNT && (cars[tiebreak].last_state == STATE_B || cars[tiebreak].last_state == DUNNO)) {
             return;
           }
-          // But if it IS us, then clear the tiebreak.
-          if (sequential_mode_tiebreak == us) {
-            sequential_mode_tiebreak = DUNNO;
-            setPilot(us, FULL);
-            sequential_pilot_timeout = millis();
-            EEPROM.write(EEPROM_LOC_CAR, us);
-            display.setCursor((us == CAR_A)?0:8, 1);
-            display.print((us == CAR_A)?"A":"B");
-            display.print(P(": off  "));
-            break;
-          }
+          if (tiebreak == us) sequential_mode_tiebreak = NO_CAR;
+          setPilot(us, FULL);
+          saveTiebreak(us);
+          showCar(us, P(": off  "));
+          break;
         }
-        // Either they are in state C/D or they're in state B and we lost the tiebreak.
-        display.setCursor((us == CAR_A)?0:8, 1);
-        display.print((us == CAR_A)?"A":"B");
-        display.print(P(": wait "));
+        // Someone else has it.
+        showCar(us, P(": wait "));
       }
       break;
     case STATE_C:
@@ -840,30 +1273,70 @@ void sequential_mode_transition(unsigned int us, unsigned int car_state) {
         // we're already charging. This might be a flip from C to D. Ignore it.
         break;
       }
-      if (pilotState(us) != FULL) {
+      if (car.pilot_state != FULL && car.pilot_state != ALLOT) {
         error(us, 'T'); // illegal transition: no state C without a pilot
         return;
       }
-      // We're not both in state B anymore
-      sequential_pilot_timeout = 0;
+      car.turn_since = millis();
+      car.turn_charge = car.charge;
       setRelay(us, HIGH); // turn on the juice
-      display.setCursor((us == CAR_A)?0:8, 1);
-      display.print((us == CAR_A)?"A":"B");
-      display.print(P(": ON   "));
+      showCar(us, P(": ON   "));
       break;
     case STATE_E:
       error(us, 'E');
       return;
   }
-  *last_car_state = car_state;
+  car.last_state = car_state;
+  // Whoever's left in state B may need to start (or stop) taking turns.
+  checkOffer();
+}
+
+// Shared mode: the incoming pilot is divided evenly among the cars that are charging, and
+// a car waiting in state B is offered what it would get if it joined them. When another
+// car starts, the ones already charging must be given TRANSITION_DELAY to cut back before
+// it does (see shared_mode_transition()). This only ever raises their pilots otherwise.
+static void shareOut() {
+  unsigned int charging = chargingCount();
+  for(unsigned int car = 0; car < CAR_COUNT; car++) {
+    if (isCarCharging(car))
+      sharePilot(car, charging);
+    else if (cars[car].last_state == STATE_B)
+      sharePilot(car, charging + 1);
+  }
+}
+
+// A car's power is off for good after an error (or a pause). Whatever pilot it had is
+// free for the others.
+static void releasePilot(unsigned int car) {
+  if (paused) return;
+  switch(operatingMode) {
+    case MODE_SHARED:
+      shareOut();
+      break;
+    case MODE_SEQUENTIAL:
+      if (endOverlap(car)) break;
+      // Still charging, so its turn was over and it didn't stop within ERROR_DELAY. The turn
+      // goes on as handTurn() would have passed it, not in outlet order.
+      if ((cars[car].last_state == STATE_C || cars[car].last_state == STATE_D) && giveTurn(leastServed(car))) break;
+      offerPilot(car);
+      break;
+    case MODE_DEMAND:
+      allotDemand();
+      break;
+  }
+}
+
+// The car wants power, but the ones already charging have to cut back first. It gets it
+// as soon as they have (see checkHandoff()), or after TRANSITION_DELAY at the latest.
+static void awaitHandoff(unsigned int car) {
+  Tasks.start(&cars[car].request, TRANSITION_DELAY);
+  Tasks.start(&handoff_settle, HANDOFF_SETTLE_TIME);
 }
 
 void shared_mode_transition(unsigned int us, unsigned int car_state) {
-  unsigned int them = (us == CAR_A)?CAR_B:CAR_A;
-  unsigned int *last_car_state = (us == CAR_A)?&last_car_a_state:&last_car_b_state;
-  unsigned long *car_request_time = (us == CAR_A)?&car_a_request_time:&car_b_request_time;
+  car_type &car = cars[us];
     
-  *last_car_state = car_state;    
+  car.last_state = car_state;    
   switch(car_state) {
     case STATE_A:
     case STATE_B:
@@ -871,16 +1344,14 @@ void shared_mode_transition(unsigned int us, unsigned int car_state) {
       // In either case, clear any connection delay timer,
       // make sure the relay is off, and set the diplay
       // appropriately. For state A, set our pilot high,
-      // and fot state B, set it to half if the other car
-      // is charging, full otherwise.
+      // and for state B, offer it what it would get if
+      // it joined the cars that are charging. They get
+      // whatever share we had.
       setRelay(us, LOW);
-      setPilot(us, car_state == STATE_A ? HIGH : (isCarCharging(them)?HALF:FULL));
-      display.setCursor((us == CAR_A)?0:8, 1);
-      display.print((us == CAR_A)?"A":"B");
-      display.print(car_state == STATE_A ? ": ---  " : ": off  ");
-      *car_request_time = 0;
-      if (pilotState(them) == HALF)
-        setPilot(them, FULL);
+      Tasks.stop(&car.request);
+      if (car_state == STATE_A) setPilot(us, HIGH);
+      showCar(us, car_state == STATE_A ? ": ---  " : ": off  ");
+      shareOut();
       break;
     case STATE_C:
     case STATE_D:
@@ -888,25 +1359,153 @@ void shared_mode_transition(unsigned int us, unsigned int car_state) {
         // we're already charging. This might be a flip from C to D. Ignore it.
         break;
       }
-      if (isCarCharging(them)) {
+      if (chargingCount() != 0) {
         // if they are charging, we must transition them.
-        *car_request_time = millis();
-        // Drop car A down to 50%
-        setPilot(them, HALF);
-        setPilot(us, HALF); // this is redundant unless we are transitioning from A directly to C
-        display.setCursor((us == CAR_A)?0:8, 1);
-        display.print((us == CAR_A)?"A":"B");
-        display.print(": wait ");
+        awaitHandoff(us);
+        // Drop everyone down to their new share. This includes us, which is redundant
+        // unless we are transitioning from A directly to C.
+        shareOut();
+        showCar(us, P(": wait "));
       } else {
-        // if they're not charging, then we can just go. If they have a full pilot, they get downshifted.
-        if (pilotState(them) == FULL)
-          setPilot(them, HALF);
+        // if nobody else is charging, then we can just go. Anyone waiting gets downshifted.
+        shareOut();
         setPilot(us, FULL); // this is redundant unless we are transitioning from A directly to C
         setRelay(us, HIGH);
-        *car_request_time = 0;
-        display.setCursor((us == CAR_A)?0:8, 1);
-        display.print((us == CAR_A)?"A":"B");
-        display.print(P(": ON   "));
+        Tasks.stop(&car.request);
+        showCar(us, P(": ON   "));
+      }
+      break;
+    case STATE_E:
+      error(us, 'E');
+      break;
+  }
+}
+
+// Demand mode: what would each car that's charging get (in milliamps)? A car that's been on
+// the ammeter for a whole DEMAND_INTERVAL since it started (or its pilot last went up), and
+// that's drawn less than it's offered, could use what it drew plus DEMAND_HEADROOM. Once it's
+// been cut back to that (to less than an even split), it keeps its allotment for as long as
+// it draws DEMAND_HYSTERESIS less, rather than wanting it all back the moment it's within
+// DEMAND_HEADROOM of it. Any
+// other could use all an outlet can give. The ones that want less than an even split get
+// what they want, and what's left is split among the rest. Cars that aren't charging get 0.
+static void demandShares(unsigned long *shares) {
+  unsigned long want[CAR_COUNT];
+  unsigned int left = 0;
+  unsigned long now = millis();
+  for(unsigned int car = 0; car < CAR_COUNT; car++)
+    if (isCarCharging(car)) left++;
+  unsigned long split = left == 0 ? 0 : incomingPilotMilliamps / left;
+  for(unsigned int car = 0; car < CAR_COUNT; car++) {
+    shares[car] = 0;
+    want[car] = 0;
+    if (!isCarCharging(car)) continue;
+    car_type &c = cars[car];
+    unsigned long peak = (c.peak_draw > c.last_peak) ? c.peak_draw : c.last_peak;
+    want[car] = MAXIMUM_OUTLET_CURRENT;
+    if (!c.metered || now - c.demand_since < DEMAND_INTERVAL) continue;
+    unsigned long offered = pilotOffered(car);
+    if (peak + DEMAND_HEADROOM < offered) {
+      want[car] = peak + DEMAND_HEADROOM;
+      if (want[car] < DEMAND_MINIMUM) want[car] = DEMAND_MINIMUM;
+    } else if (c.pilot_state == ALLOT && offered < split && peak + DEMAND_HYSTERESIS < offered) {
+      want[car] = offered;
+    }
+  }
+  unsigned long remaining = incomingPilotMilliamps;
+  while(left > 0) {
+    unsigned long even = remaining / left;
+    boolean settled = false;
+    for(unsigned int car = 0; car < CAR_COUNT; car++) {
+      if (want[car] == 0 || shares[car] != 0 || want[car] > even) continue;
+      shares[car] = want[car];
+      remaining -= want[car];
+      left--;
+      settled = true;
+    }
+    if (settled) continue;
+    // Everyone left wants more than an even split, so that's what they get.
+    for(unsigned int car = 0; car < CAR_COUNT; car++)
+      if (want[car] != 0 && shares[car] == 0) shares[car] = even;
+    break;
+  }
+}
+
+// Demand mode: move the pilots to the shares demandShares() comes up with. The ones that go
+// down are lowered right away. The ones that go up wait until the cars that were lowered have
+// had TRANSITION_DELAY to cut back (see demandRaiseTask()), so that between them, the cars
+// never draw more than the incoming pilot. A car with its relay open can't draw anything, so
+// it's given its share right away. Cars waiting in state B are offered an even share, as in
+// shared mode. Returns whether anyone has to wait for the others to cut back.
+static boolean allotDemand() {
+  unsigned long shares[CAR_COUNT];
+  demandShares(shares);
+  boolean moved = false;
+  for(unsigned int car = 0; car < CAR_COUNT; car++) {
+    if (shares[car] == 0) continue;
+    if (cars[car].pilot_state != ALLOT || labs((long)shares[car] - (long)pilotOffered(car)) >= DEMAND_HYSTERESIS)
+      moved = true;
+  }
+  if (moved) {
+    // First, the ones that come down.
+    for(unsigned int car = 0; car < CAR_COUNT; car++) {
+      cars[car].raise_to = 0;
+      if (shares[car] == 0 || cars[car].relay_state == LOW) continue;
+      if (shares[car] < pilotOffered(car)) {
+        allotPilot(car, shares[car]);
+        Tasks.start(&demand_raise, TRANSITION_DELAY);
+      }
+    }
+    // Then the ones that go up, unless someone's still cutting back.
+    for(unsigned int car = 0; car < CAR_COUNT; car++) {
+      if (shares[car] == 0) continue;
+      if (cars[car].relay_state == LOW)
+        allotPilot(car, shares[car]);
+      else if (shares[car] > pilotOffered(car)) {
+        if (Tasks.running(&demand_raise))
+          cars[car].raise_to = shares[car];
+        else
+          allotPilot(car, shares[car]);
+      }
+    }
+  }
+  unsigned int charging = chargingCount();
+  for(unsigned int car = 0; car < CAR_COUNT; car++)
+    if (!isCarCharging(car) && cars[car].last_state == STATE_B)
+      sharePilot(car, charging + 1);
+  return Tasks.running(&demand_raise);
+}
+
+void demand_mode_transition(unsigned int us, unsigned int car_state) {
+  car_type &car = cars[us];
+
+  car.last_state = car_state;
+  switch(car_state) {
+    case STATE_A:
+    case STATE_B:
+      // We're in an "off" state of one sort or other. Whatever we had goes to the others,
+      // and in state B, we're offered a share for when we want it.
+      setRelay(us, LOW);
+      Tasks.stop(&car.request);
+      if (car_state == STATE_A) setPilot(us, HIGH);
+      showCar(us, car_state == STATE_A ? ": ---  " : ": off  ");
+      allotDemand();
+      break;
+    case STATE_C:
+    case STATE_D:
+      if (isCarCharging(us)) {
+        // we're already charging. This might be a flip from C to D. Ignore it.
+        break;
+      }
+      // We count as charging while the shares are worked out. If anyone has to cut back
+      // to make room for us, we must give them TRANSITION_DELAY to do it.
+      awaitHandoff(us);
+      if (allotDemand()) {
+        showCar(us, P(": wait "));
+      } else {
+        Tasks.stop(&car.request);
+        showCar(us, P(": ON   "));
+        setRelay(us, HIGH);
       }
       break;
     case STATE_E:
@@ -915,96 +1514,167 @@ void shared_mode_transition(unsigned int us, unsigned int car_state) {
   }
 }
 
+#ifdef BUTTON_INTERRUPT
+// The MCP23017 pulls INTA low when the buttons change. Note the time, and have them
+// read, which lets INTA go high again (and that's an interrupt too, but not one that
+// means anything). Both edges of a push are timed from here, so it doesn't matter how
+// long it is before checkEvent() gets to look.
+ISR(PCINT2_vect) {
+  if (FastPin<BUTTON_INT_PIN>::read() == LOW) {
+    button_changed_at = millis();
+    lcd.buttonsChanged();
+  }
+}
+
+static void buttonInterrupt() {
+  pinMode(BUTTON_INT_PIN, INPUT);
+  *digitalPinToPCMSK(BUTTON_INT_PIN) |= _BV(digitalPinToPCMSKbit(BUTTON_INT_PIN));
+  PCICR |= _BV(digitalPinToPCICRbit(BUTTON_INT_PIN));
+  lcd.interruptOnButtons();
+}
+#endif
+
 unsigned int checkEvent() {
-  log(LOG_TRACE, P("Checking for button event"));
-  if (button_debounce_time != 0 && millis() - button_debounce_time < BUTTON_DEBOUNCE_INTERVAL) {
+  LOG(LOG_TRACE, "Checking for button event");
+  unsigned int buttons = display.readButtons();
+#ifndef BUTTON_INTERRUPT
+  // With nothing to say when they change, the change is when a read first shows it.
+  if (buttons != button_polled) {
+    button_polled = buttons;
+    button_changed_at = millis();
+  }
+#endif
+  unsigned long changed_at;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    changed_at = button_changed_at;
+  }
+  if (millis() - changed_at < BUTTON_DEBOUNCE_INTERVAL) {
     // debounce is in progress
     return EVENT_NONE;
-  } else {
-    // debounce is over
-    button_debounce_time = 0;
   }
-  unsigned int buttons = display.readButtons();
-  log(LOG_TRACE, P("Buttons %d"), buttons);
+  LOG(LOG_TRACE, "Buttons %d", buttons);
   if ((buttons & BUTTON) != 0) {
-    log(LOG_TRACE, P("Button is down"));
+    LOG(LOG_TRACE, "Button is down");
     // Button is down
     if (button_press_time == 0) { // this is the start of a press.
-      button_debounce_time = button_press_time = millis();
+      button_press_time = changed_at;
     }
     return EVENT_NONE; // We don't know what this button-push is going to be yet
   } else {
-    log(LOG_TRACE, P("Button is up"));
+    LOG(LOG_TRACE, "Button is up");
     // Button released
     if (button_press_time == 0) return EVENT_NONE; // It wasn't down anyway.
-    // We are now ending a button-push. First, start debuncing.
-    button_debounce_time = millis();
-    unsigned long button_pushed_time = button_debounce_time - button_press_time;
+    // We are now ending a button-push, which lasted from one change to the other.
+    unsigned long button_pushed_time = changed_at - button_press_time;
     button_press_time = 0;
     if (button_pushed_time > BUTTON_LONG_START) {
-      log(LOG_DEBUG, P("Button long-push event"));
+      LOG(LOG_DEBUG, "Button long-push event");
       return EVENT_LONG_PUSH;
     } else {
-      log(LOG_DEBUG, P("Button short-push event"));
+      LOG(LOG_DEBUG, "Button short-push event");
       return EVENT_SHORT_PUSH;
     }
   }
 }
 
+#ifdef MEGA_HYDRA
+// SetPinFrequencySafe() starts each timer on its own, so Timer4 (cars C and D) would be
+// some random fraction of a period out from Timer1 (cars A and B), which times the pilot
+// sense conversions for all four. Restart the two together from zero, so that they're in step.
+static void syncPilotTimers() {
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    uint8_t clock1 = TCCR1B & 0x07, clock4 = TCCR4B & 0x07;
+    TCCR1B &= ~0x07;
+    TCCR4B &= ~0x07;
+    TCNT1 = 0;
+    TCNT4 = 0;
+    TCCR4B |= clock4;
+    TCCR1B |= clock1;
+  }
+}
+#endif
+
 void setup() {
   // This must be done as early as possible to prevent the watchdog from biting during reset.
   MCUSR = 0;
   wdt_enable(WDTO_1S);
 
+  // The deadlines that nothing runs go first, before anything can start them, so
+  // that run() disarms them when they expire, even if nobody asks.
+  Tasks.add(&relay_settle, NULL, 0, DEADLINE_TASK_SLACK);
+  Tasks.add(&handoff_settle, NULL, 0, DEADLINE_TASK_SLACK);
+
   InitTimersSafe();
-  display.setMCPType(LTI_TYPE_MCP23017);
-  display.begin(16, 2); 
+  Twi.begin(I2C_CLOCK_HZ);
+  display.begin(LCD_COLS, LCD_ROWS); 
+#ifdef BUTTON_INTERRUPT
+  buttonInterrupt();
+#endif
 
 #if SERIAL_LOG_LEVEL > 0
-  Serial.begin(SERIAL_BAUD_RATE);
+  Uart.begin(SERIAL_BAUD_RATE);
+#ifdef LOG_TOKENS
+  logTokensBegin(SERIAL_LOG_LEVEL);
+#endif
 #endif
 
-  log(LOG_DEBUG, P("Starting v%s"), VERSION);
+  LOG(LOG_DEBUG, "Starting v%s", VERSION);
   
   pinMode(INCOMING_PILOT_PIN, INPUT_PULLUP);
+  attachInterrupt(INCOMING_PILOT_INT, incomingPilotEdge, CHANGE);
   pinMode(INCOMING_PROXIMITY_PIN, INPUT_PULLUP);
   pinMode(OUTGOING_PROXIMITY_PIN, OUTPUT);
-  pinMode(CAR_A_PILOT_OUT_PIN, OUTPUT);
-  pinMode(CAR_B_PILOT_OUT_PIN, OUTPUT);
-  pinMode(CAR_A_RELAY, OUTPUT);
-  pinMode(CAR_B_RELAY, OUTPUT);
 #ifdef GROUND_TEST
   pinMode(GROUND_TEST_PIN, INPUT);
 #endif
+  static const uint8_t relay_pins[CAR_COUNT] = CAR_PINS(RELAY);
+#ifdef RELAY_TEST
+  static const uint8_t relay_test_pins[CAR_COUNT] = CAR_PINS(RELAY_TEST);
+#endif
+  for(unsigned int car = 0; car < CAR_COUNT; car++) {
+    pinMode(pilot_out_pins[car], OUTPUT);
+    pinMode(relay_pins[car], OUTPUT);
 #ifdef RELAY_TEST
-  pinMode(CAR_A_RELAY_TEST, INPUT);
-  pinMode(CAR_B_RELAY_TEST, INPUT);
+    pinMode(relay_test_pins[car], INPUT);
 #endif
+  }
+
+  {
+    // From here on, the A/d converter belongs to the sampler. No more analogRead().
+    static const uint8_t pilot_sense_pins[CAR_COUNT] = CAR_PINS(PILOT_SENSE_PIN);
+    static const uint8_t current_pins[CAR_COUNT] = CAR_PINS(CURRENT_PIN);
+    uint8_t channels[SLOT_COUNT];
+    for(unsigned int car = 0; car < CAR_COUNT; car++) {
+      channels[SLOT_PILOT(car)] = pilot_sense_pins[car];
+      channels[SLOT_CURRENT(car)] = current_pins[car];
+    }
+    Sampler.begin(channels, SLOT_COUNT, SLOT_PILOT_COUNT, PILOT_PERIOD_US);
+    for(unsigned int car = 0; car < CAR_COUNT; car++)
+      Sampler.measureRms(SLOT_CURRENT(car));
+    SenseLevels nominal = { CURRENT_0A, PILOT_12V, PILOT_N12V };
+    baseline.begin(EEPROM_BASELINE, nominal);
+    for(unsigned int car = 0; car < CAR_COUNT; car++)
+      Sampler.setRmsZero(SLOT_CURRENT(car), baseline.ctZero(car));
+  }
 
-  digitalWrite(OUTGOING_PROXIMITY_PIN, LOW);
-
-  // Enter state A on both cars
-  setPilot(CAR_A, HIGH);
-  setPilot(CAR_B, HIGH);
-  // And make sure the power is off.
-  setRelay(CAR_A, LOW);
-  setRelay(CAR_B, LOW);
-
-  memset(car_a_current_samples, 0, sizeof(car_a_current_samples));
-  memset(car_b_current_samples, 0, sizeof(car_b_current_samples));
-  last_car_a_state = DUNNO;
-  last_car_b_state = DUNNO;
-  car_a_request_time = 0;
-  car_b_request_time = 0;
-  car_a_overdraw_begin = 0;
-  car_b_overdraw_begin = 0;
-  last_current_log_car_a = 0;
-  last_current_log_car_b = 0;
+  FastPin<OUTGOING_PROXIMITY_PIN>::low();
+
+  for(unsigned int car = 0; car < CAR_COUNT; car++) {
+    // Enter state A on every car
+    setPilot(car, HIGH);
+    // And make sure the power is off.
+    setRelay(car, LOW);
+
+    cars[car].current_spikes.reset();
+    cars[car].metered = false;
+    cars[car].last_state = DUNNO;
+    cars[car].sensed_state = DUNNO;
+    cars[car].seen_state = DUNNO;
+    cars[car].seen_count = 0;
+    cars[car].last_current_log = 0;
+  }
   lastProximity = HIGH;
-  button_debounce_time = 0;
   button_press_time = 0;
-  sequential_pilot_timeout = 0;
-  relay_change_time = 0;
 #ifdef GROUND_TEST
   current_ground_status = 0;
 #endif
@@ -1013,10 +1683,12 @@ void setup() {
     operatingMode = DEFAULT_MODE;
     EEPROM.write(EEPROM_LOC_MODE, operatingMode);
   }
+  sequential_mode_tiebreak = NO_CAR;
+  seq_overlap = NO_CAR;
   if (operatingMode == MODE_SEQUENTIAL) {
-    sequential_mode_tiebreak = EEPROM.read(EEPROM_LOC_CAR);
-    if (sequential_mode_tiebreak != CAR_A && sequential_mode_tiebreak != CAR_B)
-      sequential_mode_tiebreak = DUNNO;
+    unsigned int saved = EEPROM.read(EEPROM_LOC_CAR);
+    if (saved >= 1 && saved <= CAR_COUNT)
+      sequential_mode_tiebreak = saved - 1;
   }
 
   display.setBacklight(WHITE);
@@ -1026,60 +1698,82 @@ void setup() {
   display.setCursor(0, 1);
   display.print(P(VERSION));
 
-  boolean success = SetPinFrequencySafe(CAR_A_PILOT_OUT_PIN, 1000);
-  if (!success) {
-    log(LOG_INFO, P("SetPinFrequency for car A failed!"));
-    display.setBacklight(YELLOW);
-  }
-  success = SetPinFrequencySafe(CAR_B_PILOT_OUT_PIN, 1000);
-  if (!success) {
-    log(LOG_INFO, P("SetPinFrequency for car B failed!"));
-    display.setBacklight(BLUE);
+  for(unsigned int car = 0; car < CAR_COUNT; car++) {
+    boolean success = SetPinFrequencySafe(pilot_out_pins[car], 1000000L / PILOT_PERIOD_US);
+    if (!success) {
+      LOG(LOG_INFO, "SetPinFrequency for car %c failed!", car_letter(car));
+      display.setBacklight(car == CAR_A ? YELLOW : BLUE);
+    }
   }
-  // In principle, neither of the above two !success conditions should ever
+  // In principle, none of the above !success conditions should ever
   // happen.
+#ifdef MEGA_HYDRA
+  syncPilotTimers();
+#endif
 
 #ifdef RELAY_TEST
   {
-    boolean test_a = digitalRead(CAR_A_RELAY_TEST) == HIGH;
-    boolean test_b = digitalRead(CAR_B_RELAY_TEST) == HIGH;
-    if (test_a || test_b) {
+    boolean failed = false;
+    for(unsigned int car = 0; car < CAR_COUNT; car++)
+      if (relayTest(car)) failed = true;
+    if (failed) {
       display.setBacklight(RED);
       display.clear();
       display.print(P("Relay Test Failure: "));
-      if (test_a) display.print('A');
-      if (test_b) display.print('B');
+      for(unsigned int car = 0; car < CAR_COUNT; car++)
+        if (relayTest(car)) display.print(car_letter(car));
       die(); // and goodnight
     }
   }
 #endif
 
-  // meanwhile, the fill in the incoming pilot rolling average...
-  for(int i = 0; i < ROLLING_AVERAGE_SIZE; i++) {
-    pollIncomingPilot();
-  }
+  // Display the splash screen for 2 seconds. Meanwhile, the incoming pilot is being timed.
+  Delay(2000); // let the splash screen show
+  pollIncomingPilot();
   lastIncomingPilot = incomingPilotMilliamps;
-
-  // Display the splash screen for 2 seconds total. We spent some time above sampling the
-  // pilot, so don't include that.
-  Delay(2000 - (ROLLING_AVERAGE_SIZE * PILOT_POLL_INTERVAL)); // let the splash screen show
   display.clear();
+
+  // From here on, loop() runs everything as a task.
+  set_sleep_mode(SLEEP_MODE_IDLE);
+  Tasks.add(&safety_task, safetyTask, SAFETY_TASK_PERIOD, SAFETY_TASK_SLACK);
+  for(unsigned int car = 0; car < CAR_COUNT; car++) {
+    Tasks.add(&cars[car].overdraw, overdrawTask, 0, DEADLINE_TASK_SLACK, car);
+    Tasks.add(&cars[car].error_delay, errorDelayTask, 0, DEADLINE_TASK_SLACK, car);
+    Tasks.add(&cars[car].request, requestTask, 0, DEADLINE_TASK_SLACK, car);
+  }
+  Tasks.add(&sequential_offer, sequentialOfferTask, 0, DEADLINE_TASK_SLACK);
+  Tasks.add(&demand_raise, demandRaiseTask, 0, DEADLINE_TASK_SLACK);
+  Tasks.add(&pilot_task, pilotTask, PILOT_TASK_PERIOD, PILOT_TASK_SLACK);
+  Tasks.add(&current_task, currentTask, CURRENT_TASK_PERIOD, CURRENT_TASK_SLACK);
+  Tasks.add(&demand_task, demandTask, DEMAND_TASK_PERIOD, DEMAND_TASK_SLACK);
+  Tasks.add(&button_task, buttonTask, BUTTON_TASK_PERIOD, BUTTON_TASK_SLACK);
+  Tasks.add(&display_task, displayTask, DISPLAY_TASK_PERIOD, DISPLAY_TASK_SLACK);
+  Tasks.add(&lcd_task, lcdTask, LCD_TASK_PERIOD, LCD_TASK_SLACK);
+  Tasks.add(&log_task, logTask, LOG_TASK_PERIOD, LOG_TASK_SLACK);
 }
 
 void loop() {
 
   // Pet the dog
   wdt_reset();
-  
+
+  if (Tasks.run() == NULL) {
+    // Nothing is due. Doze until the next interrupt, which is never more than a millisecond away.
+    sleep_mode();
+  }
+}
+
+// Ground and relay tests, and the incoming proximity
+static void safetyTask(Task *task) {
 #ifdef GROUND_TEST
-  if ((relay_state_a == HIGH || relay_state_b == HIGH) && relay_change_time == 0) {
-    unsigned char ground = digitalRead(GROUND_TEST_PIN) == HIGH;
+  if (anyRelayClosed() && !Tasks.pending(&relay_settle)) {
+    unsigned char ground = FastPin<GROUND_TEST_PIN>::read() == HIGH;
     if (ground != current_ground_status) {
       current_ground_status = ground;
       if (!ground) {
         // we've just noticed a ground failure.
-        log(LOG_INFO, P("Ground failure detected"));
-        error(BOTH, 'F');
+        LOG(LOG_INFO, "Ground failure detected");
+        error(ALL_CARS, 'F');
       }
     }
   } else {
@@ -1088,101 +1782,73 @@ void loop() {
 #endif
 
 #ifdef RELAY_TEST
-  if (relay_change_time == 0) {
-    // The relay is off, but the relay test shows a voltage, that's a stuck relay
-    if ((digitalRead(CAR_A_RELAY_TEST) == HIGH) && (relay_state_a == LOW)) {
-      log(LOG_INFO, P("Relay fault detected on car A"));
-      error(CAR_A, 'R');    
-    }
-    if ((digitalRead(CAR_B_RELAY_TEST) == HIGH) && (relay_state_b == LOW)) {
-      log(LOG_INFO, P("Relay fault detected on car B"));
-      error(CAR_B, 'R');
-    }
+  if (!Tasks.pending(&relay_settle)) {
+    for(unsigned int car = 0; car < CAR_COUNT; car++) {
+      boolean test = relayTest(car);
+      // The relay is off, but the relay test shows a voltage, that's a stuck relay
+      if (test && (cars[car].relay_state == LOW)) {
+        LOG(LOG_INFO, "Relay fault detected on %s", car_str(car));
+        error(car, 'R');
+      }
 #ifdef RELAY_TESTS_GROUND
-    // If the relay is on, but the relay test does not show a voltage, that's a ground impedance failure
-    if ((digitalRead(CAR_A_RELAY_TEST) == LOW) && (relay_state_a == HIGH)) {
-      log(LOG_INFO, P("Ground failure detected on car A"));
-      error(CAR_A, 'F');    
-    }
-    if ((digitalRead(CAR_B_RELAY_TEST) == LOW) && (relay_state_b == HIGH)) {
-      log(LOG_INFO, P("Ground failure detected on car B"));
-      error(CAR_B, 'F);
-    }
+      // If the relay is on, but the relay test does not show a voltage, that's a ground impedance failure
+      if (!test && (cars[car].relay_state == HIGH)) {
+        LOG(LOG_INFO, "Ground failure detected on %s", car_str(car));
+        error(car, 'F');
+      }
 #endif
+    }
   }
 #endif
-  if (millis() > relay_change_time + RELAY_TEST_GRACE_TIME)
-    relay_change_time = 0;
-
-  // cut down on how frequently we call millis()
-  boolean proximityOrPilotError = false;
-  
-  // Update the display
-
-  if (last_car_a_state == STATE_E || last_car_b_state == STATE_E) {
-    // One or both cars in error state
-    display.setBacklight(RED);
-  } 
-  else {
-    boolean a = isCarCharging(CAR_A);
-    boolean b = isCarCharging(CAR_B);
-
-    // Neither car
-    if (!a && !b) display.setBacklight(paused?YELLOW:GREEN);
-    // Both cars
-    else if (a && b) display.setBacklight(VIOLET);
-    // One car or the other
-    else if (a ^ b) display.setBacklight(TEAL);
-  }
 
   // Check proximity
-  unsigned int proximity = digitalRead(INCOMING_PROXIMITY_PIN);
+  unsigned int proximity = FastPin<INCOMING_PROXIMITY_PIN>::read();
   if (proximity != lastProximity) {
     if (proximity != HIGH) {
 
-      log(LOG_INFO, P("Incoming proximity disconnect"));
+      LOG(LOG_INFO, "Incoming proximity disconnect");
       
       // EVs are supposed to react to a proximity transition much faster than
       // an error transition.
-      digitalWrite(OUTGOING_PROXIMITY_PIN, HIGH);
+      FastPin<OUTGOING_PROXIMITY_PIN>::high();
 
       display.setCursor(0, 0);
       display.print(P("DISCONNECTING..."));
-      error(BOTH, 'P');
+      error(ALL_CARS, 'P');
     } 
     else {
-      log(LOG_INFO, P("Incoming proximity restore"));
+      LOG(LOG_INFO, "Incoming proximity restore");
       // Clear out "Disconnecting..."
       display.setCursor(0, 0);
       display.print(P("                "));
       
       // In case someone pushed the button and changed their mind
-      digitalWrite(OUTGOING_PROXIMITY_PIN, LOW);
+      FastPin<OUTGOING_PROXIMITY_PIN>::low();
     }
   }
   lastProximity = proximity;
-  if (proximity != HIGH) proximityOrPilotError = true;
+}
+
+// The incoming pilot, the pilot sense and state transitions.
+static void pilotTask(Task *task) {
+  boolean proximityOrPilotError = lastProximity != HIGH;
 
   pollIncomingPilot();
   if (!proximityOrPilotError && incomingPilotMilliamps < MINIMUM_INLET_CURRENT) {
     if (!paused) {
       if (operatingMode == MODE_SEQUENTIAL) {
         // remember which car was active
-        if (pilot_state_a == FULL) sequential_mode_tiebreak = CAR_A;
-        else if (pilot_state_b == FULL) sequential_mode_tiebreak = CAR_B;
-        else sequential_mode_tiebreak = DUNNO;
+        sequential_mode_tiebreak = pilotHolder();
+      }
+      // Turn off all of the pilots
+      for(unsigned int car = 0; car < CAR_COUNT; car++) {
+        setPilot(car, HIGH);
+        Tasks.start(&cars[car].error_delay, ERROR_DELAY);
+        cars[car].last_state = DUNNO;
+        Tasks.stop(&cars[car].request);
       }
-      // Turn off both pilots
-      setPilot(CAR_A, HIGH);
-      setPilot(CAR_B, HIGH);
-      unsigned long now = millis();
-      car_a_error_time = now;
-      car_b_error_time = now;
-      last_car_a_state = DUNNO;
-      last_car_b_state = DUNNO;
-      car_a_request_time = 0;
-      car_b_request_time = 0;      
-      log(LOG_INFO, P("Incoming pilot invalid. Pausing."));
+      seq_overlap = NO_CAR;
+      LOG(LOG_INFO, "Incoming pilot invalid. Pausing.");
       display.setCursor(0, 0);
       display.print(P("I:PAUSE "));
     }
@@ -1193,313 +1859,366 @@ void loop() {
     paused = false;
   }
 
-  if(paused || !proximityOrPilotError) {
-    if (!paused) {
-      display.setCursor(0, 0);
-      display.print(P("I:"));
-      display.print(formatMilliamps(incomingPilotMilliamps));
-    }
-    display.setCursor(8, 0);
-    display.print(P("M:"));
-    switch(operatingMode) {
-      case MODE_SHARED:
-        display.print(P("shared")); break;
-      case MODE_SEQUENTIAL:
-        display.print(P("seqntl")); break;
-      default:
-        display.print(P("UNK")); break;
-    }
-  }
-
   // Adjust the pilot levels to follow any changes in the incoming pilot
   unsigned long fuzz = labs(incomingPilotMilliamps - lastIncomingPilot);
   if (fuzz > PILOT_FUZZ) {
-    log(LOG_INFO, P("Detected incoming pilot fuzz of %lu mA"), fuzz);
-    switch(pilot_state_a) {
-      case HALF: setPilot(CAR_A, HALF); break;
-      case FULL: setPilot(CAR_A, FULL); break;
-    }
-    switch(pilot_state_b) {
-      case HALF: setPilot(CAR_B, HALF); break;
-      case FULL: setPilot(CAR_B, FULL); break;
+    LOG(LOG_INFO, "Detected incoming pilot fuzz of %lu mA", fuzz);
+    for(unsigned int car = 0; car < CAR_COUNT; car++) {
+      switch(cars[car].pilot_state) {
+        case SHARE: setPilot(car, SHARE); break;
+        case FULL: setPilot(car, FULL); break;
+      }
     }
     lastIncomingPilot = incomingPilotMilliamps;
-  }
-
-  // Check the pilot sense on each car.
-  unsigned int car_a_state = checkState(CAR_A);
-
-  if (paused || last_car_a_state == STATE_E) {
-    switch(car_a_state) {
-    case STATE_A:
-      // we were in error, but the car's been disconnected.
-      // If we still have a pilot or proximity error, then
-      // we can't clear the error.
-      if (!proximityOrPilotError) {
-      // If not, clear the error state. The next time through
-      // will take us back to state A.
-        last_car_a_state = DUNNO;
-        log(LOG_INFO, P("Car A disconnected, clearing error"));
-      }
-      if (paused) {
-          display.setCursor(0, 1);
-          display.print("A: ---  ");
-      }
-      // fall through...
-    case STATE_B:
-      // If we see a transition to state B, the error is still in effect, but complete (and
-      // cancel) any pending relay opening.
-      if (car_a_error_time != 0) {
-        car_a_error_time = 0;
-        setRelay(CAR_A, LOW);
-        if (isCarCharging(CAR_B) || last_car_b_state == STATE_B)
-          setPilot(CAR_B, FULL);
+    // Demand mode's shares were worked out from the old one.
+    if (operatingMode == MODE_DEMAND && !paused) allotDemand();
+    // So was what sequential mode let a car have alongside a tapering one. If there's no
+    // longer room for both, the first car comes first.
+    if (operatingMode == MODE_SEQUENTIAL && !paused && seq_overlap != NO_CAR && cars[seq_overlap].pilot_state == ALLOT) {
+      unsigned int holder = pilotHolder();
+      if (holder == NO_CAR || pilotMilliamps(holder) + pilotMilliamps(seq_overlap) > incomingPilotMilliamps) {
+        LOG(LOG_INFO, "No more room alongside the tapering car, stopping %s", car_str(seq_overlap));
+        stopOverlap();
       }
-      if (paused && car_a_state == STATE_B) {
-        display.setCursor(0, 1);
-        display.print("A: off  ");
-      }
-      break;
-    }
-  } else if (car_a_state != last_car_a_state) {
-    if (last_car_a_state != DUNNO)
-      log(LOG_INFO, P("Car A state transition: %s->%s."), state_str(last_car_a_state), state_str(car_a_state));
-    switch(operatingMode) {
-      case MODE_SHARED:
-        shared_mode_transition(CAR_A, car_a_state);
-        break;
-      case MODE_SEQUENTIAL:
-        sequential_mode_transition(CAR_A, car_a_state);
-        break;
     }
   }
 
-  unsigned int car_b_state = checkState(CAR_B);
-  if (paused || last_car_b_state == STATE_E) {
-    switch(car_b_state) {
-    case STATE_A:
-      // we were in error, but the car's been disconnected.
-      // If we still have a pilot or proximity error, then
-      // we can't clear the error.
-      if (!proximityOrPilotError) {
-      // If not, clear the error state. The next time through
-      // will take us back to state A.
-        last_car_b_state = DUNNO;
-        log(LOG_INFO, P("Car B disconnected, clearing error"));
-      }
-      if (paused) {
-          display.setCursor(8, 1);
-          display.print("B: ---  ");
-      }
-      // fall through...
-    case STATE_B:
-      // If we see a transition to state B, the error is still in effect, but complete (and
-      // cancel) any pending relay opening.
-      if (car_b_error_time != 0) {
-        car_b_error_time = 0;
-        setRelay(CAR_B, LOW);
-        if (isCarCharging(CAR_A) || last_car_a_state == STATE_B)
-          setPilot(CAR_A, FULL);
+  // Check the pilot sense on every car. They're looked at together, so the
+  // transitions below see the cars as they were at the same moment.
+  unsigned int states[CAR_COUNT];
+  checkStates(states);
+
+  for(unsigned int us = 0; us < CAR_COUNT; us++) {
+    car_type &car = cars[us];
+    unsigned int car_state = states[us];
+    car.sensed_state = car_state;
+    // A car that's been unplugged starts over.
+    if (car_state == STATE_A) car.charge = car.charge_part = 0;
+
+    if (paused || car.last_state == STATE_E) {
+      switch(car_state) {
+      case STATE_A:
+        // we were in error, but the car's been disconnected.
+        // If we still have a pilot or proximity error, then
+        // we can't clear the error.
+        if (!proximityOrPilotError) {
+        // If not, clear the error state. The next time through
+        // will take us back to state A.
+          car.last_state = DUNNO;
+          LOG(LOG_INFO, "Car %c disconnected, clearing error", car_letter(us));
+        }
+        // fall through...
+      case STATE_B:
+        // If we see a transition to state B, the error is still in effect, but complete (and
+        // cancel) any pending relay opening.
+        if (Tasks.running(&car.error_delay)) {
+          Tasks.stop(&car.error_delay);
+          setRelay(us, LOW);
+          releasePilot(us);
+        }
+        break;
       }
-      if (paused && car_b_state == STATE_B) {
-        display.setCursor(8, 1);
-        display.print("B: off  ");
+    } else if (car_state != car.last_state) {
+      if (car.last_state != DUNNO)
+        LOG(LOG_INFO, "Car %c state transition: %s->%s.", car_letter(us), state_str(car.last_state), state_str(car_state));
+      switch(operatingMode) {
+        case MODE_SHARED:
+          shared_mode_transition(us, car_state);
+          break;
+        case MODE_SEQUENTIAL:
+          sequential_mode_transition(us, car_state);
+          break;
+        case MODE_DEMAND:
+          demand_mode_transition(us, car_state);
+          break;
       }
-      break;
-    }
-  } else if (car_b_state != last_car_b_state) {
-    if (last_car_b_state != DUNNO)
-      log(LOG_INFO, P("Car B state transition: %s->%s."), state_str(last_car_b_state), state_str(car_b_state));
-    switch(operatingMode) {
-      case MODE_SHARED:
-        shared_mode_transition(CAR_B, car_b_state);
-        break;
-      case MODE_SEQUENTIAL:
-        sequential_mode_transition(CAR_B, car_b_state);
-        break;
     }
   }
-  if (sequential_pilot_timeout != 0) {
-    unsigned long now = millis();
-    if (now - sequential_pilot_timeout > SEQ_MODE_OFFER_TIMEOUT) {
-      if (pilot_state_a == FULL) {
-        log(LOG_INFO, P("Sequential mode offer timeout, moving offer to %s"), car_str(CAR_B));
-        setPilot(CAR_A, HIGH);
-        setPilot(CAR_B, FULL);
-        sequential_pilot_timeout = now;
-        display.setCursor(0, 1);
-        display.print("A: wait B: off  ");
-      } else if (pilot_state_b == FULL) {
-        log(LOG_INFO, P("Sequential mode offer timeout, moving offer to %s"), car_str(CAR_A));
-        setPilot(CAR_B, HIGH);
-        setPilot(CAR_A, FULL);
-        sequential_pilot_timeout = now;
-        display.setCursor(0, 1);
-        display.print("A: off  B: wait ");
-      }
+}
+
+// The protocol deadlines. Each of these runs once, when its delay is up, unless it's been
+// stopped first. The task's arg is the car it's for.
+
+// The other cars have had TRANSITION_DELAY to drop to their new shares. It's our turn.
+static void requestTask(Task *task) {
+  unsigned int car = task->arg;
+  LOG(LOG_INFO, "Delayed transition completed on %s", car_str(car));
+  setRelay(car, HIGH);
+  showCar(car, P(": ON   "));
+}
+
+// ERROR_DELAY after the pilot was taken away, the power goes, too.
+static void errorDelayTask(Task *task) {
+  unsigned int car = task->arg;
+  setRelay(car, LOW);
+  if (paused) {
+    showCar(car, P(": off  "));
+    LOG(LOG_INFO, "Power withdrawn after pause delay on %s", car_str(car));
+  } else {
+    LOG(LOG_INFO, "Power withdrawn after error delay on %s", car_str(car));
+  }
+  releasePilot(car);
+}
+
+// The car's been over its limit for all of OVERDRAW_GRACE_PERIOD.
+static void overdrawTask(Task *task) {
+  error(task->arg, 'O');
+}
+
+// The car with the pilot and another one have sat in state B for SEQ_MODE_OFFER_TIMEOUT.
+// Offer the pilot to the next one.
+static void sequentialOfferTask(Task *task) {
+  unsigned int holder = pilotHolder();
+  if (holder == NO_CAR) return;
+  unsigned int next = nextWaiting(holder);
+  if (next == NO_CAR) return;
+  LOG(LOG_INFO, "Sequential mode offer timeout, moving offer to %s", car_str(next));
+  setPilot(holder, HIGH);
+  setPilot(next, FULL);
+  Tasks.start(task, SEQ_MODE_OFFER_TIMEOUT);
+  showCar(holder, P(": wait "));
+  showCar(next, P(": off  "));
+}
+
+// Demand mode: the cars that were lowered have had TRANSITION_DELAY to cut back. The ones
+// that were waiting for that can go up now. In sequential mode, the car waiting on a tapering
+// one can have what it doesn't use.
+static void demandRaiseTask(Task *task) {
+  for(unsigned int car = 0; car < CAR_COUNT; car++) {
+    if (cars[car].raise_to != 0 && isCarCharging(car))
+      allotPilot(car, cars[car].raise_to);
+    cars[car].raise_to = 0;
+  }
+  unsigned int holder = pilotHolder();
+  if (seq_overlap != NO_CAR && holder != NO_CAR && cars[seq_overlap].pilot_state == HIGH) {
+    if (cars[seq_overlap].last_state != STATE_B) {
+      endOverlap(seq_overlap);
+      return;
     }
+    allotPilot(seq_overlap, incomingPilotMilliamps - pilotMilliamps(holder));
+    showCar(seq_overlap, P(": off  "));
   }
-  
-  {
-    unsigned long now = millis();
-    if (now - last_state_log > STATE_LOG_INTERVAL) {
-      last_state_log = now;
-      log(LOG_INFO, P("States: Car A, %s; Car B, %s"), state_str(last_car_a_state), state_str(last_car_b_state));
-      log(LOG_INFO, P("Incoming pilot %s"), formatMilliamps(incomingPilotMilliamps));
+}
+
+// Demand mode: every DEMAND_INTERVAL, see what the cars have been drawing, and move the
+// shares to match. Not while a car is on its way in, or any are still cutting back.
+// Sequential mode looks at whether the car with the pilot has tapered off, or had its turn.
+static void demandTask(Task *task) {
+  for(unsigned int car = 0; car < CAR_COUNT; car++) {
+    cars[car].last_peak = cars[car].peak_draw;
+    cars[car].peak_draw = 0;
+  }
+  if (paused) return;
+  if (Tasks.running(&demand_raise)) return;
+  for(unsigned int car = 0; car < CAR_COUNT; car++)
+    if (Tasks.running(&cars[car].request)) return;
+  if (operatingMode == MODE_DEMAND)
+    allotDemand();
+  else if (operatingMode == MODE_SEQUENTIAL) {
+    checkTaper();
+    checkTurn();
+  }
+}
+
+// While a car waits for the others to cut back (see awaitHandoff()), see whether they have.
+// Every car that's charging must be on the ammeter, and within its pilot for all of
+// HANDOFF_SETTLE_TIME.
+static void checkHandoff() {
+  boolean waiting = false;
+  for(unsigned int car = 0; car < CAR_COUNT; car++)
+    if (Tasks.running(&cars[car].request)) waiting = true;
+  if (!waiting) return;
+  for(unsigned int car = 0; car < CAR_COUNT; car++) {
+    car_type &c = cars[car];
+    if (c.relay_state != HIGH || c.last_state == STATE_E) continue;
+    if (!c.metered || c.shown > pilotMilliamps(car) + OVERDRAW_GRACE_AMPS) {
+      Tasks.start(&handoff_settle, HANDOFF_SETTLE_TIME);
+      return;
     }
   }
-   
-  // Update the ammeter display and check for overdraw conditions.
+  if (Tasks.pending(&handoff_settle)) return;
+  for(unsigned int car = 0; car < CAR_COUNT; car++) {
+    if (!Tasks.running(&cars[car].request)) continue;
+    Tasks.stop(&cars[car].request);
+    LOG(LOG_INFO, "Early transition completed on %s", car_str(car));
+    setRelay(car, HIGH);
+    showCar(car, P(": ON   "));
+  }
+}
+
+// The ammeters and the overdraw checks. What's shown is left for the display task.
+static void currentTask(Task *task) {
   // We allow a 5 second grace because the J1772 spec requires allowing
   // the car 5 seconds to respond to incoming pilot changes.
   // If the overdraw condition is acute enough, we'll be blowing fuses
   // in hardware, so this isn't as dire a condition as it sounds.
   // More likely what it means is that the car hasn't reacted to an
-  // attempt to reduce it to half power (and the other car has not yet
+  // attempt to reduce it to its share (and the next car has not yet
   // been turned on), so we must error them out before letting the other
   // car start.
-  if (relay_state_a == HIGH && last_car_a_state != STATE_E) { // Only check the ammeter if the power is actually on and we're not errored
-    unsigned long car_a_draw = readCurrent(CAR_A);
-
-    {
-      unsigned long now = millis();
-      if (now - last_current_log_car_a > CURRENT_LOG_INTERVAL) {
-        last_current_log_car_a = now;
-        log(LOG_INFO, P("Car A current draw %lu mA"), car_a_draw);
+  for(unsigned int us = 0; us < CAR_COUNT; us++) {
+    car_type &car = cars[us];
+    if (car.relay_state == HIGH && car.last_state != STATE_E) { // Only check the ammeter if the power is actually on and we're not errored
+      unsigned long draw = readCurrent(us);
+      // The overdraw check uses the raw reading. Only what's shown has the spikes taken out.
+      car.shown = car.current_spikes.add(draw);
+      if (!car.metered) {
+        car.demand_since = millis();
+        car.peak_draw = car.last_peak = 0;
       }
-    }
-    
-    // If the other car is charging, then we can only have half power
-    unsigned long car_a_limit = incomingPilotMilliamps / ((pilotState(CAR_A) == HALF)? 2 : 1);
-
-    if (car_a_draw > car_a_limit + OVERDRAW_GRACE_AMPS) {
-      // car A has begun an over-draw condition. They have 5 seconds of grace before we pull the plug.
-      if (car_a_overdraw_begin == 0) {
-        car_a_overdraw_begin = millis();
-      } 
-      else {
-        if (millis() - car_a_overdraw_begin > OVERDRAW_GRACE_PERIOD) {
-          error(CAR_A, 'O');
-          return;
+      if (!car.metered || car.shown * 100 >= pilotOffered(us) * SEQ_TAPER_PERCENT)
+        car.taper_since = millis();
+      {
+        unsigned long now = millis();
+        if (car.metered) {
+          car.charge_part += car.shown * (now - car.metered_at);
+          car.charge += car.charge_part / 3600000UL;
+          car.charge_part %= 3600000UL;
         }
+        car.metered_at = now;
       }
-    }
-    else {
-      // car A is under its limit. Cancel any overdraw in progress
-      car_a_overdraw_begin = 0;
-    }
-    display.setCursor(0, 1);
-    display.print("A:");
-    display.print(formatMilliamps(car_a_draw));
-  } 
-  else {
-    // Car A is not charging
-    car_a_overdraw_begin = 0;
-    memset(car_b_current_samples, 0, sizeof(car_b_current_samples));
-  }
+      car.metered = true;
+      // Demand mode goes by what's shown, so that the inrush doesn't count.
+      if (car.shown > car.peak_draw) car.peak_draw = (car.shown > 0xffff) ? 0xffff : car.shown;
 
-  if (relay_state_b == HIGH && last_car_b_state != STATE_E) { // Only check the ammeter if the power is actually on and we're not errored
-    unsigned long car_b_draw = readCurrent(CAR_B);
+      {
+        unsigned long now = millis();
+        if (now - car.last_current_log > CURRENT_LOG_INTERVAL) {
+          car.last_current_log = now;
+          LOG(LOG_INFO, "Car %c current draw %lu mA", car_letter(us), car.shown);
+        }
+      }
 
-    {
-      unsigned long now = millis();
-      if (now - last_current_log_car_b > CURRENT_LOG_INTERVAL) {
-        last_current_log_car_b = now;
-        log(LOG_INFO, P("Car B current draw %lu mA"), car_b_draw);
+      // If other cars are charging, then we can only have our share
+      unsigned long limit = pilotMilliamps(us);
+
+      if (draw > limit + OVERDRAW_GRACE_AMPS) {
+        // the car has begun an over-draw condition. They have 5 seconds of grace before we pull the plug.
+        if (!Tasks.running(&car.overdraw))
+          Tasks.start(&car.overdraw, OVERDRAW_GRACE_PERIOD);
       }
-    }
-    
-    // If the other car is charging, then we can only have half power
-    unsigned long car_b_limit = incomingPilotMilliamps / ((pilotState(CAR_B) == HALF) ? 2 : 1);
-
-    if (car_b_draw > car_b_limit + OVERDRAW_GRACE_AMPS) {
-      // car B has begun an over-draw condition. They have 5 seconds of grace before we pull the plug.
-      if (car_b_overdraw_begin == 0) {
-        car_b_overdraw_begin = millis();
-      } 
       else {
-        if (millis() - car_b_overdraw_begin > OVERDRAW_GRACE_PERIOD) {
-          error(CAR_B, 'O');
-          return;
-        }
+        // the car is under its limit. Cancel any overdraw in progress
+        Tasks.stop(&car.overdraw);
       }
-    }
+    } 
     else {
-      car_b_overdraw_begin = 0;
+      // the car is not charging
+      Tasks.stop(&car.overdraw);
+      car.current_spikes.reset();
+      car.metered = false;
+      if (car.relay_state == LOW) learnCurrentZero(us);
+    }
+  }
+
+  checkHandoff();
+}
+
+// The button, which changes the mode.
+static void buttonTask(Task *task) {
+  for(unsigned int car = 0; car < CAR_COUNT; car++) {
+    // Only when all of the plugs are out
+    if (cars[car].sensed_state != STATE_A) return;
+  }
+  unsigned int event = checkEvent();
+  if (event == EVENT_SHORT_PUSH || event == EVENT_LONG_PUSH) {
+    operatingMode++;
+    if (operatingMode > LAST_MODE) operatingMode = 0;
+    EEPROM.write(EEPROM_LOC_MODE, operatingMode);
+    const char *modeStr;
+    switch(operatingMode) {
+      case MODE_SEQUENTIAL: modeStr = "sequential"; break;
+      case MODE_DEMAND: modeStr = "demand"; break;
+      case MODE_SHARED: modeStr = "shared"; break;
+      default: modeStr = "UNKNOWN";
     }
-    display.setCursor(8, 1);
-    display.print("B:");
-    display.print(formatMilliamps(car_b_draw));
+    LOG(LOG_INFO, "Changing operating mode to %s", modeStr);
+  }
+}
+
+// Send the LCD whatever's changed on the display.
+static void lcdTask(Task *task) {
+  display.flush();
+}
+
+// The backlight, the incoming pilot and mode, and the ammeters.
+static void displayTask(Task *task) {
+  boolean errored = false;
+  for(unsigned int car = 0; car < CAR_COUNT; car++)
+    if (cars[car].last_state == STATE_E) errored = true;
+  if (errored) {
+    // One or more cars in error state
+    display.setBacklight(RED);
   } 
   else {
-    // Car B is not charging
-    car_b_overdraw_begin = 0;
-    memset(car_b_current_samples, 0, sizeof(car_b_current_samples));
-  }
-
-  // We need to use labs() here because we cached now early on, so it may actually be
-  // *before* the time in question
-  if (car_a_request_time != 0 && (millis() - car_a_request_time) > TRANSITION_DELAY) {
-    // We've waited long enough.
-    log(LOG_INFO, P("Delayed transition completed on car A"));
-    car_a_request_time = 0;
-    setRelay(CAR_A, HIGH);
-    display.setCursor(0, 1);
-    display.print("A: ON   ");
-  }
-  if (car_a_error_time != 0 && (millis() - car_a_error_time) > ERROR_DELAY) {
-    car_a_error_time = 0;
-    setRelay(CAR_A, LOW);
-    if (paused) {
-      display.setCursor(0, 1);
-      display.print(P("A: off  "));
-      log(LOG_INFO, P("Power withdrawn after pause delay on car A"));
-    } else {
-      log(LOG_INFO, P("Power withdrawn after error delay on car A"));
+    switch(chargingCount()) {
+      // No car
+      case 0: display.setBacklight(paused?YELLOW:GREEN); break;
+      // One car
+      case 1: display.setBacklight(TEAL); break;
+      // More than one
+      default: display.setBacklight(VIOLET); break;
     }
-    if (isCarCharging(CAR_B) || last_car_b_state == STATE_B)
-        setPilot(CAR_B, FULL);
-  }
-  if (car_b_request_time != 0 && (millis() - car_b_request_time) > TRANSITION_DELAY) {
-    log(LOG_INFO, P("Delayed transition completed on car B"));
-    // We've waited long enough.
-    car_b_request_time = 0;
-    setRelay(CAR_B, HIGH);
-    display.setCursor(8, 1);
-    display.print("B: ON   ");
-  }
-  if (car_b_error_time != 0 && (millis() - car_b_error_time) > ERROR_DELAY) {
-    car_b_error_time = 0;
-    setRelay(CAR_B, LOW);
-    if (paused) {
-      display.setCursor(8, 1);
-      display.print(P("B: off  "));
-      log(LOG_INFO, P("Power withdrawn after pause delay on car B"));
-    } else {
-      log(LOG_INFO, P("Power withdrawn after error delay on car B"));
+  }
+
+  if (paused || lastProximity == HIGH) {
+    if (!paused) {
+      display.setCursor(0, 0);
+      display.print(P("I:"));
+      display.print(formatMilliamps(incomingPilotMilliamps));
+    }
+    display.setCursor(8, 0);
+    display.print(P("M:"));
+    switch(operatingMode) {
+      case MODE_SHARED:
+        display.print(P("shared")); break;
+      case MODE_SEQUENTIAL:
+        display.print(P("seqntl")); break;
+      case MODE_DEMAND:
+        display.print(P("demand")); break;
+      default:
+        display.print(P("UNK")); break;
     }
-    if (isCarCharging(CAR_A) || last_car_a_state == STATE_B)
-        setPilot(CAR_A, FULL);
   }
-  
-  if (car_a_state == STATE_A && car_b_state == STATE_A) {
-    // Allow playing with the menu button only when both plugs are out
-    unsigned int event = checkEvent();
-    if (event == EVENT_SHORT_PUSH || event == EVENT_LONG_PUSH) {
-      operatingMode++;
-      if (operatingMode > LAST_MODE) operatingMode = 0;
-      EEPROM.write(EEPROM_LOC_MODE, operatingMode);
-      const char *modeStr;
-      switch(operatingMode) {
-        case MODE_SEQUENTIAL: modeStr = "sequential"; break;
-        case MODE_SHARED: modeStr = "shared"; break;
-        default: modeStr = "UNKNOWN";
+
+  for(unsigned int us = 0; us < CAR_COUNT; us++) {
+    car_type &car = cars[us];
+    if (paused) {
+      // Show which cars are plugged in.
+      if (car.sensed_state == STATE_A) {
+        showCar(us, ": ---  ");
+      } else if (car.sensed_state == STATE_B) {
+        showCar(us, ": off  ");
       }
-      log(LOG_INFO, P("Changing operating mode to %s"), modeStr);
+    }
+
+    if (car.relay_state == HIGH && car.last_state != STATE_E && car.metered) {
+      showCar(us, ":");
+      display.print(formatMilliamps(car.shown));
     }
   }
-  
 }
 
-
-
+// The periodic logs, and saving what's been learned.
+static void logTask(Task *task) {
+  unsigned long now = millis();
+  if (now - last_state_log > STATE_LOG_INTERVAL) {
+    last_state_log = now;
+    char states[CAR_COUNT * 16];
+    states[0] = 0;
+    for(unsigned int car = 0; car < CAR_COUNT; car++) {
+      size_t len = strlen(states);
+      snprintf(states + len, sizeof(states) - len, P("%sCar %c, %s"), car == 0 ? "" : "; ", car_letter(car), state_str(cars[car].last_state));
+    }
+    LOG(LOG_INFO, "States: %s", states);
+    LOG(LOG_INFO, "Incoming pilot %s", formatMilliamps(incomingPilotMilliamps));
+    unsigned int mains = 0;
+    for(unsigned int car = 0; car < CAR_COUNT && mains == 0; car++)
+      mains = Sampler.mainsFrequency(SLOT_CURRENT(car));
+    if (mains != 0) LOG(LOG_INFO, "Mains frequency %u.%u Hz", mains / 10, mains % 10);
+  }
+  if (now - last_baseline_save > BASELINE_SAVE_INTERVAL) {
+    last_baseline_save = now;
+    if (baseline.save()) LOG(LOG_INFO, "Saved the learned sense input levels");
+  }
+}
@@ -18,10 +18,21 @@
  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
 
+#include <avr/sleep.h>
 #include <avr/wdt.h>
-#include <Wire.h>
-#include <LiquidTWI2.h>
+#include <util/atomic.h>
+#include <AsyncTWI.h>
+#include <AsyncUART.h>
+#include <LogTokens.h>
+#include <TwiLCD.h>
+#include <ShadowLCD.h>
 #include <PWM.h>
+#include <AnalogSampler.h>
+#include <FastPin.h>
+#include <FixedPoint.h>
+#include <SampleFilters.h>
+#include <SenseBaseline.h>
+#include <TaskRunner.h>
 #include <EEPROM.h>
 #include <Time.h>
 #include <DS1307RTC.h>
@@ -34,6 +45,31 @@
 
 
 #define LCD_I2C_ADDR 0x20 // for adafruit shield or backpack
+// The DS1307 is a standard mode part. With a DS3231 in its place, this can be TWI_FAST_HZ.
+#define I2C_CLOCK_HZ TWI_STANDARD_HZ
+
+// On a Mega (ATmega640, 1280 or 2560), there are the pins and the timers for more than two
+// outlets. They're laid out in the Mega pin assignments below.
+#if defined(__AVR_ATmega640__) || defined(__AVR_ATmega1280__) || defined(__AVR_ATmega2560__)
+#define MEGA_HYDRA
+#endif
+
+// How many outlets? The reference design has two. A Mega Hydra can have three or four.
+#ifdef MEGA_HYDRA
+#define CAR_COUNT 4
+#else
+#define CAR_COUNT 2
+#endif
+
+// Two cars fit on a 16x2 display, under the status line. Any more need a 20x4 one (TwiLCD
+// addresses the bottom two lines the way a 20 column display lays them out).
+#if CAR_COUNT > 2
+#define LCD_COLS 20
+#define LCD_ROWS 4
+#else
+#define LCD_COLS 16
+#define LCD_ROWS 2
+#endif
 
 // By historical accident, car B is actually
 // the lower pin number in most cases.
@@ -71,10 +107,18 @@
 // pilot. If the other car changes its mind, it can get power without a delay.
 //#define QUICK_CYCLING_WORKAROUND
 
+// If the LCD shield's MCP23017 has its INTA wired to BUTTON_INT_PIN, then uncomment this,
+// and the buttons will only be read over i2c when one of them changes, not polled.
+//#define BUTTON_INTERRUPT
+
 #ifdef GROUND_TEST
 
-// This must be high at all times while charging either car, or else it's a ground failure.
+// This must be high at all times while charging any car, or else it's a ground failure.
+#ifdef MEGA_HYDRA
+#define GROUND_TEST_PIN 30
+#else
 #define GROUND_TEST_PIN 6
+#endif
 
 #endif
 
@@ -93,7 +137,48 @@
 
 #define GFI_TEST_PIN            3
 
-#ifndef SWAP_CARS
+#ifdef BUTTON_INTERRUPT
+// The LCD shield's MCP23017 pulls its INTA low when a button changes. It has to be
+// wired to a pin on pin change interrupt 2 (see buttonInterrupt()).
+#ifdef MEGA_HYDRA
+#define BUTTON_INT_PIN          A8
+#else
+#define BUTTON_INT_PIN          5
+#endif
+#endif
+
+#ifdef MEGA_HYDRA
+// ---------- DIGITAL PINS ----------
+// Timer1 makes the pilots for cars A and B, and Timer4 the ones for cars C and D. Timer4
+// is kept in step with Timer1 (see syncPilotTimers()), because it's Timer1 that starts
+// the pilot sense conversions.
+#define CAR_A_PILOT_OUT_PIN     11
+#define CAR_B_PILOT_OUT_PIN     12
+#define CAR_C_PILOT_OUT_PIN     6
+#define CAR_D_PILOT_OUT_PIN     7
+
+#define CAR_A_RELAY             22
+#define CAR_B_RELAY             23
+#define CAR_C_RELAY             24
+#define CAR_D_RELAY             25
+
+#ifdef RELAY_TEST
+#define CAR_A_RELAY_TEST        26
+#define CAR_B_RELAY_TEST        27
+#define CAR_C_RELAY_TEST        28
+#define CAR_D_RELAY_TEST        29
+#endif
+
+// ---------- ANALOG PINS ----------
+#define CAR_A_PILOT_SENSE_PIN   0
+#define CAR_B_PILOT_SENSE_PIN   1
+#define CAR_C_PILOT_SENSE_PIN   2
+#define CAR_D_PILOT_SENSE_PIN   3
+#define CAR_A_CURRENT_PIN       4
+#define CAR_B_CURRENT_PIN       5
+#define CAR_C_CURRENT_PIN       6
+#define CAR_D_CURRENT_PIN       7
+#elif !defined(SWAP_CARS)
 // ---------- DIGITAL PINS ----------
 #define CAR_A_PILOT_OUT_PIN     10
 #define CAR_B_PILOT_OUT_PIN     9
@@ -150,15 +235,42 @@
 #define CAR_B_CURRENT_PIN       3
 #endif
 
-// for things like erroring out a car
-#define BOTH                    0
-#define CAR_A                   1
-#define CAR_B                   2
+// ---------- A/d SAMPLER SLOTS ----------
+// The A/d converter runs on its interrupt, visiting each of these in turn. Each car has a
+// pilot slot and a current slot. The pilot slots must come first: they're timed to the
+// pilot PWM, and the others fill in between.
+#define SLOT_PILOT(car)         (car)
+#define SLOT_CURRENT(car)       (CAR_COUNT + (car))
+#define SLOT_COUNT              (2 * CAR_COUNT)
+#define SLOT_PILOT_COUNT        CAR_COUNT
+#if SLOT_COUNT > SAMPLER_MAX_CHANNELS
+#error There are more sampler slots than the sampler has channels
+#endif
+
+// The pilot period, in microseconds.
+#define PILOT_PERIOD_US 1000
+
+// How many microseconds pass (on average) between two samples of the same current pin. Each
+// half pilot period has one pilot conversion and as many current ones as fit after it.
+#define CURRENT_SAMPLE_PERIOD_US (((PILOT_PERIOD_US / 2) / SAMPLER_FREE_CONVERSIONS(PILOT_PERIOD_US)) * (SLOT_COUNT - SLOT_PILOT_COUNT))
+
+// Cars are numbered from 0, which is also their place in cars[].
+#define CAR_A                   0
+#define CAR_B                   1
+#define CAR_C                   2
+#define CAR_D                   3
+// for things like erroring out every car
+#define ALL_CARS                0xff
+// for when it's none of them
+#define NO_CAR                  0xfe
 #define DEFAULT_TIEBREAK        CAR_A
 
-// Don't use 0 or 1 because that's the value of LOW and HIGH.
-#define HALF                    3
+// Don't use 0 or 1 because that's the value of LOW and HIGH. SHARE is a share of the
+// incoming pilot, when it's divided among the cars (see sharePilot()). ALLOT is whatever
+// demand mode has given the car (see allotPilot()).
+#define SHARE                   3
 #define FULL                    4
+#define ALLOT                   5
 
 #define STATE_A                 1
 #define STATE_B                 2
@@ -174,7 +286,8 @@
 
 // These are the expected analogRead() ranges for pilot read-back from the cars.
 // These are calculated from the expected voltages seen through the dividor network,
-// then scaling those voltages for 0-1024.
+// then scaling those voltages for 0-1024. Each car's readings are mapped onto this
+// scale by what's been learned of its own +12 and -12 volt levels first (see SenseBaseline).
 
 // 11 volts
 #define STATE_A_MIN      870
@@ -194,6 +307,15 @@
 #define PILOT_0V         556
 // -10 volts. We're fairly generous.
 #define PILOT_DIODE_MAX  250
+// +12 and -12 volts, as nominal as PILOT_0V (which is halfway between them).
+#define PILOT_12V        898
+#define PILOT_N12V       214
+// The CT bias puts no current at mid-scale, give or take its resistors.
+#define CURRENT_0A       512
+
+// How often (in milliseconds) are the learned sense input levels saved to EEPROM (if they've
+// moved)? Writing takes a while, and the EEPROM wears out, so not too often.
+#define BASELINE_SAVE_INTERVAL 3600000
 
 // This is how long we allow a car to draw more current than it is allowed before we
 // error it out (in milliseconds). The spec says that a car is supposed to have 5000
@@ -210,30 +332,41 @@
 #define ERROR_DELAY 3000
 
 // When a car requests state C while the other car is already in state C, we delay them for
-// this long while the other car transitions to half power. THIS INTERVAL MUST BE LONGER
+// up to this long while the other car transitions to half power. THIS INTERVAL MUST BE LONGER
 // THAN THE OVERDRAW_GRACE_PERIOD! (in milliseconds) The spec says it must be shorter than
 // 5000 ms.
 #define TRANSITION_DELAY 4500
 
-// Amount of time, in milliseconds, we will look for positive and negative peaks on the car
-// pilot pins. It takes around .1 ms to do one read, so we should get a bit less than 200 chances
-// this way.
-#define STATE_CHECK_INTERVAL 20
-
-// How often (in milliseconds) is the state of both cars logged?
-#define STATE_LOG_INTERVAL 60000
+// But most cars cut back much sooner than that. Once every car that's charging has drawn no
+// more than its new pilot allows (plus OVERDRAW_GRACE_AMPS) for this long (in milliseconds),
+// the waiting car can go.
+#define HANDOFF_SETTLE_TIME 500
+
+// Number of pilot sense samples we look at for positive and negative peaks on the car pilot pins.
+// The pilot sense conversions are started by the PWM timer itself, right in the middle of the high
+// half of the pilot and then right in the middle of the low half, with the cars taking turns.
+// So each car gets a high and a low sample every CAR_COUNT ms, away from the edges and their
+// ringing, and that pair is all it takes to know the car's state.
+#define STATE_CHECK_SAMPLES 2
+#if STATE_CHECK_SAMPLES > SAMPLER_RING_SIZE
+#error STATE_CHECK_SAMPLES is more than the sample ring
+#endif
 
-// This is the number of duty cycle or ammeter samples we keep to make a rolling average to stabilize
-// the display. The balance here is between stability and responsiveness,
-#define ROLLING_AVERAGE_SIZE 10
+// A single pair is no defence against noise, though, so a car is only taken to be in a new
+// state once this many checks in a row (one every PILOT_TASK_PERIOD, each on a pair of its
+// own) have read it. A glitch then has to last 20 ms to be believed, and a real change is
+// acted on no more than 30 ms after it happens, well inside the 100 ms the car allows for
+// the relay to open when it stops asking for power.
+#define STATE_CHECK_CONFIRM 3
 
-// The maximum number of milliseconds to sample an ammeter pin in order to find three zero-crossings.
-// one and a half cycles at 50 Hz is 30 ms.
-#define CURRENT_SAMPLE_INTERVAL 35
+// How often (in milliseconds) is the state of every car logged?
+#define STATE_LOG_INTERVAL 60000
 
-// Once we detect a zero-crossing, we should not look for one for another quarter cycle or so. 1/4
-// cycle at 50 Hz is 5 ms.
-#define CURRENT_ZERO_DEBOUNCE_INTERVAL 5
+// The ammeter is kept by the sampler's interrupt handler, which locks onto the mains frequency
+// (50 or 60 Hz - it works out which by itself) from the CT signal and adds up the squares of the
+// samples over windows of exactly one mains cycle. So there's always the latest cycle's RMS ready
+// to read, and because every reading covers a whole cycle, no more and no less, they're steady
+// enough to display without averaging.
 
 // How often (in milliseconds) is the current draw by a car logged?
 #define CURRENT_LOG_INTERVAL 1000
@@ -282,10 +415,65 @@
 
 // Hardware versions 1.0 and beyond have a 6 pin FTDI compatible port laid out on the board.
 // We're going to use this sort of "log4j" style. The log level is 0 for no logging at all
-// (and if it's 0, the Serial won't be initialized), 1 for info level logging (which will
+// (and if it's 0, the serial port won't be initialized), 1 for info level logging (which will
 // simply include state transitions only), or 2 for debugging.
 #define SERIAL_LOG_LEVEL LOG_INFO
+// Log lines are queued and sent from the UART's interrupt (see lib/AsyncUART). Nothing waits
+// for them: a line that doesn't fit in the queue is dropped, and counted. The faster the port,
+// the fewer that are. 9600 is what the Hydra has always talked at. Since nothing waits on the
+// port any more, 115200 is safe too, and drops far fewer lines. With a 16 MHz crystal, 250000
+// is exact, if your terminal can do it.
 #define SERIAL_BAUD_RATE 9600
+// Define this to log in tokens rather than text (see lib/LogTokens): a handful of bytes for
+// each line, with no formatting done here at all. You'll need host/hydra_logdecode to read them.
+//#define LOG_TOKENS
+
+// loop() runs each of these jobs as a task of its own (see TaskRunner.h). How often (in
+// milliseconds) does each come due, and how late may it start before that counts against it?
+// They're listed in order of importance, which is the order they're run in when more than one
+// is due.
+// GFI, ground and relay tests
+#define SAFETY_TASK_PERIOD 10
+#define SAFETY_TASK_SLACK 5
+// The protocol deadlines (see TaskRunner.h). They don't repeat, so this is only their slack.
+#define DEADLINE_TASK_SLACK 5
+// The pilot sense and state transitions
+#define PILOT_TASK_PERIOD 10
+#define PILOT_TASK_SLACK 10
+// The ammeters and overdraw checks. The ammeters are updated once per mains cycle.
+#define CURRENT_TASK_PERIOD 20
+#define CURRENT_TASK_SLACK 20
+// Demand mode's look at what the cars are drawing
+#define DEMAND_TASK_PERIOD DEMAND_INTERVAL
+#define DEMAND_TASK_SLACK 1000
+// The button
+#define BUTTON_TASK_PERIOD 20
+#define BUTTON_TASK_SLACK 30
+// The backlight, the time of day and mode, and the ammeter display
+#define DISPLAY_TASK_PERIOD 250
+#define DISPLAY_TASK_SLACK 250
+// Sending whatever changed on the display to the LCD
+#define LCD_TASK_PERIOD 100
+#define LCD_TASK_SLACK 100
+// The time of day events, and the periodic logs
+#define CLOCK_TASK_PERIOD 1000
+#define CLOCK_TASK_SLACK 1000
+
+// If you want to see where the time goes, uncomment this. Every task keeps track of how many
+// times it ran, how many of those started late, the latest it started, and the longest and the
+// total time it ran for, and it keeps a histogram of its run times (in log2 buckets from 128 us).
+// With SERIAL_LOG_LEVEL at LOG_DEBUG, those are logged (and then cleared) every
+// PROFILE_LOG_INTERVAL. Sending a 'p' over the serial port logs them right away, and an 'r'
+// clears them. The histograms cost about 450 bytes of RAM (600 on a Mega).
+//#define TASK_PROFILE
+
+#ifdef TASK_PROFILE
+// How often (in milliseconds) is the task profile logged?
+#define PROFILE_LOG_INTERVAL (10 * 60000L)
+#define PROFILE_TASK_PERIOD 100
+// How many tasks (with a function) there are to keep histograms for.
+#define PROFILE_TASKS (12 + 3 * CAR_COUNT)
+#endif
 
 // in shared mode, two cars connected simultaneously will get 50% of the incoming pilot
 #define MODE_SHARED 0
@@ -293,20 +481,51 @@
 // from C/D to B again. When it does, if the other car is in state B1, then it will be given
 // a pilot.
 #define MODE_SEQUENTIAL 1
+// in demand mode, the incoming pilot is divided among the cars that are charging by what
+// they actually draw. A car that's using less than its share keeps DEMAND_HEADROOM over what
+// it draws, and the rest goes to the others (see demandShares()).
+#define MODE_DEMAND 2
 
 // In sequential mode, if both cars are sitting in state B, flip the pilot back and forth between
 // both cars every so often in case one of them changes their mind.
 #define SEQ_MODE_OFFER_TIMEOUT (5 * 60 * 1000L) // 5 minutes
 
+// In sequential mode, once the car with the pilot has drawn less than this percentage of it
+// for SEQ_TAPER_TIME (in milliseconds), it's tapering off. It keeps what it draws plus
+// DEMAND_HEADROOM, and the next car waiting can have the rest, as long as that's at least
+// DEMAND_MINIMUM. If the first car wants more again, it gets it back (see checkTaper()).
+#define SEQ_TAPER_PERCENT 50
+#define SEQ_TAPER_TIME (5 * 60 * 1000L) // 5 minutes
+
+// In sequential mode, a car's turn with the pilot is over once it's been charging for
+// SEQ_TURN_TIME (in milliseconds) or has drawn SEQ_TURN_CHARGE (in milliamp-hours) since its
+// turn started, whichever is first. Set either to 0 to not go by it. Then the pilot moves to
+// the car waiting that's drawn the least since it was plugged in, if that's less than this
+// one has (see checkTurn()).
+#define SEQ_TURN_TIME (2 * 60 * 60 * 1000L) // 2 hours
+#define SEQ_TURN_CHARGE 30000
+
+// In demand mode, how often (in milliseconds) are the shares looked at again? A car's demand
+// is the most it drew over the last interval or so, so it takes up to two of these to notice
+// that a car has tapered off.
+#define DEMAND_INTERVAL 30000L
+// How much (in milliamps) a car keeps over the most it's drawn. This must be more than
+// OVERDRAW_GRACE_AMPS.
+#define DEMAND_HEADROOM 2000
+// The least (in milliamps) a car is offered. The J1772 spec bottoms out at 6A.
+#define DEMAND_MINIMUM 6000
+// Don't move the pilots unless one of them would move by at least this much (in milliamps).
+#define DEMAND_HYSTERESIS 1000
+
 // If we add more modes, set this to the highest numbered one.
-#define LAST_MODE MODE_SEQUENTIAL
+#define LAST_MODE MODE_DEMAND
 
 // Set this to the desired startup mode
 #define DEFAULT_MODE MODE_SHARED
 
 // Which button do we use?
 #define BUTTON BUTTON_SELECT
-// If we see any state change on the button, we ignore all changes for this long
+// The buttons have to have been still for this long before we believe them.
 #define BUTTON_DEBOUNCE_INTERVAL 50
 // How long does the button have to stay down before we call it a LONG push?
 #define BUTTON_LONG_START 250
@@ -338,11 +557,12 @@ event_type events[EVENT_COUNT];
 #define CALIB_AMM_MAX 5 // this is in 0.1A units
 #define CALIB_PILOT_MAX 10 // this is in -% units. Can derate pilots up to 5%.
 typedef struct calib_struct {
-  char amm_a, amm_b, pilot_a, pilot_b;
+  char amm[CAR_COUNT], pilot[CAR_COUNT];
 
   static unsigned char menuItem;
 
-  calib_struct() : amm_a(0), amm_b(0), pilot_a(0), pilot_b(0) {
+  calib_struct() {
+    for(unsigned int i = 0; i < CAR_COUNT; i++) amm[i] = pilot[i] = 0;
     eepromRead();
   }
 
@@ -353,7 +573,7 @@ typedef struct calib_struct {
 } calib_type;
 
 calib_type calib;
-static unsigned char calib_struct::menuItem;
+unsigned char calib_struct::menuItem;
 
 
 // The location in EEPROM to save the operating mode
@@ -372,14 +592,18 @@ static unsigned char calib_struct::menuItem;
 // where do we store calibration data?
 #define EEPROM_CALIB (EEPROM_EVENT_BASE + EVENT_COUNT * sizeof(event_struct))
 
+// where do we store the learned sense input levels?
+#define EEPROM_BASELINE (EEPROM_CALIB + sizeof(calib_type))
+
 // current tail in EEPROM
-#define EEPROM_END (EEPROM_CALIB + sizeof(calib_type))
+#define EEPROM_END (EEPROM_BASELINE + BASELINE_EEPROM_SIZE)
 
 
 // menu 0: operating mode
 #define MENU_OPERATING_MODE 0
 #define OPTION_SHARED_TEXT "Shared"
 #define OPTION_SEQUENTIAL_TEXT "Sequential"
+#define OPTION_DEMAND_TEXT "Demand"
 #define MENU_OPERATING_MODE_HEADER "Operating Mode"
 // menu 1: current available
 #define MENU_CURRENT_AVAIL 1
@@ -453,34 +677,96 @@ Timezone dst(summer, winter);
 char p_buffer[96];
 #define P(str) (strcpy_P(p_buffer, PSTR(str)), p_buffer)
 
-LiquidTWI2 display(LCD_I2C_ADDR, 1);
+TwiLCD lcd(LCD_I2C_ADDR);
+// Everything is written to this copy of the display, and the LCD task sends the real one
+// whatever changed (see ShadowLCD.h).
+ShadowLCD<TwiLCD, LCD_COLS, LCD_ROWS> display(lcd);
+
+// Everything about one outlet, and the car plugged into it.
+typedef struct car_struct {
+  unsigned int last_state;    // the state the transitions last acted on
+  unsigned int sensed_state;  // what checkStates() last saw
+  unsigned int seen_state;    // what the pilot sense last read, which may not have stuck yet
+  unsigned char seen_count;   // how many checks in a row have read seen_state
+  unsigned int pilot_state;   // LOW, HIGH, SHARE, FULL or ALLOT
+  unsigned int pilot_ways;    // for SHARE, how many ways the incoming pilot is divided
+  unsigned int allotted;      // for ALLOT, what the pilot offers (in milliamps)
+  unsigned int raise_to;      // in demand mode, what it's offered once the others cut back, or 0
+  // What demand mode goes by: the most it drew (in milliamps) since the last look and over
+  // the interval before that, and when the ammeter started on it (or its pilot last went up).
+  unsigned int peak_draw, last_peak;
+  unsigned long demand_since;
+  unsigned long taper_since;  // when it last drew SEQ_TAPER_PERCENT of its pilot (or started)
+  // What it's drawn since it was plugged in (in milliamp-hours, and the part of the next one in
+  // milliamp-milliseconds), and when what's shown was last added in.
+  unsigned long charge, charge_part, metered_at;
+  // In sequential mode, when its turn with the pilot started, and what it had drawn by then.
+  unsigned long turn_since, turn_charge;
+  // This volatile one is touched by the GFI interrupt handler
+  volatile unsigned int relay_state;
+  boolean seq_done;           // in sequential mode, it's had its turn
+  // The ammeter readings are put through a median of 3, so that a single wild reading
+  // (like the inrush when a relay closes) doesn't show.
+  MedianFilter<unsigned long, 3> current_spikes;
+  unsigned long shown;        // what the ammeter shows
+  boolean metered;            // ... if anything
+  unsigned long last_current_log;
+  // The protocol deadlines. Each is a one-shot task (see TaskRunner.h); arg is the car.
+  Task overdraw;              // OVERDRAW_GRACE_PERIOD after it started overdrawing
+  Task request;               // TRANSITION_DELAY after it asked for power
+  Task error_delay;           // ERROR_DELAY after its pilot was taken away
+} car_type;
+
+car_type cars[CAR_COUNT];
+
+// A table of one of the pins above, in car order: CAR_PINS(RELAY) is { CAR_A_RELAY, CAR_B_RELAY ... }
+#if CAR_COUNT == 2
+#define CAR_PINS(pin) { CAR_A_##pin, CAR_B_##pin }
+#elif CAR_COUNT == 3
+#define CAR_PINS(pin) { CAR_A_##pin, CAR_B_##pin, CAR_C_##pin }
+#else
+#define CAR_PINS(pin) { CAR_A_##pin, CAR_B_##pin, CAR_C_##pin, CAR_D_##pin }
+#endif
+
+// The relays and the relay tests go through FastPin, which needs its pin when it's
+// compiled, so those are picked out with a switch instead (see relayWrite()).
+const uint8_t pilot_out_pins[CAR_COUNT] = CAR_PINS(PILOT_OUT_PIN);
 
-unsigned long car_a_current_samples[ROLLING_AVERAGE_SIZE], car_b_current_samples[ROLLING_AVERAGE_SIZE];
 unsigned long incomingPilotMilliamps;
-unsigned int last_car_a_state, last_car_b_state;
-unsigned long car_a_overdraw_begin, car_b_overdraw_begin;
-unsigned long car_a_request_time, car_b_request_time;
-unsigned long car_a_error_time, car_b_error_time;
-unsigned long last_current_log_car_a, last_current_log_car_b;
 unsigned long last_state_log;
-unsigned long sequential_pilot_timeout;
-boolean seq_car_a_done = false, seq_car_b_done = false;
-unsigned int pilot_state_a, pilot_state_b;
+unsigned long last_baseline_save;
+SenseBaseline baseline;
+Task sequential_offer;                       // SEQ_MODE_OFFER_TIMEOUT after the offer last moved
+Task demand_raise;                           // TRANSITION_DELAY after demand mode lowered a pilot
+unsigned int seq_overlap;                    // in sequential mode, the car charging alongside a tapering one
 unsigned int operatingMode, sequential_mode_tiebreak;
-unsigned long button_press_time, button_debounce_time;
+unsigned long button_press_time;
+volatile unsigned long button_changed_at;    // when the buttons were last seen to change
+#ifndef BUTTON_INTERRUPT
+unsigned int button_polled;                  // what checkEvent() last read
+#endif
+Task relay_settle;                           // no function: RELAY_TEST_GRACE_TIME after a relay moved
+Task handoff_settle;                         // no function: HANDOFF_SETTLE_TIME after a car was last over its pilot
 #ifdef GROUND_TEST
 unsigned char current_ground_status;
 #endif
 #ifdef QUICK_CYCLING_WORKAROUND
-unsigned long pilot_release_holdoff_time;
+Task pilot_release_holdoff;                  // PILOT_RELEASE_HOLDOFF_MINUTES after one car stopped
 #endif
-// These volatile ones are touched by the GFI interrupt handler
-volatile unsigned int relay_state_a, relay_state_b;
-volatile unsigned long relay_change_time;
+// This volatile one is touched by the GFI interrupt handler, too
 volatile boolean gfiTriggered = false;
 boolean paused = false;
 boolean enterPause = false;
 boolean inMenu = false;
+Task safety_task, pilot_task, current_task, demand_task, button_task, display_task, lcd_task, clock_task;
+#ifdef TASK_PROFILE
+Task profile_task;
+boolean profile_logging, profile_periodic;
+Task *profile_log_line; // the next task to log, or NULL for the heading
+boolean profile_log_hist; // whether its histogram is next
+unsigned long profile_start;
+unsigned int profile_hist[PROFILE_TASKS][TASK_HIST_BUCKETS];
+#endif
 
 // top level do-menu func forward declaration 
 void doMenu(boolean initialize);
@@ -501,31 +787,43 @@ unsigned int editYear;
 boolean blink;
 boolean enable_dst;
 
-void log(unsigned int level, const char * fmt_str, ...) {
-#if SERIAL_LOG_LEVEL > 0
+// Log with LOG(level, "format", args...). The format is a plain string literal, which stays
+// in flash (or, logging in tokens, isn't there at all).
+#ifdef LOG_TOKENS
+#define LOG(level, fmt, ...) logToken((level), __LINE__, LOG_SIGNATURE(fmt), ##__VA_ARGS__)
+#else
+#define LOG(level, fmt, ...) logText((level), PSTR(fmt), ##__VA_ARGS__)
+#endif
+
+void logText(unsigned int level, const char * fmt_str, ...) {
+#if SERIAL_LOG_LEVEL > 0 && !defined(LOG_TOKENS)
   if (level > SERIAL_LOG_LEVEL) return;
   char buf[96]; // Danger, Will Robinson!
-  va_list argptr;
-  va_start(argptr, fmt_str);
-  vsnprintf(buf, sizeof(buf), fmt_str, argptr);
-  va_end(argptr);
-
+  const char *prefix;
   switch(level) {
   case LOG_INFO: 
-    Serial.print(P("INFO: ")); 
+    prefix = PSTR("INFO: ");
     break;
   case LOG_DEBUG: 
-    Serial.print(P("DEBUG: ")); 
+    prefix = PSTR("DEBUG: ");
     break;
   case LOG_TRACE:
-    Serial.print(millis());
-    Serial.print(P(" TRACE: "));
+    Uart.print(millis());
+    prefix = PSTR(" TRACE: ");
     break;
   default: 
-    Serial.print(P("UNKNOWN: ")); 
+    prefix = PSTR("UNKNOWN: ");
     break;
   }
-  Serial.println(buf);
+  strcpy_P(buf, prefix);
+  Uart.print(buf);
+
+  va_list argptr;
+  va_start(argptr, fmt_str);
+  vsnprintf_P(buf, sizeof(buf), fmt_str, argptr);
+  va_end(argptr);
+  Uart.print(buf);
+  Uart.endLine();
 #endif
 }
 
@@ -533,17 +831,29 @@ static inline const char *car_str(unsigned int car) {
   switch(car) {
     case CAR_A: return "car A";
     case CAR_B: return "car B";
-    case BOTH: return "both car";
+#if CAR_COUNT > 2
+    case CAR_C: return "car C";
+#endif
+#if CAR_COUNT > 3
+    case CAR_D: return "car D";
+#endif
+    case ALL_CARS: return "all cars";
     default: return "UNKNOWN";
   }
 }
 
+// What the car is called on the display and in the log.
+static inline char car_letter(unsigned int car) {
+  return 'A' + car;
+}
+
 static inline const char *logic_str(unsigned int state) {
   switch(state) {
     case LOW: return "LOW";
     case HIGH: return "HIGH";
-    case HALF: return "HALF";
+    case SHARE: return "SHARE";
     case FULL: return "FULL";
+    case ALLOT: return "ALLOT";
     default: return "UNKNOWN";
   }
 }
@@ -565,135 +875,144 @@ static inline const char* state_str(unsigned int state) {
   }
 }
 
-// Convert a milliamp allowance into an outgoing pilot duty cycle.
-// In lieu of floating point, this is duty in mils (tenths of a percent)
-static inline unsigned int MAToDuty(unsigned long milliamps) {
-  if (milliamps < 6000) {
-    return 9999; // illegal - set pilot to "high"
-  } 
-  else if (milliamps < 51000) {
-    return milliamps/60;
-  } 
-  else if (milliamps <= 80000) {
-    return (milliamps / 250) + 640;
-  } 
-  else {
-    return 9999; // illegal - set pilot to "high"
-  }
-}
-
-// Convert a milliamp allowance into a value suitable for
-// pwmWrite - a scale from 0 to 255.
-inline static unsigned int MAtoPwm(unsigned long milliamps) {
-  unsigned int out = MAToDuty(milliamps);
-
-  if (out >= 1000) return 255; // full on
-
-  out = (unsigned int)((out * 256L) / 1000);  
-
-  return out;
+#ifdef TASK_PROFILE
+static inline const char *task_str(Task *task) {
+  if (task == &safety_task) return "safety";
+  for(unsigned int car = 0; car < CAR_COUNT; car++) {
+    // These are only ever logged one at a time, so the names can share a buffer.
+    static char name[16];
+    const char *what = NULL;
+    if (task == &cars[car].overdraw) what = "overdraw";
+    else if (task == &cars[car].error_delay) what = "error delay";
+    else if (task == &cars[car].request) what = "request";
+    if (what == NULL) continue;
+    snprintf(name, sizeof(name), "%s %c", what, car_letter(car));
+    return name;
+  }
+  if (task == &relay_settle) return "relay settle";
+  if (task == &handoff_settle) return "handoff settle";
+  if (task == &sequential_offer) return "sequential offer";
+  if (task == &demand_raise) return "demand raise";
+#ifdef QUICK_CYCLING_WORKAROUND
+  if (task == &pilot_release_holdoff) return "pilot release";
+#endif
+  if (task == &pilot_task) return "pilot";
+  if (task == &current_task) return "current";
+  if (task == &demand_task) return "demand";
+  if (task == &button_task) return "button";
+  if (task == &display_task) return "display";
+  if (task == &lcd_task) return "lcd";
+  if (task == &clock_task) return "clock";
+  if (task == &profile_task) return "profile";
+  return "UNKNOWN";
 }
+#endif
 
-// Turn a millamp value into nn.n as amps, with the tenth rounded near.
-char *formatMilliamps(unsigned long milliamps) {
-  static char out[6];
-
-  if (milliamps < 1000) {
-    // truncate the units digit - there's no way we're that accurate.
-    milliamps /= 10;
-    milliamps *= 10;
-
-    sprintf(out, P("%3lumA"), milliamps);
-  } 
-  else {
-    int hundredths = (milliamps / 10) % 100;
-    int tenths = hundredths / 10 + (((hundredths % 10) >= 5)?1:0);
-    int units = milliamps / 1000;
-    if (tenths >= 10) {
-      tenths -= 10;
-      units++;
-    }
-
-    sprintf(out, P("%2d.%01dA"), units, tenths);
-  }
-
-  return out;
+// Each car has an 8 character cell on the display, two to a line under the status line.
+// This puts the cursor there, names the car, and then shows whatever's given.
+static void showCar(unsigned int car, const char *status) {
+  display.setCursor((car % 2) * 8, 1 + car / 2);
+  display.print(car_letter(car));
+  display.print(status);
 }
 
 void error(unsigned int car, char err) {
-  unsigned long now = millis(); // so both cars get the same time.
   // Set the pilot to constant 12: indicates an EVSE error.
   // We can't use -12, because then we'd never detect a return
   // to state A. But the spec says we're allowed to return to B1
   // (that is, turn off the oscillator) whenever we want.
   
   // Stop flipping, one way or another
-  sequential_pilot_timeout = 0;
-  if (car == BOTH || car == CAR_A) {
-    setPilot(CAR_A, HIGH);
-    if (last_car_a_state != STATE_E) {
-      last_car_a_state = STATE_E;
-      car_a_error_time = now;
+  Tasks.stop(&sequential_offer);
+  for(unsigned int i = 0; i < CAR_COUNT; i++) {
+    if (car != ALL_CARS && car != i) continue;
+    setPilot(i, HIGH);
+    if (cars[i].last_state != STATE_E) {
+      cars[i].last_state = STATE_E;
+      Tasks.start(&cars[i].error_delay, ERROR_DELAY);
     }
-    car_a_request_time = 0;
-  }
-  if (car == BOTH || car == CAR_B) {
-    setPilot(CAR_B, HIGH);
-    if (last_car_b_state != STATE_E) {
-      last_car_b_state = STATE_E;
-      car_b_error_time = now;
-    }
-    car_b_request_time = 0;
+    Tasks.stop(&cars[i].request);
   }
   
   display.setBacklight(RED);
-  if (car == BOTH || car == CAR_A) {
-    display.setCursor(0, 1);
-    display.print(P("A:ERR "));
+  for(unsigned int i = 0; i < CAR_COUNT; i++) {
+    if (car != ALL_CARS && car != i) continue;
+    showCar(i, P(":ERR "));
     display.print(err);
     display.print(' ');
   }
-  if (car == BOTH || car == CAR_B) {
-    display.setCursor(8, 1);
-    display.print(P("B:ERR "));
-    display.print(err);
-    display.print(' ');
+
+  LOG(LOG_INFO, "Error %c on %s", err, car_str(car));
+}
+
+// Drive a car's relay.
+static inline void relayWrite(unsigned int car, uint8_t state) {
+  switch(car) {
+    case CAR_A: FastPin<CAR_A_RELAY>::write(state); break;
+    case CAR_B: FastPin<CAR_B_RELAY>::write(state); break;
+#if CAR_COUNT > 2
+    case CAR_C: FastPin<CAR_C_RELAY>::write(state); break;
+#endif
+#if CAR_COUNT > 3
+    case CAR_D: FastPin<CAR_D_RELAY>::write(state); break;
+#endif
   }
+}
 
-  log(LOG_INFO, P("Error %c on %s"), err, car_str(car));
+#ifdef RELAY_TEST
+// Whether there's voltage past a car's relay.
+static inline boolean relayTest(unsigned int car) {
+  switch(car) {
+    case CAR_A: return FastPin<CAR_A_RELAY_TEST>::read() == HIGH;
+    case CAR_B: return FastPin<CAR_B_RELAY_TEST>::read() == HIGH;
+#if CAR_COUNT > 2
+    case CAR_C: return FastPin<CAR_C_RELAY_TEST>::read() == HIGH;
+#endif
+#if CAR_COUNT > 3
+    case CAR_D: return FastPin<CAR_D_RELAY_TEST>::read() == HIGH;
+#endif
+    default: return false;
+  }
 }
+#endif
 
 void gfi_trigger() {
-  // Make sure both relays are *immediately* flipped off.
-  digitalWrite(CAR_A_RELAY, LOW);
-  digitalWrite(CAR_B_RELAY, LOW);
+  // Make sure all of the relays are *immediately* flipped off.
+  FastPin<CAR_A_RELAY>::low();
+  FastPin<CAR_B_RELAY>::low();
+#if CAR_COUNT > 2
+  FastPin<CAR_C_RELAY>::low();
+#endif
+#if CAR_COUNT > 3
+  FastPin<CAR_D_RELAY>::low();
+#endif
   // Now make the data consistent. Make sure that anything you touch here is declared "volatile"
-  relay_state_a = relay_state_b = LOW;
-  relay_change_time = millis();
-  // We don't have time in an IRQ to do more than that.
+  for(uint8_t car = 0; car < CAR_COUNT; car++)
+    cars[car].relay_state = LOW;
+  // We don't have time in an IRQ to do more than that. The safety task holds off
+  // the relay tests until it's seen this.
   gfiTriggered = true;
 }
 
+// Is any car's relay closed?
+static inline boolean anyRelayClosed() {
+  for(unsigned int car = 0; car < CAR_COUNT; car++)
+    if (cars[car].relay_state == HIGH) return true;
+  return false;
+}
+
 void setRelay(unsigned int car, unsigned int state) {
-  if (relay_state_a == LOW && relay_state_b == LOW && state == HIGH) {
+  if (!anyRelayClosed() && state == HIGH) {
     // We're transitioning from no car to one car - insert a GFI self test.
     gfiSelfTest();
   }
-  log(LOG_DEBUG, P("Setting %s relay to %s"), car_str(car), logic_str(state));
-  switch(car) {
-  case CAR_A:
-    if (relay_state_a == state) return; // did nothing.
-    digitalWrite(CAR_A_RELAY, state);
-    relay_state_a = state;
-    break;
-  case CAR_B:
-    if (relay_state_b == state) return; // did nothing.
-    digitalWrite(CAR_B_RELAY, state);
-    relay_state_b = state;
-    break;
-  }
+  LOG(LOG_DEBUG, "Setting %s relay to %s", car_str(car), logic_str(state));
+  if (car >= CAR_COUNT) return;
+  if (cars[car].relay_state == state) return; // did nothing.
+  relayWrite(car, state);
+  cars[car].relay_state = state;
   // This only counts if we actually changed anything.
-  relay_change_time = millis();
+  Tasks.start(&relay_settle, RELAY_TEST_GRACE_TIME);
 }
 
 // If it's in an error state, it's not charging (the relay may still be on during error delay).
@@ -701,52 +1020,56 @@ void setRelay(unsigned int car, unsigned int state) {
 // Otherwise, check the state of the relay.
 static inline boolean isCarCharging(unsigned int car) {
   if (paused) return false;
-  switch(car) {
-  case CAR_A:
-    if (last_car_a_state == STATE_E) return LOW;
-    if (car_a_request_time != 0) return HIGH;
-    return relay_state_a;
-    break;
-  case CAR_B:
-    if (last_car_b_state == STATE_E) return LOW;
-    if (car_b_request_time != 0) return HIGH;
-    return relay_state_b;
-    break;
-  default:
-    return LOW; // This should not be possible
-  }
+  if (car >= CAR_COUNT) return LOW; // This should not be possible
+  if (cars[car].last_state == STATE_E) return LOW;
+  if (Tasks.running(&cars[car].request)) return HIGH;
+  return cars[car].relay_state;
+}
+
+// How many cars are charging (as isCarCharging() sees it)?
+static unsigned int chargingCount() {
+  unsigned int count = 0;
+  for(unsigned int car = 0; car < CAR_COUNT; car++)
+    if (isCarCharging(car)) count++;
+  return count;
+}
+
+// How many ways is the incoming pilot divided for the car's share? 1 for all of it.
+static inline unsigned int pilotWays(unsigned int car) {
+  return (cars[car].pilot_state == SHARE) ? cars[car].pilot_ways : 1;
+}
+
+// What the car's pilot allows it to draw, before any calibration (in milliamps).
+static inline unsigned long pilotMilliamps(unsigned int car) {
+  if (cars[car].pilot_state == ALLOT) return cars[car].allotted;
+  return incomingPilotMilliamps / pilotWays(car);
 }
 
-// Set the pilot for the car as appropriate. 'which' is either HALF, FULL, LOW or HIGH.
+// What the car's pilot actually offers it (in milliamps), before any calibration.
+static inline unsigned long pilotOffered(unsigned int car) {
+  unsigned long ma = pilotMilliamps(car);
+  return (ma > MAXIMUM_OUTLET_CURRENT) ? MAXIMUM_OUTLET_CURRENT : ma;
+}
+
+// Set the pilot for the car as appropriate. 'which' is either SHARE, FULL, ALLOT, LOW or HIGH.
 // HIGH sets a constant +12v, which is the spec for state A, but we also use it for
-// state E. HALF means that the other car is charging, so we only can have half power.
+// state E. SHARE means that other cars are charging, so we can only have our share
+// (see sharePilot()), and ALLOT that demand mode has decided what we get (see allotPilot()).
 
 void setPilot(unsigned int car, unsigned int which) {
-  log(LOG_DEBUG, P("Setting %s pilot to %s"), car_str(car), logic_str(which));
-  // set the outgoing pilot for the given car to either HALF state, FULL state, or HIGH.
-  int pin;
-  char pilot_derate;
-  switch(car) {
-    case CAR_A:
-      pin = CAR_A_PILOT_OUT_PIN;
-      pilot_state_a = which;
-      pilot_derate = calib.pilot_a;
-      break;
-    case CAR_B:
-      pin = CAR_B_PILOT_OUT_PIN;
-      pilot_state_b = which;
-      pilot_derate = calib.pilot_b;
-      break;
-    default: return;
-  }
+  LOG(LOG_DEBUG, "Setting %s pilot to %s", car_str(car), logic_str(which));
+  // set the outgoing pilot for the given car to either SHARE state, FULL state, ALLOT state, or HIGH.
+  if (car >= CAR_COUNT) return;
+  int pin = pilot_out_pins[car];
+  char pilot_derate = calib.pilot[car];
+  cars[car].pilot_state = which;
   if (which == LOW || which == HIGH) {
     // This is what the pwm library does anyway.
-    log(LOG_TRACE, P("Pin %d to digital %d"), pin, which);
+    LOG(LOG_TRACE, "Pin %d to digital %d", pin, which);
     digitalWrite(pin, which);
   } 
   else {
-    unsigned long ma = incomingPilotMilliamps;
-    if (which == HALF) ma /= 2;
+    unsigned long ma = pilotMilliamps(car);
     // Calibrate 
     if (pilot_derate != 0) {
       // pilot_derate is usally negative percentages (0, -1, -2 .. -CALIB_PILOT_MAX)
@@ -756,29 +1079,34 @@ void setPilot(unsigned int car, unsigned int which) {
     }
     if (ma > MAXIMUM_OUTLET_CURRENT) ma = MAXIMUM_OUTLET_CURRENT;
     unsigned int val = MAtoPwm(ma);
-    log(LOG_TRACE, P("Pin %d to PWM %d"), pin, val);
+    LOG(LOG_TRACE, "Pin %d to PWM %d", pin, val);
     pwmWrite(pin, val);
   }
 }
 
-static inline unsigned int pilotState(unsigned int car) {
-  return (car == CAR_A)?pilot_state_a:pilot_state_b;
+// Give the car a pilot for one of 'ways' equal shares of the incoming pilot.
+void sharePilot(unsigned int car, unsigned int ways) {
+  if (ways <= 1) {
+    setPilot(car, FULL);
+    return;
+  }
+  cars[car].pilot_ways = ways;
+  setPilot(car, SHARE);
 }
 
-int checkState(unsigned int car) {
-  // poll the pilot state pin for 10 ms (should be 10 pilot cycles), looking for the low and high.
-  unsigned int low = 9999, high = 0;
-  unsigned int car_pin = (car == CAR_A) ? CAR_A_PILOT_SENSE_PIN : CAR_B_PILOT_SENSE_PIN;
-  unsigned long count = 0;
-  for(unsigned long start = millis(); millis() - start < STATE_CHECK_INTERVAL; ) {
-    unsigned int val = analogRead(car_pin);
-    if (val > high) high = val;
-    if (val < low) low = val;
-    count++;
+// Give the car a pilot that offers it 'ma' (in milliamps). If that's more than it had,
+// what it's drawn so far says nothing about what it wants now.
+void allotPilot(unsigned int car, unsigned long ma) {
+  if (ma > pilotOffered(car)) {
+    cars[car].demand_since = millis();
+    cars[car].peak_draw = cars[car].last_peak = 0;
   }
+  cars[car].allotted = ma;
+  setPilot(car, ALLOT);
+}
 
-  log(LOG_TRACE, P("%s high %u low %u count %lu"), car_str(car), high, low, count);
-  
+// Classify a car's pilot from the lowest and highest pilot sense readings.
+static unsigned int pilotStateFrom(unsigned int low, unsigned int high) {
   // If the pilot low was below zero, then that means we must have
   // been oscillating. If we were, then perform the diode check.
   if (low < PILOT_0V && low > PILOT_DIODE_MAX) {
@@ -800,175 +1128,306 @@ int checkState(unsigned int car) {
   return STATE_E;
 }
 
-static inline unsigned long ulong_sqrt(unsigned long in) {
-  unsigned long out;
-  // find the last int whose square is not too big
-  // Yes, it's wasteful, but we only theoretically ever have to go to 512.
-  // Removing floating point saves us almost 1K of flash.
-  for(out = 1; out*out <= in; out++) ;
-  return out - 1;
-//  return (unsigned long)sqrt((float)in);
-}
-
-unsigned long readCurrent(unsigned int car) {
-  unsigned int car_pin = (car == CAR_A) ? CAR_A_CURRENT_PIN : CAR_B_CURRENT_PIN;
-  char calib_amm = car == CAR_A ? calib.amm_a : calib.amm_b;
-  unsigned long sum = 0;
-  unsigned int zero_crossings = 0;
-  unsigned long last_zero_crossing_time = 0, now_ms;
-  long last_sample = -1; // should be impossible - the A/d is 0 to 1023.
-  unsigned int sample_count = 0;
-  for(unsigned long start = millis(); (now_ms = millis()) - start < CURRENT_SAMPLE_INTERVAL; ) {
-    long sample = analogRead(car_pin);
-    // If this isn't the first sample, and if the sign of the value differs from the
-    // sign of the previous value, then count that as a zero crossing.
-    if (last_sample != -1 && ((last_sample > 512) != (sample > 512))) {
-      // Once we've seen a zero crossing, don't look for one for a little bit.
-      // It's possible that a little noise near zero could cause a two-sample
-      // inversion.
-      if (now_ms - last_zero_crossing_time > CURRENT_ZERO_DEBOUNCE_INTERVAL) {
-        zero_crossings++;
-        last_zero_crossing_time = now_ms;
-      }
+// Look at the latest pilot sense samples for the low and high on every car at once.
+// The pilots are sampled in turn by the same converter, so this sees all of the cars
+// over the same CAR_COUNT ms. states[] gets each car's state, which stays what it was
+// until STATE_CHECK_CONFIRM checks in a row agree on a new one.
+void checkStates(unsigned int *states) {
+  uint8_t slots[CAR_COUNT];
+  uint16_t low[CAR_COUNT], high[CAR_COUNT];
+  for(uint8_t i = 0; i < CAR_COUNT; i++) slots[i] = SLOT_PILOT(i);
+  unsigned int count = Sampler.range(slots, CAR_COUNT, STATE_CHECK_SAMPLES, low, high);
+
+  for(uint8_t i = 0; i < CAR_COUNT; i++) {
+    LOG(LOG_TRACE, "Car %c high %u low %u, count %u", car_letter(i), high[i], low[i], count);
+    car_type &c = cars[i];
+    unsigned int state = pilotStateFrom(baseline.pilotReading(i, low[i]), baseline.pilotReading(i, high[i]));
+    if (state != c.seen_state) {
+      c.seen_state = state;
+      c.seen_count = 0;
     }
-    last_sample = sample;
-    switch(zero_crossings) {
-    case 0: 
-      continue; // Still waiting to start sampling
-    case 1:
-    case 2:
-      // Gather the sum-of-the-squares and count how many samples we've collected.
-      sum += (unsigned long)((sample - 512) * (sample - 512));
-      sample_count++;
+    if (c.seen_count < STATE_CHECK_CONFIRM) c.seen_count++;
+    if (c.seen_count < STATE_CHECK_CONFIRM) {
+      states[i] = c.sensed_state;
       continue;
-    case 3:
-      // The answer is the square root of the mean of the squares.
-      // But additionally, that value must be scaled to a real current value.
-      sum = ulong_sqrt(sum / sample_count) * CURRENT_SCALE_FACTOR;
-      // Only apply calibration on readings meaningfully high.
-      if ( sum > 5000 ) sum += 100 * calib_amm;
-      return sum;
     }
+    states[i] = state;
+    // Nobody's plugged in, so the high is +12 volts. And if it's oscillating and passed the
+    // diode check, then the low is -12.
+    if (state == STATE_A) baseline.pilotHigh(i, high[i]);
+    if (state != STATE_A && state != STATE_E && low[i] != high[i]) baseline.pilotLow(i, low[i]);
   }
-  // ran out of time. Assume that it's simply not oscillating any. 
-  return 0;
 }
 
-unsigned long rollRollingAverage(unsigned long array[], unsigned long new_value) {
-#if ROLLING_AVERAGE_SIZE == 0
-  return new_value;
-#else
-  unsigned long sum = new_value;
-  for(int i = ROLLING_AVERAGE_SIZE - 1; i >= 1; i--) {
-    array[i] = array[i - 1];
-    sum += array[i];
+// With a car's relay open, whatever its CT reads is zero current.
+void learnCurrentZero(unsigned int car) {
+  uint8_t slot = SLOT_CURRENT(car);
+  uint16_t low, high;
+  if (Sampler.range(&slot, 1, SAMPLER_RING_SIZE, &low, &high) == 0) return;
+  baseline.ctIdle(car, (low + high) / 2);
+  Sampler.setRmsZero(slot, baseline.ctZero(car));
+}
+
+unsigned long readCurrent(unsigned int car) {
+  char calib_amm = calib.amm[car];
+  unsigned long sum;
+  // Both of these are in sixteenths of a sample, which cancel out.
+  unsigned int count = Sampler.rms(SLOT_CURRENT(car), &sum);
+  if (count == 0) return 0; // nothing yet
+  // The answer is the square root of the mean of the squares.
+  // But additionally, that value must be scaled to a real current value.
+  sum = ulong_sqrt(sum / count) * CURRENT_SCALE_FACTOR;
+  // Only apply calibration on readings meaningfully high.
+  if ( sum > 5000 ) sum += 100 * calib_amm;
+  return sum;
+}
+
+// Sequential mode: which car has the pilot? There's only ever one with a FULL pilot. While
+// it's tapering off, it has an ALLOT pilot instead, and so does seq_overlap.
+static unsigned int pilotHolder() {
+  for(unsigned int car = 0; car < CAR_COUNT; car++) {
+    if (cars[car].pilot_state == FULL) return car;
+    if (cars[car].pilot_state == ALLOT && car != seq_overlap) return car;
   }
-  array[0] = new_value;
-  return (sum / ROLLING_AVERAGE_SIZE);
-#endif
+  return NO_CAR;
+}
+
+// Sequential mode: the next car after 'from' (going around in order) that's waiting in
+// state B, or NO_CAR. With skip_done, cars that have had their turn are passed over.
+static unsigned int nextWaiting(unsigned int from, boolean skip_done) {
+  if (from >= CAR_COUNT) from = CAR_COUNT - 1;
+  for(unsigned int i = 1; i < CAR_COUNT; i++) {
+    unsigned int car = (from + i) % CAR_COUNT;
+    if (cars[car].last_state != STATE_B) continue;
+    if (skip_done && cars[car].seq_done) continue;
+    return car;
+  }
+  return NO_CAR;
+}
+
+// Sequential mode: if nobody has the pilot, the next car after 'from' that's waiting for it
+// can have it.
+static void offerPilot(unsigned int from) {
+  if (pilotHolder() != NO_CAR || seq_overlap != NO_CAR) return;
+  unsigned int next = nextWaiting(from, false);
+  if (next == NO_CAR) return;
+  setPilot(next, FULL);
+  showCar(next, P(": off  "));
+}
+
+// Sequential mode: while the car with the pilot sits in state B and another one is waiting
+// in state B, too, the offer moves on every SEQ_MODE_OFFER_TIMEOUT. Otherwise, it stays put.
+static void checkOffer() {
+  unsigned int holder = pilotHolder();
+  if (holder == NO_CAR || cars[holder].last_state != STATE_B || nextWaiting(holder, false) == NO_CAR) {
+    Tasks.stop(&sequential_offer);
+  } else if (!Tasks.running(&sequential_offer)) {
+    Tasks.start(&sequential_offer, SEQ_MODE_OFFER_TIMEOUT);
+  }
+}
+
+// Sequential mode: the car was charging alongside a tapering one, or was the tapering one,
+// and its pilot's gone now. Whichever of them is left gets the whole pilot. Returns whether
+// there was such a thing to end.
+static boolean endOverlap(unsigned int car) {
+  if (seq_overlap == NO_CAR) return false;
+  // If the holder still has its pilot, it's some other car.
+  if (car != seq_overlap && pilotHolder() != NO_CAR) return false;
+  seq_overlap = NO_CAR;
+  unsigned int left = pilotHolder();
+  if (left != NO_CAR)
+    setPilot(left, FULL);
+  else
+    offerPilot(car);
+  return true;
+}
+
+// Sequential mode: the car charging alongside the pilot holder has to stop. It gets
+// ERROR_DELAY to do it, as in a pause.
+static void stopOverlap() {
+  unsigned int car = seq_overlap;
+  setPilot(car, HIGH);
+  showCar(car, P(": wait "));
+  if (cars[car].relay_state == HIGH)
+    Tasks.start(&cars[car].error_delay, ERROR_DELAY);
+  else
+    endOverlap(car);
+}
+
+// Sequential mode: has the car with the pilot tapered off enough to let the next one in on
+// what it isn't using? Or, if it already has, does it want that back? The next car isn't
+// offered anything until the holder has had TRANSITION_DELAY to cut back (see
+// demandRaiseTask()).
+static void checkTaper() {
+  unsigned int holder = pilotHolder();
+  if (holder == NO_CAR || !isCarCharging(holder)) return;
+  car_type &c = cars[holder];
+  unsigned long peak = (c.peak_draw > c.last_peak) ? c.peak_draw : c.last_peak;
+  if (seq_overlap != NO_CAR) {
+    // The first car still comes first. Once it's using up its headroom, the other one stops.
+    if (cars[seq_overlap].pilot_state != ALLOT || peak + DEMAND_HYSTERESIS < pilotOffered(holder)) return;
+    LOG(LOG_INFO, "Car %c wants more again, stopping %s", car_letter(holder), car_str(seq_overlap));
+    stopOverlap();
+    return;
+  }
+  if (!c.metered || millis() - c.taper_since < SEQ_TAPER_TIME) return;
+  unsigned int next = nextWaiting(holder, true);
+  if (next == NO_CAR) return;
+  unsigned long keep = peak + DEMAND_HEADROOM;
+  if (keep < DEMAND_MINIMUM) keep = DEMAND_MINIMUM;
+  if (keep + DEMAND_MINIMUM > incomingPilotMilliamps) return;
+  LOG(LOG_INFO, "Car %c has tapered off to %lu mA, sharing with %s", car_letter(holder), peak, car_str(next));
+  allotPilot(holder, keep);
+  seq_overlap = next;
+  Tasks.start(&demand_raise, TRANSITION_DELAY);
+}
+
+// Sequential mode: of the cars other than 'except' that are waiting in state B, the one that's
+// drawn the least since it was plugged in, or NO_CAR. A tie goes to the first one after
+// 'except', going around in order.
+static unsigned int leastServed(unsigned int except) {
+  unsigned int least = NO_CAR;
+  for(unsigned int i = 1; i < CAR_COUNT; i++) {
+    unsigned int car = (except + i) % CAR_COUNT;
+    if (cars[car].last_state != STATE_B || cars[car].seq_done) continue;
+    if (least == NO_CAR || cars[car].charge < cars[least].charge) least = car;
+  }
+  return least;
+}
+
+// Sequential mode: has the car with the pilot had its turn (see SEQ_TURN_TIME)? If a car
+// that's waiting has drawn less, the holder's pilot is taken away. It gets ERROR_DELAY to
+// stop, as in a pause, and the pilot moves on once it has (see handTurn()).
+static void checkTurn() {
+  unsigned int holder = pilotHolder();
+  if (holder == NO_CAR || seq_overlap != NO_CAR || !isCarCharging(holder)) return;
+  car_type &c = cars[holder];
+  boolean over = false;
+  if (SEQ_TURN_TIME != 0 && millis() - c.turn_since >= SEQ_TURN_TIME) over = true;
+  if (SEQ_TURN_CHARGE != 0 && c.charge - c.turn_charge >= SEQ_TURN_CHARGE) over = true;
+  if (!over) return;
+  unsigned int next = leastServed(holder);
+  if (next == NO_CAR || cars[next].charge >= c.charge) return;
+  LOG(LOG_INFO, "Car %c has had its turn (%lu mAh), moving the pilot to %s", car_letter(holder), c.charge - c.turn_charge, car_str(next));
+  setPilot(holder, HIGH);
+  Tasks.start(&c.error_delay, ERROR_DELAY);
+  showCar(holder, P(": wait "));
+}
+
+// Sequential mode: a turn is over, and the pilot goes to next, unless nobody's waiting or
+// somebody's been given it in the meantime. Returns whether it went.
+static boolean giveTurn(unsigned int next) {
+  if (next == NO_CAR || pilotHolder() != NO_CAR || seq_overlap != NO_CAR) return false;
+  setPilot(next, FULL);
+  showCar(next, P(": off  "));
+  return true;
+}
+
+// Sequential mode: the car whose turn was over has stopped. The pilot goes to the car waiting
+// that's drawn the least, or back to this one if nobody is.
+static void handTurn(unsigned int car) {
+  Tasks.stop(&cars[car].error_delay);
+  showCar(car, P(": wait "));
+  unsigned int next = leastServed(car);
+  giveTurn(next == NO_CAR ? car : next);
 }
 
 // So the desired logic is as follows: 
 // (1) If one or none cars are plugged, the behavior is really no different from shared mode. 
-// (2) if two cars are plugged, 
+// (2) if more cars are plugged, 
 // (2a) on un-pause the tie is broken with last car charging during last non-pause, or last car plugged during pause.
 // (2b) once cars are done charging, do not keep flipping -- keep their state B-HIGH. This is reset by entering pause, 
 // OR any of the cars unplugged, in which case "done" restrictions are foregone, as flipping becomes non-issue -- the 
 // car will keep itself off even if we are at FULL advertisement.
+// (3) the pilot goes around the cars that want it in order, starting after the car that last had it.
 
 void sequential_mode_transition(unsigned int us, unsigned int car_state) {
-  unsigned int them = (us == CAR_A)?CAR_B:CAR_A;
-  unsigned int *last_car_state = (us == CAR_A)?&last_car_a_state:&last_car_b_state;
-  unsigned int their_state = (us == CAR_A)?last_car_b_state:last_car_a_state;
-  boolean& us_done = us == CAR_A?seq_car_a_done:seq_car_b_done;
-  boolean& them_done = them == CAR_A? seq_car_a_done:seq_car_b_done;
+  car_type &car = cars[us];
   
   switch(car_state) {
     case STATE_A:
       // No matter what, insure that the pilot and relay are off.
       setRelay(us, LOW);
       setPilot(us, HIGH);
-      // We're not both in state B anymore.
-      sequential_pilot_timeout = 0;
-      // We don't exist. If they're waiting, they can have it.
-      if (their_state == STATE_B)
-      {
-          setPilot(them, FULL);
-          display.setCursor((them == CAR_A)?0:8, 1);
-          display.print((them == CAR_A)?"A":"B");
-          display.print(P(": off  "));
-      }
-      display.setCursor((us == CAR_A)?0:8, 1);
-      display.print((us == CAR_A)?"A":"B");
-      display.print(P(": ---  "));
+      // We don't exist. If someone's waiting, they can have it.
+      if (!endOverlap(us)) offerPilot(us);
+      showCar(us, P(": ---  "));
       // reset done state for all
-      us_done = false;
-      them_done = false;
+      for(unsigned int i = 0; i < CAR_COUNT; i++)
+        cars[i].seq_done = false;
       break;
     case STATE_B:
       // No matter what, insure that the relay is off.
       setRelay(us, LOW);
-      if (*last_car_state == STATE_C || *last_car_state == STATE_D) {
+      if (car.last_state == STATE_C || car.last_state == STATE_D) {
         // We transitioned from C/D to B. That means we're passing the batton
-        // to the other car, if they want it and not marked "done" yet.
-        if (their_state == STATE_B) {
-          if ( ! them_done) { 
+        // to the next car waiting, if there's one not marked "done" yet.
+        if (seq_overlap != NO_CAR) {
+          // We were charging alongside another car, and whichever of us is left gets the
+          // whole pilot. Unless we were stopped to give the first car its pilot back, we've
+          // had our turn.
+          boolean stopped = us == seq_overlap && car.pilot_state == HIGH;
+          setPilot(us, HIGH);
+          Tasks.stop(&car.error_delay);
+          endOverlap(us);
+          car.seq_done = !stopped;
+          if (stopped)
+            showCar(us, P(": wait "));
+          else
+            showCar(us, P(": done "));
+        } else if (car.pilot_state == HIGH) {
+          // Our turn was over (see checkTurn()), but we're not done.
+          handTurn(us);
+        } else if (nextWaiting(us, false) != NO_CAR) {
+          unsigned int next = nextWaiting(us, true);
+          if (next != NO_CAR) {
             // flip only if they are not done yet, otherwise wait for pilot timeout before we do again.
             setPilot(us, HIGH);
-            setPilot(them, FULL);
+            setPilot(next, FULL);
+            showCar(next, P(": off  "));
           }
-          display.setCursor((them == CAR_A)?0:8, 1);
-          display.print((them == CAR_A)?"A":"B");
-          if (them_done) display.print(P(": done ")); else display.print(P(": off  "));
-          display.setCursor((us == CAR_A)?0:8, 1);
-          display.print((us == CAR_A)?"A":"B");
-          display.print(P(": done ")); // differentiated from "wait" because a C/D->B transition has occurred.
+          showCar(us, P(": done ")); // differentiated from "wait" because a C/D->B transition has occurred.
           // Disable future charges for this car until re-unpaused or re-plugged.
-          us_done = true;
-          sequential_pilot_timeout = millis(); // We're both now in B. Start flipping.
+          car.seq_done = true;
         } else {
-          display.setCursor((us == CAR_A)?0:8, 1);
-          display.print((us == CAR_A)?"A":"B");
-          display.print(P(": off  "));
-          // their state is not B, so we're not "flipping"
-          sequential_pilot_timeout = 0;
+          showCar(us, P(": off  "));
         }
       } else {
-        if (their_state == STATE_A) {
-          // We can only grab the batton if they're not plugged in at all.
+        // Is anyone else in line for the pilot? Someone's got it, or is about to be let go
+        // after an error, or is (or may be) in state B.
+        boolean busy = pilotHolder() != NO_CAR || seq_overlap != NO_CAR, tied = false;
+        for(unsigned int i = 0; i < CAR_COUNT; i++) {
+          if (i == us) continue;
+          if (cars[i].last_state == STATE_E && Tasks.running(&cars[i].error_delay)) busy = true;
+          if (cars[i].last_state == STATE_B || cars[i].last_state == DUNNO) tied = true;
+        }
+        if (!busy && !tied) {
+          // We can only grab the batton if nobody else is plugged in at all.
           setPilot(us, FULL);
-          us_done = false;
-          them_done = false;
-          sequential_pilot_timeout = 0;
-          display.setCursor((us == CAR_A)?0:8, 1);
-          display.print((us == CAR_A)?"A":"B");
-          display.print(P(": off  "));
+          for(unsigned int i = 0; i < CAR_COUNT; i++)
+            cars[i].seq_done = false;
+          showCar(us, P(": off  "));
           break;
-        } else if (their_state == STATE_B || their_state == DUNNO) {
-          // BUT if we're *both* in state b, then that's a tie. We break the tie with our saved tiebreak value.
-          // If it's not us, then we simply ignore this transition entirely. The other car will wind up in this same place,
-          // we'll turn their pilot on, and then clear the tiebreak. Next time we roll through, we'll go into the other
-          // half of this if/else and we'll get the "wait" display
-          if (sequential_mode_tiebreak != us ) {
+        } else if (!busy) {
+          // BUT if others are in state b too, then that's a tie. We break the tie with our saved tiebreak value.
+          // If it's another car in the tie, then we simply ignore this transition entirely. That car will wind up
+          // in this same place, we'll turn their pilot on, and then the rest of us will see that they have it
+          // and go into the "wait" display below. If the tiebreak car isn't in the tie at all, we'll do.
+          unsigned int tiebreak = sequential_mode_tiebreak;
+          if (tiebreak != us && tiebreak < CAR_COUNT && (cars[tiebreak].last_state == STATE_B || cars[tiebreak].last_state == DUNNO)) {
             return;
           }
-          // But if it IS us, then clear the tiebreak.
-          if (!us_done && (sequential_mode_tiebreak == us )) {
+          if (!car.seq_done) {
             setPilot(us, FULL);
-            sequential_pilot_timeout = millis();
-            display.setCursor((us == CAR_A)?0:8, 1);
-            display.print((us == CAR_A)?"A":"B");
-            display.print(P(": off  "));
+            showCar(us, P(": off  "));
             break;
           }
         }
-        // Either they are in state C/D or they're in state B and we lost the tiebreak.
-        display.setCursor((us == CAR_A)?0:8, 1);
-        display.print((us == CAR_A)?"A":"B");
-        if ( us_done) 
-          display.print(P(": done ")); 
-        else 
-          display.print(P(": wait "));
+        // Either someone else has it or we lost the tiebreak.
+        if (car.seq_done)
+          showCar(us, P(": done "));
+        else
+          showCar(us, P(": wait "));
       }
       break;
     case STATE_C:
@@ -977,30 +1436,80 @@ void sequential_mode_transition(unsigned int us, unsigned int car_state) {
         // we're already charging. This might be a flip from C to D. Ignore it.
         break;
       }
-      if (pilotState(us) != FULL) {
+      if (car.pilot_state != FULL && car.pilot_state != ALLOT) {
         error(us, 'T'); // illegal transition: no state C without a pilot
         return;
       }
-      // We're not both in state B anymore
-      sequential_pilot_timeout = 0;
-      display.setCursor((us == CAR_A)?0:8, 1);
-      display.print((us == CAR_A)?"A":"B");
-      display.print(P(": ON   "));
+      car.turn_since = millis();
+      car.turn_charge = car.charge;
+      showCar(us, P(": ON   "));
       setRelay(us, HIGH); // turn on the juice
       break;
     case STATE_E:
       error(us, 'E');
       return;
   }
-  *last_car_state = car_state;
+  car.last_state = car_state;
+  // Whoever's left in state B may need to start (or stop) taking turns.
+  checkOffer();
+}
+
+// Shared mode: the incoming pilot is divided evenly among the cars that are charging, and
+// a car waiting in state B is offered what it would get if it joined them. When another
+// car starts, the ones already charging must be given TRANSITION_DELAY to cut back before
+// it does (see shared_mode_transition()). This only ever raises their pilots otherwise.
+static void shareOut() {
+  unsigned int charging = chargingCount();
+  for(unsigned int car = 0; car < CAR_COUNT; car++) {
+    if (isCarCharging(car))
+      sharePilot(car, charging);
+    else if (cars[car].last_state == STATE_B)
+      sharePilot(car, charging + 1);
+  }
+}
+
+#ifdef QUICK_CYCLING_WORKAROUND
+// Would any car that's charging get a bigger share than it has right now?
+static boolean sharesWouldRise() {
+  unsigned int charging = chargingCount();
+  for(unsigned int car = 0; car < CAR_COUNT; car++)
+    if (isCarCharging(car) && pilotWays(car) > charging) return true;
+  return false;
+}
+#endif
+
+// A car's power is off for good after an error (or a pause). Whatever pilot it had is
+// free for the others.
+static void releasePilot(unsigned int car) {
+  if (paused) return;
+  switch(operatingMode) {
+    case MODE_SHARED:
+      shareOut();
+      break;
+    case MODE_SEQUENTIAL:
+      if (endOverlap(car)) break;
+      // Still charging, so its turn was over and it didn't stop within ERROR_DELAY. The turn
+      // goes on as handTurn() would have passed it, not in outlet order.
+      if ((cars[car].last_state == STATE_C || cars[car].last_state == STATE_D) && giveTurn(leastServed(car))) break;
+      offerPilot(car);
+      break;
+    case MODE_DEMAND:
+      allotDemand();
+      break;
+  }
+}
+
+// The car wants power, but the ones already charging have to cut back first. It gets it
+// as soon as they have (see checkHandoff()), or after TRANSITION_DELAY at the latest.
+static void awaitHandoff(unsigned int car) {
+  Tasks.start(&cars[car].request, TRANSITION_DELAY);
+  Tasks.start(&handoff_settle, HANDOFF_SETTLE_TIME);
 }
 
 void shared_mode_transition(unsigned int us, unsigned int car_state) {
-  unsigned int them = (us == CAR_A)?CAR_B:CAR_A;
-  unsigned int *last_car_state = (us == CAR_A)?&last_car_a_state:&last_car_b_state;
-  unsigned long *car_request_time = (us == CAR_A)?&car_a_request_time:&car_b_request_time;
+  car_type &car = cars[us];
     
-  *last_car_state = car_state;    
+  car.last_state = car_state;    
   switch(car_state) {
     case STATE_A:
     case STATE_B:
@@ -1008,31 +1517,25 @@ void shared_mode_transition(unsigned int us, unsigned int car_state) {
       // In either case, clear any connection delay timer,
       // make sure the relay is off, and set the diplay
       // appropriately. For state A, set our pilot high,
-      // and fot state B, set it to half if the other car
-      // is charging, full otherwise.
+      // and for state B, offer it what it would get if
+      // it joined the cars that are charging. They get
+      // whatever share we had.
       setRelay(us, LOW);
-      setPilot(us, car_state == STATE_A ? HIGH : (isCarCharging(them)?HALF:FULL));
-      display.setCursor((us == CAR_A)?0:8, 1);
-      display.print((us == CAR_A)?"A":"B");
-      display.print(car_state == STATE_A ? ": ---  " : ": off  ");
-      *car_request_time = 0;
-#ifdef QUICK_CYCLING_WORKAROUND
-      if (!isCarCharging(them)) {
-        // If the other car isn't actually charging, then we don't
-        // need to bother being tricky.
-        if (pilotState(them) == HALF)
-          setPilot(them, FULL);
-        pilot_release_holdoff_time = 0;
-      } else
-#endif
-      if (pilotState(them) == HALF) {
+      Tasks.stop(&car.request);
+      if (car_state == STATE_A) setPilot(us, HIGH);
+      showCar(us, car_state == STATE_A ? ": ---  " : ": off  ");
 #ifdef QUICK_CYCLING_WORKAROUND
-        // Since they're charging, in *this* much time, we'll give the other car a full pilot.
-        pilot_release_holdoff_time = millis() + (PILOT_RELEASE_HOLDOFF_MINUTES * (1000L * 60));
-#else
-        setPilot(them, FULL);
-#endif
+      if (sharesWouldRise()) {
+        // Since they're charging, in *this* much time, we'll give the others their bigger shares.
+        if (car_state == STATE_B) sharePilot(us, chargingCount() + 1);
+        Tasks.start(&pilot_release_holdoff, PILOT_RELEASE_HOLDOFF_MINUTES * (1000L * 60));
+        break;
       }
+      // If the others aren't actually charging, then we don't
+      // need to bother being tricky.
+      Tasks.stop(&pilot_release_holdoff);
+#endif
+      shareOut();
       break;
     case STATE_C:
     case STATE_D:
@@ -1040,40 +1543,170 @@ void shared_mode_transition(unsigned int us, unsigned int car_state) {
         // we're already charging. This might be a flip from C to D. Ignore it.
         break;
       }
-      if (isCarCharging(them)) {
-#ifdef QUICK_CYCLING_WORKAROUND
-        if (pilot_release_holdoff_time != 0) {
-          // We turned back on before the grace period. We can just go, since they
-          // still have a half-pilot.
-          pilot_release_holdoff_time = 0; // cancel the grace period
-          setPilot(them, HALF); // *should* be redundant
-          setPilot(us, HALF); // redundant, unless we went straight from A to C.
-          display.setCursor((us == CAR_A)?0:8, 1);
-          display.print((us == CAR_A)?"A":"B");
-          display.print(P(": ON   "));
-          setRelay(us, HIGH);
-        } else {
-#endif
-        // if they are charging, we must transition them.
-        *car_request_time = millis();
-        // Drop car A down to 50%
-        setPilot(them, HALF);
-        setPilot(us, HALF); // this is redundant unless we are transitioning from A to C suddenly.
-        display.setCursor((us == CAR_A)?0:8, 1);
-        display.print((us == CAR_A)?"A":"B");
-        display.print(P(": wait "));
+      if (chargingCount() != 0) {
 #ifdef QUICK_CYCLING_WORKAROUND
+        if (Tasks.running(&pilot_release_holdoff)) {
+          // We turned back on before the grace period. If the others still have shares
+          // no bigger than they'll have with us, we can just go.
+          unsigned int ways = chargingCount() + 1;
+          boolean go = true;
+          for(unsigned int i = 0; i < CAR_COUNT; i++)
+            if (isCarCharging(i) && pilotWays(i) < ways) go = false;
+          if (go) {
+            Tasks.stop(&pilot_release_holdoff); // cancel the grace period
+            sharePilot(us, ways); // redundant, unless we went straight from A to C.
+            showCar(us, P(": ON   "));
+            setRelay(us, HIGH);
+            shareOut(); // *should* be redundant
+            break;
+          }
         }
 #endif
+        // if they are charging, we must transition them.
+        awaitHandoff(us);
+        // Drop everyone down to their new share. This includes us, which is redundant
+        // unless we are transitioning from A to C suddenly.
+        shareOut();
+        showCar(us, P(": wait "));
       } else {
-        // if they're not charging, then we can just go. If they have a full pilot, they get downshifted.
-        if (pilotState(them) == FULL)
-          setPilot(them, HALF);
+        // if nobody else is charging, then we can just go. Anyone waiting gets downshifted.
+        shareOut();
         setPilot(us, FULL); // this is redundant unless we are going directly from A to C.
-        *car_request_time = 0;
-        display.setCursor((us == CAR_A)?0:8, 1);
-        display.print((us == CAR_A)?"A":"B");
-        display.print(P(": ON   "));
+        Tasks.stop(&car.request);
+        showCar(us, P(": ON   "));
+        setRelay(us, HIGH);
+      }
+      break;
+    case STATE_E:
+      error(us, 'E');
+      break;
+  }
+}
+
+// Demand mode: what would each car that's charging get (in milliamps)? A car that's been on
+// the ammeter for a whole DEMAND_INTERVAL since it started (or its pilot last went up), and
+// that's drawn less than it's offered, could use what it drew plus DEMAND_HEADROOM. Once it's
+// been cut back to that (to less than an even split), it keeps its allotment for as long as
+// it draws DEMAND_HYSTERESIS less, rather than wanting it all back the moment it's within
+// DEMAND_HEADROOM of it. Any
+// other could use all an outlet can give. The ones that want less than an even split get
+// what they want, and what's left is split among the rest. Cars that aren't charging get 0.
+static void demandShares(unsigned long *shares) {
+  unsigned long want[CAR_COUNT];
+  unsigned int left = 0;
+  unsigned long now = millis();
+  for(unsigned int car = 0; car < CAR_COUNT; car++)
+    if (isCarCharging(car)) left++;
+  unsigned long split = left == 0 ? 0 : incomingPilotMilliamps / left;
+  for(unsigned int car = 0; car < CAR_COUNT; car++) {
+    shares[car] = 0;
+    want[car] = 0;
+    if (!isCarCharging(car)) continue;
+    car_type &c = cars[car];
+    unsigned long peak = (c.peak_draw > c.last_peak) ? c.peak_draw : c.last_peak;
+    want[car] = MAXIMUM_OUTLET_CURRENT;
+    if (!c.metered || now - c.demand_since < DEMAND_INTERVAL) continue;
+    unsigned long offered = pilotOffered(car);
+    if (peak + DEMAND_HEADROOM < offered) {
+      want[car] = peak + DEMAND_HEADROOM;
+      if (want[car] < DEMAND_MINIMUM) want[car] = DEMAND_MINIMUM;
+    } else if (c.pilot_state == ALLOT && offered < split && peak + DEMAND_HYSTERESIS < offered) {
+      want[car] = offered;
+    }
+  }
+  unsigned long remaining = incomingPilotMilliamps;
+  while(left > 0) {
+    unsigned long even = remaining / left;
+    boolean settled = false;
+    for(unsigned int car = 0; car < CAR_COUNT; car++) {
+      if (want[car] == 0 || shares[car] != 0 || want[car] > even) continue;
+      shares[car] = want[car];
+      remaining -= want[car];
+      left--;
+      settled = true;
+    }
+    if (settled) continue;
+    // Everyone left wants more than an even split, so that's what they get.
+    for(unsigned int car = 0; car < CAR_COUNT; car++)
+      if (want[car] != 0 && shares[car] == 0) shares[car] = even;
+    break;
+  }
+}
+
+// Demand mode: move the pilots to the shares demandShares() comes up with. The ones that go
+// down are lowered right away. The ones that go up wait until the cars that were lowered have
+// had TRANSITION_DELAY to cut back (see demandRaiseTask()), so that between them, the cars
+// never draw more than the incoming pilot. A car with its relay open can't draw anything, so
+// it's given its share right away. Cars waiting in state B are offered an even share, as in
+// shared mode. Returns whether anyone has to wait for the others to cut back.
+static boolean allotDemand() {
+  unsigned long shares[CAR_COUNT];
+  demandShares(shares);
+  boolean moved = false;
+  for(unsigned int car = 0; car < CAR_COUNT; car++) {
+    if (shares[car] == 0) continue;
+    if (cars[car].pilot_state != ALLOT || labs((long)shares[car] - (long)pilotOffered(car)) >= DEMAND_HYSTERESIS)
+      moved = true;
+  }
+  if (moved) {
+    // First, the ones that come down.
+    for(unsigned int car = 0; car < CAR_COUNT; car++) {
+      cars[car].raise_to = 0;
+      if (shares[car] == 0 || cars[car].relay_state == LOW) continue;
+      if (shares[car] < pilotOffered(car)) {
+        allotPilot(car, shares[car]);
+        Tasks.start(&demand_raise, TRANSITION_DELAY);
+      }
+    }
+    // Then the ones that go up, unless someone's still cutting back.
+    for(unsigned int car = 0; car < CAR_COUNT; car++) {
+      if (shares[car] == 0) continue;
+      if (cars[car].relay_state == LOW)
+        allotPilot(car, shares[car]);
+      else if (shares[car] > pilotOffered(car)) {
+        if (Tasks.running(&demand_raise))
+          cars[car].raise_to = shares[car];
+        else
+          allotPilot(car, shares[car]);
+      }
+    }
+  }
+  unsigned int charging = chargingCount();
+  for(unsigned int car = 0; car < CAR_COUNT; car++)
+    if (!isCarCharging(car) && cars[car].last_state == STATE_B)
+      sharePilot(car, charging + 1);
+  return Tasks.running(&demand_raise);
+}
+
+void demand_mode_transition(unsigned int us, unsigned int car_state) {
+  car_type &car = cars[us];
+
+  car.last_state = car_state;
+  switch(car_state) {
+    case STATE_A:
+    case STATE_B:
+      // We're in an "off" state of one sort or other. Whatever we had goes to the others,
+      // and in state B, we're offered a share for when we want it.
+      setRelay(us, LOW);
+      Tasks.stop(&car.request);
+      if (car_state == STATE_A) setPilot(us, HIGH);
+      showCar(us, car_state == STATE_A ? ": ---  " : ": off  ");
+      allotDemand();
+      break;
+    case STATE_C:
+    case STATE_D:
+      if (isCarCharging(us)) {
+        // we're already charging. This might be a flip from C to D. Ignore it.
+        break;
+      }
+      // We count as charging while the shares are worked out. If anyone has to cut back
+      // to make room for us, we must give them TRANSITION_DELAY to do it.
+      awaitHandoff(us);
+      if (allotDemand()) {
+        showCar(us, P(": wait "));
+      } else {
+        Tasks.stop(&car.request);
+        showCar(us, P(": ON   "));
         setRelay(us, HIGH);
       }
       break;
@@ -1098,44 +1731,73 @@ unsigned int checkTimer() {
   return TE_NONE;
 }
 
+#ifdef BUTTON_INTERRUPT
+// The MCP23017 pulls INTA low when the buttons change. Note the time, and have them
+// read, which lets INTA go high again (and that's an interrupt too, but not one that
+// means anything). Both edges of a push are timed from here, so it doesn't matter how
+// long it is before checkEvent() gets to look.
+ISR(PCINT2_vect) {
+  if (FastPin<BUTTON_INT_PIN>::read() == LOW) {
+    button_changed_at = millis();
+    lcd.buttonsChanged();
+  }
+}
+
+static void buttonInterrupt() {
+  pinMode(BUTTON_INT_PIN, INPUT);
+  *digitalPinToPCMSK(BUTTON_INT_PIN) |= _BV(digitalPinToPCMSKbit(BUTTON_INT_PIN));
+  PCICR |= _BV(digitalPinToPCICRbit(BUTTON_INT_PIN));
+  lcd.interruptOnButtons();
+}
+#endif
+
 unsigned int checkEvent() {
-  log(LOG_TRACE, P("Checking for button event"));
-  if (button_debounce_time != 0 && millis() - button_debounce_time < BUTTON_DEBOUNCE_INTERVAL) {
+  LOG(LOG_TRACE, "Checking for button event");
+  unsigned int buttons = display.readButtons();
+#ifndef BUTTON_INTERRUPT
+  // With nothing to say when they change, the change is when a read first shows it.
+  if (buttons != button_polled) {
+    button_polled = buttons;
+    button_changed_at = millis();
+  }
+#endif
+  unsigned long changed_at;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    changed_at = button_changed_at;
+  }
+  if (millis() - changed_at < BUTTON_DEBOUNCE_INTERVAL) {
     // debounce is in progress
     return EVENT_NONE;
-  } else {
-    // debounce is over
-    button_debounce_time = 0;
   }
-  unsigned int buttons = display.readButtons();
-  log(LOG_TRACE, P("Buttons %d"), buttons);
+  LOG(LOG_TRACE, "Buttons %d", buttons);
   if ((buttons & BUTTON) != 0) {
-    log(LOG_TRACE, P("Button is down"));
+    LOG(LOG_TRACE, "Button is down");
     // Button is down
     if (button_press_time == 0) { // this is the start of a press.
-      button_debounce_time = button_press_time = millis();
+      button_press_time = changed_at;
     }
     return EVENT_NONE; // We don't know what this button-push is going to be yet
   } else {
-    log(LOG_TRACE, P("Button is up"));
+    LOG(LOG_TRACE, "Button is up");
     // Button released
     if (button_press_time == 0) return EVENT_NONE; // It wasn't down anyway.
-    // We are now ending a button-push. First, start debuncing.
-    button_debounce_time = millis();
-    unsigned long button_pushed_time = button_debounce_time - button_press_time;
+    // We are now ending a button-push, which lasted from one change to the other.
+    unsigned long button_pushed_time = changed_at - button_press_time;
     button_press_time = 0;
     if (button_pushed_time > BUTTON_LONG_START) {
-      log(LOG_DEBUG, P("Button long-push event"));
+      LOG(LOG_DEBUG, "Button long-push event");
       return EVENT_LONG_PUSH;
     } else {
-      log(LOG_DEBUG, P("Button short-push event"));
+      LOG(LOG_DEBUG, "Button short-push event");
       return EVENT_SHORT_PUSH;
     }
   }
 }
 
-// Just like delay(), but petting the watchdog while we're at it
+// Just like delay(), but petting the watchdog while we're at it. Whatever's on the display
+// is shown while we wait.
 static void Delay(unsigned int t) {
+  display.flush();
   while(t > 100) {
     delay(100);
     t -= 100;
@@ -1146,12 +1808,13 @@ static void Delay(unsigned int t) {
 }
 
 static void die() {
-  // set both pilots to -12
-  setPilot(CAR_A, LOW);
-  setPilot(CAR_B, LOW);
-  // make sure both relays are off
-  setRelay(CAR_A, LOW);
-  setRelay(CAR_B, LOW);
+  display.flush();
+  // set all of the pilots to -12
+  for(unsigned int car = 0; car < CAR_COUNT; car++)
+    setPilot(car, LOW);
+  // make sure all of the relays are off
+  for(unsigned int car = 0; car < CAR_COUNT; car++)
+    setRelay(car, LOW);
   // and goodnight
   do {
     wdt_reset(); // keep petting the dog, but do nothing else.
@@ -1183,14 +1846,31 @@ static void gfiSelfTest() {
   }
   if (!gfiTriggered) gfiTestFailure(0);
   unsigned long clearStart = millis();
-  while(digitalRead(GFI_PIN) == HIGH) {
+  while(FastPin<GFI_PIN>::read() == HIGH) {
     wdt_reset();
-    if (millis() > clearStart + GFI_TEST_CLEAR_TIME) gfiTestFailure(1);
+    if (millis() - clearStart > GFI_TEST_CLEAR_TIME) gfiTestFailure(1);
   }
   Delay(GFI_TEST_DEBOUNCE_TIME);
   gfiTriggered = false;
 }
 
+#ifdef MEGA_HYDRA
+// SetPinFrequencySafe() starts each timer on its own, so Timer4 (cars C and D) would be
+// some random fraction of a period out from Timer1 (cars A and B), which times the pilot
+// sense conversions for all four. Restart the two together from zero, so that they're in step.
+static void syncPilotTimers() {
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    uint8_t clock1 = TCCR1B & 0x07, clock4 = TCCR4B & 0x07;
+    TCCR1B &= ~0x07;
+    TCCR4B &= ~0x07;
+    TCNT1 = 0;
+    TCNT4 = 0;
+    TCCR4B |= clock4;
+    TCCR1B |= clock1;
+  }
+}
+#endif
+
 static inline time_t localTime() {
   return enable_dst?dst.toLocal(now()):now();
 }
@@ -1401,7 +2081,7 @@ void doEventMenu(boolean initialize) {
       if (editMeridian == 0 && saveHour == 12) saveHour = 0;
       if (editMeridian == 1 && saveHour != 12) saveHour += 12;
 #endif
-      log(LOG_DEBUG, P("Saving event %d - %d:%d dow_mask %x event %d"), editEvent, saveHour, editMinute, editDOW, editType);
+      LOG(LOG_DEBUG, "Saving event %d - %d:%d dow_mask %x event %d", editEvent, saveHour, editMinute, editDOW, editType);
       events[editEvent].hour = saveHour;
       events[editEvent].minute = editMinute;
       events[editEvent].dow_mask = editDOW;
@@ -1484,10 +2164,10 @@ void doEventMenu(boolean initialize) {
 // calib_struct support
 void calib_struct::eepromRead() {
   EEPROMClass().get(EEPROM_CALIB, *this);
-  if (abs(amm_a) > CALIB_AMM_MAX) amm_a = 0;
-  if (abs(amm_b) > CALIB_AMM_MAX) amm_b = 0;
-  if (pilot_a > 0 || pilot_a < -CALIB_PILOT_MAX) pilot_a = 0;
-  if (pilot_b > 0 || pilot_b < -CALIB_PILOT_MAX) pilot_b = 0;
+  for(unsigned int i = 0; i < CAR_COUNT; i++) {
+    if (abs(amm[i]) > CALIB_AMM_MAX) amm[i] = 0;
+    if (pilot[i] > 0 || pilot[i] < -CALIB_PILOT_MAX) pilot[i] = 0;
+  }
 }
 
 void calib_struct::eepromWrite() {
@@ -1497,7 +2177,8 @@ void calib_struct::eepromWrite() {
 void doCalibMenu(boolean initialize) { calib.doMenu(initialize); }
 
 void calib_struct::doMenu(boolean initialize) {
-#define MAX_ITEMS 4
+// The ammeter for each car, then the pilot derate for each car.
+#define MAX_ITEMS (2 * CAR_COUNT)
   unsigned int event = checkEvent();
   char str[17];
   if (initialize) {
@@ -1506,16 +2187,15 @@ void calib_struct::doMenu(boolean initialize) {
     event = EVENT_SHORT_PUSH;
   } else {
     
-    char& amm((menuItem & 1) == 0 ? amm_a : amm_b);
-    char& pilot((menuItem & 1) == 0 ? pilot_a : pilot_b);
+    char& amm(this->amm[menuItem % CAR_COUNT]);
+    char& pilot(this->pilot[menuItem % CAR_COUNT]);
     
     switch (event ) {
       case EVENT_SHORT_PUSH:
-        switch (menuItem)  {
-          case 0: 
-          case 1: if ( ++amm > CALIB_AMM_MAX) amm = -CALIB_AMM_MAX; break;
-          case 2: 
-          case 3: if ( --pilot < -CALIB_PILOT_MAX) pilot = 0; break;
+        if (menuItem < CAR_COUNT) {
+          if ( ++amm > CALIB_AMM_MAX) amm = -CALIB_AMM_MAX;
+        } else {
+          if ( --pilot < -CALIB_PILOT_MAX) pilot = 0;
         }
         break;
       case EVENT_LONG_PUSH:
@@ -1532,30 +2212,23 @@ void calib_struct::doMenu(boolean initialize) {
   }
 
   // drawing
-  char* carSymb = (menuItem & 1) == 0 ? "A" : "B";
-  char& amm((menuItem & 1) == 0 ? amm_a : amm_b);
-  char& pilot((menuItem & 1) == 0 ? pilot_a : pilot_b);
+  char carSymb = car_letter(menuItem % CAR_COUNT);
+  char& amm(this->amm[menuItem % CAR_COUNT]);
+  char& pilot(this->pilot[menuItem % CAR_COUNT]);
   
-  switch (menuItem) {
-    case 0:
-    case 1:
-      display.clear();
-      display.print(P("Ammeter"));
-
-      display.setCursor(0, 1);
-      snprintf(str, sizeof(str), P(" Car %s: %s0.%d"), carSymb, amm < 0 ? "-" : "+", abs(amm));
-      display.print(str);
-      break;
+  display.clear();
+  if (menuItem < CAR_COUNT) {
+    display.print(P("Ammeter"));
 
-    case 2: 
-    case 3:
-      display.clear();
-      display.print(P("Pilot derate"));
+    display.setCursor(0, 1);
+    snprintf(str, sizeof(str), P(" Car %c: %s0.%d"), carSymb, amm < 0 ? "-" : "+", abs(amm));
+    display.print(str);
+  } else {
+    display.print(P("Pilot derate"));
 
-      display.setCursor(0, 1);
-      snprintf(str, sizeof(str), P(" Car %s: %d%%"), carSymb, (int)pilot);
-      display.print(str);
-      break;
+    display.setCursor(0, 1);
+    snprintf(str, sizeof(str), P(" Car %c: %d%%"), carSymb, (int)pilot);
+    display.print(str);
   }
 }
 // calibration structure support
@@ -1674,6 +2347,9 @@ void doMenu(boolean initialize) {
         case MODE_SEQUENTIAL:
           display.print(P(OPTION_SEQUENTIAL_TEXT));
           break;
+        case MODE_DEMAND:
+          display.print(P(OPTION_DEMAND_TEXT));
+          break;
       }
       break;
     case MENU_CURRENT_AVAIL:
@@ -1757,17 +2433,28 @@ void setup() {
   MCUSR = 0; // changing the watchdog requires this first.
   wdt_enable(WDTO_1S);
 
+  // The deadlines that nothing runs go first, before anything can start them, so
+  // that run() disarms them when they expire, even if nobody asks.
+  Tasks.add(&relay_settle, NULL, 0, DEADLINE_TASK_SLACK);
+  Tasks.add(&handoff_settle, NULL, 0, DEADLINE_TASK_SLACK);
+
   // Start serial logging first so we can detect a good CPU reset.
 #if SERIAL_LOG_LEVEL > 0
-  Serial.begin(SERIAL_BAUD_RATE);
+  Uart.begin(SERIAL_BAUD_RATE);
+#ifdef LOG_TOKENS
+  logTokensBegin(SERIAL_LOG_LEVEL);
+#endif
 #endif
 
-  log(LOG_DEBUG, P("Starting HW:%s SW:%s"), HW_VERSION, SW_VERSION);
+  LOG(LOG_DEBUG, "Starting HW:%s SW:%s", HW_VERSION, SW_VERSION);
   
   InitTimersSafe();
   
-  display.setMCPType(LTI_TYPE_MCP23017);
-  display.begin(16, 2);   
+  Twi.begin(I2C_CLOCK_HZ);
+  display.begin(LCD_COLS, LCD_ROWS);   
+#ifdef BUTTON_INTERRUPT
+  buttonInterrupt();
+#endif
   display.setBacklight(WHITE);
   display.clear();
   display.setCursor(0, 0);
@@ -1782,43 +2469,56 @@ void setup() {
   pinMode(GFI_TEST_PIN, OUTPUT);
   digitalWrite(GFI_TEST_PIN, LOW);
   attachInterrupt(GFI_IRQ, gfi_trigger, RISING);
-  pinMode(CAR_A_PILOT_OUT_PIN, OUTPUT);
-  pinMode(CAR_B_PILOT_OUT_PIN, OUTPUT);
-  pinMode(CAR_A_RELAY, OUTPUT);
-  pinMode(CAR_B_RELAY, OUTPUT);
 #ifdef GROUND_TEST
   pinMode(GROUND_TEST_PIN, INPUT);
 #endif
+  static const uint8_t relay_pins[CAR_COUNT] = CAR_PINS(RELAY);
+#ifdef RELAY_TEST
+  static const uint8_t relay_test_pins[CAR_COUNT] = CAR_PINS(RELAY_TEST);
+#endif
+  for(unsigned int car = 0; car < CAR_COUNT; car++) {
+    pinMode(pilot_out_pins[car], OUTPUT);
+    pinMode(relay_pins[car], OUTPUT);
 #ifdef RELAY_TEST
-  pinMode(CAR_A_RELAY_TEST, INPUT);
-  pinMode(CAR_B_RELAY_TEST, INPUT);
-#endif
-
-  // Enter state A on both cars
-  setPilot(CAR_A, HIGH);
-  setPilot(CAR_B, HIGH);
-  // And make sure the power is off.
-  setRelay(CAR_A, LOW);
-  setRelay(CAR_B, LOW);
-
-  memset(car_a_current_samples, 0, sizeof(car_a_current_samples));
-  memset(car_b_current_samples, 0, sizeof(car_b_current_samples));
-  last_car_a_state = DUNNO;
-  last_car_b_state = DUNNO;
-  car_a_request_time = 0;
-  car_b_request_time = 0;
-  car_a_overdraw_begin = 0;
-  car_b_overdraw_begin = 0;
-  last_current_log_car_a = 0;
-  last_current_log_car_b = 0;
-  button_debounce_time = 0;
+    pinMode(relay_test_pins[car], INPUT);
+#endif
+  }
+
+  {
+    // From here on, the A/d converter belongs to the sampler. No more analogRead().
+    static const uint8_t pilot_sense_pins[CAR_COUNT] = CAR_PINS(PILOT_SENSE_PIN);
+    static const uint8_t current_pins[CAR_COUNT] = CAR_PINS(CURRENT_PIN);
+    uint8_t channels[SLOT_COUNT];
+    for(unsigned int car = 0; car < CAR_COUNT; car++) {
+      channels[SLOT_PILOT(car)] = pilot_sense_pins[car];
+      channels[SLOT_CURRENT(car)] = current_pins[car];
+    }
+    Sampler.begin(channels, SLOT_COUNT, SLOT_PILOT_COUNT, PILOT_PERIOD_US);
+    for(unsigned int car = 0; car < CAR_COUNT; car++)
+      Sampler.measureRms(SLOT_CURRENT(car));
+    SenseLevels nominal = { CURRENT_0A, PILOT_12V, PILOT_N12V };
+    baseline.begin(EEPROM_BASELINE, nominal);
+    for(unsigned int car = 0; car < CAR_COUNT; car++)
+      Sampler.setRmsZero(SLOT_CURRENT(car), baseline.ctZero(car));
+  }
+
+  for(unsigned int car = 0; car < CAR_COUNT; car++) {
+    // Enter state A on every car
+    setPilot(car, HIGH);
+    // And make sure the power is off.
+    setRelay(car, LOW);
+
+    cars[car].current_spikes.reset();
+    cars[car].metered = false;
+    cars[car].seq_done = false;
+    cars[car].last_state = DUNNO;
+    cars[car].sensed_state = DUNNO;
+    cars[car].seen_state = DUNNO;
+    cars[car].seen_count = 0;
+    cars[car].last_current_log = 0;
+  }
   button_press_time = 0;
-  sequential_pilot_timeout = 0;
   last_minute = 99;
-  relay_change_time = 0;
-#ifdef QUICK_CYCLING_WORKAROUND
-  pilot_release_holdoff_time = 0;
-#endif
 
   operatingMode = EEPROM.read(EEPROM_LOC_MODE);
   if (operatingMode > LAST_MODE) {
@@ -1826,6 +2526,7 @@ void setup() {
     EEPROM.write(EEPROM_LOC_MODE, operatingMode);
   }
   sequential_mode_tiebreak = DEFAULT_TIEBREAK;
+  seq_overlap = NO_CAR;
   
   unsigned int max_current_amps = EEPROM.read(EEPROM_LOC_MAX_AMPS);
   // Make sure that the saved value is one of the choices in the menu
@@ -1861,18 +2562,18 @@ void setup() {
   char calValue = (char)EEPROM.read(EEPROM_LOC_CLOCK_CALIBRATION);
   RTC.setCalibration(calValue);
 
-  boolean success = SetPinFrequencySafe(CAR_A_PILOT_OUT_PIN, 1000);
-  if (!success) {
-    log(LOG_INFO, P("SetPinFrequency for car A failed!"));
-    display.setBacklight(YELLOW);
-  }
-  success = SetPinFrequencySafe(CAR_B_PILOT_OUT_PIN, 1000);
-  if (!success) {
-    log(LOG_INFO, P("SetPinFrequency for car B failed!"));
-    display.setBacklight(BLUE);
+  for(unsigned int car = 0; car < CAR_COUNT; car++) {
+    boolean success = SetPinFrequencySafe(pilot_out_pins[car], 1000000L / PILOT_PERIOD_US);
+    if (!success) {
+      LOG(LOG_INFO, "SetPinFrequency for car %c failed!", car_letter(car));
+      display.setBacklight(car == CAR_A ? YELLOW : BLUE);
+    }
   }
-  // In principle, neither of the above two !success conditions should ever
+  // In principle, none of the above !success conditions should ever
   // happen.
+#ifdef MEGA_HYDRA
+  syncPilotTimers();
+#endif
 
   Delay(2000);
   display.clear();
@@ -1880,7 +2581,7 @@ void setup() {
   gfiSelfTest();
   
 #if 0 // ground test is now only active while charging
-  if (digitalRead(GROUND_TEST_PIN) != HIGH) {
+  if (FastPin<GROUND_TEST_PIN>::read() != HIGH) {
     display.setBacklight(RED);
     display.clear();
     display.print(P("Ground Test Failure"));
@@ -1889,45 +2590,91 @@ void setup() {
 #endif
 #ifdef RELAY_TEST
   {
-    boolean test_a = digitalRead(CAR_A_RELAY_TEST) == HIGH;
-    boolean test_b = digitalRead(CAR_B_RELAY_TEST) == HIGH;
-    if (test_a || test_b) {
+    boolean failed = false;
+    for(unsigned int car = 0; car < CAR_COUNT; car++)
+      if (relayTest(car)) failed = true;
+    if (failed) {
       display.setBacklight(RED);
       display.clear();
       display.print(P("Relay Failure: "));
       display.setCursor(0, 1);
-      if (test_a) display.print('A');
-      if (test_b) display.print('B');
+      for(unsigned int car = 0; car < CAR_COUNT; car++)
+        if (relayTest(car)) display.print(car_letter(car));
       die();
     }
   }
 #endif
+
+  // From here on, loop() runs everything as a task.
+  set_sleep_mode(SLEEP_MODE_IDLE);
+  Tasks.add(&safety_task, safetyTask, SAFETY_TASK_PERIOD, SAFETY_TASK_SLACK);
+  for(unsigned int car = 0; car < CAR_COUNT; car++) {
+    Tasks.add(&cars[car].overdraw, overdrawTask, 0, DEADLINE_TASK_SLACK, car);
+    Tasks.add(&cars[car].error_delay, errorDelayTask, 0, DEADLINE_TASK_SLACK, car);
+    Tasks.add(&cars[car].request, requestTask, 0, DEADLINE_TASK_SLACK, car);
+  }
+  Tasks.add(&sequential_offer, sequentialOfferTask, 0, DEADLINE_TASK_SLACK);
+  Tasks.add(&demand_raise, demandRaiseTask, 0, DEADLINE_TASK_SLACK);
+#ifdef QUICK_CYCLING_WORKAROUND
+  Tasks.add(&pilot_release_holdoff, pilotReleaseTask, 0, DEADLINE_TASK_SLACK);
+#endif
+  Tasks.add(&pilot_task, pilotTask, PILOT_TASK_PERIOD, PILOT_TASK_SLACK);
+  Tasks.add(&current_task, currentTask, CURRENT_TASK_PERIOD, CURRENT_TASK_SLACK);
+  Tasks.add(&demand_task, demandTask, DEMAND_TASK_PERIOD, DEMAND_TASK_SLACK);
+  Tasks.add(&button_task, buttonTask, BUTTON_TASK_PERIOD, BUTTON_TASK_SLACK);
+  Tasks.add(&display_task, displayTask, DISPLAY_TASK_PERIOD, DISPLAY_TASK_SLACK);
+  Tasks.add(&lcd_task, lcdTask, LCD_TASK_PERIOD, LCD_TASK_SLACK);
+  Tasks.add(&clock_task, clockTask, CLOCK_TASK_PERIOD, CLOCK_TASK_SLACK);
+#ifdef TASK_PROFILE
+  Tasks.add(&profile_task, profileTask, PROFILE_TASK_PERIOD, PROFILE_TASK_PERIOD);
+  unsigned int hist = 0;
+  for(Task *t = Tasks.first(); t != NULL && hist < PROFILE_TASKS; t = t->next)
+    if (t->function != NULL) Tasks.histogram(t, profile_hist[hist++]);
+  profile_start = millis();
+#endif
 }
 
 void loop() {
 
+  // Pet the dog
   wdt_reset();
 
   if (inMenu) {
     doMenuFunc(false);
+    display.flush();
     return;
   }
-  
+
+  if (Tasks.run() == NULL) {
+    // Nothing is due. Doze until the next interrupt, which is never more than a millisecond away.
+    sleep_mode();
+  }
+}
+
+// Whether the relays have been still long enough for the relay and ground tests to mean anything.
+static inline boolean relaysSettled() {
+  return !gfiTriggered && !Tasks.pending(&relay_settle);
+}
+
+// GFI, ground and relay tests
+static void safetyTask(Task *task) {
   if (gfiTriggered) {
-    log(LOG_INFO, P("GFI fault detected"));
-    error(BOTH, 'G');
+    // The interrupt handler opened the relays.
+    Tasks.start(&relay_settle, RELAY_TEST_GRACE_TIME);
+    LOG(LOG_INFO, "GFI fault detected");
+    error(ALL_CARS, 'G');
     gfiTriggered = false;
   }
 
 #ifdef GROUND_TEST
-  if ((relay_state_a == HIGH || relay_state_b == HIGH) && relay_change_time == 0) {
-    unsigned char ground = digitalRead(GROUND_TEST_PIN) == HIGH;
+  if (anyRelayClosed() && relaysSettled()) {
+    unsigned char ground = FastPin<GROUND_TEST_PIN>::read() == HIGH;
     if (ground != current_ground_status) {
       current_ground_status = ground;
       if (!ground) {
         // we've just noticed a ground failure.
-        log(LOG_INFO, P("Ground failure detected"));
-        error(BOTH, 'F');
+        LOG(LOG_INFO, "Ground failure detected");
+        error(ALL_CARS, 'F');
       }
     }
   } else {
@@ -1936,425 +2683,413 @@ void loop() {
 #endif
 
 #ifdef RELAY_TEST
-  if (relay_change_time == 0) {
-    // If the power's off but there's still a voltage, that's a stuck relay
-    if ((digitalRead(CAR_A_RELAY_TEST) == HIGH) && (relay_state_a == LOW)) {
-      log(LOG_INFO, P("Relay fault detected on car A"));
-      error(CAR_A, 'R');    
-    }
-    if ((digitalRead(CAR_B_RELAY_TEST) == HIGH) && (relay_state_b == LOW)) {
-      log(LOG_INFO, P("Relay fault detected on car B"));
-      error(CAR_B, 'R');
-    }
+  if (relaysSettled()) {
+    for(unsigned int car = 0; car < CAR_COUNT; car++) {
+      boolean test = relayTest(car);
+      // If the power's off but there's still a voltage, that's a stuck relay
+      if (test && (cars[car].relay_state == LOW)) {
+        LOG(LOG_INFO, "Relay fault detected on %s", car_str(car));
+        error(car, 'R');
+      }
 #ifdef RELAY_TESTS_GROUND
-    // If the power's on, but there's no voltage, that's a ground impedance failure
-    if ((digitalRead(CAR_A_RELAY_TEST) == LOW) && (relay_state_a == HIGH)) {
-      log(LOG_INFO, P("Ground failure detected on car A"));
-      error(CAR_A, 'F');    
-    }
-    if ((digitalRead(CAR_B_RELAY_TEST) == LOW) && (relay_state_b == HIGH)) {
-      log(LOG_INFO, P("Ground failure detected on car B"));
-      error(CAR_B, 'F');
-    }
+      // If the power's on, but there's no voltage, that's a ground impedance failure
+      if (!test && (cars[car].relay_state == HIGH)) {
+        LOG(LOG_INFO, "Ground failure detected on %s", car_str(car));
+        error(car, 'F');
+      }
 #endif
+    }
   }
 #endif
-  if (relay_change_time != 0 && millis() > relay_change_time + RELAY_TEST_GRACE_TIME)
-    relay_change_time = 0;
-    
-  // Update the display
-  if (last_car_a_state == STATE_E || last_car_b_state == STATE_E) {
-    // One or both cars in error state
-    display.setBacklight(RED);
-  } 
-  else {
-    boolean a = isCarCharging(CAR_A);
-    boolean b = isCarCharging(CAR_B);
-
-    // Neither car
-    if (!a && !b) display.setBacklight(paused?YELLOW:GREEN);
-    // Both cars
-    else if (a && b) display.setBacklight(VIOLET);
-    // One car or the other
-    else if (a ^ b) display.setBacklight(TEAL);
-  }
+}
 
+// Pausing, the pilot sense and the state transitions.
+static void pilotTask(Task *task) {
   if(enterPause) {
     if (!paused) {
       if (operatingMode == MODE_SEQUENTIAL) {
         // remember which car was active
-        if (pilot_state_a == FULL) sequential_mode_tiebreak = CAR_A;
-        else if (pilot_state_b == FULL) sequential_mode_tiebreak = CAR_B;
-        else sequential_mode_tiebreak = DEFAULT_TIEBREAK;
+        sequential_mode_tiebreak = pilotHolder();
+        if (sequential_mode_tiebreak == NO_CAR) sequential_mode_tiebreak = DEFAULT_TIEBREAK;
+      }
+      // Turn off all of the pilots
+      for(unsigned int car = 0; car < CAR_COUNT; car++) {
+        setPilot(car, HIGH);
+        Tasks.start(&cars[car].error_delay, ERROR_DELAY);
+        cars[car].last_state = DUNNO;
+        Tasks.stop(&cars[car].request);
+        cars[car].seq_done = false;
       }
-      // Turn off both pilots
-      setPilot(CAR_A, HIGH);
-      setPilot(CAR_B, HIGH);
-      unsigned long now = millis();
-      car_a_error_time = now;
-      car_b_error_time = now;
-      last_car_a_state = DUNNO;
-      last_car_b_state = DUNNO;
-      car_a_request_time = 0;
-      car_b_request_time = 0;     
-      seq_car_a_done = false;
-      seq_car_b_done = false; 
-      log(LOG_INFO, P("Pausing."));
+      seq_overlap = NO_CAR;
+      LOG(LOG_INFO, "Pausing.");
     }
     paused = true;
   } else {
     // reset car states if unpaused so that initial transitions may run on unpause for any plugged cars.
     if ( paused ) {
-      last_car_a_state = DUNNO;
-      last_car_b_state = DUNNO;
+      for(unsigned int car = 0; car < CAR_COUNT; car++)
+        cars[car].last_state = DUNNO;
     }
     paused = false;
   }
 
-  // Print the time of day
-  display.setCursor(0, 0);
-  char buf[17];
-  if (RTC.isRunning()) {
-#ifdef CLOCK_24HOUR
-  snprintf(buf, sizeof(buf), P(" %02d:%02d  "), hour(localTime()), minute(localTime()));
-#else
-  snprintf(buf, sizeof(buf), P("%2d:%02d%cM "), hourFormat12(localTime()), minute(localTime()), isPM(localTime())?'P':'A');
-#endif
-  } else {
-    snprintf(buf, sizeof(buf), P("        "));
+  // Check the pilot sense on every car. They're looked at together, so the
+  // transitions below see the cars as they were at the same moment.
+  unsigned int states[CAR_COUNT];
+  checkStates(states);
+
+  for(unsigned int us = 0; us < CAR_COUNT; us++) {
+    car_type &car = cars[us];
+    unsigned int car_state = states[us];
+    car.sensed_state = car_state;
+    // A car that's been unplugged starts over.
+    if (car_state == STATE_A) car.charge = car.charge_part = 0;
+
+    if (paused || car.last_state == STATE_E) {
+      switch(car_state) {
+      case STATE_A:
+        // we were in error, but the car's been disconnected.
+        // If we are still paused, then
+        // we can't clear the error.
+        if (!paused) {
+          // If not, clear the error state. The next time through
+          // will take us back to state A.
+          car.last_state = DUNNO;
+          LOG(LOG_INFO, "Car %c disconnected, clearing error", car_letter(us));
+        } else {
+          // We're paused. The display task shows that the car's gone.
+          car.last_state = car_state;
+        }
+        // fall through...
+      case STATE_B:
+        // If we see a transition to state B, the error is still in effect, but complete (and
+        // cancel) any pending relay opening.
+        if (Tasks.running(&car.error_delay)) {
+          Tasks.stop(&car.error_delay);
+          setRelay(us, LOW);
+          releasePilot(us);
+        }
+        if (paused && car_state == STATE_B) {
+          // just plugged in -- set the tie break in sequential mode to this last plugged car during pause.
+          // this will not engage if the state ws "DUNNO" which i guess what it is going to be after just
+          // entering pause or powering up. But i cannot use from DUNNO transition here since it may also be 
+          // just entering the pause, in which case it will always reset the tiebreak to the last car no
+          // matter what. So resetting priority would require unplug-plug and not just pause-then-plug. It
+          // should be ok though.
+          if ( car.last_state == STATE_A ) {
+            sequential_mode_tiebreak = us;
+            car.last_state = STATE_B;
+          }
+        }
+        break;
+      }
+    } else if (car_state != car.last_state) {
+      if (car.last_state != DUNNO)
+        LOG(LOG_INFO, "Car %c state transition: %s->%s.", car_letter(us), state_str(car.last_state), state_str(car_state));
+      switch(operatingMode) {
+        case MODE_SHARED:
+          shared_mode_transition(us, car_state);
+          break;
+        case MODE_SEQUENTIAL:
+          sequential_mode_transition(us, car_state);
+          break;
+        case MODE_DEMAND:
+          demand_mode_transition(us, car_state);
+          break;
+      }
+    }
   }
-  display.print(buf);
-  
+}
+
+// The protocol deadlines. Each of these runs once, when its delay is up, unless it's been
+// stopped first. The task's arg is the car it's for.
+
+// The other cars have had TRANSITION_DELAY to drop to their new shares. It's our turn.
+static void requestTask(Task *task) {
+  unsigned int car = task->arg;
+  LOG(LOG_INFO, "Delayed transition completed on %s", car_str(car));
+  showCar(car, P(": ON   "));
+  setRelay(car, HIGH);
+}
+
+// ERROR_DELAY after the pilot was taken away, the power goes, too.
+static void errorDelayTask(Task *task) {
+  unsigned int car = task->arg;
+  setRelay(car, LOW);
   if (paused) {
-    display.print(P("M:PAUSED"));
+    showCar(car, P(": off  "));
+    LOG(LOG_INFO, "Power withdrawn after pause delay on %s", car_str(car));
   } else {
-    display.print(P("M:"));
-    switch(operatingMode) {
-      case MODE_SHARED:
-        display.print(P("shared")); break;
-      case MODE_SEQUENTIAL:
-        display.print(P("seqntl")); break;
-      default:
-        display.print(P("UNK")); break;
-    }
+    LOG(LOG_INFO, "Power withdrawn after error delay on %s", car_str(car));
   }
+  releasePilot(car);
+}
 
-  // Check the pilot sense on each car.
-  unsigned int car_a_state = checkState(CAR_A);
+// The car's been over its limit for all of OVERDRAW_GRACE_PERIOD.
+static void overdrawTask(Task *task) {
+  error(task->arg, 'O');
+}
 
-  if (paused || last_car_a_state == STATE_E) {
-    switch(car_a_state) {
-    case STATE_A:
-      // we were in error, but the car's been disconnected.
-      // If we are still paused, then
-      // we can't clear the error.
-      if (!paused) {
-      // If not, clear the error state. The next time through
-      // will take us back to state A.
-        last_car_a_state = DUNNO;
-        log(LOG_INFO, P("Car A disconnected, clearing error"));
-      } else {
-        // We're paused. We will fix up the display ourselves.
-        display.setCursor(0, 1);
-        display.print(P("A: ---  "));
-        last_car_a_state = car_a_state;
-      }
-      // fall through...
-    case STATE_B:
-      // If we see a transition to state B, the error is still in effect, but complete (and
-      // cancel) any pending relay opening.
-      if (car_a_error_time != 0) {
-        car_a_error_time = 0;
-        setRelay(CAR_A, LOW);
-        if (isCarCharging(CAR_B) || last_car_b_state == STATE_B)
-          setPilot(CAR_B, FULL);
-      }
-      if (paused && car_a_state == STATE_B) {
-        // just plugged in -- set the tie break in sequential mode to this last plugged car during pause.
-        if ( last_car_a_state == STATE_A ) {
-          sequential_mode_tiebreak = CAR_A;
-          last_car_a_state = STATE_B;
-        }
-        display.setCursor(0, 1);
-        if ( operatingMode == MODE_SEQUENTIAL && sequential_mode_tiebreak == CAR_A) 
-          display.print(P("A: off* "));
-        else 
-          display.print(P("A: off  "));
-      }
-      break;
-    }
-  } else if (car_a_state != last_car_a_state) {
-    if (last_car_a_state != DUNNO)
-      log(LOG_INFO, P("Car A state transition: %s->%s."), state_str(last_car_a_state), state_str(car_a_state));
-    switch(operatingMode) {
-      case MODE_SHARED:
-        shared_mode_transition(CAR_A, car_a_state);
-        break;
-      case MODE_SEQUENTIAL:
-        sequential_mode_transition(CAR_A, car_a_state);
-        break;
-    }
+// The car with the pilot and another one have sat in state B for SEQ_MODE_OFFER_TIMEOUT.
+// Offer the pilot to the next one.
+static void sequentialOfferTask(Task *task) {
+  unsigned int holder = pilotHolder();
+  if (holder == NO_CAR) return;
+  unsigned int next = nextWaiting(holder, false);
+  if (next == NO_CAR) return;
+  LOG(LOG_INFO, "Sequential mode offer timeout, moving offer to %s", car_str(next));
+  setPilot(holder, HIGH);
+  setPilot(next, FULL);
+  Tasks.start(task, SEQ_MODE_OFFER_TIMEOUT);
+  showCar(holder, cars[holder].seq_done ? ": done " : ": wait ");
+  showCar(next, P(": off  "));
+}
+
+#ifdef QUICK_CYCLING_WORKAROUND
+// The car that stopped hasn't come back. The ones that are left can have its share.
+static void pilotReleaseTask(Task *task) {
+  if (chargingCount() == 0) {
+    LOG(LOG_INFO, "Pilot release interval elapsed, but no car is charging??");
+    return;
   }
+  LOG(LOG_INFO, "Pilot release interval elapsed. Raising pilots on remaining cars.");
+  shareOut();
+}
+#endif
 
-  unsigned int car_b_state = checkState(CAR_B);
-  if (paused || last_car_b_state == STATE_E) {
-    switch(car_b_state) {
-    case STATE_A:
-      // we were in error, but the car's been disconnected.
-      // If we are still paused, then
-      // we can't clear the error.
-      if (!paused) {
-        // If not, clear the error state. The next time through
-        // will take us back to state A.
-        last_car_b_state = DUNNO;
-        log(LOG_INFO, P("Car B disconnected, clearing error"));
-      } else {
-        // We're paused. We will fix up the display ourselves.
-        display.setCursor(8, 1);
-        display.print(P("B: ---  "));
-        last_car_b_state = car_b_state;
-      }
-      // fall through...
-    case STATE_B:
-      // If we see a transition to state B, the error is still in effect, but complete (and
-      // cancel) any pending relay opening.
-      if (car_b_error_time != 0) {
-        car_b_error_time = 0;
-        setRelay(CAR_B, LOW);
-        if (isCarCharging(CAR_A) || last_car_a_state == STATE_B)
-          setPilot(CAR_A, FULL);
-      }
-      if (paused && car_b_state == STATE_B) {
-        // just plugged in -- set the tie break in sequential mode to this last plugged car during pause.
-        // this will not engage if the state ws "DUNNO" which i guess what it is going to be after just
-        // entering pause or powering up. But i cannot use from DUNNO transition here since it may also be 
-        // just entering the pause, in which case it will always reset the tiebreak to B no matter what.
-        // So resetting priority would require unplug-plug and not just pause-then-plug. It should be ok
-        // though.
-        if ( last_car_b_state == STATE_A ) {
-          sequential_mode_tiebreak = CAR_B;
-          last_car_b_state = STATE_B;
-        }
-        display.setCursor(8, 1);
-        if ( operatingMode == MODE_SEQUENTIAL && sequential_mode_tiebreak == CAR_B) 
-          display.print(P("B: off* "));
-        else 
-          display.print(P("B: off  "));
-      }
-      break;
-    }
-  } else if (car_b_state != last_car_b_state) {
-    if (last_car_b_state != DUNNO)
-      log(LOG_INFO, P("Car B state transition: %s->%s."), state_str(last_car_b_state), state_str(car_b_state));
-    switch(operatingMode) {
-      case MODE_SHARED:
-        shared_mode_transition(CAR_B, car_b_state);
-        break;
-      case MODE_SEQUENTIAL:
-        sequential_mode_transition(CAR_B, car_b_state);
-        break;
+// Demand mode: the cars that were lowered have had TRANSITION_DELAY to cut back. The ones
+// that were waiting for that can go up now. In sequential mode, the car waiting on a tapering
+// one can have what it doesn't use.
+static void demandRaiseTask(Task *task) {
+  for(unsigned int car = 0; car < CAR_COUNT; car++) {
+    if (cars[car].raise_to != 0 && isCarCharging(car))
+      allotPilot(car, cars[car].raise_to);
+    cars[car].raise_to = 0;
+  }
+  unsigned int holder = pilotHolder();
+  if (seq_overlap != NO_CAR && holder != NO_CAR && cars[seq_overlap].pilot_state == HIGH) {
+    if (cars[seq_overlap].last_state != STATE_B) {
+      endOverlap(seq_overlap);
+      return;
     }
+    allotPilot(seq_overlap, incomingPilotMilliamps - pilotMilliamps(holder));
+    showCar(seq_overlap, P(": off  "));
   }
-  if (sequential_pilot_timeout != 0) {
-    unsigned long now = millis();
-    if (now - sequential_pilot_timeout > SEQ_MODE_OFFER_TIMEOUT) {
-      if (pilot_state_a == FULL) {
-        log(LOG_INFO, P("Sequential mode offer timeout, moving offer to %s"), car_str(CAR_B));
-        setPilot(CAR_A, HIGH);
-        setPilot(CAR_B, FULL);
-        sequential_pilot_timeout = now;
-        display.setCursor(0, 1);
-        if ( seq_car_a_done ) 
-          display.print(P("A: done "));
-        else 
-          display.print(P("A: wait "));
-        display.print(P("B: off  "));
-      } else if (pilot_state_b == FULL) {
-        log(LOG_INFO, P("Sequential mode offer timeout, moving offer to %s"), car_str(CAR_A));
-        setPilot(CAR_B, HIGH);
-        setPilot(CAR_A, FULL);
-        sequential_pilot_timeout = now;
-        display.setCursor(0, 1);
-        display.print(P("A: off  "));
-        if ( seq_car_b_done ) 
-          display.print(P("B: done "));
-        else 
-          display.print(P("B: wait "));
-      }
-    }
+}
+
+// Demand mode: every DEMAND_INTERVAL, see what the cars have been drawing, and move the
+// shares to match. Not while a car is on its way in, or any are still cutting back.
+// Sequential mode looks at whether the car with the pilot has tapered off, or had its turn.
+static void demandTask(Task *task) {
+  for(unsigned int car = 0; car < CAR_COUNT; car++) {
+    cars[car].last_peak = cars[car].peak_draw;
+    cars[car].peak_draw = 0;
+  }
+  if (paused) return;
+  if (Tasks.running(&demand_raise)) return;
+  for(unsigned int car = 0; car < CAR_COUNT; car++)
+    if (Tasks.running(&cars[car].request)) return;
+  if (operatingMode == MODE_DEMAND)
+    allotDemand();
+  else if (operatingMode == MODE_SEQUENTIAL) {
+    checkTaper();
+    checkTurn();
   }
-  
-  {
-    unsigned long now = millis();
-    if (now - last_state_log > STATE_LOG_INTERVAL) {
-      last_state_log = now;
-      log(LOG_INFO, P("States: Car A, %s; Car B, %s"), state_str(last_car_a_state), state_str(last_car_b_state));
-      log(LOG_INFO, P("Power available %lu mA"), incomingPilotMilliamps);
+}
+
+// While a car waits for the others to cut back (see awaitHandoff()), see whether they have.
+// Every car that's charging must be on the ammeter, and within its pilot for all of
+// HANDOFF_SETTLE_TIME.
+static void checkHandoff() {
+  boolean waiting = false;
+  for(unsigned int car = 0; car < CAR_COUNT; car++)
+    if (Tasks.running(&cars[car].request)) waiting = true;
+  if (!waiting) return;
+  for(unsigned int car = 0; car < CAR_COUNT; car++) {
+    car_type &c = cars[car];
+    if (c.relay_state != HIGH || c.last_state == STATE_E) continue;
+    if (!c.metered || c.shown > pilotMilliamps(car) + OVERDRAW_GRACE_AMPS) {
+      Tasks.start(&handoff_settle, HANDOFF_SETTLE_TIME);
+      return;
     }
   }
-   
-  // Update the ammeter display and check for overdraw conditions.
+  if (Tasks.pending(&handoff_settle)) return;
+  for(unsigned int car = 0; car < CAR_COUNT; car++) {
+    if (!Tasks.running(&cars[car].request)) continue;
+    Tasks.stop(&cars[car].request);
+    LOG(LOG_INFO, "Early transition completed on %s", car_str(car));
+    setRelay(car, HIGH);
+    showCar(car, P(": ON   "));
+  }
+}
+
+// The ammeters and the overdraw checks. What's shown is left for the display task.
+static void currentTask(Task *task) {
   // We allow a 5 second grace because the J1772 spec requires allowing
   // the car 5 seconds to respond to incoming pilot changes.
   // If the overdraw condition is acute enough, we'll be blowing fuses
   // in hardware, so this isn't as dire a condition as it sounds.
   // More likely what it means is that the car hasn't reacted to an
-  // attempt to reduce it to half power (and the other car has not yet
+  // attempt to reduce it to its share (and the next car has not yet
   // been turned on), so we must error them out before letting the other
   // car start.
-  if (relay_state_a == HIGH && last_car_a_state != STATE_E) { // Only check the ammeter if the power is actually on and we're not errored
-    unsigned long car_a_draw = readCurrent(CAR_A);
-
-    {
-      unsigned long now = millis();
-      if (now - last_current_log_car_a > CURRENT_LOG_INTERVAL) {
-        last_current_log_car_a = now;
-        log(LOG_INFO, P("Car A current draw %lu mA"), car_a_draw);
+  for(unsigned int us = 0; us < CAR_COUNT; us++) {
+    car_type &car = cars[us];
+    if (car.relay_state == HIGH && car.last_state != STATE_E) { // Only check the ammeter if the power is actually on and we're not errored
+      unsigned long draw = readCurrent(us);
+      // The overdraw check uses the raw reading. Only what's shown has the spikes taken out.
+      car.shown = car.current_spikes.add(draw);
+      if (!car.metered) {
+        car.demand_since = millis();
+        car.peak_draw = car.last_peak = 0;
       }
-    }
-    
-    // If the other car is charging, then we can only have half power
-    unsigned long car_a_limit = incomingPilotMilliamps / ((pilotState(CAR_A) == HALF)? 2 : 1);
-
-    if (car_a_draw > car_a_limit + OVERDRAW_GRACE_AMPS) {
-      // car A has begun an over-draw condition. They have 5 seconds of grace before we pull the plug.
-      if (car_a_overdraw_begin == 0) {
-        car_a_overdraw_begin = millis();
-      } 
-      else {
-        if (millis() - car_a_overdraw_begin > OVERDRAW_GRACE_PERIOD) {
-          error(CAR_A, 'O');
-          return;
+      if (!car.metered || car.shown * 100 >= pilotOffered(us) * SEQ_TAPER_PERCENT)
+        car.taper_since = millis();
+      {
+        unsigned long now = millis();
+        if (car.metered) {
+          car.charge_part += car.shown * (now - car.metered_at);
+          car.charge += car.charge_part / 3600000UL;
+          car.charge_part %= 3600000UL;
         }
+        car.metered_at = now;
       }
-    }
-    else {
-      // car A is under its limit. Cancel any overdraw in progress
-      car_a_overdraw_begin = 0;
-    }
-    display.setCursor(0, 1);
-    display.print("A:");
-    display.print(formatMilliamps(car_a_draw));
-  } 
-  else {
-    // Car A is not charging
-    car_a_overdraw_begin = 0;
-    memset(car_b_current_samples, 0, sizeof(car_b_current_samples));
-  }
+      car.metered = true;
+      // Demand mode goes by what's shown, so that the inrush doesn't count.
+      if (car.shown > car.peak_draw) car.peak_draw = (car.shown > 0xffff) ? 0xffff : car.shown;
 
-  if (relay_state_b == HIGH && last_car_b_state != STATE_E) { // Only check the ammeter if the power is actually on and we're not errored
-    unsigned long car_b_draw = readCurrent(CAR_B);
+      {
+        unsigned long now = millis();
+        if (now - car.last_current_log > CURRENT_LOG_INTERVAL) {
+          car.last_current_log = now;
+          LOG(LOG_INFO, "Car %c current draw %lu mA", car_letter(us), car.shown);
+        }
+      }
+
+      // If other cars are charging, then we can only have our share
+      unsigned long limit = pilotMilliamps(us);
 
-    {
-      unsigned long now = millis();
-      if (now - last_current_log_car_b > CURRENT_LOG_INTERVAL) {
-        last_current_log_car_b = now;
-        log(LOG_INFO, P("Car B current draw %lu mA"), car_b_draw);
+      if (draw > limit + OVERDRAW_GRACE_AMPS) {
+        // the car has begun an over-draw condition. They have 5 seconds of grace before we pull the plug.
+        if (!Tasks.running(&car.overdraw))
+          Tasks.start(&car.overdraw, OVERDRAW_GRACE_PERIOD);
       }
-    }
-    
-    // If the other car is charging, then we can only have half power
-    unsigned long car_b_limit = incomingPilotMilliamps / ((pilotState(CAR_B) == HALF) ? 2 : 1);
-
-    if (car_b_draw > car_b_limit + OVERDRAW_GRACE_AMPS) {
-      // car B has begun an over-draw condition. They have 5 seconds of grace before we pull the plug.
-      if (car_b_overdraw_begin == 0) {
-        car_b_overdraw_begin = millis();
-      } 
       else {
-        if (millis() - car_b_overdraw_begin > OVERDRAW_GRACE_PERIOD) {
-          error(CAR_B, 'O');
-          return;
-        }
+        // the car is under its limit. Cancel any overdraw in progress
+        Tasks.stop(&car.overdraw);
       }
-    }
+    } 
     else {
-      car_b_overdraw_begin = 0;
+      // the car is not charging
+      Tasks.stop(&car.overdraw);
+      car.current_spikes.reset();
+      car.metered = false;
+      if (car.relay_state == LOW) learnCurrentZero(us);
     }
-    display.setCursor(8, 1);
-    display.print("B:");
-    display.print(formatMilliamps(car_b_draw));
+  }
+
+  checkHandoff();
+}
+
+// The button. A short push pauses or unpauses, and a long one brings up the menu.
+static void buttonTask(Task *task) {
+  unsigned int event = checkEvent();
+  if (event == EVENT_SHORT_PUSH)
+    enterPause = !paused;
+  for(unsigned int car = 0; car < CAR_COUNT; car++) {
+    // Allow playing with the menu button only when all of the plugs are out
+    if (cars[car].sensed_state != STATE_A) return;
+  }
+  if (event == EVENT_LONG_PUSH) {
+    inMenu = true;
+    for(unsigned int car = 0; car < CAR_COUNT; car++)
+      cars[car].last_state = DUNNO;
+    doMenu(true);
+  }
+}
+
+// Send the LCD whatever's changed on the display.
+static void lcdTask(Task *task) {
+  display.flush();
+}
+
+// The backlight, the time of day and mode, and the ammeters.
+static void displayTask(Task *task) {
+  boolean errored = false;
+  for(unsigned int car = 0; car < CAR_COUNT; car++)
+    if (cars[car].last_state == STATE_E) errored = true;
+  if (errored) {
+    // One or more cars in error state
+    display.setBacklight(RED);
   } 
   else {
-    // Car B is not charging
-    car_b_overdraw_begin = 0;
-    memset(car_b_current_samples, 0, sizeof(car_b_current_samples));
+    switch(chargingCount()) {
+      // No car
+      case 0: display.setBacklight(paused?YELLOW:GREEN); break;
+      // One car
+      case 1: display.setBacklight(TEAL); break;
+      // More than one
+      default: display.setBacklight(VIOLET); break;
+    }
   }
-  
-  // We need to use labs() here because we cached now early on, so it may actually be
-  // *before* the time in question
-  if (car_a_request_time != 0 && (millis() - car_a_request_time) > TRANSITION_DELAY) {
-    // We've waited long enough.
-    log(LOG_INFO, P("Delayed transition completed on car A"));
-    car_a_request_time = 0;
-    display.setCursor(0, 1);
-    display.print(P("A: ON   "));
-    setRelay(CAR_A, HIGH);
+
+  // Print the time of day
+  display.setCursor(0, 0);
+  char buf[17];
+  if (RTC.isRunning()) {
+#ifdef CLOCK_24HOUR
+  snprintf(buf, sizeof(buf), P(" %02d:%02d  "), hour(localTime()), minute(localTime()));
+#else
+  snprintf(buf, sizeof(buf), P("%2d:%02d%cM "), hourFormat12(localTime()), minute(localTime()), isPM(localTime())?'P':'A');
+#endif
+  } else {
+    snprintf(buf, sizeof(buf), P("        "));
   }
-  if (car_a_error_time != 0 && (millis() - car_a_error_time) > ERROR_DELAY) {
-    car_a_error_time = 0;
-    setRelay(CAR_A, LOW);
-    if (paused) {
-      display.setCursor(0, 1);
-      display.print(P("A: off  "));
-      log(LOG_INFO, P("Power withdrawn after pause delay on car A"));
-    } else {
-      log(LOG_INFO, P("Power withdrawn after error delay on car A"));
+  display.print(buf);
+  
+  if (paused) {
+    display.print(P("M:PAUSED"));
+  } else {
+    display.print(P("M:"));
+    switch(operatingMode) {
+      case MODE_SHARED:
+        display.print(P("shared")); break;
+      case MODE_SEQUENTIAL:
+        display.print(P("seqntl")); break;
+      case MODE_DEMAND:
+        display.print(P("demand")); break;
+      default:
+        display.print(P("UNK")); break;
     }
-    if (isCarCharging(CAR_B) || last_car_b_state == STATE_B)
-        setPilot(CAR_B, FULL);
-  }
-  if (car_b_request_time != 0 && (millis() - car_b_request_time) > TRANSITION_DELAY) {
-    log(LOG_INFO, P("Delayed transition completed on car B"));
-    // We've waited long enough.
-    car_b_request_time = 0;
-    display.setCursor(8, 1);
-    display.print(P("B: ON   "));
-    setRelay(CAR_B, HIGH);
-  }
-  if (car_b_error_time != 0 && (millis() - car_b_error_time) > ERROR_DELAY) {
-    car_b_error_time = 0;
-    setRelay(CAR_B, LOW);
-    if (paused) {
-      display.setCursor(8, 1);
-      display.print(P("B: off  "));
-      log(LOG_INFO, P("Power withdrawn after pause delay on car B"));
-    } else
-      log(LOG_INFO, P("Power withdrawn after error delay on car B"));
-    if (isCarCharging(CAR_A) || last_car_a_state == STATE_B)
-        setPilot(CAR_A, FULL);
   }
-  
-#ifdef QUICK_CYCLING_WORKAROUND
-  if (pilot_release_holdoff_time != 0 && millis() > pilot_release_holdoff_time) {
-    log(LOG_INFO, P("Pilot release interval elapsed. Raising pilot to full on remaining car."));
-      if (isCarCharging(CAR_A)) {
-        setPilot(CAR_A, FULL);
-      } else if (isCarCharging(CAR_B)) {
-        setPilot(CAR_B, FULL);
-      } else {
-        log(LOG_INFO, P("Pilot release interval elapsed, but no car is charging??"));
+
+  for(unsigned int us = 0; us < CAR_COUNT; us++) {
+    car_type &car = cars[us];
+    if (paused) {
+      // Show which cars are plugged in. In sequential mode, the one that gets the pilot first
+      // when we resume is starred.
+      if (car.sensed_state == STATE_A) {
+        showCar(us, P(": ---  "));
+      } else if (car.sensed_state == STATE_B) {
+        if ( operatingMode == MODE_SEQUENTIAL && sequential_mode_tiebreak == us) 
+          showCar(us, P(": off* "));
+        else 
+          showCar(us, P(": off  "));
       }
-      pilot_release_holdoff_time = 0;
-  }
-#endif
-  
-  unsigned int event = checkEvent();
-  if (event == EVENT_SHORT_PUSH)
-    enterPause = !paused;
-  if (car_a_state == STATE_A && car_b_state == STATE_A) {
-    // Allow playing with the menu button only when both plugs are out
-    if (event == EVENT_LONG_PUSH) {
-      inMenu = true;
-      last_car_a_state = DUNNO;
-      last_car_b_state = DUNNO;
-      doMenu(true);
+    }
+
+    if (car.relay_state == HIGH && car.last_state != STATE_E && car.metered) {
+      showCar(us, ":");
+      display.print(formatMilliamps(car.shown));
     }
   }
-  
+}
+
+// The time of day events, and the periodic logging and saving.
+static void clockTask(Task *task) {
   if (last_minute != minute(localTime())) {
     last_minute = minute(localTime());
-    event = checkTimer();
+    unsigned int event = checkTimer();
     switch(event) {
       case TE_PAUSE:
         if (!paused) enterPause = true;
@@ -2364,7 +3099,94 @@ void loop() {
         break;
     }
   }
-  
+  unsigned long now = millis();
+  if (now - last_state_log > STATE_LOG_INTERVAL) {
+    last_state_log = now;
+    char states[CAR_COUNT * 16];
+    states[0] = 0;
+    for(unsigned int car = 0; car < CAR_COUNT; car++) {
+      size_t len = strlen(states);
+      snprintf(states + len, sizeof(states) - len, P("%sCar %c, %s"), car == 0 ? "" : "; ", car_letter(car), state_str(cars[car].last_state));
+    }
+    LOG(LOG_INFO, "States: %s", states);
+    LOG(LOG_INFO, "Power available %lu mA", incomingPilotMilliamps);
+    unsigned int mains = 0;
+    for(unsigned int car = 0; car < CAR_COUNT && mains == 0; car++)
+      mains = Sampler.mainsFrequency(SLOT_CURRENT(car));
+    if (mains != 0) LOG(LOG_INFO, "Mains frequency %u.%u Hz", mains / 10, mains % 10);
+  }
+  if (now - last_baseline_save > BASELINE_SAVE_INTERVAL) {
+    last_baseline_save = now;
+    if (baseline.save()) LOG(LOG_INFO, "Saved the learned sense input levels");
+  }
 }
 
-
+#ifdef TASK_PROFILE
+// Sending a 'p' over the serial port logs the task profile, and an 'r' clears it. With
+// SERIAL_LOG_LEVEL at LOG_DEBUG, it's logged (and then cleared) every PROFILE_LOG_INTERVAL, too.
+// One line is logged per run, so as not to hold up the other tasks for long.
+static void profileTask(Task *task) {
+#if SERIAL_LOG_LEVEL > 0
+  while(Uart.available()) {
+    switch(Uart.read()) {
+      case 'p':
+        if (!profile_logging) {
+          profile_logging = true;
+          profile_log_line = NULL;
+          profile_log_hist = false;
+          profile_periodic = false;
+        }
+        break;
+      case 'r':
+        Tasks.clearStats();
+        profile_start = millis();
+        break;
+    }
+  }
+#endif
+#if SERIAL_LOG_LEVEL >= LOG_DEBUG
+  if (!profile_logging && millis() - profile_start > PROFILE_LOG_INTERVAL) {
+    profile_logging = true;
+    profile_log_line = NULL;
+    profile_log_hist = false;
+    profile_periodic = true;
+  }
+#endif
+  if (!profile_logging) return;
+
+  unsigned int level = profile_periodic ? LOG_DEBUG : LOG_INFO;
+  Task *t = profile_log_line;
+  if (t == NULL) {
+    // The heading is two lines: what's logged for each task, and then the histogram buckets.
+    if (!profile_log_hist) {
+      LOG(level, "Task profile for the last %lu ms (runs, late, worst late ms, worst us, total us):", millis() - profile_start);
+      profile_log_hist = true;
+    } else {
+      LOG(level, "Run times (us): <128 <256 <512 <1k <2k <4k <8k <16k <32k <64k <128k more");
+      profile_log_hist = false;
+      profile_log_line = Tasks.first();
+    }
+    return;
+  }
+  if (!profile_log_hist) {
+    LOG(level, "%s: %u %u %u %u %lu", task_str(t), t->runs, t->late, t->worst_late, t->worst_us, t->busy_us);
+    // A deadline with no function never runs, so it has no histogram.
+    profile_log_hist = t->hist != NULL;
+    if (profile_log_hist) return;
+  } else {
+    unsigned int *h = t->hist;
+    LOG(level, "%s times: %u %u %u %u %u %u %u %u %u %u %u %u", task_str(t),
+      h[0], h[1], h[2], h[3], h[4], h[5], h[6], h[7], h[8], h[9], h[10], h[11]);
+    profile_log_hist = false;
+  }
+  profile_log_line = t->next;
+  if (profile_log_line == NULL) {
+    profile_logging = false;
+    if (profile_periodic) {
+      // The periodic log clears the profile when it's done, so each one covers an interval.
+      Tasks.clearStats();
+      profile_start = millis();
+    }
+  }
+}
+#endif
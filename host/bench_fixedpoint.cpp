@@ -0,0 +1,289 @@
+/*
+
+ Benchmark and cross-check of the FixedPoint library
+ Copyright 2026 Nicholas W. Sayer
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program; if not, write to the Free Software Foundation, Inc.,
+ 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+
+// The sketches used to carry their own copies of these routines, written
+// with plain division, a linear search square root and sprintf(). This
+// runs the FixedPoint versions against those, checking that every answer
+// is the same over the whole range of inputs that the firmware can hand
+// them, and then times both.
+//
+// The originals are reproduced below with AVR integer widths (unsigned
+// long is 32 bits, unsigned int is 16) so that they overflow and truncate
+// the way they do on the board. The timings are host CPU cycles (or
+// nanoseconds, off of x86). The AVR has no divide instruction, so there the
+// difference is larger still.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include <FixedPoint.h>
+
+namespace old {
+
+typedef uint32_t ulong;
+typedef uint16_t uint;
+
+static ulong timeToMA(ulong samplesHigh, ulong samplesLow) {
+  uint duty = (samplesHigh * 1000) / (samplesHigh + samplesLow);
+  if (duty < 80) {
+    return 0;
+  } else if (duty <= 100) {
+    return 6000L;
+  } else if (duty <= 850) {
+    return duty * 60L;
+  } else if (duty <= 960) {
+    return (duty - 640) * 250L;
+  } else if (duty <= 980) {
+    return 80000L;
+  } else {
+    return 0;
+  }
+}
+
+static uint MAToDuty(ulong milliamps) {
+  if (milliamps < 6000) {
+    return 9999;
+  }
+  else if (milliamps < 51000) {
+    return milliamps/60;
+  }
+  else if (milliamps <= 80000) {
+    return (milliamps / 250) + 640;
+  }
+  else {
+    return 9999;
+  }
+}
+
+static uint MAtoPwm(ulong milliamps) {
+  uint out = MAToDuty(milliamps);
+
+  if (out >= 1000) return 255;
+
+  out = (uint)((out * 256L) / 1000);
+
+  return out;
+}
+
+static char *formatMilliamps(ulong milliamps) {
+  static char out[7]; // one more than the original, which "100.0A" overran
+
+  if (milliamps < 1000) {
+    milliamps /= 10;
+    milliamps *= 10;
+
+    sprintf(out, "%3umA", (unsigned)milliamps);
+  }
+  else {
+    int hundredths = (milliamps / 10) % 100;
+    int tenths = hundredths / 10 + (((hundredths % 10) >= 5)?1:0);
+    int units = milliamps / 1000;
+    if (tenths >= 10) {
+      tenths -= 10;
+      units++;
+    }
+
+    sprintf(out, "%2d.%01dA", units, tenths);
+  }
+
+  return out;
+}
+
+static ulong ulong_sqrt(ulong in) {
+  ulong out;
+  for(out = 1; out*out <= in; out++) ;
+  return out - 1;
+}
+
+}
+
+// The largest A/d reading is 1023, and the mean of the squares of the
+// distances from the midpoint can't be more than 512 squared.
+#define SQRT_FIRMWARE_MAX (512UL * 512UL)
+// old::ulong_sqrt() overflows its square past this.
+#define SQRT_OLD_MAX (65535UL * 65535UL - 1)
+// The largest current there is any reason to format. Past this, the old
+// formatMilliamps() overran its buffer with "100.0A".
+#define FORMAT_MAX 99949UL
+// The splitter hands timeToMA() the incoming pilot's high and total time in
+// microseconds, summed over at most 64 periods of up to 1.25 ms each.
+#define PILOT_SMALL_MAX 2000
+#define PILOT_TIME_MAX (64UL * 1250)
+
+static unsigned long failures;
+
+static void fail(const char *what, unsigned long in, unsigned long in2, unsigned long expected, unsigned long got) {
+  if (failures++ < 20)
+    printf("MISMATCH %s(%lu, %lu): expected %lu, got %lu\n", what, in, in2, expected, got);
+}
+
+static void check_sqrt(bool exhaustive) {
+  for(uint32_t i = 0; i <= SQRT_FIRMWARE_MAX; i++) {
+    unsigned long got = ulong_sqrt(i);
+    if (got != old::ulong_sqrt(i)) fail("ulong_sqrt", i, 0, old::ulong_sqrt(i), got);
+  }
+  // Past that, the old version is far too slow to run on every value. Check
+  // the new one against the definition instead: either everything, or
+  // either side of every perfect square plus a spread in between.
+  uint64_t step = exhaustive ? 1 : 4093;
+  for(uint64_t i = 0; i <= 0xffffffffULL; i += step) {
+    uint64_t r = ulong_sqrt((uint32_t)i);
+    if (r * r > i || (r + 1) * (r + 1) <= i) fail("ulong_sqrt", i, 0, 0, r);
+  }
+  for(uint64_t r = 1; r <= 65535; r++) {
+    uint64_t sq = r * r;
+    if (ulong_sqrt((uint32_t)(sq - 1)) != r - 1) fail("ulong_sqrt", sq - 1, 0, r - 1, ulong_sqrt(sq - 1));
+    if (ulong_sqrt((uint32_t)sq) != r) fail("ulong_sqrt", sq, 0, r, ulong_sqrt(sq));
+  }
+  if (ulong_sqrt(0xffffffffUL) != 65535) fail("ulong_sqrt", 0xffffffffUL, 0, 65535, ulong_sqrt(0xffffffffUL));
+}
+
+static void check_duty() {
+  // Everything from 0 to well past the top of the J1772 range, plus a spread
+  // over the rest of the 32 bit range.
+  for(uint64_t i = 0; i <= 0xffffffffULL; i += (i < 200000) ? 1 : 65521) {
+    uint32_t ma = (uint32_t)i;
+    if (MAToDuty(ma) != old::MAToDuty(ma)) fail("MAToDuty", ma, 0, old::MAToDuty(ma), MAToDuty(ma));
+    if (MAtoPwm(ma) != old::MAtoPwm(ma)) fail("MAtoPwm", ma, 0, old::MAtoPwm(ma), MAtoPwm(ma));
+  }
+}
+
+static void check_pilot() {
+  // Every pair of small times...
+  for(uint32_t high = 0; high <= PILOT_SMALL_MAX; high++)
+    for(uint32_t low = 0; low <= PILOT_SMALL_MAX; low++) {
+      if (high + low == 0) continue; // The old one divides by zero.
+      if (timeToMA(high, low) != old::timeToMA(high, low))
+        fail("timeToMA", high, low, old::timeToMA(high, low), timeToMA(high, low));
+    }
+  // ...and every high time for a spread of totals up to the largest.
+  for(uint32_t total = PILOT_SMALL_MAX; total <= PILOT_TIME_MAX; total += 97)
+    for(uint32_t high = 0; high <= total; high++) {
+      uint32_t low = total - high;
+      if (timeToMA(high, low) != old::timeToMA(high, low))
+        fail("timeToMA", high, low, old::timeToMA(high, low), timeToMA(high, low));
+    }
+}
+
+static void check_format() {
+  char expected[8];
+  for(uint32_t ma = 0; ma <= FORMAT_MAX; ma++) {
+    strcpy(expected, old::formatMilliamps(ma));
+    const char *got = formatMilliamps(ma);
+    if (strcmp(expected, got) != 0 && failures++ < 20)
+      printf("MISMATCH formatMilliamps(%lu): expected \"%s\", got \"%s\"\n", (unsigned long)ma, expected, got);
+  }
+  for(uint32_t ma = FORMAT_MAX + 1; ma < 200000; ma++)
+    if (strcmp(formatMilliamps(ma), "99.9A") != 0 && failures++ < 20)
+      printf("MISMATCH formatMilliamps(%lu): expected \"99.9A\", got \"%s\"\n", (unsigned long)ma, formatMilliamps(ma));
+}
+
+static inline uint64_t ticks() {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+// Keeps the compiler from throwing away the work being timed.
+static volatile unsigned long sink;
+
+#define BENCH(name, range, expr) do { \
+    uint64_t best = ~0ULL; \
+    for(int pass = 0; pass < 5; pass++) { \
+      uint64_t start = ticks(); \
+      for(uint32_t x = 0; x < (range); x++) sink = (expr); \
+      uint64_t t = ticks() - start; \
+      if (t < best) best = t; \
+    } \
+    per[n++] = (double)best / (range); \
+    printf("  %-34s %10.1f\n", name, per[n - 1]); \
+  } while(0)
+
+static void bench() {
+  double per[2];
+  int n;
+#if defined(__x86_64__) || defined(__i386__)
+  printf("per call, in host CPU cycles:\n");
+#else
+  printf("per call, in nanoseconds:\n");
+#endif
+
+  // The firmware's square root inputs are spread over 0 to 512 squared.
+  n = 0;
+  BENCH("ulong_sqrt (old)", 4096, old::ulong_sqrt(x * 64));
+  BENCH("ulong_sqrt", 4096, ulong_sqrt(x * 64));
+  printf("  %-34s %10.1fx\n", "", per[0] / per[1]);
+
+  n = 0;
+  BENCH("MAtoPwm (old)", 90000, old::MAtoPwm(x));
+  BENCH("MAtoPwm", 90000, MAtoPwm(x));
+  printf("  %-34s %10.1fx\n", "", per[0] / per[1]);
+
+  n = 0;
+  BENCH("timeToMA (old)", 1000000, old::timeToMA(x % 1000, 1000 - (x % 1000)));
+  BENCH("timeToMA", 1000000, timeToMA(x % 1000, 1000 - (x % 1000)));
+  printf("  %-34s %10.1fx\n", "", per[0] / per[1]);
+
+  n = 0;
+  BENCH("formatMilliamps (old)", 100000, (unsigned long)old::formatMilliamps(x % FORMAT_MAX)[1]);
+  BENCH("formatMilliamps", 100000, (unsigned long)formatMilliamps(x % FORMAT_MAX)[1]);
+  printf("  %-34s %10.1fx\n", "", per[0] / per[1]);
+}
+
+static void usage() {
+  fprintf(stderr, "Usage: bench_fixedpoint [-x]\n");
+  fprintf(stderr, "  -x  check ulong_sqrt() against every 32 bit input (slow)\n");
+  exit(1);
+}
+
+int main(int argc, char **argv) {
+  bool exhaustive = false;
+  int c;
+  while((c = getopt(argc, argv, "x")) != -1) {
+    switch(c) {
+      case 'x': exhaustive = true; break;
+      default: usage();
+    }
+  }
+
+  check_sqrt(exhaustive);
+  check_duty();
+  check_pilot();
+  check_format();
+  if (failures != 0) {
+    printf("%lu mismatches\n", failures);
+    return 1;
+  }
+  printf("all results match\n");
+  bench();
+  return 0;
+}
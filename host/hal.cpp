@@ -0,0 +1,1277 @@
+/*
+
+ Board model for the J1772 Hydra host build
+ Copyright 2026 Nicholas W. Sayer
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program; if not, write to the Free Software Foundation, Inc.,
+ 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <Arduino.h>
+#include <avr/sleep.h>
+#include <avr/wdt.h>
+#include <EEPROM.h>
+#include <PWM.h>
+#include <TwiLCD.h>
+#include <TimeLib.h>
+
+#include "hal.h"
+
+HalBoard hal_board;
+HalStats hal_stats;
+
+char hal_lcd[HAL_LCD_ROWS][HAL_LCD_COLS + 1];
+uint8_t hal_lcd_rows = 2, hal_lcd_cols = 16;
+uint8_t hal_lcd_backlight;
+
+// ---------- registers ----------
+volatile uint8_t MCUSR;
+volatile uint8_t SREG;
+volatile uint8_t ADMUX;
+volatile uint8_t ADCSRA;
+volatile uint8_t ADCSRB;
+volatile uint16_t ADC;
+volatile uint8_t TIFR1;
+volatile uint8_t TCCR1B, TCCR4B;
+volatile uint8_t PCICR, PCIFR;
+volatile uint8_t PCMSK0, PCMSK1, PCMSK2;
+volatile uint16_t TCNT1, TCNT4;
+#ifdef __AVR_ATmega2560__
+HalIoReg PINA(0, HalIoReg::PIN), DDRA(0, HalIoReg::DDR), PORTA(0, HalIoReg::PORT);
+HalIoReg PINB(1, HalIoReg::PIN), DDRB(1, HalIoReg::DDR), PORTB(1, HalIoReg::PORT);
+HalIoReg PINC(2, HalIoReg::PIN), DDRC(2, HalIoReg::DDR), PORTC(2, HalIoReg::PORT);
+HalIoReg PIND(3, HalIoReg::PIN), DDRD(3, HalIoReg::DDR), PORTD(3, HalIoReg::PORT);
+HalIoReg PINE(4, HalIoReg::PIN), DDRE(4, HalIoReg::DDR), PORTE(4, HalIoReg::PORT);
+HalIoReg PINF(5, HalIoReg::PIN), DDRF(5, HalIoReg::DDR), PORTF(5, HalIoReg::PORT);
+HalIoReg PING(6, HalIoReg::PIN), DDRG(6, HalIoReg::DDR), PORTG(6, HalIoReg::PORT);
+HalIoReg PINH(7, HalIoReg::PIN), DDRH(7, HalIoReg::DDR), PORTH(7, HalIoReg::PORT);
+HalIoReg PINJ(8, HalIoReg::PIN), DDRJ(8, HalIoReg::DDR), PORTJ(8, HalIoReg::PORT);
+HalIoReg PINK(9, HalIoReg::PIN), DDRK(9, HalIoReg::DDR), PORTK(9, HalIoReg::PORT);
+HalIoReg PINL(10, HalIoReg::PIN), DDRL(10, HalIoReg::DDR), PORTL(10, HalIoReg::PORT);
+#else
+HalIoReg PINB(0, HalIoReg::PIN), DDRB(0, HalIoReg::DDR), PORTB(0, HalIoReg::PORT);
+HalIoReg PINC(1, HalIoReg::PIN), DDRC(1, HalIoReg::DDR), PORTC(1, HalIoReg::PORT);
+HalIoReg PIND(2, HalIoReg::PIN), DDRD(2, HalIoReg::DDR), PORTD(2, HalIoReg::PORT);
+#endif
+
+// The interrupt vectors a sketch or library might provide.
+extern "C" void ADC_vect(void) __attribute__((weak));
+
+// ---------- private state ----------
+static hal_time_t clock_ns;
+static hal_time_t clock_skip; // how far millis() has been moved on by hal_skip()
+static hal_time_t deadline;
+
+// The direction and output (or pull-up) latches of the ports: B, C and D on the ATmega328P,
+// and A to L (less I) on the Mega.
+#ifdef __AVR_ATmega2560__
+#define HAL_PORTS 11
+#else
+#define HAL_PORTS 3
+#endif
+static uint8_t ddr_reg[HAL_PORTS], port_reg[HAL_PORTS];
+static bool pwm_on[NUM_DIGITAL_PINS];
+static uint8_t pwm_val[NUM_DIGITAL_PINS];
+static uint32_t pwm_hz[NUM_DIGITAL_PINS];
+// Timer1 drives pins 9 and 10 (11 and 12 on the Mega), and its BOTTOM and TOP can start
+// A/d conversions. Every timer is modeled as starting its period at the same instant.
+static uint32_t timer1_hz;
+
+static void (*ext_isr[2])(void);
+static int ext_mode[2];
+static bool ext_pending[2];
+
+static bool adc_busy;
+static uint8_t adc_channel;
+static hal_time_t adc_done_at;
+static hal_time_t adc_start_at;
+
+static hal_time_t gfi_until;
+static hal_time_t gfi_open_timer; // when the GFI tripped with a relay closed, until they're all open
+
+static hal_time_t inlet_edge_at; // 0 if the incoming pilot isn't oscillating, or nobody's listening
+
+static hal_time_t wdt_timeout;
+static hal_time_t wdt_last;
+static unsigned int wdr_streak;
+static bool sleep_enabled;
+
+static hal_world_fn world;
+static hal_time_t world_next;
+
+static FILE *serial_out;
+static FILE *serial_capture;
+static bool serial_line_start = true;
+static hal_time_t uart_shifting_until; // when the byte in the shift register is all out
+static bool uart_full;                 // a byte is waiting in UDR0 for the shift register
+static uint8_t uart_waiting;
+
+static bool eeprom_ready;
+static uint8_t eeprom[E2END + 1];
+
+static uint8_t rtc_reg[64];
+static uint8_t rtc_pointer;
+static bool rtc_halted;
+static time_t rtc_time_at_set;
+static hal_time_t rtc_set_at;
+
+static uint32_t noise_seed = 1;
+
+static void twi_finish();
+static void uart_step();
+static void twi_reset();
+static void mcp_reset();
+static void mcp_sample();
+static int mcp_int_level();
+extern "C" void TWI_vect(void) __attribute__((weak));
+extern "C" void USART_UDRE_vect(void) __attribute__((weak));
+extern "C" void PCINT0_vect(void) __attribute__((weak));
+extern "C" void PCINT1_vect(void) __attribute__((weak));
+extern "C" void PCINT2_vect(void) __attribute__((weak));
+static uint8_t twcr;
+static bool twi_busy;
+static hal_time_t twi_done_at;
+
+// A small, repeatable amount of noise: -1, 0 or +1 counts.
+static int noise() {
+  noise_seed = noise_seed * 1103515245 + 12345;
+  return (int)((noise_seed >> 16) % 3) - 1;
+}
+
+static inline bool interrupts_enabled() {
+  return (SREG & _BV(SREG_I)) != 0;
+}
+
+// Run an interrupt handler the way the hardware would: with interrupts off.
+static void run_isr(void (*isr)(void)) {
+  uint8_t saved = SREG;
+  SREG &= ~_BV(SREG_I);
+  hal_stats.interrupts++;
+  clock_ns += HAL_ISR_NS;
+  isr();
+  SREG = saved;
+}
+
+// ---------- the outside world ----------
+
+#ifdef __AVR_ATmega2560__
+// The Arduino pin on each bit of each port of the Mega, A to L, from its schematic, or -1
+// for the ones that aren't brought out.
+static const int8_t mega_port_pins[HAL_PORTS][8] = {
+  { 22, 23, 24, 25, 26, 27, 28, 29 }, // A
+  { 53, 52, 51, 50, 10, 11, 12, 13 }, // B
+  { 37, 36, 35, 34, 33, 32, 31, 30 }, // C
+  { 21, 20, 19, 18, -1, -1, -1, 38 }, // D
+  { 0, 1, -1, 5, 2, 3, -1, -1 },      // E
+  { 54, 55, 56, 57, 58, 59, 60, 61 }, // F (A0-A7)
+  { 41, 40, 39, -1, -1, 4, -1, -1 },  // G
+  { 17, 16, -1, 6, 7, 8, 9, -1 },     // H
+  { 15, 14, -1, -1, -1, -1, -1, -1 }, // J
+  { 62, 63, 64, 65, 66, 67, 68, 69 }, // K (A8-A15)
+  { 49, 48, 47, 46, 45, 44, 43, 42 }, // L
+};
+#endif
+
+// Which port (0 for B, 1 for C, 2 for D, or on a Mega 0 for A up to 10 for L) a digital
+// pin is on, and its bit there, or -1 for the pins that are only analog inputs.
+static int pin_port(uint8_t pin, uint8_t *bit) {
+  *bit = 0;
+#ifdef __AVR_ATmega2560__
+  for(int port = 0; port < HAL_PORTS; port++)
+    for(uint8_t b = 0; b < 8; b++)
+      if (mega_port_pins[port][b] == pin) {
+        *bit = b;
+        return port;
+      }
+#else
+  if (pin < 8) { *bit = pin; return 2; }
+  if (pin < 14) { *bit = pin - 8; return 0; }
+  if (pin < 20) { *bit = pin - 14; return 1; }
+#endif
+  return -1;
+}
+
+static bool pin_is_output(uint8_t pin) {
+  uint8_t bit;
+  int port = pin_port(pin, &bit);
+  return port >= 0 && (ddr_reg[port] & _BV(bit));
+}
+
+// The output latch, which for an input turns the pull-up on.
+static int pin_latch(uint8_t pin) {
+  uint8_t bit;
+  int port = pin_port(pin, &bit);
+  return (port >= 0 && (port_reg[port] & _BV(bit))) ? HIGH : LOW;
+}
+
+// The instantaneous level of a pin we drive, taking PWM into account. The PWM
+// library runs its timers in phase and frequency correct mode, which centres
+// the high part of each cycle on the timer's BOTTOM, at the start of the period.
+static int output_level(int pin, hal_time_t t) {
+  if (!pwm_on[pin]) return pin_latch(pin);
+  if (pwm_val[pin] == 0) return LOW;
+  if (pwm_val[pin] == 255 || pwm_hz[pin] == 0) return HIGH;
+  hal_time_t period = HAL_SEC / pwm_hz[pin];
+  hal_time_t half_high = (period * pwm_val[pin]) / 255 / 2;
+  hal_time_t phase = t % period;
+  return (phase < half_high || phase >= period - half_high) ? HIGH : LOW;
+}
+
+// The first time after t that Timer1 gets to TOP (mid-period) or BOTTOM.
+static hal_time_t timer1_next(hal_time_t t, bool top) {
+  hal_time_t period = HAL_SEC / timer1_hz;
+  hal_time_t offset = top ? period / 2 : 0;
+  hal_time_t base = t - (t % period) + offset;
+  while(base <= t) base += period;
+  return base;
+}
+
+static int car_index_by_pin(int pin, int8_t HalCar::*which) {
+  for(int i = 0; i < hal_board.cars; i++)
+    if (hal_board.car[i].*which == pin) return i;
+  return -1;
+}
+
+bool hal_relay_closed(int car) {
+  int pin = hal_board.car[car].relay_pin;
+  return pin >= 0 && pin_is_output(pin) && pin_latch(pin) == HIGH;
+}
+
+int hal_pilot_duty(int car) {
+  int pin = hal_board.car[car].pilot_pin;
+  if (!pwm_on[pin] || pwm_val[pin] == 255) return (pwm_on[pin] || pin_latch(pin) == HIGH) ? -1 : -2;
+  if (pwm_val[pin] == 0) return -2;
+  return (pwm_val[pin] * 1000 + 127) / 255;
+}
+
+// The pilot voltage, in millivolts, with the car's load on it.
+static long pilot_mv(const HalCar &car, hal_time_t t) {
+  long loaded;
+  switch(car.state) {
+    case 'B': loaded = 9000; break;
+    case 'C': loaded = 6000; break;
+    case 'D': loaded = 3000; break;
+    default: loaded = 12000; break;
+  }
+  if (output_level(car.pilot_pin, t) == HIGH) return loaded;
+  // On the negative half, the diode takes the car out of the picture - unless it's shorted.
+  return car.diode ? -12000 : -loaded;
+}
+
+// The pilot sense divider puts 0 volts at 556 counts and 12 volts at 898.
+static uint16_t pilot_counts(const HalCar &car, hal_time_t t) {
+  long counts = 556 + car.sense_offset + (pilot_mv(car, t) * 285) / 10000 + noise();
+  if (counts < 0) counts = 0;
+  if (counts > 1023) counts = 1023;
+  return counts;
+}
+
+// The CT output rides on a 2.5 volt bias.
+static uint16_t ct_counts(int index, hal_time_t t) {
+  const HalCar &car = hal_board.car[index];
+  long counts = 512 + car.ct_bias + noise();
+  if (hal_relay_closed(index) && (car.state == 'C' || car.state == 'D')) {
+    double phase = 2 * M_PI * hal_board.mains_hz * (t / (double)HAL_SEC);
+    double peak = car.draw_ma * M_SQRT2 / hal_board.ct_ma_per_count;
+    counts += lround(peak * sin(phase));
+  }
+  if (counts < 0) counts = 0;
+  if (counts > 1023) counts = 1023;
+  return counts;
+}
+
+static uint16_t analog_value(uint8_t channel, hal_time_t t) {
+  for(int i = 0; i < hal_board.cars; i++) {
+    if (hal_board.car[i].sense_channel == channel) return pilot_counts(hal_board.car[i], t);
+    if (hal_board.car[i].ct_channel == channel) return ct_counts(i, t);
+  }
+  return 0;
+}
+
+// How long the incoming pilot is high in each 1 ms period.
+static hal_time_t inlet_high_ns() {
+  // The J1772 duty cycle is amps / 0.6 up to 51 A, and then amps / 2.5 + 64.
+  unsigned long duty = (hal_board.inlet_ma <= 51000) ? hal_board.inlet_ma / 60 : hal_board.inlet_ma / 250 + 640;
+  return (HAL_MS * duty) / 1000;
+}
+
+// The first edge of the incoming pilot after t, or 0 if there won't be one.
+static hal_time_t next_inlet_edge(hal_time_t t) {
+  if (!hal_board.inlet_connected || hal_board.inlet_ma == 0) return 0;
+  hal_time_t high = inlet_high_ns();
+  if (high == 0 || high >= HAL_MS) return 0;
+  hal_time_t phase = t % HAL_MS;
+  return t - phase + (phase < high ? high : HAL_MS);
+}
+
+static int input_level(uint8_t pin) {
+  hal_time_t t = clock_ns;
+  if (pin == hal_board.button_int_pin) return mcp_int_level();
+  if (pin == hal_board.gfi_pin) return t < gfi_until ? HIGH : LOW;
+  if (pin == hal_board.inlet_proximity_pin) return hal_board.inlet_connected ? HIGH : LOW;
+  if (pin == hal_board.inlet_pilot_pin) {
+    if (!hal_board.inlet_connected) return LOW;
+    if (hal_board.inlet_ma == 0) return HIGH;
+    return (t % HAL_MS) < inlet_high_ns() ? HIGH : LOW;
+  }
+  int car = car_index_by_pin(pin, &HalCar::relay_test_pin);
+  if (car >= 0) return (hal_relay_closed(car) || hal_board.car[car].relay_welded) ? HIGH : LOW;
+  return pin_latch(pin);
+}
+
+static void external_edge(int irq, int rising) {
+  if (irq < 0 || irq > 1 || ext_isr[irq] == NULL) return;
+  if (ext_mode[irq] == CHANGE || (ext_mode[irq] == RISING) == (rising != 0))
+    ext_pending[irq] = true;
+}
+
+// Any change on a pin sets its pin change flag, if it's masked in.
+static void pin_change(int8_t pin) {
+  if (pin < 0) return;
+  volatile uint8_t *mask = digitalPinToPCMSK(pin);
+  if (mask != NULL && (*mask & _BV(digitalPinToPCMSKbit(pin)))) PCIFR |= _BV(digitalPinToPCICRbit(pin));
+}
+
+static void gfi_trip(hal_time_t duration) {
+  bool was_high = clock_ns < gfi_until;
+  if (clock_ns + duration > gfi_until) gfi_until = clock_ns + duration;
+  // The GFI is on INT0 or INT1, depending on the pin.
+  if (!was_high) external_edge(hal_board.gfi_pin - 2, HIGH);
+}
+
+static bool any_relay_closed() {
+  for(int i = 0; i < hal_board.cars; i++)
+    if (hal_relay_closed(i)) return true;
+  return false;
+}
+
+void hal_gfi_fault(hal_time_t duration) {
+  if (clock_ns >= gfi_until && any_relay_closed()) gfi_open_timer = clock_ns;
+  gfi_trip(duration);
+}
+
+// Everything that changes an output latch comes through here.
+static void write_port(int port, uint8_t value) {
+  uint8_t rose = value & ~port_reg[port];
+  port_reg[port] = value;
+  uint8_t bit;
+  if (hal_board.gfi_test_pin >= 0 && pin_port(hal_board.gfi_test_pin, &bit) == port && (rose & _BV(bit)))
+    gfi_trip(HAL_GFI_HOLD_NS);
+  if (gfi_open_timer != 0 && !any_relay_closed()) {
+    hal_time_t latency = clock_ns - gfi_open_timer;
+    if (latency > hal_stats.gfi_open_worst) hal_stats.gfi_open_worst = latency;
+    hal_stats.gfi_opens++;
+    gfi_open_timer = 0;
+  }
+}
+
+HalIoReg::operator uint8_t() const {
+  hal_advance(HAL_PORT_IO_NS);
+  switch(kind) {
+    case DDR: return ddr_reg[port];
+    case PORT: return port_reg[port];
+    default: break;
+  }
+  uint8_t value = 0;
+  for(uint8_t pin = 0; pin < NUM_DIGITAL_PINS; pin++) {
+    uint8_t bit;
+    if (pin_port(pin, &bit) != port) continue;
+    int level = pin_is_output(pin) ? output_level(pin, clock_ns) : input_level(pin);
+    if (level == HIGH) value |= _BV(bit);
+  }
+  return value;
+}
+
+HalIoReg &HalIoReg::operator=(uint8_t value) {
+  hal_advance(HAL_PORT_IO_NS);
+  switch(kind) {
+    case DDR: ddr_reg[port] = value; break;
+    case PORT: write_port(port, value); break;
+    default: break; // toggling outputs through PINx isn't modeled
+  }
+  return *this;
+}
+
+HalIoReg &HalIoReg::operator|=(uint8_t bits) {
+  hal_advance(HAL_PORT_IO_NS);
+  switch(kind) {
+    case DDR: ddr_reg[port] |= bits; break;
+    case PORT: write_port(port, port_reg[port] | bits); break;
+    default: break;
+  }
+  return *this;
+}
+
+HalIoReg &HalIoReg::operator&=(uint8_t bits) {
+  hal_advance(HAL_PORT_IO_NS);
+  switch(kind) {
+    case DDR: ddr_reg[port] &= bits; break;
+    case PORT: write_port(port, port_reg[port] & bits); break;
+    default: break;
+  }
+  return *this;
+}
+
+// ---------- the clock ----------
+
+static void adc_step() {
+  // An auto triggered conversion hasn't really started until its trigger, and until
+  // then the firmware may change the trigger (or the channel), late as its interrupt
+  // handler may be. Look at it afresh.
+  if (adc_busy && clock_ns < adc_start_at) adc_busy = false;
+  if (adc_busy && clock_ns >= adc_done_at) {
+    adc_busy = false;
+    ADC = analog_value(adc_channel, adc_start_at + HAL_ADC_SAMPLE_NS);
+    ADCSRA &= ~_BV(ADSC);
+    ADCSRA |= _BV(ADIF);
+    hal_stats.adc_conversions++;
+  }
+  if ((ADCSRA & _BV(ADIF)) && (ADCSRA & _BV(ADIE)) && interrupts_enabled() && ADC_vect) {
+    ADCSRA &= ~_BV(ADIF);
+    run_isr(ADC_vect);
+  }
+  if (!adc_busy && (ADCSRA & _BV(ADEN)) && (ADCSRA & _BV(ADSC))) {
+    adc_busy = true;
+    adc_channel = ADMUX & 0x07;
+    adc_start_at = clock_ns;
+    adc_done_at = clock_ns + HAL_ADC_CONVERSION_NS;
+  } else if (!adc_busy && (ADCSRA & _BV(ADEN)) && (ADCSRA & _BV(ADATE)) && (ADCSRB & 0x06) == 0x06) {
+    // Auto triggered by Timer1's capture flag (which is set at TOP) or its overflow (at BOTTOM).
+    adc_busy = true;
+    adc_channel = ADMUX & 0x07;
+    adc_start_at = timer1_next(clock_ns, ADCSRB & 0x01);
+    adc_done_at = adc_start_at + HAL_ADC_CONVERSION_NS;
+  }
+}
+
+static void deliver_interrupts() {
+  if (!interrupts_enabled()) return;
+  for(int i = 0; i < 2; i++) {
+    if (ext_pending[i]) {
+      ext_pending[i] = false;
+      run_isr(ext_isr[i]);
+    }
+  }
+  void (*const pcint_isr[3])(void) = { PCINT0_vect, PCINT1_vect, PCINT2_vect };
+  for(int i = 0; i < 3; i++) {
+    if ((PCIFR & PCICR & _BV(i)) && pcint_isr[i] != NULL) {
+      PCIFR &= ~_BV(i);
+      run_isr(pcint_isr[i]);
+    }
+  }
+  adc_step();
+  twi_finish();
+  uart_step();
+}
+
+void hal_advance(hal_time_t ns) {
+  wdr_streak = 0;
+  hal_time_t target = clock_ns + ns;
+  while(true) {
+    deliver_interrupts();
+    hal_time_t next = target;
+    if (adc_busy && adc_done_at < next) next = adc_done_at;
+    if (twi_busy && twi_done_at < next) next = twi_done_at;
+    if (uart_full && uart_shifting_until < next) next = uart_shifting_until;
+    if (deadline != 0 && deadline < next) next = deadline;
+    if (world != NULL && world_next < next) next = world_next;
+    if (inlet_edge_at != 0 && inlet_edge_at < next) next = inlet_edge_at;
+    if (next > clock_ns) clock_ns = next;
+    adc_step();
+    twi_finish();
+    uart_step();
+    if (inlet_edge_at != 0 && clock_ns >= inlet_edge_at) {
+      // The incoming pilot is on INT0 or INT1, depending on the pin.
+      external_edge(hal_board.inlet_pilot_pin - 2, inlet_edge_at % HAL_MS == 0);
+      inlet_edge_at = next_inlet_edge(inlet_edge_at);
+    }
+    if (world != NULL && clock_ns >= world_next) {
+      world_next = world(clock_ns);
+      // The world may have pushed or let go of a button.
+      mcp_sample();
+    }
+    if (wdt_timeout != 0 && clock_ns - wdt_last > wdt_timeout) {
+      HalStop stop = { "watchdog" };
+      throw stop;
+    }
+    if (deadline != 0 && clock_ns >= deadline) {
+      HalStop stop = { "time" };
+      throw stop;
+    }
+    if (clock_ns >= target) break;
+  }
+}
+
+hal_time_t hal_now() {
+  return clock_ns;
+}
+
+void hal_set_deadline(hal_time_t when) {
+  deadline = when;
+}
+
+void hal_set_world(hal_world_fn fn, hal_time_t first) {
+  world = fn;
+  world_next = first;
+}
+
+void hal_init() {
+  clock_ns = 0;
+  clock_skip = 0;
+  deadline = 0;
+  memset(ddr_reg, 0, sizeof(ddr_reg));
+  memset(port_reg, 0, sizeof(port_reg));
+  memset(pwm_on, 0, sizeof(pwm_on));
+  memset(ext_isr, 0, sizeof(ext_isr));
+  memset(ext_pending, 0, sizeof(ext_pending));
+  adc_busy = false;
+  ADCSRA = ADCSRB = ADMUX = TIFR1 = 0;
+  PCICR = PCIFR = PCMSK0 = PCMSK1 = PCMSK2 = 0;
+  TCCR1B = TCCR4B = 0;
+  TCNT1 = TCNT4 = 0;
+  timer1_hz = 500; // what InitTimersSafe() leaves it at
+  gfi_until = 0;
+  gfi_open_timer = 0;
+  inlet_edge_at = 0;
+  wdt_timeout = 0;
+  wdr_streak = 0;
+  sleep_enabled = false;
+  world = NULL;
+  UBRR0 = 0;
+  UCSR0A = _BV(UDRE0);
+  UCSR0B = UCSR0C = 0;
+  uart_full = false;
+  uart_shifting_until = 0;
+  memset(&hal_stats, 0, sizeof(hal_stats));
+  if (hal_board.lcd_cols == 0) hal_board.lcd_cols = 16;
+  if (hal_board.lcd_rows == 0) hal_board.lcd_rows = 2;
+  hal_lcd_cols = hal_board.lcd_cols > HAL_LCD_COLS ? HAL_LCD_COLS : hal_board.lcd_cols;
+  hal_lcd_rows = hal_board.lcd_rows > HAL_LCD_ROWS ? HAL_LCD_ROWS : hal_board.lcd_rows;
+  twi_reset();
+  mcp_reset();
+  if (hal_board.mains_hz == 0) hal_board.mains_hz = 60;
+  if (hal_board.ct_ma_per_count == 0) hal_board.ct_ma_per_count = 106;
+  // The Arduino core turns interrupts on before setup().
+  sei();
+}
+
+// ---------- watchdog ----------
+
+void wdt_enable(unsigned char timeout) {
+  wdt_timeout = (15ULL * HAL_MS) << timeout;
+  if (timeout == WDTO_1S) wdt_timeout = HAL_SEC; // the rest are close enough
+  wdt_last = clock_ns;
+}
+
+void wdt_disable(void) {
+  wdt_timeout = 0;
+}
+
+void wdt_reset(void) {
+  unsigned int streak = wdr_streak;
+  hal_advance(HAL_WDR_NS);
+  wdt_last = clock_ns;
+  // Nothing else is going to happen on the board, so there's no sense waiting for the
+  // deadline. That is, once whatever's still going out over i2c or the serial port has gone.
+  wdr_streak = (twi_busy || (UCSR0B & _BV(UDRIE0))) ? 0 : streak + 1;
+  if (wdr_streak >= HAL_WDR_HALT) {
+    HalStop stop = { "halted" };
+    throw stop;
+  }
+}
+
+// ---------- sleep ----------
+
+// Only idle mode is modelled. Everything that could wake the chip keeps running.
+void set_sleep_mode(unsigned char mode) {
+}
+
+void sleep_enable(void) {
+  sleep_enabled = true;
+}
+
+void sleep_disable(void) {
+  sleep_enabled = false;
+}
+
+void sleep_cpu(void) {
+  if (!sleep_enabled) return;
+  if (!interrupts_enabled()) {
+    // Nothing will ever wake it up.
+    HalStop stop = { "halted" };
+    throw stop;
+  }
+  // Timer0 ticks over every millisecond. The ADC, the external interrupts or
+  // anything the world does may come sooner than that.
+  hal_time_t wake = (clock_ns / HAL_MS + 1) * HAL_MS;
+  if (adc_busy && adc_done_at < wake) wake = adc_done_at;
+  if (twi_busy && twi_done_at < wake) wake = twi_done_at;
+  if (uart_full && uart_shifting_until < wake) wake = uart_shifting_until;
+  if (inlet_edge_at != 0 && inlet_edge_at < wake) wake = inlet_edge_at;
+  if (world != NULL && world_next < wake) wake = world_next;
+  hal_time_t start = clock_ns;
+  if (wake > clock_ns) hal_advance(wake - clock_ns);
+  hal_stats.asleep += clock_ns - start;
+}
+
+// ---------- Arduino core ----------
+
+void pinMode(uint8_t pin, uint8_t mode) {
+  uint8_t bit;
+  int port = pin_port(pin, &bit);
+  if (port >= 0) {
+    if (mode == OUTPUT) {
+      ddr_reg[port] |= _BV(bit);
+    } else {
+      ddr_reg[port] &= ~_BV(bit);
+      write_port(port, mode == INPUT_PULLUP ? (port_reg[port] | _BV(bit)) : (port_reg[port] & ~_BV(bit)));
+    }
+  }
+  hal_advance(HAL_DIGITAL_IO_NS);
+}
+
+void digitalWrite(uint8_t pin, uint8_t val) {
+  // The table lookups come first, and the port is written at the end.
+  hal_advance(HAL_DIGITAL_IO_NS);
+  uint8_t bit;
+  int port = pin_port(pin, &bit);
+  if (port >= 0) {
+    // Just like the real thing, this takes the pin away from the PWM timer.
+    pwm_on[pin] = false;
+    write_port(port, val ? (port_reg[port] | _BV(bit)) : (port_reg[port] & ~_BV(bit)));
+  }
+}
+
+int digitalRead(uint8_t pin) {
+  hal_advance(HAL_DIGITAL_IO_NS);
+  if (pin >= NUM_DIGITAL_PINS) return LOW;
+  if (pin_is_output(pin)) return output_level(pin, clock_ns);
+  return input_level(pin);
+}
+
+int analogRead(uint8_t pin) {
+  if (pin >= A0) pin -= A0;
+  hal_advance(HAL_ANALOG_READ_NS);
+  return analog_value(pin, clock_ns);
+}
+
+void hal_skip(hal_time_t ns) {
+  clock_skip += ns;
+}
+
+unsigned long millis(void) {
+  hal_advance(HAL_MILLIS_NS);
+  return (unsigned long)((clock_ns + clock_skip) / HAL_MS);
+}
+
+unsigned long micros(void) {
+  hal_advance(HAL_MILLIS_NS);
+  return (unsigned long)((clock_ns + clock_skip) / HAL_US);
+}
+
+void delay(unsigned long ms) {
+  hal_advance(ms * HAL_MS);
+}
+
+void delayMicroseconds(unsigned int us) {
+  hal_advance(us * HAL_US);
+}
+
+void attachInterrupt(uint8_t irq, void (*isr)(void), int mode) {
+  if (irq > 1) return;
+  ext_isr[irq] = isr;
+  ext_mode[irq] = mode;
+  ext_pending[irq] = false;
+  if (irq == hal_board.inlet_pilot_pin - 2) inlet_edge_at = next_inlet_edge(clock_ns);
+}
+
+void detachInterrupt(uint8_t irq) {
+  if (irq > 1) return;
+  ext_isr[irq] = NULL;
+  if (irq == hal_board.inlet_pilot_pin - 2) inlet_edge_at = 0;
+}
+
+size_t Print::print(long n, int base) {
+  if (n < 0 && base == DEC) return print('-') + print((unsigned long)-n, base);
+  return print((unsigned long)n, base);
+}
+
+size_t Print::print(unsigned long n, int base) {
+  char buf[8 * sizeof(long) + 1];
+  char *str = &buf[sizeof(buf) - 1];
+  *str = 0;
+  if (base < 2) base = 10;
+  do {
+    char c = n % base;
+    n /= base;
+    *--str = c < 10 ? c + '0' : c + 'A' - 10;
+  } while(n);
+  return write(str);
+}
+
+// ---------- the UART ----------
+
+volatile uint16_t UBRR0;
+volatile uint8_t UCSR0A, UCSR0B, UCSR0C;
+HalUartData UDR0;
+
+void hal_serial_output(FILE *f) {
+  serial_out = f;
+}
+
+void hal_serial_capture(FILE *f) {
+  serial_capture = f;
+}
+
+// A start bit, eight data bits and a stop bit.
+static hal_time_t uart_char_ns() {
+  unsigned long clocks = (UBRR0 + 1UL) * ((UCSR0A & _BV(U2X0)) ? 8 : 16) * 10;
+  return (clocks * 1000000000ULL) / F_CPU;
+}
+
+// Once a byte is in the shift register, it's as good as sent.
+static void uart_shift(uint8_t c, hal_time_t at) {
+  uart_shifting_until = at + uart_char_ns();
+  hal_stats.serial_bytes++;
+  if (serial_capture != NULL) fputc(c, serial_capture);
+  if (serial_out != NULL && c != '\r') {
+    if (serial_line_start) {
+      fprintf(serial_out, "[%10.3f] ", at / (double)HAL_SEC);
+      serial_line_start = false;
+    }
+    fputc(c, serial_out);
+    if (c == '\n') serial_line_start = true;
+  }
+}
+
+// Move the waiting byte on if the shift register is done, and interrupt for the next one.
+static void uart_step() {
+  if (uart_full && clock_ns >= uart_shifting_until) {
+    uart_full = false;
+    uart_shift(uart_waiting, uart_shifting_until);
+  }
+  if (uart_full) UCSR0A &= ~_BV(UDRE0); else UCSR0A |= _BV(UDRE0);
+  if (!uart_full && (UCSR0B & _BV(UDRIE0)) && interrupts_enabled() && USART_UDRE_vect) run_isr(USART_UDRE_vect);
+}
+
+HalUartData::operator uint8_t() const {
+  hal_advance(HAL_PORT_IO_NS);
+  return 0;
+}
+
+HalUartData &HalUartData::operator=(uint8_t value) {
+  hal_advance(HAL_PORT_IO_NS);
+  // Writing it while it's full loses the byte, the same as on the chip.
+  if (!(UCSR0B & _BV(TXEN0)) || uart_full) return *this;
+  if (clock_ns >= uart_shifting_until) {
+    uart_shift(value, clock_ns);
+  } else {
+    uart_full = true;
+    uart_waiting = value;
+    UCSR0A &= ~_BV(UDRE0);
+  }
+  return *this;
+}
+
+// ---------- EEPROM ----------
+
+EEPROMClass EEPROM;
+
+// Static constructors in the sketch read the EEPROM before hal_init() gets a chance to run.
+static void eeprom_check() {
+  if (eeprom_ready) return;
+  memset(eeprom, 0xff, sizeof(eeprom));
+  eeprom_ready = true;
+}
+
+uint8_t hal_eeprom_read(int address) {
+  eeprom_check();
+  return eeprom[address & E2END];
+}
+
+void hal_eeprom_load(int address, uint8_t value) {
+  eeprom_check();
+  eeprom[address & E2END] = value;
+}
+
+void hal_eeprom_write(int address, uint8_t value) {
+  eeprom_check();
+  eeprom[address & E2END] = value;
+  hal_stats.eeprom_writes++;
+  hal_advance(HAL_EEPROM_WRITE_NS);
+}
+
+// ---------- PWM ----------
+
+void InitTimers() {}
+void InitTimersSafe() {}
+
+bool SetPinFrequency(int8_t pin, uint32_t frequency) {
+  if (pin < 0 || pin >= NUM_DIGITAL_PINS) return false;
+  pwm_hz[pin] = frequency;
+#ifdef __AVR_ATmega2560__
+  if (pin == 11 || pin == 12) timer1_hz = frequency;
+#else
+  if (pin == 9 || pin == 10) timer1_hz = frequency;
+#endif
+  return true;
+}
+
+bool SetPinFrequencySafe(int8_t pin, uint32_t frequency) {
+  return SetPinFrequency(pin, frequency);
+}
+
+void pwmWrite(uint8_t pin, uint8_t val) {
+  if (pin < NUM_DIGITAL_PINS) {
+    pwm_on[pin] = true;
+    pwm_val[pin] = val;
+  }
+  hal_advance(HAL_PWM_WRITE_NS);
+}
+
+// ---------- i2c, and the DS1307 on it ----------
+
+#define DS1307_ADDR 0x68
+
+static uint8_t dec2bcd(uint8_t num) {
+  return ((num / 10) << 4) | (num % 10);
+}
+
+static uint8_t bcd2dec(uint8_t num) {
+  return (num >> 4) * 10 + (num & 0x0f);
+}
+
+void hal_rtc_set(time_t t) {
+  rtc_time_at_set = t;
+  rtc_set_at = clock_ns;
+  rtc_halted = false;
+}
+
+// Bring the time registers up to date with the virtual clock.
+static void rtc_tick() {
+  if (rtc_halted) return;
+  tmElements_t tm;
+  breakTime(rtc_time_at_set + (time_t)((clock_ns - rtc_set_at) / HAL_SEC), tm);
+  rtc_reg[0] = dec2bcd(tm.Second);
+  rtc_reg[1] = dec2bcd(tm.Minute);
+  rtc_reg[2] = dec2bcd(tm.Hour);
+  rtc_reg[3] = dec2bcd(tm.Wday);
+  rtc_reg[4] = dec2bcd(tm.Day);
+  rtc_reg[5] = dec2bcd(tm.Month);
+  rtc_reg[6] = dec2bcd(tmYearToY2k(tm.Year));
+}
+
+static uint8_t rtc_write(const uint8_t *buf, uint8_t len) {
+  if (len == 0) return 0;
+  rtc_tick();
+  rtc_pointer = buf[0] & 0x3f;
+  bool time_written = false;
+  for(uint8_t i = 1; i < len; i++) {
+    if (rtc_pointer < 7) time_written = true;
+    rtc_reg[rtc_pointer] = buf[i];
+    rtc_pointer = (rtc_pointer + 1) & 0x3f;
+  }
+  if (time_written) {
+    rtc_halted = (rtc_reg[0] & 0x80) != 0;
+    if (!rtc_halted) {
+      tmElements_t tm;
+      tm.Second = bcd2dec(rtc_reg[0] & 0x7f);
+      tm.Minute = bcd2dec(rtc_reg[1]);
+      tm.Hour = bcd2dec(rtc_reg[2] & 0x3f);
+      tm.Wday = bcd2dec(rtc_reg[3]);
+      tm.Day = bcd2dec(rtc_reg[4]);
+      tm.Month = bcd2dec(rtc_reg[5]);
+      tm.Year = y2kYearToTm(bcd2dec(rtc_reg[6]));
+      hal_rtc_set(makeTime(tm));
+    }
+  }
+  return 0;
+}
+
+static uint8_t rtc_read(uint8_t *buf, uint8_t len) {
+  rtc_tick();
+  for(uint8_t i = 0; i < len; i++) {
+    buf[i] = rtc_reg[rtc_pointer];
+    rtc_pointer = (rtc_pointer + 1) & 0x3f;
+  }
+  return len;
+}
+
+// ---------- the MCP23017 on the LCD shield, and the HD44780 behind it ----------
+
+#define MCP23017_ADDR 0x20
+
+// The registers, by what they are. Each has an A and a B port's worth.
+enum { MCP_IODIR, MCP_IPOL, MCP_GPINTEN, MCP_DEFVAL, MCP_INTCON, MCP_IOCON,
+  MCP_GPPU, MCP_INTF, MCP_INTCAP, MCP_GPIO, MCP_OLAT, MCP_KINDS };
+#define IOCON_BANK 0x80
+#define IOCON_SEQOP 0x20
+#define IOCON_INTPOL 0x02
+
+static uint8_t mcp_reg[MCP_KINDS][2];
+static uint8_t mcp_pointer;
+// What port A's pins were when last looked at, for interrupt on change. Port B is
+// all outputs, so it never interrupts.
+static uint8_t mcp_last_pins;
+static int mcp_int_was;
+
+// Port A has the buttons on 0-4 and the red and green backlight on 6 and 7. Port B
+// has the blue backlight on 0, then D7, D6, D5 and D4 on 1-4, E on 5 and RS on 7.
+#define LCD_E 0x20
+#define LCD_RS 0x80
+
+static bool lcd_four_bit;
+static bool lcd_second_half;
+static uint8_t lcd_first_half;
+static uint8_t lcd_address;
+static uint8_t lcd_ddram[0x80];
+static const uint8_t lcd_row_address[HAL_LCD_ROWS] = { 0x00, 0x40, 0x14, 0x54 };
+
+// Every row, as wide as the display is.
+static void lcd_blank() {
+  memset(hal_lcd, 0, sizeof(hal_lcd));
+  for(int r = 0; r < HAL_LCD_ROWS; r++)
+    memset(hal_lcd[r], ' ', hal_lcd_cols);
+}
+
+static void lcd_reset() {
+  lcd_four_bit = false;
+  lcd_second_half = false;
+  lcd_address = 0;
+  memset(lcd_ddram, ' ', sizeof(lcd_ddram));
+  lcd_blank();
+}
+
+// The display RAM is two lines of 40 characters, at 0x00 and 0x40.
+static void lcd_advance() {
+  lcd_address++;
+  if (lcd_address == 0x28) lcd_address = 0x40;
+  else if (lcd_address >= 0x68) lcd_address = 0x00;
+}
+
+static void lcd_data(uint8_t c) {
+  lcd_ddram[lcd_address] = c;
+  for(int r = 0; r < hal_lcd_rows; r++) {
+    int col = (int)lcd_address - lcd_row_address[r];
+    if (col >= 0 && col < hal_lcd_cols) hal_lcd[r][col] = c;
+  }
+  lcd_advance();
+}
+
+static void lcd_command(uint8_t c) {
+  if (c & 0x80) {
+    lcd_address = c & 0x7f;
+  } else if (c & 0x40) {
+    // character generator RAM: not modelled
+  } else if (c & 0x20) {
+    lcd_four_bit = (c & 0x10) == 0;
+  } else if (c & 0x02) {
+    lcd_address = 0;
+  } else if (c & 0x01) {
+    memset(lcd_ddram, ' ', sizeof(lcd_ddram));
+    lcd_blank();
+    lcd_address = 0;
+  }
+  // display control and entry mode are taken to be what the sketch always sets them to
+}
+
+// A fall of E latches the data lines. In 8 bit mode, only the top four are wired.
+static void lcd_strobe(uint8_t port) {
+  uint8_t n = 0;
+  if (port & 0x10) n |= 0x1;
+  if (port & 0x08) n |= 0x2;
+  if (port & 0x04) n |= 0x4;
+  if (port & 0x02) n |= 0x8;
+  uint8_t c;
+  if (!lcd_four_bit) {
+    c = n << 4;
+    lcd_second_half = false;
+  } else if (!lcd_second_half) {
+    lcd_first_half = n;
+    lcd_second_half = true;
+    return;
+  } else {
+    c = (lcd_first_half << 4) | n;
+    lcd_second_half = false;
+  }
+  hal_stats.lcd_writes++;
+  if (port & LCD_RS) lcd_data(c); else lcd_command(c);
+}
+
+// What's driven onto a port's output pins.
+static uint8_t mcp_outputs(int port) {
+  return mcp_reg[MCP_OLAT][port] & ~mcp_reg[MCP_IODIR][port];
+}
+
+// The backlight is on where its line is driven low.
+static void mcp_backlight() {
+  uint8_t a = ~mcp_outputs(0) & ~mcp_reg[MCP_IODIR][0];
+  uint8_t b = ~mcp_outputs(1) & ~mcp_reg[MCP_IODIR][1];
+  hal_lcd_backlight = ((a & 0x40) ? RED : 0) | ((a & 0x80) ? GREEN : 0) | ((b & 0x01) ? BLUE : 0);
+}
+
+// A button pulls its input low. The rest of the inputs float up.
+static uint8_t mcp_pins(int port) {
+  uint8_t pins = 0xff;
+  if (port == 0) pins &= ~(hal_board.buttons & 0x1f);
+  return pins;
+}
+
+static uint8_t mcp_gpio(int port) {
+  uint8_t inputs = mcp_reg[MCP_IODIR][port];
+  return ((mcp_pins(port) & inputs) | mcp_outputs(port)) ^ (mcp_reg[MCP_IPOL][port] & inputs);
+}
+
+// INTA is driven while any of port A's interrupt flags are up: low, unless INTPOL says high.
+static int mcp_int_level() {
+  bool active = mcp_reg[MCP_INTF][0] != 0;
+  return active == ((mcp_reg[MCP_IOCON][0] & IOCON_INTPOL) != 0) ? HIGH : LOW;
+}
+
+// Look for a change on port A's enabled inputs - from the last look, or from DEFVAL
+// where INTCON says so. The first one latches INTF and the port into INTCAP, and
+// they stay that way until INTCAP or GPIO is read.
+static void mcp_sample() {
+  uint8_t pins = mcp_pins(0);
+  uint8_t enabled = mcp_reg[MCP_GPINTEN][0] & mcp_reg[MCP_IODIR][0];
+  uint8_t intcon = mcp_reg[MCP_INTCON][0];
+  uint8_t changed = (((pins ^ mcp_last_pins) & ~intcon) | ((pins ^ mcp_reg[MCP_DEFVAL][0]) & intcon)) & enabled;
+  mcp_last_pins = pins;
+  if (changed != 0 && mcp_reg[MCP_INTF][0] == 0) {
+    mcp_reg[MCP_INTF][0] = changed;
+    mcp_reg[MCP_INTCAP][0] = mcp_gpio(0);
+  }
+  int level = mcp_int_level();
+  if (level != mcp_int_was) {
+    mcp_int_was = level;
+    pin_change(hal_board.button_int_pin);
+  }
+}
+
+static void mcp_reset() {
+  memset(mcp_reg, 0, sizeof(mcp_reg));
+  mcp_reg[MCP_IODIR][0] = mcp_reg[MCP_IODIR][1] = 0xff;
+  mcp_pointer = 0;
+  mcp_last_pins = mcp_pins(0);
+  mcp_int_was = mcp_int_level();
+  mcp_backlight();
+  lcd_reset();
+}
+
+// Which register a register address is, given how IOCON has them laid out.
+static bool mcp_decode(uint8_t address, int *kind, int *port) {
+  if (mcp_reg[MCP_IOCON][0] & IOCON_BANK) {
+    *port = (address >> 4) & 1;
+    *kind = address & 0x0f;
+  } else {
+    *port = address & 1;
+    *kind = address >> 1;
+  }
+  return *kind < MCP_KINDS && address < 0x20;
+}
+
+// After each byte, the address pointer moves on to the next register, or with SEQOP
+// set, stays put (or flips between the A and B registers of a pair, without BANK).
+static void mcp_next() {
+  uint8_t iocon = mcp_reg[MCP_IOCON][0];
+  if (iocon & IOCON_SEQOP) {
+    if (!(iocon & IOCON_BANK)) mcp_pointer ^= 1;
+  } else if (iocon & IOCON_BANK) {
+    mcp_pointer++;
+    if ((mcp_pointer & 0x0f) >= MCP_KINDS) mcp_pointer = (mcp_pointer & 0x10) ^ 0x10;
+  } else {
+    mcp_pointer = (mcp_pointer + 1) % (2 * MCP_KINDS);
+  }
+}
+
+static void mcp_write_byte(uint8_t value) {
+  int kind, port;
+  if (mcp_decode(mcp_pointer, &kind, &port)) {
+    switch(kind) {
+      case MCP_IOCON:
+        mcp_reg[MCP_IOCON][0] = mcp_reg[MCP_IOCON][1] = value;
+        break;
+      case MCP_GPIO:
+      case MCP_OLAT: {
+        uint8_t before = mcp_outputs(port);
+        mcp_reg[MCP_OLAT][port] = value;
+        if (port == 1 && (before & LCD_E) && !(mcp_outputs(1) & LCD_E)) lcd_strobe(mcp_outputs(1));
+        break;
+      }
+      case MCP_INTF:
+      case MCP_INTCAP:
+        break; // read only
+      default:
+        mcp_reg[kind][port] = value;
+        break;
+    }
+    mcp_backlight();
+    mcp_sample();
+  }
+  mcp_next();
+}
+
+static uint8_t mcp_read_byte() {
+  int kind, port;
+  uint8_t value = 0;
+  if (mcp_decode(mcp_pointer, &kind, &port)) {
+    value = (kind == MCP_GPIO) ? mcp_gpio(port) : mcp_reg[kind][port];
+    if (kind == MCP_GPIO || kind == MCP_INTCAP) {
+      // Reading either clears the interrupt. Against DEFVAL, it comes straight back
+      // if the difference is still there.
+      mcp_reg[MCP_INTF][port] = 0;
+      mcp_sample();
+    }
+  }
+  mcp_next();
+  return value;
+}
+
+// ---------- the TWI ----------
+
+volatile uint8_t TWBR;
+volatile uint8_t TWSR;
+volatile uint8_t TWDR;
+HalTwiControl TWCR;
+
+// Where the bus is in a transaction.
+enum { TWI_IDLE, TWI_ADDRESS, TWI_WRITING, TWI_READING };
+
+static int twi_phase;
+static uint8_t twi_device;         // the address of the device being talked to
+static bool twi_first;             // the next byte written is the device's register address
+static uint8_t twi_status;         // what TWSR will say when it's done
+static uint8_t twi_received;
+
+static hal_time_t twi_bit_ns() {
+  static const unsigned int prescale[] = { 1, 4, 16, 64 };
+  unsigned long divisor = 16 + 2UL * TWBR * prescale[TWSR & 0x03];
+  return (divisor * 1000000000ULL) / F_CPU;
+}
+
+static bool twi_present(uint8_t device) {
+  return device == DS1307_ADDR || device == MCP23017_ADDR;
+}
+
+static void twi_step(hal_time_t bits, uint8_t status) {
+  twi_busy = true;
+  twi_done_at = clock_ns + bits * twi_bit_ns();
+  twi_status = status;
+}
+
+static void twi_reset() {
+  twcr = 0;
+  twi_phase = TWI_IDLE;
+  twi_busy = false;
+  TWBR = 0;
+  TWSR = 0xf8;
+  TWDR = 0xff;
+}
+
+// The firmware has written TWCR.
+static void twi_control(uint8_t value) {
+  bool go = (value & _BV(TWINT)) != 0;
+  // TWINT is cleared by writing a one to it. TWSTO is only ever seen set until it's done.
+  twcr = (twcr & _BV(TWINT)) | (value & ~_BV(TWINT));
+  if (go) twcr &= ~_BV(TWINT);
+  if (!(twcr & _BV(TWEN))) {
+    twi_phase = TWI_IDLE;
+    twi_busy = false;
+    return;
+  }
+  if (!go || twi_busy) return;
+  if (value & _BV(TWSTO)) {
+    twi_phase = TWI_IDLE;
+    twcr &= ~_BV(TWSTO);
+  }
+  if (value & _BV(TWSTA)) {
+    bool repeated = twi_phase != TWI_IDLE;
+    if (!repeated) hal_stats.i2c_transactions++;
+    twi_phase = TWI_ADDRESS;
+    twi_step(2, repeated ? 0x10 : 0x08);
+    return;
+  }
+  switch(twi_phase) {
+    case TWI_ADDRESS: {
+      hal_stats.i2c_bytes++;
+      twi_device = TWDR >> 1;
+      bool read = (TWDR & 1) != 0;
+      bool ack = twi_present(twi_device);
+      twi_phase = read ? TWI_READING : TWI_WRITING;
+      twi_first = true;
+      twi_step(9, read ? (ack ? 0x40 : 0x48) : (ack ? 0x18 : 0x20));
+      if (!ack) twi_phase = TWI_IDLE;
+      break;
+    }
+    case TWI_WRITING: {
+      hal_stats.i2c_bytes++;
+      uint8_t b = TWDR;
+      if (twi_device == DS1307_ADDR) {
+        // The DS1307 takes its register address and then data, one byte at a time.
+        uint8_t buf[2] = { twi_first ? b : rtc_pointer, b };
+        rtc_write(buf, twi_first ? 1 : 2);
+      } else if (twi_first) {
+        mcp_pointer = b;
+      } else {
+        mcp_write_byte(b);
+      }
+      twi_first = false;
+      twi_step(9, 0x28);
+      break;
+    }
+    case TWI_READING:
+      hal_stats.i2c_bytes++;
+      if (twi_device == DS1307_ADDR) rtc_read(&twi_received, 1); else twi_received = mcp_read_byte();
+      twi_step(9, (value & _BV(TWEA)) ? 0x50 : 0x58);
+      break;
+    default:
+      break;
+  }
+}
+
+// Finish the step in progress if it's time, and interrupt for the next one.
+static void twi_finish() {
+  if (twi_busy && clock_ns >= twi_done_at) {
+    twi_busy = false;
+    TWSR = twi_status | (TWSR & 0x03);
+    if (twi_phase == TWI_READING && (twi_status == 0x50 || twi_status == 0x58)) TWDR = twi_received;
+    twcr |= _BV(TWINT);
+  }
+  if ((twcr & _BV(TWINT)) && (twcr & _BV(TWIE)) && interrupts_enabled() && TWI_vect) run_isr(TWI_vect);
+}
+
+HalTwiControl::operator uint8_t() const {
+  hal_advance(HAL_PORT_IO_NS);
+  return twcr;
+}
+
+HalTwiControl &HalTwiControl::operator=(uint8_t value) {
+  hal_advance(HAL_PORT_IO_NS);
+  twi_control(value);
+  return *this;
+}
+
+const char *hal_backlight_name(uint8_t color) {
+  switch(color) {
+    case OFF: return "OFF";
+    case RED: return "RED";
+    case GREEN: return "GREEN";
+    case YELLOW: return "YELLOW";
+    case BLUE: return "BLUE";
+    case VIOLET: return "VIOLET";
+    case TEAL: return "TEAL";
+    case WHITE: return "WHITE";
+    default: return "UNKNOWN";
+  }
+}
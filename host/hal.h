@@ -0,0 +1,177 @@
+/*
+
+ Board model for the J1772 Hydra host build
+ Copyright 2026 Nicholas W. Sayer
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program; if not, write to the Free Software Foundation, Inc.,
+ 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef hal_h
+#define hal_h
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+// The sketches are compiled unchanged against the headers in include/, which
+// stand in for the Arduino core, the AVR registers they touch and the libraries
+// that talk to hardware. Everything behind those headers lands here.
+//
+// Time is virtual. It only moves when the sketch does something that would take
+// time on the real board - an I/O call, a delay, a wait for the i2c bus - or
+// when the harness lets it pass. The sketch's own arithmetic is free. Peripherals
+// (the A/d converter, the TWI, the UART, the GFI, the pilot generators) are
+// evaluated as a function of virtual time, and their interrupts are delivered
+// as the clock passes the instant they would have fired.
+
+// Virtual time, in nanoseconds since reset.
+typedef uint64_t hal_time_t;
+
+#define HAL_US 1000ULL
+#define HAL_MS (1000ULL * HAL_US)
+#define HAL_SEC (1000ULL * HAL_MS)
+
+// How long the various operations take on a 16 MHz ATmega328P. These are
+// approximations, but they're the right order of magnitude.
+#define HAL_DIGITAL_IO_NS 4000ULL        // digitalRead(), digitalWrite(), pinMode()
+#define HAL_PORT_IO_NS 125ULL            // touching PORTx, PINx or DDRx directly (sbi, cbi, in)
+#define HAL_MILLIS_NS 1000ULL            // millis(), micros()
+#define HAL_ANALOG_READ_NS 112000ULL     // analogRead(): one conversion plus overhead
+#define HAL_PWM_WRITE_NS 6000ULL         // pwmWrite()
+#define HAL_ADC_CONVERSION_NS 104000ULL  // 13 A/d clocks at 125 kHz
+#define HAL_ADC_SAMPLE_NS 12000ULL       // the sample-and-hold closes 1.5 A/d clocks in
+#define HAL_ISR_NS 5000ULL               // entering, running and leaving a short ISR
+#define HAL_EEPROM_WRITE_NS 3300000ULL   // one EEPROM byte write
+#define HAL_WDR_NS 1000ULL              // wdt_reset(), and the loop around it
+#define HAL_WDR_HALT 1000                // how many wdt_reset()s in a row mean the sketch has halted
+#define HAL_GFI_HOLD_NS (15ULL * HAL_MS) // how long the GFI output stays up after the test trips it
+
+// Thrown out of the sketch to end a run. The reason is "time" when the deadline
+// passes, "watchdog" if the watchdog would have reset the board, and "halted"
+// if the sketch has stopped doing anything but petting the watchdog (die()).
+struct HalStop {
+  const char *reason;
+};
+
+// The most outlets a board can have. The reference design has two; a Mega Hydra has four.
+#define HAL_MAX_CARS 4
+
+// The biggest LCD the sketches drive: 16x2 for two cars, 20x4 for more.
+#define HAL_LCD_ROWS 4
+#define HAL_LCD_COLS 20
+
+// One outlet, and whatever is plugged into it.
+struct HalCar {
+  // wiring (-1 for not connected)
+  int8_t pilot_pin;        // PWM pilot generator output
+  int8_t relay_pin;        // contactor drive
+  int8_t relay_test_pin;   // HIGH when there's voltage past the contactor
+  int8_t sense_channel;    // A/d channel watching the pilot
+  int8_t ct_channel;       // A/d channel on the current transformer
+
+  // the vehicle
+  char state;              // 'A' (unplugged), 'B', 'C' or 'D'
+  bool diode;              // false simulates a shorted pilot diode
+  unsigned long draw_ma;   // RMS current drawn while the contactor is closed in C or D
+
+  // faults
+  bool relay_welded;       // relay test shows voltage no matter what
+
+  // component tolerances, in A/d counts
+  int ct_bias;             // where the CT sits with no current, from mid-scale
+  int sense_offset;        // added to every pilot sense reading
+};
+
+struct HalBoard {
+  int cars;                // how many of car[] are wired up
+  HalCar car[HAL_MAX_CARS];
+  // EVSE: the GFI sensor output, and the line that injects a test fault
+  int8_t gfi_pin, gfi_test_pin;
+  // Splitter: the upstream EVSE's pilot and proximity, normalized to TTL
+  int8_t inlet_pilot_pin, inlet_proximity_pin;
+  unsigned long inlet_ma;  // what the upstream pilot offers. 0 means no oscillation
+  bool inlet_connected;
+  unsigned int mains_hz;
+  unsigned int ct_ma_per_count; // the CT and burden resistor's scale
+  uint8_t buttons;         // LCD shield buttons being held down right now
+  int8_t button_int_pin;   // where the MCP23017's INTA goes (-1 for not connected)
+  uint8_t lcd_cols, lcd_rows; // the size of the LCD's glass (16x2 if left at 0)
+};
+
+extern HalBoard hal_board;
+
+// Counters, for profiling.
+struct HalStats {
+  unsigned long adc_conversions;
+  unsigned long interrupts;
+  unsigned long i2c_transactions;
+  unsigned long i2c_bytes;
+  unsigned long lcd_writes;
+  unsigned long serial_bytes;
+  unsigned long eeprom_writes;
+  hal_time_t asleep;          // time spent in sleep_cpu()
+  unsigned long gfi_opens;    // GFI trips with a relay closed, that then saw them all open
+  hal_time_t gfi_open_worst;  // the longest any of those took
+};
+
+extern HalStats hal_stats;
+
+// Reset the board model to power-on state. The board wiring must already be filled in.
+void hal_init();
+hal_time_t hal_now();
+// Let time pass, delivering any interrupts that come due.
+void hal_advance(hal_time_t ns);
+// Throw HalStop once virtual time reaches this point (0 for never).
+void hal_set_deadline(hal_time_t when);
+
+// The world outside the board. Once virtual time reaches the time it last
+// returned, the world function is called again to update the board (plug cars
+// in, change what they draw and so on). It returns when it next wants to run.
+typedef hal_time_t (*hal_world_fn)(hal_time_t now);
+void hal_set_world(hal_world_fn fn, hal_time_t first);
+
+// Move millis() and micros() on by this much at once, as if the board had spent that
+// long with nothing to do. Nothing else (the RTC included) sees it.
+void hal_skip(hal_time_t ns);
+
+// Trip the GFI as a real ground fault would, holding it for the given time.
+void hal_gfi_fault(hal_time_t duration);
+
+// Preload an EEPROM byte before the sketch starts, as if it had been written by an earlier run.
+void hal_eeprom_load(int address, uint8_t value);
+
+// Set the RTC to the given time (seconds since 1970, in local winter time).
+void hal_rtc_set(time_t t);
+
+// Where the sketch's Serial output goes (NULL to discard).
+void hal_serial_output(FILE *f);
+// And where it goes byte for byte, with no timestamps (NULL for nowhere). For logs
+// in tokens, which aren't text.
+void hal_serial_capture(FILE *f);
+
+// The LCD frame buffer and backlight color. Only as many rows and columns as the
+// board's LCD has are used.
+extern char hal_lcd[HAL_LCD_ROWS][HAL_LCD_COLS + 1];
+extern uint8_t hal_lcd_rows, hal_lcd_cols;
+extern uint8_t hal_lcd_backlight;
+const char *hal_backlight_name(uint8_t color);
+
+// Is the contactor for this car closed?
+bool hal_relay_closed(int car);
+// The duty cycle (in tenths of a percent) presently on the car's pilot, or
+// -1 for a steady +12 and -2 for a steady -12.
+int hal_pilot_duty(int car);
+
+#endif
@@ -0,0 +1,154 @@
+/*
+
+ Arduino.h for the J1772 Hydra host build
+ Copyright 2026 Nicholas W. Sayer
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program; if not, write to the Free Software Foundation, Inc.,
+ 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+// Just enough of the Arduino core for the Hydra sketches and their libraries.
+// Everything here is implemented by the board model in hal.cpp.
+
+#ifndef Arduino_h
+#define Arduino_h
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <math.h>
+
+#include <avr/pgmspace.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+
+typedef bool boolean;
+typedef uint8_t byte;
+
+#define HIGH 0x1
+#define LOW  0x0
+
+#define INPUT 0x0
+#define OUTPUT 0x1
+#define INPUT_PULLUP 0x2
+
+#define CHANGE 1
+#define FALLING 2
+#define RISING 3
+
+#define DEC 10
+#define HEX 16
+#define OCT 8
+#define BIN 2
+
+#ifdef __AVR_ATmega2560__
+// The Mega's analog inputs follow its 54 digital pins.
+#define A0 54
+#define A1 55
+#define A2 56
+#define A3 57
+#define A4 58
+#define A5 59
+#define A6 60
+#define A7 61
+#define A8 62
+#define A9 63
+#define A10 64
+#define A11 65
+#define A12 66
+#define A13 67
+#define A14 68
+#define A15 69
+
+#define NUM_DIGITAL_PINS 70
+
+// The pins with pin change interrupts: 10-13 and 50-53 on PCINT0, and A8-A15 on PCINT2.
+#define digitalPinToPCICR(p) ((((p) >= 10 && (p) <= 13) || ((p) >= 50 && (p) <= 53) || ((p) >= A8 && (p) <= A15)) ? &PCICR : (volatile uint8_t *)0)
+#define digitalPinToPCICRbit(p) (((p) >= A8 && (p) <= A15) ? 2 : 0)
+#define digitalPinToPCMSK(p) ((((p) >= 10 && (p) <= 13) || ((p) >= 50 && (p) <= 53)) ? &PCMSK0 : ((p) >= A8 && (p) <= A15) ? &PCMSK2 : (volatile uint8_t *)0)
+#define digitalPinToPCMSKbit(p) (((p) >= 10 && (p) <= 13) ? (p) - 6 : ((p) >= 50 && (p) <= 53) ? 53 - (p) : ((p) >= A8 && (p) <= A15) ? (p) - A8 : 0)
+
+#define SDA 20
+#define SCL 21
+#else
+#define A0 14
+#define A1 15
+#define A2 16
+#define A3 17
+#define A4 18
+#define A5 19
+#define A6 20
+#define A7 21
+
+#define NUM_DIGITAL_PINS 22
+
+// Every pin has a pin change interrupt: port D's are PCINT2, port B's PCINT0 and port C's PCINT1.
+#define digitalPinToPCICR(p) (((p) >= 0 && (p) < 20) ? &PCICR : (volatile uint8_t *)0)
+#define digitalPinToPCICRbit(p) (((p) < 8) ? 2 : ((p) < 14) ? 0 : 1)
+#define digitalPinToPCMSK(p) (((p) < 8) ? &PCMSK2 : ((p) < 14) ? &PCMSK0 : ((p) < 20) ? &PCMSK1 : (volatile uint8_t *)0)
+#define digitalPinToPCMSKbit(p) (((p) < 8) ? (p) : ((p) < 14) ? (p) - 8 : (p) - 14)
+
+#define SDA 18
+#define SCL 19
+#endif
+
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t val);
+int digitalRead(uint8_t pin);
+int analogRead(uint8_t pin);
+
+unsigned long millis(void);
+unsigned long micros(void);
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+
+void attachInterrupt(uint8_t irq, void (*isr)(void), int mode);
+void detachInterrupt(uint8_t irq);
+
+#define interrupts() sei()
+#define noInterrupts() cli()
+
+class Print
+{
+  public:
+    virtual ~Print() {}
+    virtual size_t write(uint8_t c) = 0;
+    size_t write(const char *str) { return write((const uint8_t *)str, strlen(str)); }
+    size_t write(const uint8_t *buf, size_t len) {
+      size_t n = 0;
+      while(len--) n += write(*buf++);
+      return n;
+    }
+
+    size_t print(const char *str) { return write(str); }
+    size_t print(char c) { return write((uint8_t)c); }
+    size_t print(unsigned char n, int base = DEC) { return print((unsigned long)n, base); }
+    size_t print(int n, int base = DEC) { return print((long)n, base); }
+    size_t print(unsigned int n, int base = DEC) { return print((unsigned long)n, base); }
+    size_t print(long n, int base = DEC);
+    size_t print(unsigned long n, int base = DEC);
+
+    size_t println(void) { return write("\r\n"); }
+    size_t println(const char *str) { return print(str) + println(); }
+    size_t println(char c) { return print(c) + println(); }
+    size_t println(unsigned char n, int base = DEC) { return print(n, base) + println(); }
+    size_t println(int n, int base = DEC) { return print(n, base) + println(); }
+    size_t println(unsigned int n, int base = DEC) { return print(n, base) + println(); }
+    size_t println(long n, int base = DEC) { return print(n, base) + println(); }
+    size_t println(unsigned long n, int base = DEC) { return print(n, base) + println(); }
+};
+
+#endif
@@ -0,0 +1,60 @@
+/*
+
+ EEPROM.h for the J1772 Hydra host build
+ Copyright 2026 Nicholas W. Sayer
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program; if not, write to the Free Software Foundation, Inc.,
+ 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+// The EEPROM is an in-memory array owned by the board model. Writes take
+// as long as they do on the real part (about 3.3 ms each).
+
+#ifndef EEPROM_h
+#define EEPROM_h
+
+#include <Arduino.h>
+
+#define E2END 0x3FF
+
+uint8_t hal_eeprom_read(int address);
+void hal_eeprom_write(int address, uint8_t value);
+
+class EEPROMClass
+{
+  public:
+    uint8_t read(int address) { return hal_eeprom_read(address); }
+    void write(int address, uint8_t value) { hal_eeprom_write(address, value); }
+    void update(int address, uint8_t value) {
+      if (read(address) != value) write(address, value);
+    }
+    uint16_t length() { return E2END + 1; }
+
+    template<typename T> T &get(int address, T &t) {
+      uint8_t *ptr = (uint8_t *)&t;
+      for(unsigned int i = 0; i < sizeof(T); i++)
+        ptr[i] = read(address + i);
+      return t;
+    }
+    template<typename T> const T &put(int address, const T &t) {
+      const uint8_t *ptr = (const uint8_t *)&t;
+      for(unsigned int i = 0; i < sizeof(T); i++)
+        update(address + i, ptr[i]);
+      return t;
+    }
+};
+
+extern EEPROMClass EEPROM;
+
+#endif
@@ -0,0 +1,35 @@
+/*
+
+ PWM.h for the J1772 Hydra host build
+ Copyright 2026 Nicholas W. Sayer
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program; if not, write to the Free Software Foundation, Inc.,
+ 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+// The pilot generators. The board model remembers the frequency and duty
+// cycle of each pin, and works out the pin's level at any instant from them.
+
+#ifndef PWM_H_
+#define PWM_H_
+
+#include <Arduino.h>
+
+void InitTimers();
+void InitTimersSafe();
+void pwmWrite(uint8_t pin, uint8_t val);
+bool SetPinFrequency(int8_t pin, uint32_t frequency);
+bool SetPinFrequencySafe(int8_t pin, uint32_t frequency);
+
+#endif
@@ -0,0 +1,181 @@
+/*
+
+ avr/io.h for the J1772 Hydra host build
+ Copyright 2026 Nicholas W. Sayer
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program; if not, write to the Free Software Foundation, Inc.,
+ 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+// The handful of ATmega328P registers the Hydra touches directly. They're
+// ordinary variables here; the board model in hal.cpp looks at them as
+// virtual time passes, and behaves the way the peripheral would.
+
+#ifndef _AVR_IO_H_
+#define _AVR_IO_H_
+
+#include <stdint.h>
+
+#define _BV(bit) (1 << (bit))
+
+extern volatile uint8_t MCUSR;
+extern volatile uint8_t SREG;
+
+// A/d converter
+extern volatile uint8_t ADMUX;
+extern volatile uint8_t ADCSRA;
+extern volatile uint8_t ADCSRB;
+extern volatile uint16_t ADC;
+
+#define REFS1 7
+#define REFS0 6
+#define ADLAR 5
+#define MUX3 3
+#define MUX2 2
+#define MUX1 1
+#define MUX0 0
+
+#define ADEN 7
+#define ADSC 6
+#define ADATE 5
+#define ADIF 4
+#define ADIE 3
+#define ADPS2 2
+#define ADPS1 1
+#define ADPS0 0
+
+#define ADTS2 2
+#define ADTS1 1
+#define ADTS0 0
+
+// Timer1's flags, which can start an A/d conversion.
+extern volatile uint8_t TIFR1;
+
+#define ICF1 5
+#define TOV1 0
+
+// The clock selects and counters of the timers that make the pilots. On the Mega,
+// Timer4 makes two of them, and it's started in step with Timer1.
+extern volatile uint8_t TCCR1B, TCCR4B;
+extern volatile uint16_t TCNT1, TCNT4;
+
+#define SREG_I 7
+
+// Pin change interrupts. The board model raises a flag when the one pin it drives
+// (the MCP23017's interrupt line) changes, if that pin is masked in.
+extern volatile uint8_t PCICR, PCIFR;
+extern volatile uint8_t PCMSK0, PCMSK1, PCMSK2;
+
+#define PCIE2 2
+#define PCIE1 1
+#define PCIE0 0
+
+#define PCIF2 2
+#define PCIF1 1
+#define PCIF0 0
+
+// The TWI (i2c). TWCR goes to the board model on every access, since writing it is
+// what sets the hardware going.
+extern volatile uint8_t TWBR;
+extern volatile uint8_t TWSR;
+extern volatile uint8_t TWDR;
+
+class HalTwiControl
+{
+  public:
+    HalTwiControl() {}
+    operator uint8_t() const;
+    HalTwiControl &operator=(uint8_t value);
+  private:
+    HalTwiControl(const HalTwiControl &);
+    HalTwiControl &operator=(const HalTwiControl &);
+};
+
+extern HalTwiControl TWCR;
+
+#define TWINT 7
+#define TWEA 6
+#define TWSTA 5
+#define TWSTO 4
+#define TWWC 3
+#define TWEN 2
+#define TWIE 0
+
+// USART0. UDR0 goes to the board model, since writing it is what sends a byte. The
+// model keeps UCSR0A's UDRE0 up to date. Nothing ever comes in.
+extern volatile uint16_t UBRR0;
+extern volatile uint8_t UCSR0A, UCSR0B, UCSR0C;
+
+class HalUartData
+{
+  public:
+    HalUartData() {}
+    operator uint8_t() const;
+    HalUartData &operator=(uint8_t value);
+  private:
+    HalUartData(const HalUartData &);
+    HalUartData &operator=(const HalUartData &);
+};
+
+extern HalUartData UDR0;
+
+#define RXC0 7
+#define TXC0 6
+#define UDRE0 5
+#define U2X0 1
+
+#define RXCIE0 7
+#define TXCIE0 6
+#define UDRIE0 5
+#define RXEN0 4
+#define TXEN0 3
+
+#define UCSZ01 2
+#define UCSZ00 1
+
+// The digital I/O ports. Unlike the registers above, these go to the board model
+// on every access, so that a relay opens (or an input is sampled) at the moment the
+// firmware touches the register, the same as it would on the chip.
+class HalIoReg
+{
+  public:
+    enum Kind { PIN, DDR, PORT };
+    HalIoReg(uint8_t port, Kind kind) : port(port), kind(kind) {}
+    operator uint8_t() const;
+    HalIoReg &operator=(uint8_t value);
+    // For a constant bit, these are a single sbi or cbi.
+    HalIoReg &operator|=(uint8_t bits);
+    HalIoReg &operator&=(uint8_t bits);
+    uint8_t port; // 0 for B, 1 for C, 2 for D (on a Mega, 0 for A up to 10 for L)
+    Kind kind;
+  private:
+    HalIoReg(const HalIoReg &);
+    HalIoReg &operator=(const HalIoReg &);
+};
+
+extern HalIoReg PINB, DDRB, PORTB;
+extern HalIoReg PINC, DDRC, PORTC;
+extern HalIoReg PIND, DDRD, PORTD;
+#ifdef __AVR_ATmega2560__
+extern HalIoReg PINA, DDRA, PORTA;
+extern HalIoReg PINE, DDRE, PORTE;
+extern HalIoReg PINF, DDRF, PORTF;
+extern HalIoReg PING, DDRG, PORTG;
+extern HalIoReg PINH, DDRH, PORTH;
+extern HalIoReg PINJ, DDRJ, PORTJ;
+extern HalIoReg PINK, DDRK, PORTK;
+extern HalIoReg PINL, DDRL, PORTL;
+#endif
+
+#endif
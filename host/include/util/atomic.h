@@ -0,0 +1,46 @@
+/*
+
+ util/atomic.h for the J1772 Hydra host build
+ Copyright 2026 Nicholas W. Sayer
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program; if not, write to the Free Software Foundation, Inc.,
+ 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef _UTIL_ATOMIC_H_
+#define _UTIL_ATOMIC_H_
+
+#include <avr/interrupt.h>
+
+#define ATOMIC_RESTORESTATE 1
+#define ATOMIC_FORCEON 2
+
+class HostAtomicBlock
+{
+  public:
+    HostAtomicBlock(int type) : saved(SREG), type(type) { cli(); }
+    ~HostAtomicBlock() {
+      if (type == ATOMIC_FORCEON)
+        sei();
+      else
+        SREG = saved;
+    }
+  private:
+    uint8_t saved;
+    int type;
+};
+
+#define ATOMIC_BLOCK(type) for(HostAtomicBlock __atomic_block(type), *__atomic_once = &__atomic_block; __atomic_once; __atomic_once = 0)
+
+#endif
@@ -0,0 +1,75 @@
+#!/bin/sh
+#
+# Turn an Arduino sketch into a C++ file the way the Arduino IDE does:
+# include Arduino.h and add prototypes for every function, ahead of the
+# first function definition, so that functions can be called before
+# they appear in the file. A prototype is wrapped in the same #if, #elif
+# and #else lines as its definition, so that a function compiled out
+# doesn't leave a declaration behind. #line directives keep compiler
+# errors pointing at the .ino.
+#
+# Usage: ino2cpp.sh sketch.ino > sketch.cpp
+
+if [ $# -ne 1 ]; then
+  echo "Usage: $0 sketch.ino" >&2
+  exit 1
+fi
+
+awk -v file="$1" '
+function is_definition(line,    name) {
+  # Only column 0 definitions count - that is how the sketches are written.
+  if (line !~ /^[A-Za-z_]/) return 0
+  if (line ~ /^(typedef|struct|class|enum|union|if|else|for|while|switch|do|return|case|default)[^A-Za-z0-9_]/) return 0
+  if (line ~ /;[ \t]*(\/\/.*)?$/) return 0
+  if (line ~ /::/) return 0
+  # type name(args)
+  if (line !~ /^[A-Za-z_][A-Za-z0-9_ \t\*&]*[ \t\*&][A-Za-z_][A-Za-z0-9_]*[ \t]*\([^=]*\)[ \t]*\{?[ \t]*(\/\/.*)?$/) return 0
+  return 1
+}
+{
+  lines[NR] = $0
+}
+END {
+  first = 0
+  n = 0
+  depth = 0
+  for(i = 1; i <= NR; i++) {
+    # The conditionals that the line sits in, outermost first.
+    if (lines[i] ~ /^[ \t]*#[ \t]*if/) {
+      cond[++depth] = lines[i]
+      continue
+    }
+    if (lines[i] ~ /^[ \t]*#[ \t]*(elif|else)/) {
+      cond[depth] = cond[depth] "\n" lines[i]
+      continue
+    }
+    if (lines[i] ~ /^[ \t]*#[ \t]*endif/) {
+      depth--
+      continue
+    }
+    if (!is_definition(lines[i])) continue
+    # The brace is either on the same line or the next one.
+    if (lines[i] !~ /\{[ \t]*(\/\/.*)?$/ && lines[i + 1] !~ /^\{/) continue
+    proto = lines[i]
+    sub(/[ \t]*(\/\/.*)?$/, "", proto)
+    sub(/[ \t]*\{$/, "", proto)
+    guard = ""
+    endifs = ""
+    for(k = 1; k <= depth; k++) {
+      guard = guard cond[k] "\n"
+      endifs = endifs "\n#endif"
+    }
+    protos[++n] = guard proto ";" endifs
+    if (!first) first = i
+  }
+  print "#include <Arduino.h>"
+  print "#line 1 \"" file "\""
+  for(i = 1; i <= NR; i++) {
+    if (i == first) {
+      for(j = 1; j <= n; j++) print protos[j]
+      print "#line " i " \"" file "\""
+    }
+    print lines[i]
+  }
+}
+' "$1"
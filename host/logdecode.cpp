@@ -0,0 +1,223 @@
+/*
+
+ Log token decoder for the J1772 Hydra
+ Copyright 2026 Nicholas W. Sayer
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program; if not, write to the Free Software Foundation, Inc.,
+ 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+// Turns the log records a sketch built with LOG_TOKENS sends (see lib/LogTokens)
+// back into the text it would have sent without it, one line per record, each
+// with the time it was logged:
+//
+//   hydra_logdecode ../Hydra_EVSE/Hydra_EVSE.ino capture.bin
+//
+// The records name the line each LOG() call is on, so the string table comes from
+// reading the very same sketch source the firmware was built from. With no capture
+// file, the records are read from standard input, so that
+//
+//   stty -F /dev/ttyUSB0 raw 9600 && hydra_logdecode ../Hydra.ino < /dev/ttyUSB0
+//
+// follows a Hydra as it runs. Start it before the Hydra is reset, or it'll begin
+// in the middle of a record.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <map>
+#include <string>
+
+// The same as the sketches'.
+#define LOG_INFO 1
+#define LOG_DEBUG 2
+#define LOG_TRACE 3
+
+#define LOG_TOKEN_DROPPED 0
+
+static std::map<unsigned int, std::string> formats;
+
+static void usage() {
+  fprintf(stderr, "Usage: hydra_logdecode sketch.ino [capture]\n");
+  exit(1);
+}
+
+// The string literal (or literals, one after another) at p, unescaped. Returns
+// false if there isn't one.
+static bool literal(const char *p, std::string &out) {
+  out.clear();
+  while(*p == ' ' || *p == '\t') p++;
+  if (*p != '"') return false;
+  while(*p == '"') {
+    for(p++; *p != '"'; p++) {
+      if (*p == 0) return false;
+      if (*p != '\\') {
+        out += *p;
+        continue;
+      }
+      switch(*++p) {
+        case 'n': out += '\n'; break;
+        case 'r': out += '\r'; break;
+        case 't': out += '\t'; break;
+        case 0: return false;
+        default: out += *p; break;
+      }
+    }
+    for(p++; *p == ' ' || *p == '\t'; p++) ;
+  }
+  return true;
+}
+
+// Every LOG(level, "format", ...) in the sketch, by line. The definitions of LOG
+// itself don't have a literal where the format goes, so they're passed over.
+static void read_sketch(const char *path) {
+  FILE *f = fopen(path, "r");
+  if (f == NULL) {
+    perror(path);
+    exit(1);
+  }
+  char buf[1024];
+  unsigned int line = 0;
+  while(fgets(buf, sizeof(buf), f) != NULL) {
+    line++;
+    const char *code = buf + strspn(buf, " \t");
+    if (strncmp(code, "//", 2) == 0) continue;
+    const char *call = strstr(code, "LOG(");
+    if (call == NULL) continue;
+    const char *comma = strchr(call, ',');
+    std::string format;
+    if (comma != NULL && literal(comma + 1, format)) formats[line] = format;
+  }
+  fclose(f);
+}
+
+// Little endian, the way the AVR lays things out.
+static unsigned long take(const uint8_t *&p, const uint8_t *end, int n, bool &ok) {
+  unsigned long value = 0;
+  if (end - p < n) {
+    ok = false;
+    return 0;
+  }
+  for(int i = 0; i < n; i++) value |= (unsigned long)*p++ << (8 * i);
+  return value;
+}
+
+// printf the format again, taking each argument from the record as the firmware
+// laid it out: two bytes for an int, four for a long, and strings with their NUL.
+static bool format_record(const std::string &format, const uint8_t *p, const uint8_t *end, std::string &out) {
+  bool ok = true;
+  const char *f = format.c_str();
+  char buf[256];
+  while(*f != 0) {
+    if (*f != '%') {
+      out += *f++;
+      continue;
+    }
+    const char *start = f++;
+    bool is_long = false;
+    while(*f != 0 && strchr("0123456789-+ #.l", *f) != NULL) {
+      if (*f == 'l') is_long = true;
+      f++;
+    }
+    if (*f == 0) return false;
+    char conversion = *f++;
+    std::string spec(start, f - start);
+    if (conversion == '%') {
+      out += '%';
+      continue;
+    }
+    if (conversion == 's') {
+      const uint8_t *nul = (const uint8_t *)memchr(p, 0, end - p);
+      if (nul == NULL) return false;
+      snprintf(buf, sizeof(buf), spec.c_str(), (const char *)p);
+      p = nul + 1;
+    } else if (is_long) {
+      unsigned long value = take(p, end, 4, ok);
+      if (conversion == 'd' || conversion == 'i')
+        snprintf(buf, sizeof(buf), spec.c_str(), (long)(int32_t)value);
+      else
+        snprintf(buf, sizeof(buf), spec.c_str(), value);
+    } else {
+      unsigned int value = take(p, end, 2, ok);
+      if (conversion == 'd' || conversion == 'i')
+        snprintf(buf, sizeof(buf), spec.c_str(), (int)(int16_t)value);
+      else
+        snprintf(buf, sizeof(buf), spec.c_str(), value);
+    }
+    if (!ok) return false;
+    out += buf;
+  }
+  return p == end;
+}
+
+static void decode(const uint8_t *record, int length) {
+  const uint8_t *p = record, *end = record + length;
+  bool ok = true;
+  unsigned int id = take(p, end, 2, ok);
+  unsigned long now = take(p, end, 4, ok);
+  if (!ok) {
+    printf("(a record too short to be one)\n");
+    return;
+  }
+  unsigned int line = id & 0x3fff;
+  unsigned int level = id >> 14;
+  printf("[%10.3f] ", now / 1000.0);
+
+  if (line == LOG_TOKEN_DROPPED) {
+    unsigned int count = take(p, end, 2, ok);
+    printf("DROPPED LINES: %u\n", count);
+    return;
+  }
+
+  std::string text;
+  switch(level) {
+    case LOG_INFO: text = "INFO: "; break;
+    case LOG_DEBUG: text = "DEBUG: "; break;
+    case LOG_TRACE: text = std::to_string(now) + " TRACE: "; break;
+    default: text = "UNKNOWN: "; break;
+  }
+  std::map<unsigned int, std::string>::iterator format = formats.find(line);
+  if (format == formats.end()) {
+    printf("%s(nothing is logged on line %u of the sketch)\n", text.c_str(), line);
+    return;
+  }
+  if (!format_record(format->second, p, end, text)) {
+    printf("%s(a record that doesn't fit line %u of the sketch)\n", text.c_str(), line);
+    return;
+  }
+  printf("%s\n", text.c_str());
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2 || argc > 3) usage();
+  read_sketch(argv[1]);
+  FILE *in = stdin;
+  if (argc == 3 && (in = fopen(argv[2], "rb")) == NULL) {
+    perror(argv[2]);
+    exit(1);
+  }
+
+  int length;
+  while((length = getc(in)) != EOF) {
+    uint8_t record[256];
+    if (fread(record, 1, length, in) != (size_t)length) {
+      printf("(the capture ends in the middle of a record)\n");
+      break;
+    }
+    decode(record, length);
+    fflush(stdout);
+  }
+  return 0;
+}
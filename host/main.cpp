@@ -0,0 +1,205 @@
+/*
+
+ Host-side runner for the J1772 Hydra
+ Copyright 2026 Nicholas W. Sayer
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program; if not, write to the Free Software Foundation, Inc.,
+ 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <vector>
+
+#include "hal.h"
+
+// These come from the sketch.
+void setup();
+void loop();
+
+#if defined(HOST_EVSE)
+#define HOST_NAME "hydra_evse"
+#elif defined(HOST_SPLITTER)
+#define HOST_NAME "hydra_splitter"
+#else
+#error "Define HOST_EVSE or HOST_SPLITTER"
+#endif
+
+// Mirrors the default pin assignments at the top of the sketch.
+static void wire_board() {
+  memset(&hal_board, 0, sizeof(hal_board));
+  hal_board.cars = 2;
+  HalCar &a = hal_board.car[0];
+  HalCar &b = hal_board.car[1];
+  a.pilot_pin = 10;
+  a.relay_pin = 8;
+  a.sense_channel = 1;
+  b.pilot_pin = 9;
+  b.relay_pin = 7;
+  b.sense_channel = 0;
+#if defined(HOST_EVSE)
+  // RELAY_TESTS_GROUND is on by default, which moves the CTs.
+  a.relay_test_pin = 17; // A3
+  a.ct_channel = 7;
+  b.relay_test_pin = 16; // A2
+  b.ct_channel = 6;
+  hal_board.gfi_pin = 2;
+  hal_board.gfi_test_pin = 3;
+  hal_board.inlet_pilot_pin = -1;
+  hal_board.inlet_proximity_pin = -1;
+#else
+  a.relay_test_pin = -1;
+  a.ct_channel = 3;
+  b.relay_test_pin = -1;
+  b.ct_channel = 2;
+  hal_board.gfi_pin = -1;
+  hal_board.gfi_test_pin = -1;
+  hal_board.inlet_pilot_pin = 2;
+  hal_board.inlet_proximity_pin = 3;
+#endif
+  for(int i = 0; i < 2; i++) {
+    hal_board.car[i].state = 'A';
+    hal_board.car[i].diode = true;
+  }
+  hal_board.inlet_ma = 30000;
+  hal_board.inlet_connected = true;
+  hal_board.mains_hz = 60;
+  hal_board.button_int_pin = 5;
+}
+
+static void usage() {
+  fprintf(stderr, "Usage: " HOST_NAME " [-t seconds] [-a STATE[:mA]] [-b STATE[:mA]]"
+#if defined(HOST_SPLITTER)
+    " [-i inlet_mA]"
+#else
+    " [-g seconds]"
+#endif
+    " [-m 50|60] [-o counts] [-p counts] [-s] [-l file]\n");
+  fprintf(stderr, "  -t  how much virtual time to run for (default 60)\n");
+  fprintf(stderr, "  -a  car A's state (A, B, C or D) and what it draws in C or D\n");
+  fprintf(stderr, "  -b  the same, for car B\n");
+#if defined(HOST_SPLITTER)
+  fprintf(stderr, "  -i  the current the upstream EVSE offers (default 30000)\n");
+#endif
+  fprintf(stderr, "  -m  mains frequency (default 60)\n");
+  fprintf(stderr, "  -o  how far off of mid-scale both CTs sit with no current\n");
+  fprintf(stderr, "  -p  how far off both pilot sense inputs read\n");
+#if defined(HOST_EVSE)
+  fprintf(stderr, "  -g  trip the GFI this far into the run\n");
+#endif
+  fprintf(stderr, "  -s  echo the sketch's serial output\n");
+  fprintf(stderr, "  -l  write the sketch's serial output to a file, as it is\n");
+  exit(1);
+}
+
+static void parse_car(HalCar &car, const char *arg) {
+  char state = arg[0];
+  if (state >= 'a' && state <= 'd') state -= 'a' - 'A';
+  if (state < 'A' || state > 'D') usage();
+  car.state = state;
+  const char *colon = strchr(arg, ':');
+  if (colon != NULL) car.draw_ma = strtoul(colon + 1, NULL, 10);
+}
+
+static hal_time_t gfi_at;
+
+// The only thing that happens in the outside world once the run starts.
+static hal_time_t trip_gfi(hal_time_t now) {
+  hal_gfi_fault(100 * HAL_MS);
+  return ~(hal_time_t)0;
+}
+
+// Summary statistics for the time each pass through loop() took.
+static void report_loop_times(std::vector<hal_time_t> &times) {
+  if (times.empty()) {
+    printf("loop(): never completed\n");
+    return;
+  }
+  std::sort(times.begin(), times.end());
+  hal_time_t sum = 0;
+  for(size_t i = 0; i < times.size(); i++) sum += times[i];
+  size_t n = times.size();
+  printf("loop(): %zu passes, min %.3f ms, mean %.3f ms, p50 %.3f ms, p99 %.3f ms, max %.3f ms\n",
+    n, times[0] / (double)HAL_MS, sum / (double)n / HAL_MS,
+    times[n / 2] / (double)HAL_MS, times[(n * 99) / 100] / (double)HAL_MS, times[n - 1] / (double)HAL_MS);
+}
+
+int main(int argc, char **argv) {
+  double seconds = 60;
+  bool echo = false;
+  FILE *capture = NULL;
+
+  wire_board();
+
+  int c;
+  while((c = getopt(argc, argv, "t:a:b:i:m:g:o:p:sl:")) != -1) {
+    switch(c) {
+      case 't': seconds = atof(optarg); break;
+      case 'a': parse_car(hal_board.car[0], optarg); break;
+      case 'b': parse_car(hal_board.car[1], optarg); break;
+      case 'i': hal_board.inlet_ma = strtoul(optarg, NULL, 10); break;
+      case 'm': hal_board.mains_hz = atoi(optarg); break;
+      case 'o': hal_board.car[0].ct_bias = hal_board.car[1].ct_bias = atoi(optarg); break;
+      case 'p': hal_board.car[0].sense_offset = hal_board.car[1].sense_offset = atoi(optarg); break;
+      case 'g': gfi_at = (hal_time_t)(atof(optarg) * HAL_SEC); break;
+      case 's': echo = true; break;
+      case 'l':
+        capture = fopen(optarg, "wb");
+        if (capture == NULL) {
+          perror(optarg);
+          exit(1);
+        }
+        break;
+      default: usage();
+    }
+  }
+
+  hal_init();
+  hal_serial_output(echo ? stdout : NULL);
+  hal_serial_capture(capture);
+  hal_rtc_set(1527840000); // 2018-06-01 08:00
+  hal_set_deadline((hal_time_t)(seconds * HAL_SEC));
+  if (gfi_at != 0) hal_set_world(trip_gfi, gfi_at);
+
+  std::vector<hal_time_t> times;
+  const char *reason = "?";
+  try {
+    setup();
+    while(true) {
+      hal_time_t start = hal_now();
+      loop();
+      times.push_back(hal_now() - start);
+    }
+  } catch (HalStop &stop) {
+    reason = stop.reason;
+  }
+
+  printf("stopped: %s at %.3f s\n", reason, hal_now() / (double)HAL_SEC);
+  report_loop_times(times);
+  printf("adc conversions %lu, interrupts %lu, i2c transactions %lu (%lu bytes), lcd writes %lu\n",
+    hal_stats.adc_conversions, hal_stats.interrupts, hal_stats.i2c_transactions, hal_stats.i2c_bytes, hal_stats.lcd_writes);
+  printf("serial bytes %lu, eeprom writes %lu\n", hal_stats.serial_bytes, hal_stats.eeprom_writes);
+  printf("asleep %.1f%% of the time\n", hal_now() == 0 ? 0.0 : 100.0 * hal_stats.asleep / hal_now());
+  if (hal_stats.gfi_opens != 0)
+    printf("gfi trips with a relay closed %lu, worst time to open the relays %.3f us\n",
+      hal_stats.gfi_opens, hal_stats.gfi_open_worst / (double)HAL_US);
+  for(int i = 0; i < 2; i++)
+    printf("car %c: relay %s, pilot %d\n", 'A' + i, hal_relay_closed(i) ? "closed" : "open", hal_pilot_duty(i));
+  printf("+----------------+\n|%s|\n|%s|\n+----------------+ %s\n", hal_lcd[0], hal_lcd[1], hal_backlight_name(hal_lcd_backlight));
+  if (capture != NULL) fclose(capture);
+  return strcmp(reason, "time") == 0 ? 0 : 2;
+}
@@ -0,0 +1,876 @@
+/*
+
+ Scenario simulator for the J1772 Hydra
+ Copyright 2026 Nicholas W. Sayer
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program; if not, write to the Free Software Foundation, Inc.,
+ 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+// Runs the EVSE firmware against scripted scenarios. Each scenario is a list of
+// timed events - cars plugging in, changing state, misbehaving, the GFI tripping,
+// the button being pushed - and expectations about what the Hydra should be doing
+// at given moments. Between events, the simulated EVs follow their pilots the
+// way a real car would, after a reaction delay: they only ask for power while the
+// pilot oscillates, and they draw no more than it offers.
+//
+// A scenario file looks like this:
+//
+//   mode shared                  # or sequential, or demand
+//   amps 30                      # the supply (one of the menu choices)
+//   car a draw 32000 delay 1-3   # charger size in mA, reaction time in seconds
+//   car b bias 10 sense -15      # CT and pilot sense offsets, in A/d counts
+//   overload 10                  # how long total draw may exceed the supply (or "off")
+//   at 5 a plug                  # state B
+//   at 10~2 a C                  # ask for power, give or take 2 seconds
+//   at 30 b overdraw 20000       # ignore the pilot (b obey to stop)
+//   at 40 gfi 0.1                # a ground fault lasting 100 ms
+//   at 50 pause                  # push the button (also resume, or button N)
+//   at 55 skip 2150000           # millis() jumps this many seconds ahead
+//   at 60 expect a relay on      # also: a pilot 15000|high|low, a draw 15000,
+//                                #   lcd "A:ERR O", backlight RED, halted
+//   at 1:00 expect a pilot 8000 until 3:00   # ... and every second up to 3:00
+//   end 1:00                     # how long to run
+//
+// The other car actions are unplug, D, force STATE (whatever the pilot says),
+// draw MA, delay S, diode shorted|ok, weld and unweld. The Mega build
+// (hydra_sim_mega) has cars c and d, too.
+//
+// Any number in a scenario can be a range ("10000-32000") and any time can be
+// jittered ("1:30~10"). Variant 0 of a scenario uses the nominal values (the low
+// end of each range, no jitter); the other variants pick at random, seeded by the
+// variant number so that a failure can be reproduced with -v.
+//
+// Each run happens in a forked child, so that every run starts from the sketch's
+// power-on state, and several of them can run at once.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <math.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include "hal.h"
+
+// These come from the sketch.
+void setup();
+void loop();
+
+// Where the firmware keeps its settings. These mirror the EEPROM_LOC_* defines in the sketch.
+#define EEPROM_MODE 0
+#define EEPROM_MAX_AMPS 2
+#define EEPROM_USE_DST 3
+#define FIRMWARE_MODE_SHARED 0
+#define FIRMWARE_MODE_SEQUENTIAL 1
+#define FIRMWARE_MODE_DEMAND 2
+
+// How many cars the board has: the Mega Hydra has four outlets.
+#ifdef __AVR_ATmega2560__
+#define SIM_CARS 4
+#else
+#define SIM_CARS 2
+#endif
+
+// How often the cars look at their pilots.
+#define SIM_TICK_NS (10 * HAL_MS)
+
+// The firmware's own allowance above a car's allocation (OVERDRAW_GRACE_AMPS).
+#define SIM_GRACE_MA 1000
+
+// How often an expectation with "until" is checked.
+#define SIM_HOLD_NS HAL_SEC
+
+// ---------- scenario description ----------
+
+// A number from the script: either fixed, or a range to pick from.
+struct Value {
+  double lo, hi;
+};
+
+enum Action {
+  ACT_STATE,      // car plugs in (B), unplugs (A) or asks for power (C or D)
+  ACT_FORCE,      // car goes to state arg (A-D) whatever its pilot says
+  ACT_DRAW,       // car's charger will take up to value mA
+  ACT_OVERDRAW,   // car ignores its pilot and draws value mA
+  ACT_OBEY,       // car goes back to following its pilot
+  ACT_DIODE,      // car's pilot diode is ok (value 1) or shorted (value 0)
+  ACT_WELD,       // car's contactor welds shut (value 1) or is fixed (value 0)
+  ACT_DELAY,      // car's reaction time becomes value seconds
+  ACT_GFI,        // ground fault lasting value seconds
+  ACT_BUTTON,     // hold the button down for value seconds
+  ACT_SKIP,       // the firmware's clock jumps value seconds ahead
+  ACT_EXPECT,     // check something (see Expect)
+};
+
+enum Expect {
+  EXP_RELAY,      // car's relay closed (value 1) or open (value 0)
+  EXP_PILOT,      // car's pilot offers value mA (or is steady: arg '+' or '-')
+  EXP_DRAW,       // car is drawing value mA
+  EXP_LCD,        // text appears on the display
+  EXP_BACKLIGHT,  // backlight is text
+  EXP_HALTED,     // the firmware has died
+};
+
+struct Event {
+  int line;
+  Value at;
+  Value jitter;
+  Value until;    // an expectation holds from at until this (0 for just at)
+  Action action;
+  Expect expect;
+  int car;        // 0 for car a, 1 for b and so on, or -1 for none
+  char arg;
+  Value value;
+  std::string text;
+};
+
+struct CarSetup {
+  Value draw;     // the most the car's charger will take, mA
+  Value delay;    // how long it takes to react to a pilot change, seconds
+  Value bias;     // how far off of mid-scale the CT sits with no current, counts
+  Value sense;    // how far off the pilot sense reads, counts
+};
+
+struct Scenario {
+  std::string file;
+  int mode;
+  Value amps;
+  unsigned int mains;
+  Value end;
+  Value overload; // how long total draw may exceed the supply, seconds (negative for no check)
+  CarSetup car[SIM_CARS];
+  std::vector<Event> events;
+};
+
+// ---------- parsing ----------
+
+static const char *parse_file;
+static int parse_line;
+
+static void parse_error(const char *msg, const char *word) {
+  fprintf(stderr, "%s:%d: %s%s%s\n", parse_file, parse_line, msg, word ? ": " : "", word ? word : "");
+  exit(1);
+}
+
+// Seconds, m:ss or h:mm:ss.
+static double parse_time(const char *s) {
+  double t = 0;
+  char *end;
+  while(true) {
+    double part = strtod(s, &end);
+    if (end == s) parse_error("bad time", s);
+    t = t * 60 + part;
+    if (*end != ':') break;
+    s = end + 1;
+  }
+  if (*end != 0) parse_error("bad time", s);
+  return t;
+}
+
+static Value parse_value(const char *s, bool is_time) {
+  Value v;
+  std::string str(s);
+  size_t dash = str.find('-', 1);
+  if (dash == std::string::npos) {
+    v.lo = v.hi = is_time ? parse_time(s) : atof(s);
+    if (!is_time && !isdigit((unsigned char)s[0]) && s[0] != '.') parse_error("bad number", s);
+  } else {
+    std::string lo = str.substr(0, dash), hi = str.substr(dash + 1);
+    v.lo = is_time ? parse_time(lo.c_str()) : atof(lo.c_str());
+    v.hi = is_time ? parse_time(hi.c_str()) : atof(hi.c_str());
+    if (v.hi < v.lo) parse_error("backwards range", s);
+  }
+  return v;
+}
+
+static Value fixed(double d) {
+  Value v = { d, d };
+  return v;
+}
+
+// Split a line into words. Double quotes make one word out of several.
+static std::vector<std::string> split(const char *line) {
+  std::vector<std::string> words;
+  const char *p = line;
+  while(true) {
+    while(isspace((unsigned char)*p)) p++;
+    if (*p == 0 || *p == '#') break;
+    std::string word;
+    if (*p == '"') {
+      const char *close = strchr(p + 1, '"');
+      if (close == NULL) parse_error("unterminated string", NULL);
+      word.assign(p + 1, close - p - 1);
+      p = close + 1;
+    } else {
+      while(*p != 0 && !isspace((unsigned char)*p)) word += *p++;
+    }
+    words.push_back(word);
+  }
+  return words;
+}
+
+static int parse_car_name(const std::string &word) {
+  if (word.size() != 1) return -1;
+  int car = tolower((unsigned char)word[0]) - 'a';
+  return (car >= 0 && car < SIM_CARS) ? car : -1;
+}
+
+static void need(const std::vector<std::string> &w, size_t n) {
+  if (w.size() < n) parse_error("missing argument", w[0].c_str());
+}
+
+static void parse_expect(Event &e, const std::vector<std::string> &w, size_t i) {
+  e.action = ACT_EXPECT;
+  need(w, i + 1);
+  if (w[i] == "lcd") {
+    need(w, i + 2);
+    e.expect = EXP_LCD;
+    e.text = w[i + 1];
+    return;
+  }
+  if (w[i] == "backlight") {
+    need(w, i + 2);
+    e.expect = EXP_BACKLIGHT;
+    e.text = w[i + 1];
+    for(size_t j = 0; j < e.text.size(); j++) e.text[j] = toupper(e.text[j]);
+    return;
+  }
+  if (w[i] == "halted") {
+    e.expect = EXP_HALTED;
+    return;
+  }
+  e.car = parse_car_name(w[i]);
+  if (e.car < 0) parse_error("unknown expectation", w[i].c_str());
+  need(w, i + 3);
+  const std::string &what = w[i + 1], &arg = w[i + 2];
+  if (what == "relay") {
+    e.expect = EXP_RELAY;
+    if (arg != "on" && arg != "off") parse_error("relay is on or off", arg.c_str());
+    e.value = fixed(arg == "on");
+  } else if (what == "pilot") {
+    e.expect = EXP_PILOT;
+    if (arg == "high" || arg == "off") e.arg = '+';
+    else if (arg == "low") e.arg = '-';
+    else e.value = parse_value(arg.c_str(), false);
+  } else if (what == "draw") {
+    e.expect = EXP_DRAW;
+    e.value = parse_value(arg.c_str(), false);
+  } else {
+    parse_error("unknown expectation", what.c_str());
+  }
+}
+
+// "a C", "b draw 16000", "gfi 0.1", "button", "expect a relay on" ...
+static void parse_action(Event &e, const std::vector<std::string> &w, size_t i) {
+  need(w, i + 1);
+  const std::string &verb = w[i];
+  e.car = -1;
+  e.arg = 0;
+  e.value = fixed(0);
+  if (verb == "expect") {
+    parse_expect(e, w, i + 1);
+    return;
+  }
+  if (verb == "gfi") {
+    e.action = ACT_GFI;
+    e.value = w.size() > i + 1 ? parse_value(w[i + 1].c_str(), false) : fixed(0.015);
+    return;
+  }
+  if (verb == "skip") {
+    need(w, i + 2);
+    e.action = ACT_SKIP;
+    e.value = parse_value(w[i + 1].c_str(), false);
+    return;
+  }
+  if (verb == "button" || verb == "pause" || verb == "resume") {
+    // A short push toggles pause.
+    e.action = ACT_BUTTON;
+    e.value = w.size() > i + 1 ? parse_value(w[i + 1].c_str(), false) : fixed(0.1);
+    return;
+  }
+  e.car = parse_car_name(verb);
+  if (e.car < 0) parse_error("unknown action", verb.c_str());
+  need(w, i + 2);
+  const std::string &what = w[i + 1];
+  if (what.size() == 1 && strchr("ABCDabcd", what[0])) {
+    e.action = ACT_STATE;
+    e.arg = toupper(what[0]);
+  } else if (what == "force") {
+    need(w, i + 3);
+    e.action = ACT_FORCE;
+    e.arg = toupper(w[i + 2][0]);
+    if (w[i + 2].size() != 1 || e.arg < 'A' || e.arg > 'D') parse_error("bad state", w[i + 2].c_str());
+  } else if (what == "plug") {
+    e.action = ACT_STATE;
+    e.arg = 'B';
+  } else if (what == "unplug") {
+    e.action = ACT_STATE;
+    e.arg = 'A';
+  } else if (what == "draw" || what == "overdraw" || what == "delay") {
+    need(w, i + 3);
+    e.action = what == "draw" ? ACT_DRAW : what == "overdraw" ? ACT_OVERDRAW : ACT_DELAY;
+    e.value = parse_value(w[i + 2].c_str(), false);
+  } else if (what == "obey") {
+    e.action = ACT_OBEY;
+  } else if (what == "diode") {
+    need(w, i + 3);
+    e.action = ACT_DIODE;
+    e.value = fixed(w[i + 2] == "ok");
+  } else if (what == "weld" || what == "unweld") {
+    e.action = ACT_WELD;
+    e.value = fixed(what == "weld");
+  } else {
+    parse_error("unknown car action", what.c_str());
+  }
+}
+
+static void parse_scenario(const char *file, Scenario &s) {
+  FILE *f = fopen(file, "r");
+  if (f == NULL) {
+    perror(file);
+    exit(1);
+  }
+  parse_file = file;
+  parse_line = 0;
+  s.file = file;
+  s.mode = FIRMWARE_MODE_SHARED;
+  s.amps = fixed(30);
+  s.mains = 60;
+  s.end = fixed(0);
+  s.overload = fixed(10);
+  for(int i = 0; i < SIM_CARS; i++) {
+    s.car[i].draw = fixed(32000);
+    s.car[i].delay = fixed(2);
+    s.car[i].bias = fixed(0);
+    s.car[i].sense = fixed(0);
+  }
+  char buf[256];
+  while(fgets(buf, sizeof(buf), f) != NULL) {
+    parse_line++;
+    std::vector<std::string> w = split(buf);
+    if (w.empty()) continue;
+    if (w[0] == "mode") {
+      need(w, 2);
+      if (w[1] == "shared") s.mode = FIRMWARE_MODE_SHARED;
+      else if (w[1] == "sequential") s.mode = FIRMWARE_MODE_SEQUENTIAL;
+      else if (w[1] == "demand") s.mode = FIRMWARE_MODE_DEMAND;
+      else parse_error("mode is shared, sequential or demand", w[1].c_str());
+    } else if (w[0] == "amps") {
+      need(w, 2);
+      s.amps = parse_value(w[1].c_str(), false);
+    } else if (w[0] == "mains") {
+      need(w, 2);
+      s.mains = atoi(w[1].c_str());
+    } else if (w[0] == "overload") {
+      need(w, 2);
+      s.overload = w[1] == "off" ? fixed(-1) : parse_value(w[1].c_str(), false);
+    } else if (w[0] == "car") {
+      need(w, 4);
+      int car = parse_car_name(w[1]);
+      if (car < 0) parse_error("unknown car", w[1].c_str());
+      for(size_t i = 2; i + 1 < w.size(); i += 2) {
+        if (w[i] == "draw") s.car[car].draw = parse_value(w[i + 1].c_str(), false);
+        else if (w[i] == "delay") s.car[car].delay = parse_value(w[i + 1].c_str(), false);
+        else if (w[i] == "bias") s.car[car].bias = parse_value(w[i + 1].c_str(), false);
+        else if (w[i] == "sense") s.car[car].sense = parse_value(w[i + 1].c_str(), false);
+        else parse_error("unknown car setting", w[i].c_str());
+      }
+    } else if (w[0] == "end") {
+      need(w, 2);
+      s.end = parse_value(w[1].c_str(), true);
+    } else if (w[0] == "at") {
+      need(w, 3);
+      Event e;
+      e.line = parse_line;
+      e.expect = EXP_RELAY;
+      std::string when = w[1];
+      size_t tilde = when.find('~');
+      e.jitter = fixed(0);
+      if (tilde != std::string::npos) {
+        e.jitter = fixed(parse_time(when.substr(tilde + 1).c_str()));
+        when = when.substr(0, tilde);
+      }
+      e.at = parse_value(when.c_str(), true);
+      e.until = fixed(0);
+      if (w.size() > 4 && w[w.size() - 2] == "until") {
+        e.until = parse_value(w.back().c_str(), true);
+        w.resize(w.size() - 2);
+      }
+      parse_action(e, w, 2);
+      if (e.until.hi != 0 && e.action != ACT_EXPECT) parse_error("only an expectation can hold until", NULL);
+      s.events.push_back(e);
+    } else {
+      parse_error("unknown directive", w[0].c_str());
+    }
+  }
+  fclose(f);
+  if (s.end.hi == 0) parse_error("no end time", NULL);
+}
+
+// ---------- one run ----------
+
+// The random choices for one variant. Variant 0 is the nominal scenario.
+static unsigned int variant;
+static uint64_t rng_state;
+
+static double pick(const Value &v) {
+  if (variant == 0 || v.hi == v.lo) return v.lo;
+  rng_state = rng_state * 6364136223846793005ULL + 1442695040888963407ULL;
+  return v.lo + (v.hi - v.lo) * ((rng_state >> 11) / (double)(1ULL << 53));
+}
+
+struct TimedEvent {
+  hal_time_t at;
+  const Event *event;
+  double value;
+  bool operator<(const TimedEvent &o) const { return at < o.at || (at == o.at && event->line < o.event->line); }
+};
+
+// An EV on the end of the cable.
+struct SimCar {
+  unsigned long charger_ma;   // the most its charger will take
+  hal_time_t delay;           // reaction time
+  char want;                  // the state the driver has asked for
+  bool forced;                // true when the script has taken over the state
+  char pending_state;         // the state it's going to change to
+  hal_time_t state_at;
+  bool obey;                  // false while overdrawing on purpose
+  unsigned long overdraw_ma;
+  unsigned long pending_ma;   // what it's going to draw once it gets around to it
+  hal_time_t pending_at;
+};
+
+static const Scenario *scenario;
+static std::vector<TimedEvent> timeline;
+static size_t next_event;
+static SimCar cars[SIM_CARS];
+static hal_time_t button_release;
+static unsigned long supply_ma;
+static hal_time_t overload_limit;
+static hal_time_t overload_since;
+static hal_time_t next_tick;
+static std::string report;
+static int failures;
+
+static void fail(const TimedEvent *te, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+static void fail(const TimedEvent *te, const char *fmt, ...) {
+  char buf[256];
+  int n;
+  if (te != NULL)
+    n = snprintf(buf, sizeof(buf), "%s:%d: variant %u at %.3f s: ", scenario->file.c_str(),
+      te->event->line, variant, hal_now() / (double)HAL_SEC);
+  else
+    n = snprintf(buf, sizeof(buf), "%s: variant %u at %.3f s: ", scenario->file.c_str(),
+      variant, hal_now() / (double)HAL_SEC);
+  va_list ap;
+  va_start(ap, fmt);
+  vsnprintf(buf + n, sizeof(buf) - n, fmt, ap);
+  va_end(ap);
+  report += buf;
+  report += '\n';
+  failures++;
+}
+
+// What the car's pilot is offering, in mA, by the J1772 duty cycle rules.
+static unsigned long offered_ma(int car) {
+  int duty = hal_pilot_duty(car);
+  if (duty < 80) return 0;
+  if (duty <= 850) return duty * 60UL;
+  if (duty <= 960) return (duty - 640) * 250UL;
+  return 0;
+}
+
+static const char *car_name(int car) {
+  static const char *names[] = { "A", "B", "C", "D" };
+  return names[car];
+}
+
+// The display, one quoted row after another.
+static std::string lcd_text() {
+  std::string text;
+  for(int r = 0; r < hal_lcd_rows; r++) {
+    if (r != 0) text += ' ';
+    text += '"';
+    text += hal_lcd[r];
+    text += '"';
+  }
+  return text;
+}
+
+static void check(const TimedEvent &te) {
+  const Event &e = *te.event;
+  int car = e.car;
+  switch(e.expect) {
+    case EXP_RELAY:
+      if (hal_relay_closed(car) != (te.value != 0))
+        fail(&te, "car %s relay is %s", car_name(car), hal_relay_closed(car) ? "on" : "off");
+      break;
+    case EXP_PILOT: {
+      int duty = hal_pilot_duty(car);
+      if (e.arg != 0) {
+        if (duty != (e.arg == '+' ? -1 : -2))
+          fail(&te, "car %s pilot duty is %d", car_name(car), duty);
+      } else {
+        unsigned long ma = offered_ma(car);
+        if (labs((long)ma - (long)te.value) > 500)
+          fail(&te, "car %s pilot offers %lu mA (duty %d), not %.0f", car_name(car), ma, duty, te.value);
+      }
+      break;
+    }
+    case EXP_DRAW: {
+      unsigned long ma = hal_relay_closed(car) ? hal_board.car[car].draw_ma : 0;
+      if (labs((long)ma - (long)te.value) > 500)
+        fail(&te, "car %s draws %lu mA, not %.0f", car_name(car), ma, te.value);
+      break;
+    }
+    case EXP_LCD: {
+      bool found = false;
+      for(int r = 0; r < hal_lcd_rows; r++)
+        if (strstr(hal_lcd[r], e.text.c_str()) != NULL) found = true;
+      if (!found)
+        fail(&te, "display shows %s", lcd_text().c_str());
+      break;
+    }
+    case EXP_BACKLIGHT:
+      if (e.text != hal_backlight_name(hal_lcd_backlight))
+        fail(&te, "backlight is %s", hal_backlight_name(hal_lcd_backlight));
+      break;
+    case EXP_HALTED:
+      fail(&te, "firmware is still running");
+      break;
+  }
+}
+
+static void apply(const TimedEvent &te) {
+  const Event &e = *te.event;
+  if (e.car >= 0 && e.action != ACT_EXPECT) {
+    HalCar &hc = hal_board.car[e.car];
+    SimCar &sc = cars[e.car];
+    switch(e.action) {
+      case ACT_STATE:
+        sc.want = e.arg;
+        sc.forced = false;
+        // Plugging in and out is immediate. Asking for power waits for the pilot.
+        if (e.arg == 'A' || e.arg == 'B') hc.state = e.arg;
+        break;
+      case ACT_FORCE: sc.forced = true; hc.state = e.arg; break;
+      case ACT_DRAW: sc.charger_ma = te.value; break;
+      case ACT_OVERDRAW: sc.obey = false; sc.overdraw_ma = te.value; break;
+      case ACT_OBEY: sc.obey = true; break;
+      case ACT_DIODE: hc.diode = te.value != 0; break;
+      case ACT_WELD: hc.relay_welded = te.value != 0; break;
+      case ACT_DELAY: sc.delay = te.value * HAL_SEC; break;
+      default: break;
+    }
+    return;
+  }
+  switch(e.action) {
+    case ACT_GFI:
+      hal_gfi_fault(te.value * HAL_SEC);
+      break;
+    case ACT_BUTTON:
+      hal_board.buttons |= 0x01; // BUTTON_SELECT
+      button_release = hal_now() + (hal_time_t)(te.value * HAL_SEC);
+      break;
+    case ACT_SKIP:
+      hal_skip((hal_time_t)(te.value * HAL_SEC));
+      break;
+    case ACT_EXPECT:
+      check(te);
+      break;
+    default:
+      break;
+  }
+}
+
+// Each car decides what it wants to draw from what its pilot says, and gets
+// around to drawing it after its reaction time.
+static void cars_tick(hal_time_t now) {
+  unsigned long total = 0;
+  for(int i = 0; i < SIM_CARS; i++) {
+    HalCar &hc = hal_board.car[i];
+    SimCar &sc = cars[i];
+
+    // A car only asks for power (closes S2) while the pilot is oscillating,
+    // and stops asking when it goes away.
+    if (!sc.forced && (sc.want == 'C' || sc.want == 'D')) {
+      char next = hal_pilot_duty(i) >= 0 ? sc.want : 'B';
+      if (next != sc.pending_state) {
+        sc.pending_state = next;
+        sc.state_at = now + sc.delay;
+      }
+      if (now >= sc.state_at) hc.state = next;
+    } else {
+      sc.pending_state = hc.state;
+    }
+
+    unsigned long want = 0;
+    bool closed = hal_relay_closed(i);
+    if (closed && (hc.state == 'C' || hc.state == 'D'))
+      want = sc.obey ? std::min(sc.charger_ma, offered_ma(i)) : sc.overdraw_ma;
+    if (!closed) {
+      // With the contactor open, there's nothing to draw, and it starts over when it closes.
+      hc.draw_ma = sc.pending_ma = 0;
+      continue;
+    }
+    if (want != sc.pending_ma) {
+      sc.pending_ma = want;
+      // Cutting back because the pilot dropped (or stopping) is not optional,
+      // but overdrawing on purpose is immediate.
+      sc.pending_at = sc.obey ? now + sc.delay : now;
+    }
+    if (now >= sc.pending_at) hc.draw_ma = sc.pending_ma;
+    total += hc.draw_ma;
+  }
+
+  // The cars between them shouldn't be able to take more than the supply for long.
+  if (overload_limit != 0) {
+    if (total > supply_ma + SIM_GRACE_MA) {
+      if (overload_since == 0) overload_since = now;
+      else if (now - overload_since > overload_limit) {
+        fail(NULL, "total draw %lu mA has exceeded the %lu mA supply for %.1f s", total, supply_ma,
+          (now - overload_since) / (double)HAL_SEC);
+        overload_since = 0;
+      }
+    } else {
+      overload_since = 0;
+    }
+  }
+}
+
+static hal_time_t world(hal_time_t now) {
+  while(next_event < timeline.size() && timeline[next_event].at <= now)
+    apply(timeline[next_event++]);
+  if (button_release != 0 && now >= button_release) {
+    hal_board.buttons &= ~0x01;
+    button_release = 0;
+  }
+  if (now >= next_tick) {
+    cars_tick(now);
+    next_tick = now + SIM_TICK_NS;
+  }
+  hal_time_t next = next_tick;
+  if (next_event < timeline.size() && timeline[next_event].at < next) next = timeline[next_event].at;
+  if (button_release != 0 && button_release < next) next = button_release;
+  return next;
+}
+
+static void board_setup(const Scenario &s) {
+  memset(&hal_board, 0, sizeof(hal_board));
+  hal_board.cars = SIM_CARS;
+  // More than two cars need a 20x4 LCD.
+  hal_board.lcd_cols = SIM_CARS > 2 ? 20 : 16;
+  hal_board.lcd_rows = SIM_CARS > 2 ? 4 : 2;
+#ifdef __AVR_ATmega2560__
+  // The Mega EVSE wiring (see the MEGA_HYDRA pin assignments in the sketch).
+  static const int8_t pilot[] = { 11, 12, 6, 7 };
+  for(int i = 0; i < SIM_CARS; i++) {
+    HalCar &c = hal_board.car[i];
+    c.pilot_pin = pilot[i]; c.relay_pin = 22 + i; c.relay_test_pin = 26 + i; c.sense_channel = i; c.ct_channel = 4 + i;
+  }
+#else
+  // The default EVSE wiring (see main.cpp).
+  HalCar &a = hal_board.car[0];
+  HalCar &b = hal_board.car[1];
+  a.pilot_pin = 10; a.relay_pin = 8; a.relay_test_pin = 17; a.sense_channel = 1; a.ct_channel = 7;
+  b.pilot_pin = 9; b.relay_pin = 7; b.relay_test_pin = 16; b.sense_channel = 0; b.ct_channel = 6;
+#endif
+  hal_board.gfi_pin = 2;
+  hal_board.gfi_test_pin = 3;
+  hal_board.inlet_pilot_pin = -1;
+  hal_board.inlet_proximity_pin = -1;
+#ifdef __AVR_ATmega2560__
+  hal_board.button_int_pin = 62; // A8
+#else
+  hal_board.button_int_pin = 5;
+#endif
+  hal_board.mains_hz = s.mains;
+  for(int i = 0; i < SIM_CARS; i++) {
+    hal_board.car[i].state = 'A';
+    hal_board.car[i].diode = true;
+  }
+}
+
+// Runs in the child. Returns the exit status.
+static int run(const Scenario &s, unsigned int v, bool echo) {
+  scenario = &s;
+  variant = v;
+  rng_state = 0x9e3779b97f4a7c15ULL * (v + 1);
+
+  board_setup(s);
+  hal_init();
+  hal_serial_output(echo ? stdout : NULL);
+  hal_rtc_set(1527840000); // 2018-06-01 08:00
+
+  unsigned int amps = (unsigned int)pick(s.amps);
+  supply_ma = amps * 1000UL;
+  hal_eeprom_load(EEPROM_MODE, s.mode);
+  hal_eeprom_load(EEPROM_MAX_AMPS, amps);
+  hal_eeprom_load(EEPROM_USE_DST, 1);
+  double overload = pick(s.overload);
+  overload_limit = overload < 0 ? 0 : (hal_time_t)(overload * HAL_SEC);
+
+  for(int i = 0; i < SIM_CARS; i++) {
+    cars[i].charger_ma = pick(s.car[i].draw);
+    cars[i].delay = pick(s.car[i].delay) * HAL_SEC;
+    hal_board.car[i].ct_bias = lround(pick(s.car[i].bias));
+    hal_board.car[i].sense_offset = lround(pick(s.car[i].sense));
+    cars[i].obey = true;
+    cars[i].want = 'A';
+    cars[i].forced = false;
+    cars[i].pending_state = 'A';
+  }
+
+  timeline.clear();
+  for(size_t i = 0; i < s.events.size(); i++) {
+    const Event &e = s.events[i];
+    TimedEvent te;
+    double at = pick(e.at);
+    if (e.jitter.hi > 0) {
+      Value spread = { -e.jitter.hi, e.jitter.hi };
+      if (variant != 0) at += pick(spread);
+    }
+    te.at = at < 0 ? 0 : (hal_time_t)(at * HAL_SEC);
+    te.event = &e;
+    te.value = pick(e.value);
+    timeline.push_back(te);
+    if (e.until.hi != 0) {
+      hal_time_t until = (hal_time_t)(pick(e.until) * HAL_SEC);
+      for(te.at += SIM_HOLD_NS; te.at <= until; te.at += SIM_HOLD_NS) timeline.push_back(te);
+    }
+  }
+  std::stable_sort(timeline.begin(), timeline.end());
+  next_event = 0;
+  button_release = 0;
+  overload_since = 0;
+  next_tick = 0;
+
+  hal_set_world(world, 0);
+  hal_set_deadline((hal_time_t)(pick(s.end) * HAL_SEC));
+
+  const char *reason = "?";
+  try {
+    setup();
+    while(true) loop();
+  } catch (HalStop &stop) {
+    reason = stop.reason;
+  }
+
+  if (strcmp(reason, "halted") == 0) {
+    // Whatever is left is checked against the dead board.
+    for(; next_event < timeline.size(); next_event++) {
+      const TimedEvent &te = timeline[next_event];
+      if (te.event->action != ACT_EXPECT) continue;
+      if (te.event->expect == EXP_HALTED) continue;
+      check(te);
+    }
+  } else if (strcmp(reason, "time") != 0) {
+    fail(NULL, "stopped: %s", reason);
+  }
+  if (echo || failures != 0) {
+    char buf[192];
+    snprintf(buf, sizeof(buf), "%s: variant %u: %s at %.3f s, display %s %s\n", s.file.c_str(), variant,
+      reason, hal_now() / (double)HAL_SEC, lcd_text().c_str(), hal_backlight_name(hal_lcd_backlight));
+    report += buf;
+  }
+  if (!report.empty()) {
+    fflush(stdout);
+    ssize_t ignored = write(1, report.data(), report.size());
+    (void)ignored;
+  }
+  return failures == 0 ? 0 : 1;
+}
+
+// ---------- driver ----------
+
+static void usage() {
+  fprintf(stderr, "Usage: hydra_sim [-n variants] [-j jobs] [-v variant] scenario ...\n");
+  fprintf(stderr, "  -n  run this many variants of each scenario (default 1: just the nominal one)\n");
+  fprintf(stderr, "  -j  run this many at once (default: one per CPU)\n");
+  fprintf(stderr, "  -v  run only the given variant, echoing the firmware's serial output\n");
+  exit(1);
+}
+
+int main(int argc, char **argv) {
+  unsigned int variants = 1;
+  long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+  int only = -1;
+  int c;
+  while((c = getopt(argc, argv, "n:j:v:")) != -1) {
+    switch(c) {
+      case 'n': variants = strtoul(optarg, NULL, 10); break;
+      case 'j': jobs = strtol(optarg, NULL, 10); break;
+      case 'v': only = atoi(optarg); break;
+      default: usage();
+    }
+  }
+  if (optind >= argc || jobs < 1 || variants < 1) usage();
+
+  std::vector<Scenario> scenarios(argc - optind);
+  for(int i = optind; i < argc; i++)
+    parse_scenario(argv[i], scenarios[i - optind]);
+
+  if (only >= 0) {
+    if (scenarios.size() != 1) usage();
+    return run(scenarios[0], only, true);
+  }
+
+  struct timeval start, finish;
+  gettimeofday(&start, NULL);
+  unsigned long runs = 0, failed = 0;
+  double virtual_sec = 0;
+  long running = 0;
+  fflush(stdout);
+  for(size_t s = 0; s < scenarios.size(); s++) {
+    for(unsigned int v = 0; v < variants; v++) {
+      if (running >= jobs) {
+        int status;
+        if (wait(&status) > 0) {
+          running--;
+          if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) failed++;
+        }
+      }
+      pid_t pid = fork();
+      if (pid < 0) {
+        perror("fork");
+        return 2;
+      }
+      if (pid == 0) _exit(run(scenarios[s], v, false));
+      running++;
+      runs++;
+      virtual_sec += scenarios[s].end.hi;
+    }
+  }
+  while(running > 0) {
+    int status;
+    if (wait(&status) < 0) {
+      if (errno == EINTR) continue;
+      break;
+    }
+    running--;
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) failed++;
+  }
+  gettimeofday(&finish, NULL);
+  double wall = (finish.tv_sec - start.tv_sec) + (finish.tv_usec - start.tv_usec) / 1e6;
+  printf("%lu runs, %lu failed, up to %.1f virtual hours in %.2f s\n", runs, failed, virtual_sec / 3600, wall);
+  return failed == 0 ? 0 : 1;
+}
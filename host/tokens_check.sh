@@ -0,0 +1,30 @@
+#!/bin/sh
+#
+# Run a sketch built to log in text and the same sketch built to log in tokens,
+# the same way, and check that hydra_logdecode turns the tokens into the text.
+#
+# Usage: tokens_check.sh sketch.ino text_program tokens_program [options...]
+
+if [ $# -lt 3 ]; then
+  echo "Usage: $0 sketch.ino text_program tokens_program [options...]" >&2
+  exit 1
+fi
+
+sketch=$1
+text=$2
+tokens=$3
+shift 3
+
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+strip='s/^\[ *[0-9.]*\] //p'
+"$text" -s "$@" | sed -n "$strip" > "$dir/text" || exit 1
+"$tokens" -l "$dir/capture" "$@" > /dev/null || exit 1
+./hydra_logdecode "$sketch" "$dir/capture" | sed -n "$strip" > "$dir/decoded" || exit 1
+
+if ! diff "$dir/text" "$dir/decoded"; then
+  echo "$sketch: decoded tokens differ from the text log" >&2
+  exit 1
+fi
+echo "$sketch: $(wc -l < "$dir/text") lines, $(wc -c < "$dir/text") bytes of text, $(wc -c < "$dir/capture") bytes of tokens"
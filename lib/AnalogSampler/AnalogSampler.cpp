@@ -0,0 +1,274 @@
+/*
+
+ AnalogSampler - interrupt driven A/d converter sampling for the J1772 Hydra
+ Copyright 2026 Nicholas W. Sayer
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program; if not, write to the Free Software Foundation, Inc.,
+ 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <util/atomic.h>
+#include "AnalogSampler.h"
+
+#define RING_MASK (SAMPLER_RING_SIZE - 1)
+
+AnalogSampler Sampler;
+
+// Point the A/d mux at the given channel, with AVcc as the reference
+// (which is what analogReference(DEFAULT) would have given us).
+static inline void selectChannel(uint8_t channel) {
+#if defined(MUX5)
+  ADCSRB = (ADCSRB & ~_BV(MUX5)) | ((channel & 0x08) ? _BV(MUX5) : 0);
+#endif
+  ADMUX = _BV(REFS0) | (channel & 0x07);
+}
+
+// Start a conversion right away.
+static inline void startConversion() {
+  ADCSRA = (ADCSRA & ~_BV(ADATE)) | _BV(ADSC);
+}
+
+// Have Timer1 start the next conversion, either as it reaches the top of its
+// count or as it gets back down to the bottom.
+static inline void triggerConversion(boolean top) {
+  // The conversion starts as the flag is set, so it mustn't be set already.
+  TIFR1 = top ? _BV(ICF1) : _BV(TOV1);
+  // Trigger on Timer1 capture (which is set at TOP when ICR1 is TOP) or overflow (set at BOTTOM).
+  ADCSRB = (ADCSRB & ~(_BV(ADTS2) | _BV(ADTS1) | _BV(ADTS0))) | _BV(ADTS2) | _BV(ADTS1) | (top ? _BV(ADTS0) : 0);
+  ADCSRA |= _BV(ADATE);
+}
+
+void AnalogSampler::begin(const uint8_t *chans, uint8_t n, uint8_t t, unsigned int period) {
+  if (n > SAMPLER_MAX_CHANNELS) n = SAMPLER_MAX_CHANNELS;
+  if (t > n) t = n;
+  ADCSRA = 0; // stop anything that might be in progress
+  for(uint8_t i = 0; i < n; i++) {
+    channels[i] = chans[i];
+    head[i] = 0;
+    fill[i] = 0;
+    rms_state[i].enabled = false;
+  }
+  count = n;
+  timed = t;
+  period_us = period;
+  free_per_half = 0;
+  if (t != 0 && period / 2 > SAMPLER_TIMED_MARGIN_US + 2 * SAMPLER_CONVERSION_US)
+    free_per_half = SAMPLER_FREE_CONVERSIONS(period);
+  timed_slot = 0;
+  timed_top = false;
+  free_slot = t;
+  free_left = 0;
+  current = 0;
+  if (n == 0) return;
+  selectChannel(channels[0]);
+  // Enable, interrupt on completion, /128 prescaler...
+  ADCSRA = _BV(ADEN) | _BV(ADIE) | _BV(ADPS2) | _BV(ADPS1) | _BV(ADPS0);
+  // ...and start the first conversion.
+  if (timed == 0) {
+    startConversion();
+  } else {
+    triggerConversion(false);
+    timed_top = true;
+  }
+}
+
+void AnalogSampler::measureRms(uint8_t slot) {
+  if (slot < timed || slot >= count) return;
+  if (timed == 0)
+    rate16 = 16000000UL / (count * SAMPLER_CONVERSION_US);
+  else
+    rate16 = (32000000UL / period_us) * free_per_half / (count - timed);
+  if (rate16 == 0) return; // the slot never gets sampled
+  cycle_50 = rate16 / 50;
+  cycle_60 = rate16 / 60;
+  min_cycle = rate16 / (16 * SAMPLER_MAINS_MAX_HZ);
+  unsigned long longest = rate16 / (16 * SAMPLER_MAINS_MIN_HZ);
+  max_cycle = (longest > 254) ? 254 : longest;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    Rms &r = rms_state[slot];
+    r.positive = false;
+    r.zero = 512;
+    r.quiet = 0;
+    r.since = 255;
+    r.period_acc = 0;
+    r.period = cycle_50; // until we know better
+    r.phase = 0;
+    r.count = 0;
+    r.sum = 0;
+    r.cycle_count = 0;
+    r.cycle_sum = 0;
+    r.enabled = true;
+  }
+}
+
+void AnalogSampler::setRmsZero(uint8_t slot, uint16_t zero) {
+  if (slot >= count || zero < SAMPLER_RMS_HYSTERESIS || zero > 1023 - SAMPLER_RMS_HYSTERESIS) return;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    rms_state[slot].zero = zero;
+  }
+}
+
+unsigned int AnalogSampler::rms(uint8_t slot, unsigned long *sum_squares) {
+  unsigned int n = 0;
+  *sum_squares = 0;
+  if (slot >= count) return 0;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    n = rms_state[slot].cycle_count;
+    *sum_squares = rms_state[slot].cycle_sum;
+  }
+  return n;
+}
+
+unsigned int AnalogSampler::mainsFrequency(uint8_t slot) {
+  unsigned int period = 0;
+  if (slot >= count) return 0;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    if (rms_state[slot].period_acc != 0) period = rms_state[slot].period;
+  }
+  if (period == 0) return 0;
+  return (rate16 * 10) / period;
+}
+
+// Called from the interrupt handler with each new sample of a slot being measured for RMS.
+void AnalogSampler::accumulate(Rms &r, uint16_t value) {
+  // First, follow the mains frequency.
+  if (r.since != 255) r.since++;
+  if (r.quiet != 0) {
+    r.quiet--;
+  } else if (r.positive ? (value < r.zero - SAMPLER_RMS_HYSTERESIS) : (value > r.zero + SAMPLER_RMS_HYSTERESIS)) {
+    r.positive = !r.positive;
+    // Don't look for another for a quarter cycle, in case of noise near zero.
+    r.quiet = r.period >> 6;
+    if (r.positive) {
+      // From one rising crossing to the next is a cycle, if it's a plausible length for one.
+      if (r.since >= min_cycle && r.since <= max_cycle) {
+        unsigned int cycle = (unsigned int)r.since << 4;
+        if (r.period_acc == 0) {
+          // The first one just picks 50 or 60 Hz to start from.
+          r.period_acc = (cycle > (cycle_50 + cycle_60) / 2 ? cycle_50 : cycle_60) << 3;
+        } else {
+          r.period_acc += cycle - (r.period_acc >> 3);
+        }
+        r.period = r.period_acc >> 3;
+      }
+      r.since = 0;
+    }
+  }
+
+  // Then add the square to the current cycle, or to the end of it and the start of the next.
+  int16_t centred = (int16_t)value - (int16_t)r.zero;
+  unsigned long square = (unsigned long)((long)centred * centred);
+  uint8_t part = 16;
+  if (r.phase + 16 >= r.period) {
+    part = (r.period > r.phase) ? r.period - r.phase : 0;
+    r.cycle_sum = r.sum + square * part;
+    r.cycle_count = r.count + part;
+    r.sum = 0;
+    r.count = 0;
+    r.phase = 0;
+    part = 16 - part;
+  }
+  r.sum += square * part;
+  r.count += part;
+  r.phase += part;
+}
+
+unsigned int AnalogSampler::samplePeriod() {
+  if (timed == 0) return count * SAMPLER_CONVERSION_US;
+  if (free_per_half == 0 || count == timed) return 0;
+  return (period_us / 2 / free_per_half) * (count - timed);
+}
+
+void AnalogSampler::completed(uint16_t value) {
+  uint8_t slot = current;
+  uint8_t h = head[slot];
+  ring[slot][h] = value;
+  head[slot] = (h + 1) & RING_MASK;
+  if (fill[slot] < SAMPLER_RING_SIZE) fill[slot]++;
+  if (rms_state[slot].enabled) accumulate(rms_state[slot], value);
+
+  if (timed == 0) {
+    if (++slot >= count) slot = 0;
+    current = slot;
+    // Change the mux first. The new channel only takes effect at the start of the
+    // next conversion, which we kick off immediately afterwards.
+    selectChannel(channels[slot]);
+    startConversion();
+    return;
+  }
+
+  // A timed conversion is followed by as many of the others as will fit before the next one.
+  if (slot < timed) free_left = (count > timed) ? free_per_half : 0;
+  if (free_left != 0) {
+    free_left--;
+    current = free_slot;
+    if (++free_slot >= count) free_slot = timed;
+    selectChannel(channels[current]);
+    startConversion();
+    return;
+  }
+
+  // Time for the next timed one. Each timed slot gets the middle of the high half of
+  // the cycle (at BOTTOM), then the middle of the low half (at TOP), then the next one has a turn.
+  current = timed_slot;
+  selectChannel(channels[current]);
+  triggerConversion(timed_top);
+  if (timed_top) {
+    if (++timed_slot >= timed) timed_slot = 0;
+  }
+  timed_top = !timed_top;
+}
+
+uint8_t AnalogSampler::latest(uint8_t slot, uint16_t *buf, uint8_t max) {
+  uint8_t n = 0;
+  if (slot >= count) return 0;
+  // The samples are 16 bits, so the copy must not be interrupted part way.
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    n = fill[slot];
+    if (n > max) n = max;
+    uint8_t i = (head[slot] - n) & RING_MASK;
+    for(uint8_t j = 0; j < n; j++) {
+      buf[j] = ring[slot][i];
+      i = (i + 1) & RING_MASK;
+    }
+  }
+  return n;
+}
+
+uint8_t AnalogSampler::range(const uint8_t *slots, uint8_t n, uint8_t max, uint16_t *low, uint16_t *high) {
+  uint8_t fewest = max;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    for(uint8_t s = 0; s < n; s++) {
+      uint8_t slot = slots[s];
+      uint16_t lo = 0xffff, hi = 0;
+      uint8_t k = (slot < count) ? fill[slot] : 0;
+      if (k > max) k = max;
+      if (k < fewest) fewest = k;
+      uint8_t i = (slot < count) ? ((head[slot] - k) & RING_MASK) : 0;
+      for(uint8_t j = 0; j < k; j++) {
+        uint16_t val = ring[slot][i];
+        if (val < lo) lo = val;
+        if (val > hi) hi = val;
+        i = (i + 1) & RING_MASK;
+      }
+      low[s] = lo;
+      high[s] = hi;
+    }
+  }
+  return fewest;
+}
+
+ISR(ADC_vect) {
+  Sampler.completed(ADC);
+}
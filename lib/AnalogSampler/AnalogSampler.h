@@ -0,0 +1,162 @@
+/*
+
+ AnalogSampler - interrupt driven A/d converter sampling for the J1772 Hydra
+ Copyright 2026 Nicholas W. Sayer
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program; if not, write to the Free Software Foundation, Inc.,
+ 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef AnalogSampler_h
+#define AnalogSampler_h
+
+#include <Arduino.h>
+
+// The A/d converter runs continuously off of its conversion-complete interrupt,
+// visiting each of the configured channels in turn. Each finished conversion is
+// dropped into a ring buffer for its channel ("slot"), and the sketch simply copies
+// out the most recent history whenever it wants to look at it. Nothing ever waits
+// on the converter.
+//
+// Some channels can instead be "timed" to the PWM waveform that Timer1 makes
+// (the J1772 pilot). The PWM library runs Timer1 in phase and frequency correct
+// mode, where a pin's high time is centred on the bottom of the count and its low
+// time on the top. The A/d converter can be started by hardware at either of
+// those moments, so each timed channel is converted exactly at the middle of the
+// high part of the cycle and then exactly at the middle of the low part, with the
+// timed channels taking turns. The other channels fill in the time in between.
+// Samples of a timed slot therefore alternate between high and low.
+//
+// A slot carrying an AC signal centred on (about) mid-scale, like a current
+// transformer, can also have its RMS measured as the samples come in. It locks
+// onto the mains frequency from the signal's zero crossings (starting from whichever
+// of 50 or 60 Hz is closer, and following it from there) and adds up the squares
+// over windows of exactly one mains cycle. The sample that straddles the end of a
+// window is split between it and the next one, so every window is a whole cycle to
+// within a sixteenth of a sample, whatever the mains frequency. There's always the
+// latest cycle ready to read.
+//
+// Since the A/d converter belongs to us once begin() is called, nothing else may
+// use analogRead() afterwards.
+
+// The maximum number of channels that may be sampled. A Mega has the RAM for a Hydra
+// with four outlets.
+#if defined(__AVR_ATmega640__) || defined(__AVR_ATmega1280__) || defined(__AVR_ATmega2560__)
+#define SAMPLER_MAX_CHANNELS 8
+#else
+#define SAMPLER_MAX_CHANNELS 4
+#endif
+
+// The number of samples kept for each channel. This must be a power of two,
+// and no larger than 128.
+#define SAMPLER_RING_SIZE 64
+
+// A conversion is 13 A/d clocks. With a 16 MHz system clock and the /128 prescaler
+// (the same one analogRead() uses), that's 104 microseconds.
+#define SAMPLER_CONVERSION_US 104
+
+// When the untimed channels are being squeezed in between the timed ones, stop
+// starting them if they wouldn't finish at least this many microseconds before the
+// next timed conversion. That leaves room for other interrupts to hold ours up.
+#define SAMPLER_TIMED_MARGIN_US 40
+
+// The range of mains frequencies that the RMS measurement will lock onto.
+#define SAMPLER_MAINS_MIN_HZ 45
+#define SAMPLER_MAINS_MAX_HZ 65
+
+// A zero crossing only counts once the signal gets this far past mid-scale, so that
+// the noise when there's no current flowing isn't taken for the mains.
+#define SAMPLER_RMS_HYSTERESIS 4
+
+// How many untimed conversions fit in each half of a timed PWM period, after the
+// timed conversion at its start.
+#define SAMPLER_FREE_CONVERSIONS(period_us) ((((period_us) / 2 - SAMPLER_TIMED_MARGIN_US) / SAMPLER_CONVERSION_US) - 1)
+
+class AnalogSampler
+{
+  public:
+    // Begin sampling the given analog channels, round-robin. If timed is not zero, then
+    // the first timed channels are converted in step with Timer1's PWM, which must already
+    // be running with a period of no less than period_us microseconds.
+    void begin(const uint8_t *channels, uint8_t count, uint8_t timed = 0, unsigned int period_us = 0);
+    // Copy up to max of the most recent samples for the given slot into buf,
+    // oldest first. Returns how many were copied, which is only less than max
+    // if fewer samples than that have been taken since begin().
+    uint8_t latest(uint8_t slot, uint16_t *buf, uint8_t max);
+    // Find the lowest and highest of the last max samples for each of n slots. All of
+    // the slots are looked at together, so the results all cover the same stretch of
+    // time (give or take a conversion or two, as the channels take turns), and there's
+    // no copying. Returns the number of samples looked at per slot, as for latest().
+    uint8_t range(const uint8_t *slots, uint8_t n, uint8_t max, uint16_t *low, uint16_t *high);
+    // Start measuring the RMS of a slot, in whole mains cycles.
+    void measureRms(uint8_t slot);
+    // Change what a slot being measured for RMS reads at zero. It starts at mid-scale.
+    void setRmsZero(uint8_t slot, uint16_t zero);
+    // Get the sum of the squares (of the distance from zero) of the samples in the
+    // latest mains cycle of a slot being measured for RMS. Returns how many samples there
+    // were. Both are in sixteenths of a sample, and the count is zero if there's been
+    // nothing published yet.
+    unsigned int rms(uint8_t slot, unsigned long *sum_squares);
+    // The mains frequency that a slot being measured for RMS has locked onto, in tenths
+    // of a Hz, or zero if it hasn't yet.
+    unsigned int mainsFrequency(uint8_t slot);
+    // The average number of microseconds between consecutive samples of any one untimed channel.
+    unsigned int samplePeriod();
+    // Called with each completed conversion, to store it and start the next one.
+    void completed(uint16_t value);
+
+  private:
+    uint8_t channels[SAMPLER_MAX_CHANNELS];
+    uint8_t count;
+    uint8_t timed;
+    uint8_t free_per_half;
+    unsigned int period_us;
+    volatile uint8_t current;
+    // The timed slot, and which half of its cycle, that's next to be converted.
+    uint8_t timed_slot;
+    boolean timed_top;
+    // The untimed slot that's next, and how many more of them fit before the next timed one.
+    uint8_t free_slot;
+    uint8_t free_left;
+    volatile uint8_t head[SAMPLER_MAX_CHANNELS];
+    volatile uint8_t fill[SAMPLER_MAX_CHANNELS];
+    volatile uint16_t ring[SAMPLER_MAX_CHANNELS][SAMPLER_RING_SIZE];
+    // The RMS measurement of each slot. Lengths of time are in sixteenths of a sample.
+    struct Rms {
+      boolean enabled;
+      boolean positive; // which side of zero the signal was last seen on
+      uint16_t zero;
+      uint8_t quiet; // samples until we look for another zero crossing
+      uint8_t since; // samples since the last rising zero crossing, up to 255
+      unsigned int period_acc; // eight times the average cycle, or zero if not locked yet
+      unsigned int period; // the length of a cycle
+      unsigned int phase; // how far into the current cycle we are
+      unsigned int count;
+      unsigned long sum;
+      // The last complete cycle.
+      unsigned int cycle_count;
+      unsigned long cycle_sum;
+    };
+    Rms rms_state[SAMPLER_MAX_CHANNELS];
+    // Sixteen times the number of samples per second of each untimed slot.
+    unsigned long rate16;
+    // The length of a 50 and 60 Hz cycle, and the range of cycles (in whole samples) we'll lock onto.
+    unsigned int cycle_50, cycle_60;
+    uint8_t min_cycle, max_cycle;
+    void accumulate(Rms &r, uint16_t value);
+};
+
+extern AnalogSampler Sampler;
+
+#endif
@@ -0,0 +1,162 @@
+/*
+
+ AsyncTWI - interrupt driven, queued i2c transactions for the J1772 Hydra
+ Copyright 2026 Nicholas W. Sayer
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program; if not, write to the Free Software Foundation, Inc.,
+ 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <avr/sleep.h>
+#include <util/atomic.h>
+#include "AsyncTWI.h"
+
+// The TWI status codes we see as a master (TWSR, less the prescaler bits).
+#define TW_START 0x08
+#define TW_REP_START 0x10
+#define TW_MT_SLA_ACK 0x18
+#define TW_MT_SLA_NACK 0x20
+#define TW_MT_DATA_ACK 0x28
+#define TW_MT_DATA_NACK 0x30
+#define TW_MR_SLA_ACK 0x40
+#define TW_MR_SLA_NACK 0x48
+#define TW_MR_DATA_ACK 0x50
+#define TW_MR_DATA_NACK 0x58
+
+AsyncTWI Twi;
+
+// Hand the bus the next step. Writing TWINT clears it, which sets the hardware going.
+static inline void step(uint8_t bits) {
+  TWCR = _BV(TWEN) | _BV(TWIE) | _BV(TWINT) | bits;
+}
+
+void AsyncTWI::begin(unsigned long hz) {
+  // The same weak pull-ups Wire turns on. The LCD shield has real ones.
+  digitalWrite(SDA, HIGH);
+  digitalWrite(SCL, HIGH);
+  TWSR = 0; // no prescaler
+  TWBR = ((F_CPU / hz) - 16) / 2;
+  head = tail = NULL;
+  active = false;
+  TWCR = _BV(TWEN) | _BV(TWIE);
+}
+
+boolean AsyncTWI::queue(TwiTransaction *t) {
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    if (t->status == TWI_PENDING) return false;
+    t->status = TWI_PENDING;
+    t->next = NULL;
+    if (head == NULL) head = t; else tail->next = t;
+    tail = t;
+    if (!active) {
+      // If the last one just ended, its stop may still be going out.
+      while(TWCR & _BV(TWSTO)) ;
+      active = true;
+      step(_BV(TWSTA));
+    }
+  }
+  return true;
+}
+
+void AsyncTWI::wait(TwiTransaction *t) {
+  uint8_t sreg = SREG;
+  cli();
+  while(t->status == TWI_PENDING) {
+    // The instruction after sei() always runs before any interrupt, so the one
+    // that finishes it can't slip in between the test and going to sleep.
+    sleep_enable();
+    sei();
+    sleep_cpu();
+    cli();
+    sleep_disable();
+  }
+  SREG = sreg;
+}
+
+uint8_t AsyncTWI::run(TwiTransaction *t) {
+  queue(t);
+  wait(t);
+  return t->status;
+}
+
+// The head transaction is over. Its done function goes first, so that whatever it
+// queues follows this one's stop straight away, with the bus never going idle.
+void AsyncTWI::finish(uint8_t status) {
+  TwiTransaction *t = head;
+  head = t->next;
+  t->status = status;
+  if (t->done != NULL) t->done(t);
+  if (head != NULL) {
+    step(_BV(TWSTO) | _BV(TWSTA));
+  } else {
+    active = false;
+    step(_BV(TWSTO));
+  }
+}
+
+void AsyncTWI::interrupt() {
+  TwiTransaction *t = head;
+  switch(TWSR & 0xf8) {
+    case TW_START:
+      // A new transaction. It reads straight away only if it has nothing to write.
+      index = 0;
+      TWDR = (t->address << 1) | ((t->tx_len == 0 && t->rx_len != 0) ? 1 : 0);
+      step(0);
+      break;
+    case TW_REP_START:
+      // Done writing, and on to reading.
+      TWDR = (t->address << 1) | 1;
+      step(0);
+      break;
+    case TW_MT_SLA_ACK:
+    case TW_MT_DATA_ACK:
+      if (index < t->tx_len) {
+        TWDR = t->tx[index++];
+        step(0);
+      } else if (t->rx_len != 0) {
+        step(_BV(TWSTA));
+      } else {
+        finish(TWI_OK);
+      }
+      break;
+    case TW_MR_SLA_ACK:
+      index = 0;
+      // Acknowledge every byte but the last.
+      step(t->rx_len > 1 ? _BV(TWEA) : 0);
+      break;
+    case TW_MR_DATA_ACK:
+      t->rx[index++] = TWDR;
+      step(index + 1 < t->rx_len ? _BV(TWEA) : 0);
+      break;
+    case TW_MR_DATA_NACK:
+      t->rx[index] = TWDR;
+      finish(TWI_OK);
+      break;
+    case TW_MT_SLA_NACK:
+    case TW_MR_SLA_NACK:
+      finish(TWI_NACK_ADDRESS);
+      break;
+    case TW_MT_DATA_NACK:
+      finish(TWI_NACK_DATA);
+      break;
+    default:
+      // Lost arbitration (there's no other master, so that's noise), or a bus error.
+      finish(TWI_ERROR);
+      break;
+  }
+}
+
+ISR(TWI_vect) {
+  Twi.interrupt();
+}
@@ -0,0 +1,99 @@
+/*
+
+ AsyncTWI - interrupt driven, queued i2c transactions for the J1772 Hydra
+ Copyright 2026 Nicholas W. Sayer
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program; if not, write to the Free Software Foundation, Inc.,
+ 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef AsyncTWI_h
+#define AsyncTWI_h
+
+#include <Arduino.h>
+
+// Wire carries out an i2c transaction from start to finish while its caller waits,
+// so everything on the bus (the LCD, its buttons, the clock) used to stop the sketch
+// for as long as it took on the wire. Here, a transaction is queued instead, and the
+// TWI interrupt carries it through a byte at a time while the sketch gets on with
+// other things. Transactions go out one after another in the order they were queued.
+// As each finishes, its done function (if it has one) is called from the interrupt
+// handler. It may queue the same transaction, or another one, again.
+//
+// A transaction writes tx_len bytes from tx and then, if rx_len isn't zero, reads
+// rx_len bytes into rx (after a repeated start, if it wrote anything first). The
+// transaction and both of its buffers belong to the bus from queue() until it has
+// finished, and mustn't be touched in between.
+//
+// Since the TWI belongs to us once begin() is called, nothing may use Wire (or any
+// library built on it) afterwards.
+
+// Bus clocks. The MCP23017 behind the LCD can go much faster than fast mode, but a
+// DS1307 is a standard mode part, and it mustn't see fast mode traffic, even to others.
+#define TWI_STANDARD_HZ 100000L
+#define TWI_FAST_HZ 400000L
+
+// What became of a transaction. The failures are numbered the way Wire's
+// endTransmission() numbers them.
+#define TWI_OK 0
+#define TWI_NACK_ADDRESS 2   // nobody answered to the address
+#define TWI_NACK_DATA 3      // the device refused a byte
+#define TWI_ERROR 4          // lost arbitration, or a bus error
+#define TWI_PENDING 0xff     // queued, and not yet finished
+
+struct TwiTransaction;
+
+typedef void (*TwiFunction)(TwiTransaction *t);
+
+struct TwiTransaction {
+  uint8_t address;           // the 7 bit device address
+  const uint8_t *tx;
+  uint8_t tx_len;
+  uint8_t *rx;
+  uint8_t rx_len;
+  TwiFunction done;          // called from the interrupt when it's finished, or NULL
+  void *context;             // for the done function, to find whatever queued it
+  volatile uint8_t status;   // TWI_PENDING until it's finished. Must start out as something else
+  TwiTransaction *next;
+};
+
+class AsyncTWI
+{
+  public:
+    // Take over the TWI, running the bus at the given clock.
+    void begin(unsigned long hz);
+    // Put a transaction at the end of the queue. Returns false (and does nothing) if
+    // it's already queued.
+    boolean queue(TwiTransaction *t);
+    // Whether a transaction is queued, or on the wire now.
+    boolean busy(const TwiTransaction *t) { return t->status == TWI_PENDING; }
+    // Wait for a queued transaction to finish, idling in between interrupts. The
+    // interrupts have to be on.
+    void wait(TwiTransaction *t);
+    // Queue a transaction and wait for it. Returns how it finished.
+    uint8_t run(TwiTransaction *t);
+    // Called from the TWI interrupt, to take the transaction at the head of the queue a step further.
+    void interrupt();
+
+  private:
+    TwiTransaction *volatile head;
+    TwiTransaction *tail;
+    volatile boolean active; // the bus is ours, and the head transaction is under way
+    uint8_t index;           // of the byte in tx or rx that's next
+    void finish(uint8_t status);
+};
+
+extern AsyncTWI Twi;
+
+#endif
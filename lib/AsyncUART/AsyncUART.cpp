@@ -0,0 +1,136 @@
+/*
+
+ AsyncUART - buffered, never blocking serial log output for the J1772 Hydra
+ Copyright 2026 Nicholas W. Sayer
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program; if not, write to the Free Software Foundation, Inc.,
+ 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <util/atomic.h>
+#include "AsyncUART.h"
+
+#define RING_MASK (UART_TX_BUFFER - 1)
+
+AsyncUART Uart;
+
+void AsyncUART::begin(unsigned long baud) {
+  head = tail = fill = 0;
+  overflowed = false;
+  dropped = 0;
+  custom_marker = NULL;
+  // Double speed, which gets closer to the faster rates. This is the same rounding HardwareSerial does.
+  UBRR0 = ((F_CPU / 4 / baud) - 1) / 2;
+  UCSR0A = _BV(U2X0);
+  UCSR0C = _BV(UCSZ01) | _BV(UCSZ00);
+  UCSR0B = _BV(TXEN0) | _BV(RXEN0);
+}
+
+boolean AsyncUART::put(uint8_t c) {
+  if (overflowed) return false;
+  uint8_t next = (fill + 1) & RING_MASK;
+  if (next == tail) {
+    overflowed = true;
+    return false;
+  }
+  ring[fill] = c;
+  fill = next;
+  return true;
+}
+
+// Hand what's been written so far to the interrupt.
+void AsyncUART::publish() {
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    head = fill;
+    UCSR0B |= _BV(UDRIE0);
+  }
+}
+
+// Say how many lines went missing, as a line of its own. If even that doesn't fit,
+// keep counting.
+void AsyncUART::marker() {
+  unsigned int count = dropped;
+  // A custom marker writes with write(), which mustn't come back here.
+  dropped = 0;
+  if (custom_marker != NULL) {
+    custom_marker(count);
+  } else {
+    char digits[6];
+    uint8_t n = 0;
+    unsigned int left = count;
+    do {
+      digits[n++] = '0' + left % 10;
+      left /= 10;
+    } while(left != 0);
+    const char *text = PSTR("DROPPED LINES: ");
+    for(uint8_t i = 0; pgm_read_byte(text + i) != 0; i++) put(pgm_read_byte(text + i));
+    while(n > 0) put(digits[--n]);
+    text = PSTR("\r\n");
+    for(uint8_t i = 0; pgm_read_byte(text + i) != 0; i++) put(pgm_read_byte(text + i));
+  }
+  if (overflowed) {
+    fill = head;
+    overflowed = false;
+    dropped = count;
+    return;
+  }
+  publish();
+}
+
+size_t AsyncUART::write(uint8_t c) {
+  // The first character of a line goes after the news of any that were lost.
+  if (fill == head && !overflowed && dropped != 0) marker();
+  return put(c) ? 1 : 0;
+}
+
+boolean AsyncUART::endLine() {
+  put('\r');
+  put('\n');
+  return endRecord();
+}
+
+boolean AsyncUART::endRecord() {
+  if (overflowed) {
+    fill = head;
+    overflowed = false;
+    if (dropped != 0xffff) dropped++;
+    return false;
+  }
+  publish();
+  return true;
+}
+
+int AsyncUART::available() {
+  return (UCSR0A & _BV(RXC0)) ? 1 : 0;
+}
+
+int AsyncUART::read() {
+  if (!(UCSR0A & _BV(RXC0))) return -1;
+  return UDR0;
+}
+
+void AsyncUART::interrupt() {
+  UDR0 = ring[tail];
+  tail = (tail + 1) & RING_MASK;
+  if (tail == head) UCSR0B &= ~_BV(UDRIE0);
+}
+
+// The ATmega328P has the one USART. The Mega has four, and numbers their vectors.
+#ifdef USART0_UDRE_vect
+ISR(USART0_UDRE_vect) {
+#else
+ISR(USART_UDRE_vect) {
+#endif
+  Uart.interrupt();
+}
@@ -0,0 +1,86 @@
+/*
+
+ AsyncUART - buffered, never blocking serial log output for the J1772 Hydra
+ Copyright 2026 Nicholas W. Sayer
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program; if not, write to the Free Software Foundation, Inc.,
+ 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef AsyncUART_h
+#define AsyncUART_h
+
+#include <Arduino.h>
+
+// HardwareSerial's write() waits for room in its transmit buffer, so once a burst of
+// logging fills it, the sketch goes at the speed of the serial port. Here, nothing
+// waits. A line is written a piece at a time into the ring, and only handed to the
+// UART's data register empty interrupt once endLine() finds that all of it fit. If
+// it didn't, the whole line is dropped rather than waited for, and counted. When
+// there's room again, a "DROPPED LINES: n" line goes out ahead of the next one.
+//
+// Lines are only ever written from outside of interrupt handlers.
+//
+// What goes out needn't be text. endRecord() lets go of whatever was written as it
+// is, with the same all or nothing rule, and setMarker() has the news of dropped
+// records written some other way.
+//
+// Receiving is left to the UART's own two byte buffer, which is plenty for the
+// single character commands the sketches take.
+//
+// Since USART0 belongs to us once begin() is called, nothing may use Serial afterwards.
+
+// The ring. This must be a power of two, no bigger than 256.
+#define UART_TX_BUFFER 128
+
+// Writes the news that this many records were dropped, with write().
+typedef void (*UartMarker)(unsigned int dropped);
+
+class AsyncUART : public Print
+{
+  public:
+    // Take over USART0, 8N1. With a 16 MHz clock, 250000 is exact, and 115200
+    // is 2% fast (which is what HardwareSerial gives, too).
+    void begin(unsigned long baud);
+    virtual size_t write(uint8_t c);
+    using Print::write;
+    // Add the line ending, and let the line go. Returns false if it didn't fit (and
+    // so was dropped).
+    boolean endLine();
+    // The same, without the line ending.
+    boolean endRecord();
+    // Use this instead of the "DROPPED LINES" line, or NULL to go back to that.
+    void setMarker(UartMarker m) { custom_marker = m; }
+    // Whether a character has come in, and what it is (or -1 if none has).
+    int available();
+    int read();
+    // Called from the data register empty interrupt.
+    void interrupt();
+
+  private:
+    uint8_t ring[UART_TX_BUFFER];
+    volatile uint8_t head;  // the end of what the interrupt may send
+    volatile uint8_t tail;  // the next byte it sends
+    uint8_t fill;           // where the line being written goes next
+    boolean overflowed;     // some of the line being written didn't fit
+    unsigned int dropped;   // lines dropped since the last marker went out
+    UartMarker custom_marker;
+    boolean put(uint8_t c);
+    void publish();
+    void marker();
+};
+
+extern AsyncUART Uart;
+
+#endif
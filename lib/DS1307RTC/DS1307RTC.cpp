@@ -23,19 +23,24 @@
  */
 
 
-#if defined (__AVR_ATtiny84__) || defined(__AVR_ATtiny85__) || (__AVR_ATtiny2313__)
-#include <TinyWireM.h>
-#define Wire TinyWireM
-#else
-#include <Wire.h>
-#endif
+#include <AsyncTWI.h>
 #include "DS1307RTC.h"
 
 #define DS1307_CTRL_ID 0x68 
 
+// Ported from Wire to AsyncTWI. Everything but isRunning() still waits for its
+// transactions to finish, but isRunning() (which the EVSE asks every time it
+// redraws the clock) answers from a read that happened in the background.
+
 DS1307RTC::DS1307RTC()
 {
-  Wire.begin();
+  poll.address = DS1307_CTRL_ID;
+  poll.tx = &seconds_register;
+  poll.tx_len = 1;
+  poll.rx = &poll_seconds;
+  poll.rx_len = 1;
+  poll.done = NULL;
+  poll.status = TWI_OK;
 }
   
 // PUBLIC FUNCTIONS
@@ -56,42 +61,21 @@ bool DS1307RTC::set(time_t t)
 // Aquire data from the RTC chip in BCD format
 bool DS1307RTC::read(tmElements_t &tm)
 {
-  uint8_t sec;
-  Wire.beginTransmission(DS1307_CTRL_ID);
-#if ARDUINO >= 100  
-  Wire.write((uint8_t)0x00); 
-#else
-  Wire.send(0x00);
-#endif  
-  if (Wire.endTransmission() != 0) {
+  uint8_t buf[tmNbrFields];
+  // request the 7 data fields   (secs, min, hr, dow, date, mth, yr)
+  if (transfer(&seconds_register, 1, buf, tmNbrFields) != TWI_OK) {
     exists = false;
     return false;
   }
   exists = true;
-
-  // request the 7 data fields   (secs, min, hr, dow, date, mth, yr)
-  Wire.requestFrom(DS1307_CTRL_ID, tmNbrFields);
-  if (Wire.available() < tmNbrFields) return false;
-#if ARDUINO >= 100
-  sec = Wire.read();
-  tm.Second = bcd2dec(sec & 0x7f);   
-  tm.Minute = bcd2dec(Wire.read() );
-  tm.Hour =   bcd2dec(Wire.read() & 0x3f);  // mask assumes 24hr clock
-  tm.Wday = bcd2dec(Wire.read() );
-  tm.Day = bcd2dec(Wire.read() );
-  tm.Month = bcd2dec(Wire.read() );
-  tm.Year = y2kYearToTm((bcd2dec(Wire.read())));
-#else
-  sec = Wire.receive();
-  tm.Second = bcd2dec(sec & 0x7f);   
-  tm.Minute = bcd2dec(Wire.receive() );
-  tm.Hour =   bcd2dec(Wire.receive() & 0x3f);  // mask assumes 24hr clock
-  tm.Wday = bcd2dec(Wire.receive() );
-  tm.Day = bcd2dec(Wire.receive() );
-  tm.Month = bcd2dec(Wire.receive() );
-  tm.Year = y2kYearToTm((bcd2dec(Wire.receive())));
-#endif
-  if (sec & 0x80) return false; // clock is halted
+  tm.Second = bcd2dec(buf[0] & 0x7f);   
+  tm.Minute = bcd2dec(buf[1]);
+  tm.Hour =   bcd2dec(buf[2] & 0x3f);  // mask assumes 24hr clock
+  tm.Wday = bcd2dec(buf[3]);
+  tm.Day = bcd2dec(buf[4]);
+  tm.Month = bcd2dec(buf[5]);
+  tm.Year = y2kYearToTm((bcd2dec(buf[6])));
+  if (buf[0] & 0x80) return false; // clock is halted
   return true;
 }
 
@@ -100,42 +84,25 @@ bool DS1307RTC::write(tmElements_t &tm)
   // To eliminate any potential race conditions,
   // stop the clock before writing the values,
   // then restart it after.
-  Wire.beginTransmission(DS1307_CTRL_ID);
-#if ARDUINO >= 100  
-  Wire.write((uint8_t)0x00); // reset register pointer  
-  Wire.write((uint8_t)0x80); // Stop the clock. The seconds will be written last
-  Wire.write(dec2bcd(tm.Minute));
-  Wire.write(dec2bcd(tm.Hour));      // sets 24 hour format
-  Wire.write(dec2bcd(tm.Wday));   
-  Wire.write(dec2bcd(tm.Day));
-  Wire.write(dec2bcd(tm.Month));
-  Wire.write(dec2bcd(tmYearToY2k(tm.Year))); 
-#else  
-  Wire.send(0x00); // reset register pointer  
-  Wire.send(0x80); // Stop the clock. The seconds will be written last
-  Wire.send(dec2bcd(tm.Minute));
-  Wire.send(dec2bcd(tm.Hour));      // sets 24 hour format
-  Wire.send(dec2bcd(tm.Wday));   
-  Wire.send(dec2bcd(tm.Day));
-  Wire.send(dec2bcd(tm.Month));
-  Wire.send(dec2bcd(tmYearToY2k(tm.Year)));   
-#endif
-  if (Wire.endTransmission() != 0) {
+  uint8_t buf[tmNbrFields + 1];
+  buf[0] = 0x00; // reset register pointer  
+  buf[1] = 0x80; // Stop the clock. The seconds will be written last
+  buf[2] = dec2bcd(tm.Minute);
+  buf[3] = dec2bcd(tm.Hour);      // sets 24 hour format
+  buf[4] = dec2bcd(tm.Wday);   
+  buf[5] = dec2bcd(tm.Day);
+  buf[6] = dec2bcd(tm.Month);
+  buf[7] = dec2bcd(tmYearToY2k(tm.Year)); 
+  if (transfer(buf, sizeof(buf), NULL, 0) != TWI_OK) {
     exists = false;
     return false;
   }
   exists = true;
 
   // Now go back and set the seconds, starting the clock back up as a side effect
-  Wire.beginTransmission(DS1307_CTRL_ID);
-#if ARDUINO >= 100  
-  Wire.write((uint8_t)0x00); // reset register pointer  
-  Wire.write(dec2bcd(tm.Second)); // write the seconds, with the stop bit clear to restart
-#else  
-  Wire.send(0x00); // reset register pointer  
-  Wire.send(dec2bcd(tm.Second)); // write the seconds, with the stop bit clear to restart
-#endif
-  if (Wire.endTransmission() != 0) {
+  buf[0] = 0x00; // reset register pointer  
+  buf[1] = dec2bcd(tm.Second); // write the seconds, with the stop bit clear to restart
+  if (transfer(buf, 2, NULL, 0) != TWI_OK) {
     exists = false;
     return false;
   }
@@ -143,56 +110,38 @@ bool DS1307RTC::write(tmElements_t &tm)
   return true;
 }
 
+// The answer is from the last background read of the seconds register, and each
+// call starts another one. The very first time, there's been no read yet, so that
+// one waits for it.
 unsigned char DS1307RTC::isRunning()
 {
-  Wire.beginTransmission(DS1307_CTRL_ID);
-#if ARDUINO >= 100  
-  Wire.write((uint8_t)0x00); 
-#else
-  Wire.send(0x00);
-#endif  
-  Wire.endTransmission();
-
-  // Just fetch the seconds register and check the top bit
-  Wire.requestFrom(DS1307_CTRL_ID, 1);
-#if ARDUINO >= 100
-  return !(Wire.read() & 0x80);
-#else
-  return !(Wire.receive() & 0x80);
-#endif  
+  if (Twi.busy(&poll)) return running;
+  if (!polled) {
+    Twi.run(&poll);
+    polled = true;
+  }
+  exists = (poll.status == TWI_OK);
+  // Just check the top bit of the seconds
+  running = exists && !(poll_seconds & 0x80);
+  Twi.queue(&poll);
+  return running;
 }
 
 void DS1307RTC::setCalibration(char calValue)
 {
   unsigned char calReg = abs(calValue) & 0x1f;
   if (calValue >= 0) calReg |= 0x20; // S bit is positive to speed up the clock
-  Wire.beginTransmission(DS1307_CTRL_ID);
-#if ARDUINO >= 100  
-  Wire.write((uint8_t)0x07); // Point to calibration register
-  Wire.write(calReg);
-#else  
-  Wire.send(0x07); // Point to calibration register
-  Wire.send(calReg);
-#endif
-  Wire.endTransmission();  
+  uint8_t buf[2];
+  buf[0] = 0x07; // Point to calibration register
+  buf[1] = calReg;
+  transfer(buf, sizeof(buf), NULL, 0);
 }
 
 char DS1307RTC::getCalibration()
 {
-  Wire.beginTransmission(DS1307_CTRL_ID);
-#if ARDUINO >= 100  
-  Wire.write((uint8_t)0x07); 
-#else
-  Wire.send(0x07);
-#endif  
-  Wire.endTransmission();
-
-  Wire.requestFrom(DS1307_CTRL_ID, 1);
-#if ARDUINO >= 100
-  unsigned char calReg = Wire.read();
-#else
-  unsigned char calReg = Wire.receive();
-#endif
+  static const uint8_t calibration_register = 0x07;
+  unsigned char calReg = 0;
+  transfer(&calibration_register, 1, &calReg, 1);
   char out = calReg & 0x1f;
   if (!(calReg & 0x20)) out = -out; // S bit clear means a negative value
   return out;
@@ -200,6 +149,20 @@ char DS1307RTC::getCalibration()
 
 // PRIVATE FUNCTIONS
 
+// Write tx_len bytes, then read rx_len, and wait for it all.
+uint8_t DS1307RTC::transfer(const uint8_t *tx, uint8_t tx_len, uint8_t *rx, uint8_t rx_len)
+{
+  TwiTransaction t;
+  t.address = DS1307_CTRL_ID;
+  t.tx = tx;
+  t.tx_len = tx_len;
+  t.rx = rx;
+  t.rx_len = rx_len;
+  t.done = NULL;
+  t.status = TWI_OK;
+  return Twi.run(&t);
+}
+
 // Convert Decimal to Binary Coded Decimal (BCD)
 uint8_t DS1307RTC::dec2bcd(uint8_t num)
 {
@@ -213,6 +176,11 @@ uint8_t DS1307RTC::bcd2dec(uint8_t num)
 }
 
 bool DS1307RTC::exists = false;
+const uint8_t DS1307RTC::seconds_register = 0x00;
+TwiTransaction DS1307RTC::poll;
+uint8_t DS1307RTC::poll_seconds;
+bool DS1307RTC::polled = false;
+bool DS1307RTC::running = false;
 
 DS1307RTC RTC = DS1307RTC(); // create an instance for the user
 
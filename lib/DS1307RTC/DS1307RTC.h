@@ -7,6 +7,7 @@
 #define DS1307RTC_h
 
 #include <TimeLib.h>
+#include <AsyncTWI.h>
 
 // library interface description
 class DS1307RTC
@@ -25,6 +26,11 @@ class DS1307RTC
 
   private:
     static bool exists;
+    static const uint8_t seconds_register;
+    static TwiTransaction poll;
+    static uint8_t poll_seconds;
+    static bool polled, running;
+    static uint8_t transfer(const uint8_t *tx, uint8_t tx_len, uint8_t *rx, uint8_t rx_len);
     static uint8_t dec2bcd(uint8_t num);
     static uint8_t bcd2dec(uint8_t num);
 };
@@ -0,0 +1,123 @@
+/*
+
+ FastPin - compile-time digital pins for the J1772 Hydra
+ Copyright 2026 Nicholas W. Sayer
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program; if not, write to the Free Software Foundation, Inc.,
+ 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef FastPin_h
+#define FastPin_h
+
+#include <Arduino.h>
+
+// A digital pin whose number is fixed at compile time. digitalWrite() and
+// digitalRead() look the pin up in three tables in flash, check for PWM and
+// (for writes) turn interrupts off and on again around a read-modify-write
+// of the port, which all adds up to around 50 cycles. With the pin number as a
+// template parameter, the port and bit are constants, and each of these
+// comes down to a single sbi, cbi or in instruction.
+//
+// Because a single sbi or cbi can't be interrupted, these are safe to use both
+// inside and outside of interrupt handlers. Unlike digitalWrite(), they leave any
+// PWM on the pin alone, and they don't set the pin's direction - use pinMode()
+// for that, as usual.
+//
+//   FastPin<8>::high();
+//   if (FastPin<A3>::read() == HIGH) ...
+
+#if defined(__AVR_ATmega328P__) || defined(__AVR_ATmega328__) || defined(__AVR_ATmega168__) || defined(__AVR_ATmega168P__)
+
+// Digital pins 0-7 are port D, 8-13 are port B and 14-19 (A0-A5) are port C.
+#define FASTPIN_PORT(pin) (*((pin) < 8 ? &PORTD : (pin) < 14 ? &PORTB : &PORTC))
+#define FASTPIN_IN(pin) (*((pin) < 8 ? &PIND : (pin) < 14 ? &PINB : &PINC))
+#define FASTPIN_BIT(pin) ((uint8_t)_BV((pin) < 8 ? (pin) : (pin) < 14 ? (pin) - 8 : (pin) - 14))
+
+template <uint8_t PIN>
+class FastPin
+{
+  public:
+    static inline void high() __attribute__((always_inline)) { FASTPIN_PORT(PIN) |= FASTPIN_BIT(PIN); }
+    static inline void low() __attribute__((always_inline)) { FASTPIN_PORT(PIN) &= (uint8_t)~FASTPIN_BIT(PIN); }
+    static inline void write(uint8_t val) __attribute__((always_inline)) { if (val == LOW) low(); else high(); }
+    static inline uint8_t read() __attribute__((always_inline)) { return (FASTPIN_IN(PIN) & FASTPIN_BIT(PIN)) ? HIGH : LOW; }
+};
+
+#elif defined(__AVR_ATmega640__) || defined(__AVR_ATmega1280__) || defined(__AVR_ATmega2560__)
+
+#include <util/atomic.h>
+
+// The Mega's pins are spread over eleven ports, A to L (there's no I), with little
+// order to it, so each pin's port and bit come from a table: the port's index (A is
+// 0, L is 10) in the high nybble and the bit in the low, the same as the Mega's
+// pins_arduino.h has them.
+constexpr uint8_t fastpin_map[] = {
+  0x40, 0x41, 0x44, 0x45, 0x65, 0x43, 0x73, 0x74, 0x75, 0x76, // 0-9: E E E E G E H H H H
+  0x14, 0x15, 0x16, 0x17, 0x81, 0x80, 0x71, 0x70, 0x33, 0x32, // 10-19: B B B B J J H H D D
+  0x31, 0x30, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, // 20-29: D D A ...
+  0x27, 0x26, 0x25, 0x24, 0x23, 0x22, 0x21, 0x20, 0x37, 0x62, // 30-39: C ... D G
+  0x61, 0x60, 0xa7, 0xa6, 0xa5, 0xa4, 0xa3, 0xa2, 0xa1, 0xa0, // 40-49: G G L ...
+  0x13, 0x12, 0x11, 0x10,                                     // 50-53: B
+  0x50, 0x51, 0x52, 0x53, 0x54, 0x55, 0x56, 0x57,             // A0-A7: F
+  0x90, 0x91, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97,             // A8-A15: K
+};
+
+#define FASTPIN_REG(reg, pin) (*(fastpin_map[pin] >> 4 == 0 ? &reg##A : fastpin_map[pin] >> 4 == 1 ? &reg##B \
+  : fastpin_map[pin] >> 4 == 2 ? &reg##C : fastpin_map[pin] >> 4 == 3 ? &reg##D : fastpin_map[pin] >> 4 == 4 ? &reg##E \
+  : fastpin_map[pin] >> 4 == 5 ? &reg##F : fastpin_map[pin] >> 4 == 6 ? &reg##G : fastpin_map[pin] >> 4 == 7 ? &reg##H \
+  : fastpin_map[pin] >> 4 == 8 ? &reg##J : fastpin_map[pin] >> 4 == 9 ? &reg##K : &reg##L))
+#define FASTPIN_PORT(pin) FASTPIN_REG(PORT, pin)
+#define FASTPIN_IN(pin) FASTPIN_REG(PIN, pin)
+#define FASTPIN_BIT(pin) ((uint8_t)_BV(fastpin_map[pin] & 0x07))
+// Ports H and up are out of reach of sbi and cbi, and a write to one of them is a read,
+// an or (or and) and a write, which an interrupt handler writing the same port mustn't
+// come in the middle of. Reads are a single lds either way.
+#define FASTPIN_SBI(pin) ((fastpin_map[pin] >> 4) < 7)
+
+template <uint8_t PIN>
+class FastPin
+{
+  static_assert(PIN < sizeof(fastpin_map), "no such pin on a Mega");
+  public:
+    static inline void high() __attribute__((always_inline)) {
+      if (FASTPIN_SBI(PIN)) FASTPIN_PORT(PIN) |= FASTPIN_BIT(PIN);
+      else ATOMIC_BLOCK(ATOMIC_RESTORESTATE) { FASTPIN_PORT(PIN) |= FASTPIN_BIT(PIN); }
+    }
+    static inline void low() __attribute__((always_inline)) {
+      if (FASTPIN_SBI(PIN)) FASTPIN_PORT(PIN) &= (uint8_t)~FASTPIN_BIT(PIN);
+      else ATOMIC_BLOCK(ATOMIC_RESTORESTATE) { FASTPIN_PORT(PIN) &= (uint8_t)~FASTPIN_BIT(PIN); }
+    }
+    static inline void write(uint8_t val) __attribute__((always_inline)) { if (val == LOW) low(); else high(); }
+    static inline uint8_t read() __attribute__((always_inline)) { return (FASTPIN_IN(PIN) & FASTPIN_BIT(PIN)) ? HIGH : LOW; }
+};
+
+#else
+
+#warning "FastPin has no port map for this chip, and falls back on digitalWrite() and digitalRead()"
+
+// No port map for this chip. Fall back on the Arduino core, which is slower but works everywhere.
+template <uint8_t PIN>
+class FastPin
+{
+  public:
+    static inline void high() { digitalWrite(PIN, HIGH); }
+    static inline void low() { digitalWrite(PIN, LOW); }
+    static inline void write(uint8_t val) { digitalWrite(PIN, val); }
+    static inline uint8_t read() { return digitalRead(PIN); }
+};
+
+#endif
+
+#endif
@@ -0,0 +1,84 @@
+/*
+
+ FixedPoint - integer arithmetic for the J1772 Hydra
+ Copyright 2026 Nicholas W. Sayer
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program; if not, write to the Free Software Foundation, Inc.,
+ 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "FixedPoint.h"
+
+unsigned long ulong_sqrt(unsigned long in) {
+  // Work out the answer a bit at a time, from the top. Each result bit
+  // costs a compare, a subtract and a couple of shifts, so it's 16 trips
+  // through the loop at most, no matter how big the input.
+  uint32_t rem = in;
+  uint32_t out = 0;
+  uint32_t bit = 1UL << 30;
+  while (bit > rem) bit >>= 2;
+  while (bit != 0) {
+    if (rem >= out + bit) {
+      rem -= out + bit;
+      out = (out >> 1) + bit;
+    } else {
+      out >>= 1;
+    }
+    bit >>= 2;
+  }
+  return out;
+}
+
+char *formatMilliamps(unsigned long milliamps) {
+  static char out[6];
+
+  if (milliamps < 1000) {
+    // truncate the units digit - there's no way we're that accurate.
+    // milliamps / 10 is exact up to 1028, and tens / 10 up to 1023.
+    uint16_t tens = (uint16_t)(((uint32_t)milliamps * 205) >> 11);
+    uint8_t hundreds = (uint8_t)(((uint32_t)tens * 205) >> 11);
+    tens -= hundreds * 10;
+    out[0] = hundreds ? '0' + hundreds : ' ';
+    out[1] = (hundreds || tens) ? '0' + tens : ' ';
+    out[2] = '0';
+    out[3] = 'm';
+    out[4] = 'A';
+  }
+  else {
+    uint8_t units, tenths;
+    if (milliamps >= 99950) {
+      units = 99;
+      tenths = 9;
+    } else {
+      // (milliamps / 8) / 125, which is milliamps / 1000. Exact up to 99999.
+      units = (uint8_t)((((uint32_t)milliamps >> 3) * 8389) >> 20);
+      uint16_t rest = (uint16_t)(milliamps - units * 1000UL);
+      // Round the rest to the nearest tenth. (rest + 50) / 100 is exact up to 1099.
+      tenths = (uint8_t)(((uint32_t)(rest + 50) * 41) >> 12);
+      if (tenths >= 10) {
+        tenths -= 10;
+        units++;
+      }
+    }
+    uint8_t units_tens = (uint8_t)((units * 205U) >> 11);
+    out[0] = units_tens ? '0' + units_tens : ' ';
+    out[1] = '0' + (units - units_tens * 10);
+    out[2] = '.';
+    out[3] = '0' + tenths;
+    out[4] = 'A';
+  }
+  out[5] = 0;
+
+  return out;
+}
@@ -0,0 +1,97 @@
+/*
+
+ FixedPoint - integer arithmetic for the J1772 Hydra
+ Copyright 2026 Nicholas W. Sayer
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program; if not, write to the Free Software Foundation, Inc.,
+ 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef FixedPoint_h
+#define FixedPoint_h
+
+#include <Arduino.h>
+
+// The AVR has a hardware multiplier, but no divide instruction. A 32 bit
+// division is a subroutine call that costs something like 600 cycles, so
+// everything in here that runs regularly divides by multiplying with a
+// scaled reciprocal and shifting instead. Each of those constants is only
+// good for a limited range of inputs, which is noted alongside it. The host
+// build's bench_fixedpoint checks all of them against the plain division.
+
+// Convert the time the incoming pilot spent high and low (in any unit, so long as
+// it's the same for both, and each is less than 4 million) into the current it
+// allows, in milliamps.
+static inline unsigned long timeToMA(unsigned long samplesHigh, unsigned long samplesLow) {
+  uint32_t high = samplesHigh;
+  uint32_t total = samplesHigh + samplesLow;
+  // The duty cycle in mils (tenths of a percent) is high * 1000 / total. Which
+  // band it's in can be found by multiplication. Only the two sloped
+  // bands need the division itself.
+  uint32_t scaled = high * 1000;
+  if (scaled < total * 80) { // < 8% is an error (digital comm not supported)
+    return 0;
+  } else if (scaled < total * 101) { // 8-10% is 6A - tolerance grace
+    return 6000L;
+  } else if (scaled < total * 851) { // 10-85% uses the "low" function
+    return (scaled / total) * 60L;
+  } else if (scaled < total * 961) { // 85-96% uses the "high" function
+    return ((scaled / total) - 640) * 250L;
+  } else if (scaled < total * 981) { // 96-98% is 80A - tolerance grace
+    return 80000L;
+  } else { // > 98% is an error
+    return 0;
+  }
+}
+
+// Convert a milliamp allowance into an outgoing pilot duty cycle.
+// In lieu of floating point, this is duty in mils (tenths of a percent)
+static inline unsigned int MAToDuty(unsigned long milliamps) {
+  if (milliamps < 6000) {
+    return 9999; // illegal - set pilot to "high"
+  }
+  else if (milliamps < 51000) {
+    // milliamps / 60. Exact below 61439.
+    return (unsigned int)(((uint32_t)milliamps * 34953UL) >> 21);
+  }
+  else if (milliamps <= 80000) {
+    // (milliamps / 2) / 125, which is milliamps / 250. Exact up to 102397.
+    return (unsigned int)((((uint32_t)milliamps >> 1) * 33555UL) >> 22) + 640;
+  }
+  else {
+    return 9999; // illegal - set pilot to "high"
+  }
+}
+
+// Convert a milliamp allowance into a value suitable for
+// pwmWrite - a scale from 0 to 255.
+static inline unsigned int MAtoPwm(unsigned long milliamps) {
+  unsigned int out = MAToDuty(milliamps);
+
+  if (out >= 1000) return 255; // full on
+
+  // out * 256 / 1000. Exact for every duty below 1000.
+  return (unsigned int)(((uint32_t)out * 33555UL) >> 17);
+}
+
+// The integer square root - the largest value whose square is not more than in.
+unsigned long ulong_sqrt(unsigned long in);
+
+// Turn a millamp value into nn.n as amps, with the tenth rounded near.
+// Values below 1 amp are shown as milliamps instead, truncated to the tens.
+// Anything that would round up to 100 amps or more is shown as 99.9A.
+// The result is a static buffer that is overwritten by the next call.
+char *formatMilliamps(unsigned long milliamps);
+
+#endif
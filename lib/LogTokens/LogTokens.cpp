@@ -0,0 +1,92 @@
+/*
+
+ LogTokens - logging in tokens rather than text for the J1772 Hydra
+ Copyright 2026 Nicholas W. Sayer
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program; if not, write to the Free Software Foundation, Inc.,
+ 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdarg.h>
+#include "LogTokens.h"
+
+static uint8_t max_level;
+
+static void dropped(unsigned int count) {
+  uint8_t record[] = { 8, 0, 0, 0, 0, 0, 0, 0, 0 };
+  unsigned long now = millis();
+  for(uint8_t i = 0; i < 4; i++) record[3 + i] = now >> (8 * i);
+  record[7] = count;
+  record[8] = count >> 8;
+  Uart.write(record, sizeof(record));
+}
+
+void logTokensBegin(uint8_t level) {
+  max_level = level;
+  Uart.setMarker(dropped);
+}
+
+// How much the arguments other than strings take, and the NUL of each string.
+static uint8_t fixedSize(uint32_t signature) {
+  uint8_t n = 0;
+  for(; signature != 0; signature >>= 2)
+    n += ((signature & 0x3) == LOG_ARG_LONG) ? 4 : ((signature & 0x3) == LOG_ARG_INT) ? 2 : 1;
+  return n;
+}
+
+void logToken(uint8_t level, uint16_t line, uint32_t signature, ...) {
+  if (level > max_level) return;
+  uint8_t record[1 + LOG_TOKEN_RECORD];
+  uint8_t n = 1;
+  uint16_t id = line | ((uint16_t)level << 14);
+  record[n++] = id;
+  record[n++] = id >> 8;
+  unsigned long now = millis();
+  for(uint8_t i = 0; i < 4; i++) record[n++] = now >> (8 * i);
+
+  va_list argptr;
+  va_start(argptr, signature);
+  for(; signature != 0; signature >>= 2) {
+    switch(signature & 0x3) {
+      case LOG_ARG_INT:
+        {
+          // Anything shorter than an int was made one on the way in.
+          unsigned int value = va_arg(argptr, unsigned int);
+          record[n++] = value;
+          record[n++] = value >> 8;
+        }
+        break;
+      case LOG_ARG_LONG:
+        {
+          unsigned long value = va_arg(argptr, unsigned long);
+          for(uint8_t i = 0; i < 4; i++) record[n++] = value >> (8 * i);
+        }
+        break;
+      case LOG_ARG_STRING:
+        {
+          // Leave room for everything after it.
+          const char *value = va_arg(argptr, const char *);
+          uint8_t end = sizeof(record) - fixedSize(signature);
+          while(*value != 0 && n < end) record[n++] = *value++;
+          record[n++] = 0;
+        }
+        break;
+    }
+  }
+  va_end(argptr);
+
+  record[0] = n - 1;
+  Uart.write(record, n);
+  Uart.endRecord();
+}
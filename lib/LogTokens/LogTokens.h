@@ -0,0 +1,92 @@
+/*
+
+ LogTokens - logging in tokens rather than text for the J1772 Hydra
+ Copyright 2026 Nicholas W. Sayer
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program; if not, write to the Free Software Foundation, Inc.,
+ 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef LogTokens_h
+#define LogTokens_h
+
+#include <Arduino.h>
+#include <AsyncUART.h>
+
+// Formatting a log line on the chip means its format string has to be copied out of
+// flash, and the line put together with vsnprintf, only for most of the result to be
+// the same text it was last time. Logging in tokens, none of that happens. Each call
+// is known by the line of the sketch it's on, and all that goes out is that line
+// number, when it was called, and the arguments, as they are. hydra_logdecode (see
+// host/) reads the format strings out of the sketch and puts the text back together.
+//
+// Each call is a record of its own, which AsyncUART sends or drops whole:
+//
+//   length     one byte: how many bytes of record follow it
+//   id         two bytes: the line number, with the level in the top two bits
+//   time       four bytes: millis() when the call was made
+//   arguments  %c, %d, %u and %x take two bytes, those with an l four, and %s the
+//              string and its terminating NUL
+//
+// Everything is little endian. An id of 0 (there's no line 0) is AsyncUART's news of
+// records that were dropped. Its argument is how many, in two bytes.
+//
+// The arguments are laid out by a signature of the format string that the compiler
+// works out: two bits for each conversion, the first in the lowest two. So there can
+// be no more than 16 of them, and the sketch no longer than 16383 lines.
+
+#define LOG_ARG_INT 1
+#define LOG_ARG_LONG 2
+#define LOG_ARG_STRING 3
+
+// A record, less its length, can be no bigger than this. It's room for the id, the
+// time and 16 longs. Strings are cut short to fit.
+#define LOG_TOKEN_RECORD 72
+
+#define LOG_TOKEN_DROPPED 0
+
+// The signature of the rest of a format string, from just after a '%'.
+constexpr uint32_t logConversion(const char *fmt, uint8_t shift, boolean is_long);
+
+constexpr uint32_t logSignature(const char *fmt, uint8_t shift = 0) {
+  return (*fmt == 0) ? 0
+    : (*fmt == '%') ? logConversion(fmt + 1, shift, false)
+    : logSignature(fmt + 1, shift);
+}
+
+constexpr uint32_t logConversion(const char *fmt, uint8_t shift, boolean is_long) {
+  return (*fmt == 0) ? 0
+    : (*fmt == '%') ? logSignature(fmt + 1, shift)
+    : (*fmt == 'l') ? logConversion(fmt + 1, shift, true)
+    : ((*fmt >= '0' && *fmt <= '9') || *fmt == '-' || *fmt == '+' || *fmt == ' ' || *fmt == '#' || *fmt == '.')
+      ? logConversion(fmt + 1, shift, is_long)
+    : ((uint32_t)(*fmt == 's' ? LOG_ARG_STRING : is_long ? LOG_ARG_LONG : LOG_ARG_INT) << shift)
+      | logSignature(fmt + 1, shift + 2);
+}
+
+// Makes sure the signature is worked out when compiling, and that the format string
+// itself is left behind.
+template <uint32_t S> struct LogSignature {
+  static const uint32_t value = S;
+};
+
+#define LOG_SIGNATURE(fmt) (LogSignature<logSignature(fmt)>::value)
+
+// Send records of this level and below, and have the news of dropped records go out as
+// a record, too. Call after Uart.begin(). Until then, nothing is sent.
+void logTokensBegin(uint8_t level);
+// Send a record, if its level is being logged. The arguments follow the signature.
+void logToken(uint8_t level, uint16_t line, uint32_t signature, ...);
+
+#endif
@@ -0,0 +1,133 @@
+/*
+
+ SampleFilters - smoothing filters for the J1772 Hydra
+ Copyright 2026 Nicholas W. Sayer
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program; if not, write to the Free Software Foundation, Inc.,
+ 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef SampleFilters_h
+#define SampleFilters_h
+
+#include <Arduino.h>
+
+// Each filter is an object that keeps the state for one channel. Feed each new
+// reading to add(), which returns the filtered value. reset() forgets the history,
+// as if the object had just been made.
+
+// The average of the last N readings. The window is a ring with a running sum,
+// so an update costs the same no matter how big N is. Until N readings have been
+// added, the average is of however many there have been. S is the type the sum
+// is kept in, which must be able to hold N of the largest reading.
+template <class T, uint8_t N, class S = T>
+class MovingAverage
+{
+  public:
+    MovingAverage() { reset(); }
+    void reset() {
+      sum = 0;
+      next = 0;
+      count = 0;
+    }
+    T add(T value) {
+      if (count < N) {
+        count++;
+      } else {
+        sum -= samples[next];
+      }
+      samples[next] = value;
+      sum += value;
+      if (++next >= N) next = 0;
+      return this->value();
+    }
+    T value() { return count == 0 ? 0 : (T)(sum / count); }
+    boolean full() { return count >= N; }
+
+  private:
+    T samples[N];
+    S sum;
+    uint8_t next, count;
+};
+
+// An exponential moving average, where each new reading moves the output
+// 1/(2^SHIFT) of the way towards it. It takes no history, only an accumulator
+// that holds the average scaled up by 2^SHIFT, so S must be able to hold the
+// largest reading shifted left by SHIFT. The first reading seeds it.
+template <class T, uint8_t SHIFT, class S = T>
+class ExpAverage
+{
+  public:
+    ExpAverage() { reset(); }
+    void reset() {
+      acc = 0;
+      seeded = false;
+    }
+    T add(T value) {
+      if (!seeded) {
+        acc = ((S)value) << SHIFT;
+        seeded = true;
+      } else {
+        acc -= acc >> SHIFT;
+        acc += value;
+      }
+      return this->value();
+    }
+    T value() { return (T)(acc >> SHIFT); }
+
+  private:
+    S acc;
+    boolean seeded;
+};
+
+// The median of the last N readings, for throwing away single-reading
+// spikes. N should be odd and small - each update moves at most N entries.
+// Until there have been N readings, it's the median of those there are.
+template <class T, uint8_t N>
+class MedianFilter
+{
+  public:
+    MedianFilter() { reset(); }
+    void reset() {
+      next = 0;
+      count = 0;
+    }
+    T add(T value) {
+      uint8_t pos;
+      if (count < N) {
+        pos = count++;
+      } else {
+        // Take the oldest reading out of the sorted list...
+        T oldest = samples[next];
+        for(pos = 0; sorted[pos] != oldest; pos++) ;
+        for(; pos < N - 1; pos++) sorted[pos] = sorted[pos + 1];
+      }
+      samples[next] = value;
+      if (++next >= N) next = 0;
+      // ...and put the new one in its place.
+      while (pos > 0 && sorted[pos - 1] > value) {
+        sorted[pos] = sorted[pos - 1];
+        pos--;
+      }
+      sorted[pos] = value;
+      return this->value();
+    }
+    T value() { return count == 0 ? 0 : sorted[(count - 1) / 2]; }
+
+  private:
+    T samples[N], sorted[N];
+    uint8_t next, count;
+};
+
+#endif
@@ -0,0 +1,96 @@
+/*
+
+ SenseBaseline - self-calibrating sense input levels for the J1772 Hydra
+ Copyright 2026 Nicholas W. Sayer
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program; if not, write to the Free Software Foundation, Inc.,
+ 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <EEPROM.h>
+#include "SenseBaseline.h"
+
+static boolean near(uint16_t value, uint16_t nominal, uint16_t window) {
+  return value + window >= nominal && value <= nominal + window;
+}
+
+void SenseBaseline::begin(int addr, const SenseLevels &nom) {
+  address = addr;
+  nominal = nom;
+  EEPROM.get(address, saved);
+  for(uint8_t car = 0; car < BASELINE_MAX_CARS; car++) {
+    SenseLevels &s = saved[car];
+    // A blank EEPROM is all ones, which is never believable.
+    if (!near(s.ct_zero, nominal.ct_zero, BASELINE_CT_WINDOW)) s.ct_zero = nominal.ct_zero;
+    if (!near(s.pilot_high, nominal.pilot_high, BASELINE_PILOT_WINDOW)) s.pilot_high = nominal.pilot_high;
+    if (!near(s.pilot_low, nominal.pilot_low, BASELINE_PILOT_WINDOW)) s.pilot_low = nominal.pilot_low;
+    ct[car].reset();
+    ct[car].add(s.ct_zero);
+    high[car].reset();
+    high[car].add(s.pilot_high);
+    low[car].reset();
+    low[car].add(s.pilot_low);
+    rescale(car);
+  }
+}
+
+void SenseBaseline::ctIdle(uint8_t car, uint16_t reading) {
+  if (near(reading, nominal.ct_zero, BASELINE_CT_WINDOW)) ct[car].add(reading);
+}
+
+void SenseBaseline::pilotHigh(uint8_t car, uint16_t reading) {
+  if (!near(reading, nominal.pilot_high, BASELINE_PILOT_WINDOW)) return;
+  uint16_t before = high[car].value();
+  if (high[car].add(reading) != before) rescale(car);
+}
+
+void SenseBaseline::pilotLow(uint8_t car, uint16_t reading) {
+  if (!near(reading, nominal.pilot_low, BASELINE_PILOT_WINDOW)) return;
+  uint16_t before = low[car].value();
+  if (low[car].add(reading) != before) rescale(car);
+}
+
+// Only called when a level changes, so that pilotReading() needn't divide.
+void SenseBaseline::rescale(uint8_t car) {
+  uint16_t h = high[car].value(), l = low[car].value();
+  pilot_zero[car] = (h + l) / 2;
+  scale[car] = ((unsigned long)(nominal.pilot_high - nominal.pilot_low) << 12) / (h - l);
+}
+
+unsigned int SenseBaseline::pilotReading(uint8_t car, unsigned int reading) {
+  long offset = (((long)reading - pilot_zero[car]) * scale[car] + 2048) >> 12;
+  long mapped = (nominal.pilot_high + nominal.pilot_low) / 2 + offset;
+  if (mapped < 0) return 0;
+  if (mapped > 1023) return 1023;
+  return mapped;
+}
+
+static boolean moved(uint16_t now, uint16_t then) {
+  return !near(now, then, BASELINE_SAVE_DELTA - 1);
+}
+
+boolean SenseBaseline::save() {
+  boolean changed = false;
+  for(uint8_t car = 0; car < BASELINE_MAX_CARS; car++) {
+    SenseLevels &s = saved[car];
+    if (moved(ct[car].value(), s.ct_zero) || moved(high[car].value(), s.pilot_high) || moved(low[car].value(), s.pilot_low)) {
+      s.ct_zero = ct[car].value();
+      s.pilot_high = high[car].value();
+      s.pilot_low = low[car].value();
+      changed = true;
+    }
+  }
+  if (changed) EEPROM.put(address, saved);
+  return changed;
+}
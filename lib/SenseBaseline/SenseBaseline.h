@@ -0,0 +1,93 @@
+/*
+
+ SenseBaseline - self-calibrating sense input levels for the J1772 Hydra
+ Copyright 2026 Nicholas W. Sayer
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program; if not, write to the Free Software Foundation, Inc.,
+ 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef SenseBaseline_h
+#define SenseBaseline_h
+
+#include <Arduino.h>
+#include <SampleFilters.h>
+
+// The sense inputs never read quite what the arithmetic says they should. The CT
+// bias divider is a couple of resistors, and so is the pilot sense network, and
+// their tolerances move everything by a few counts. That inflates the RMS of a
+// current reading and moves the state thresholds around.
+//
+// So whenever a reference level can be seen, it's learned: the CT with the relay
+// open (no current), the pilot sense with the pilot high and nobody plugged in
+// (+12 volts), and in the low half of a pilot that's oscillating (-12 volts).
+// 0 volts on the pilot is halfway between those two. A reading that's too far off
+// from nominal to be believed is ignored, so nothing can be learned from a fault.
+//
+// Pilot readings are mapped back onto the nominal scale, so that all of the state
+// thresholds can still be written as constants.
+
+// How far (in counts) a learned level may be from the nominal one.
+#define BASELINE_CT_WINDOW 16
+#define BASELINE_PILOT_WINDOW 24
+
+// How far a level has to move from what's in the EEPROM before save() writes it again.
+#define BASELINE_SAVE_DELTA 2
+
+// How many cars' levels are kept. A Mega Hydra has up to four outlets.
+#if defined(__AVR_ATmega640__) || defined(__AVR_ATmega1280__) || defined(__AVR_ATmega2560__)
+#define BASELINE_MAX_CARS 4
+#else
+#define BASELINE_MAX_CARS 2
+#endif
+
+// How much of the EEPROM begin() and save() use.
+#define BASELINE_EEPROM_SIZE (BASELINE_MAX_CARS * sizeof(SenseLevels))
+
+// What the sense inputs for one car read at their reference points.
+struct SenseLevels {
+  uint16_t ct_zero;     // the CT, with no current flowing
+  uint16_t pilot_high;  // the pilot sense, at +12 volts
+  uint16_t pilot_low;   // the pilot sense, at -12 volts
+};
+
+class SenseBaseline
+{
+  public:
+    // Start from the nominal levels, or from what was saved at address, if it's believable.
+    void begin(int address, const SenseLevels &nominal);
+    // Tell it what a car's inputs read right now at one of the reference points.
+    void ctIdle(uint8_t car, uint16_t reading);
+    void pilotHigh(uint8_t car, uint16_t reading);
+    void pilotLow(uint8_t car, uint16_t reading);
+    // What the CT reads with no current.
+    uint16_t ctZero(uint8_t car) { return ct[car].value(); }
+    // What a pilot sense reading would have been, had the car's levels been nominal.
+    unsigned int pilotReading(uint8_t car, unsigned int reading);
+    // Write the learned levels to the EEPROM, if they've moved since the last time.
+    // Returns whether it did.
+    boolean save();
+
+  private:
+    int address;
+    SenseLevels nominal;
+    SenseLevels saved[BASELINE_MAX_CARS];
+    ExpAverage<uint16_t, 6> ct[BASELINE_MAX_CARS], high[BASELINE_MAX_CARS], low[BASELINE_MAX_CARS];
+    // Pilot readings are mapped by zero + ((reading - pilot_zero) * scale) >> 12.
+    uint16_t pilot_zero[BASELINE_MAX_CARS];
+    uint16_t scale[BASELINE_MAX_CARS];
+    void rescale(uint8_t car);
+};
+
+#endif
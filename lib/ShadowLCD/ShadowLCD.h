@@ -0,0 +1,121 @@
+/*
+
+ ShadowLCD - a RAM copy of a character LCD for the J1772 Hydra
+ Copyright 2026 Nicholas W. Sayer
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program; if not, write to the Free Software Foundation, Inc.,
+ 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef ShadowLCD_h
+#define ShadowLCD_h
+
+#include <Arduino.h>
+
+// The LCD sits behind an i2c port expander, so every character written to it costs
+// several i2c transactions, and the sketches rewrite the same text (and set the same
+// backlight colour) over and over. This stands in for the display: writes go to a
+// copy of the screen in RAM, and flush() sends the real one only the characters that
+// differ from what it already shows, with a cursor move in front of each run of them,
+// and the backlight if it changed. Call flush() every so often, and before anything
+// that waits with the screen as it is.
+//
+// LCD is the real display's class (TwiLCD), and COLS and ROWS its size. Anything
+// written past the end of a row is dropped.
+template <class LCD, uint8_t COLS, uint8_t ROWS>
+class ShadowLCD : public Print
+{
+  public:
+    ShadowLCD(LCD &lcd) : lcd(lcd) {
+      memset(want, ' ', sizeof(want));
+      memset(shown, ' ', sizeof(shown));
+      col = row = 0;
+      backlight = shown_backlight = 0;
+      dirty = false;
+    }
+
+    // The real display starts out blank, with the backlight in an unknown state.
+    void begin(uint8_t cols, uint8_t rows) {
+      lcd.begin(cols, rows);
+      lcd.clear();
+      memset(shown, ' ', sizeof(shown));
+      shown_backlight = 0xff;
+      dirty = true;
+    }
+    uint8_t readButtons() { return lcd.readButtons(); }
+
+    void clear() {
+      memset(want, ' ', sizeof(want));
+      col = row = 0;
+      dirty = true;
+    }
+    void home() { col = row = 0; }
+    void setCursor(uint8_t c, uint8_t r) {
+      col = c;
+      row = (r < ROWS) ? r : ROWS - 1;
+    }
+    void setBacklight(uint8_t status) {
+      if (status == backlight) return;
+      backlight = status;
+      dirty = true;
+    }
+    virtual size_t write(uint8_t c) {
+      if (col < COLS) {
+        char &cell = want[row][col];
+        if (cell != (char)c) {
+          cell = c;
+          dirty = true;
+        }
+      }
+      col++;
+      return 1;
+    }
+    using Print::write;
+
+    // Bring the real display up to date. If nothing's changed since the last time,
+    // this doesn't touch it.
+    void flush() {
+      if (!dirty) return;
+      dirty = false;
+      for(uint8_t r = 0; r < ROWS; r++) {
+        boolean placed = false;
+        for(uint8_t c = 0; c < COLS; c++) {
+          if (want[r][c] == shown[r][c]) {
+            placed = false;
+            continue;
+          }
+          // The real cursor moves along as it writes, so a run of changes needs
+          // only the one move.
+          if (!placed) lcd.setCursor(c, r);
+          placed = true;
+          lcd.write(want[r][c]);
+          shown[r][c] = want[r][c];
+        }
+      }
+      if (backlight != shown_backlight) {
+        lcd.setBacklight(backlight);
+        shown_backlight = backlight;
+      }
+    }
+
+  private:
+    LCD &lcd;
+    char want[ROWS][COLS];   // what the sketch has written
+    char shown[ROWS][COLS];  // what the real display shows
+    uint8_t col, row;
+    uint8_t backlight, shown_backlight;
+    boolean dirty;
+};
+
+#endif
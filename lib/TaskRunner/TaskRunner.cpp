@@ -0,0 +1,118 @@
+/*
+
+ TaskRunner - a cooperative scheduler for the J1772 Hydra
+ Copyright 2026 Nicholas W. Sayer
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program; if not, write to the Free Software Foundation, Inc.,
+ 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "TaskRunner.h"
+
+TaskRunner Tasks;
+
+static inline void count(unsigned int &counter) {
+  if (counter != 0xffff) counter++;
+}
+
+// Whether when is still in the future, as the ATmega sees it.
+static inline boolean before(unsigned long now, unsigned long when) {
+  return (int32_t)(uint32_t)(now - when) < 0;
+}
+
+void TaskRunner::add(Task *task, TaskFunction function, unsigned int period, unsigned int slack, unsigned char arg) {
+  task->function = function;
+  task->arg = arg;
+  task->period = period;
+  task->slack = slack;
+  task->due = millis();
+  task->armed = period != 0;
+  task->hist = NULL;
+  task->next = NULL;
+  Task **p = &head;
+  while(*p != NULL) p = &(*p)->next;
+  *p = task;
+  clearStats();
+}
+
+void TaskRunner::start(Task *task, unsigned long delay) {
+  task->due = millis() + delay;
+  task->armed = true;
+}
+
+boolean TaskRunner::pending(Task *task) {
+  if (!task->armed) return false;
+  if (before(millis(), task->due)) return true;
+  // One with a function is still to be run.
+  if (task->function == NULL) task->armed = false;
+  return false;
+}
+
+Task *TaskRunner::run() {
+  unsigned long now = millis();
+  for(Task *task = head; task != NULL; task = task->next) {
+    if (!task->armed || before(now, task->due)) continue;
+    if (task->function == NULL) {
+      // A plain deadline. It's expired, and that's all.
+      task->armed = false;
+      continue;
+    }
+
+    unsigned long behind = now - task->due;
+    if (behind > task->slack) count(task->late);
+    if (behind > task->worst_late) task->worst_late = behind > 0xffff ? 0xffff : behind;
+
+    // Keep to the schedule, so that the period is right on average.
+    if (task->period == 0) task->armed = false;
+    else task->due += task->period;
+
+    unsigned long start = micros();
+    task->function(task);
+    unsigned long took = micros() - start;
+
+    if (task->period != 0 && task->armed && !before(millis(), task->due)) {
+      // It's fallen a whole period behind. There's no sense in catching up, and
+      // if it were to run again right away, nothing after it would get a turn.
+      task->due = millis() + task->period;
+    }
+
+    count(task->runs);
+    task->busy_us += took;
+    if (took > task->worst_us) task->worst_us = took > 0xffff ? 0xffff : took;
+    if (task->hist != NULL) {
+      unsigned int bucket = 0;
+      for(unsigned long t = took / TASK_HIST_BASE; t != 0 && bucket < TASK_HIST_BUCKETS - 1; t >>= 1)
+        bucket++;
+      count(task->hist[bucket]);
+    }
+    return task;
+  }
+  return NULL;
+}
+
+void TaskRunner::histogram(Task *task, unsigned int *hist) {
+  task->hist = hist;
+  memset(hist, 0, TASK_HIST_BUCKETS * sizeof(*hist));
+}
+
+void TaskRunner::clearStats() {
+  for(Task *task = head; task != NULL; task = task->next) {
+    if (task->hist != NULL) memset(task->hist, 0, TASK_HIST_BUCKETS * sizeof(*task->hist));
+    task->runs = 0;
+    task->late = 0;
+    task->worst_late = 0;
+    task->worst_us = 0;
+    task->busy_us = 0;
+  }
+}
@@ -0,0 +1,114 @@
+/*
+
+ TaskRunner - a cooperative scheduler for the J1772 Hydra
+ Copyright 2026 Nicholas W. Sayer
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program; if not, write to the Free Software Foundation, Inc.,
+ 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef TaskRunner_h
+#define TaskRunner_h
+
+#include <Arduino.h>
+
+// loop() used to do everything, once per pass, in one long line. However long the
+// slowest thing took is how long everything else - the safety checks included - had
+// to wait for its next turn.
+//
+// Now each job is a task with a period of its own. loop() calls run(), which runs
+// the most important task that's due (the tasks are in order of importance, which
+// is the order they were added in) and returns. So between any two tasks, the most
+// important one that's due always goes next, and it never waits for more than one
+// other task to finish. Nothing here preempts anything: a task must do a bit of
+// work and return, never wait for something to happen.
+//
+// A task with a period of 0 is a one-shot. It runs once, some time after start(),
+// and then waits for the next start(). That makes it a deadline that can be moved
+// or cancelled: all of the protocol timeouts are one-shots, added right after the
+// safety checks, so they go off when they're due rather than whenever some loop
+// next gets around to comparing timestamps. A one-shot with no function is just a
+// deadline for something else to check with pending(), which works in the menus,
+// too. Add it to the runner all the same, so that run() disarms it once it expires.
+//
+// Every comparison with millis() is of a difference, so none of this minds it
+// rolling over (every 49.7 days), as long as no delay is longer than half of that.
+// But a deadline left armed for more than half of that would look to be in the
+// future again, which is why an expired one mustn't stay armed: pending() and run()
+// both disarm it. The differences are taken as 32 bits, so that the host build
+// (where a long is 64) sees the same.
+//
+// Each task keeps track of how often it ran, how often it started more than its
+// slack behind when it was due, and how long it ran for. Given somewhere to keep it
+// (with histogram()), it counts its run times in log2 buckets, too.
+
+// Bucket n counts runs shorter than (TASK_HIST_BASE << n) microseconds, and the last
+// one counts everything longer than that.
+#define TASK_HIST_BUCKETS 12
+#define TASK_HIST_BASE 128
+
+struct Task;
+
+// The function is handed its own task, so that it can tell which one it is (by arg,
+// say), or start() itself again.
+typedef void (*TaskFunction)(Task *task);
+
+struct Task {
+  TaskFunction function;
+  unsigned char arg;         // for the function, to tell one task from another that runs it
+  unsigned int period;       // milliseconds between runs, or 0 for a one-shot
+  unsigned int slack;        // how late (in milliseconds) it may start before it counts as late
+  unsigned long due;         // millis() when it's next to run
+  boolean armed;             // whether it's going to run at all
+  // Run time accounting, since the last clearStats(). The counts stick at their maximum.
+  unsigned int runs;
+  unsigned int late;         // how many runs started more than slack late
+  unsigned int worst_late;   // milliseconds
+  unsigned int worst_us;     // the longest run
+  unsigned long busy_us;     // all of the runs together
+  unsigned int *hist;        // TASK_HIST_BUCKETS run time counts, or NULL for none
+  Task *next;
+};
+
+class TaskRunner
+{
+  public:
+    // Add a task, after (and so less important than) all of the ones already added.
+    // A periodic task is armed, and due right away. A one-shot waits for start().
+    void add(Task *task, TaskFunction function, unsigned int period, unsigned int slack, unsigned char arg = 0);
+    // Arm a task to run delay milliseconds from now. For a periodic task, that
+    // moves all of the runs after it, too.
+    void start(Task *task, unsigned long delay);
+    // It won't run again until the next start().
+    void stop(Task *task) { task->armed = false; }
+    // Whether it's going to run again.
+    boolean running(const Task *task) { return task->armed; }
+    // Whether it's armed and not yet due. For a deadline with no function, that's
+    // whether it has yet to expire, and if it has, it's disarmed.
+    boolean pending(Task *task);
+    // Run the most important task that's due, and return it, or NULL if none were.
+    Task *run();
+    // The first task; each one's next is the one after it.
+    Task *first() { return head; }
+    // Count the task's run times into hist, which has TASK_HIST_BUCKETS counts.
+    void histogram(Task *task, unsigned int *hist);
+    void clearStats();
+
+  private:
+    Task *head;
+};
+
+extern TaskRunner Tasks;
+
+#endif
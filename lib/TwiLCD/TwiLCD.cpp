@@ -0,0 +1,269 @@
+/*
+
+ TwiLCD - a character LCD behind an MCP23017, on AsyncTWI, for the J1772 Hydra
+ Copyright 2026 Nicholas W. Sayer
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program; if not, write to the Free Software Foundation, Inc.,
+ 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <util/atomic.h>
+#include "TwiLCD.h"
+
+#define QUEUE_MASK (TWILCD_QUEUE - 1)
+
+// The MCP23017 registers, with IOCON.BANK set: each port's registers together.
+#define MCP_IODIRA 0x00
+#define MCP_GPINTENA 0x02
+#define MCP_INTCONA 0x04
+#define MCP_GPPUA 0x06
+#define MCP_GPIOA 0x09
+#define MCP_OLATA 0x0a
+#define MCP_IODIRB 0x10
+#define MCP_OLATB 0x1a
+// IOCON is at 0x05 with BANK set, and at 0x0a (or 0x0b) without it.
+#define MCP_IOCON_BANKED 0x05
+#define MCP_IOCON_UNBANKED 0x0a
+#define IOCON_BANK 0x80
+#define IOCON_SEQOP 0x20 // set to keep writing the same register, rather than moving on
+
+// Port A has the buttons on 0-4 and the red and green backlight on 6 and 7.
+// Port B has the blue backlight on 0 and the display on the rest. The backlight
+// is on when its line is low.
+#define BUTTON_MASK 0x1f
+#define A_RED _BV(6)
+#define A_GREEN _BV(7)
+#define B_BLUE _BV(0)
+#define B_RS _BV(7)
+#define B_E _BV(5)
+
+// The HD44780 commands we use.
+#define LCD_CLEAR 0x01
+#define LCD_HOME 0x02
+#define LCD_ENTRY_LEFT 0x06
+#define LCD_DISPLAY_ON 0x0c
+#define LCD_FUNCTION_4BIT 0x20
+#define LCD_FUNCTION_2LINE 0x08
+#define LCD_SET_DDRAM 0x80
+
+// Clearing and going home take the display much longer than anything else.
+#define LCD_CLEAR_MS 2
+
+static const uint8_t row_offsets[] = { 0x00, 0x40, 0x14, 0x54 };
+
+static const uint8_t gpioa_register = MCP_GPIOA;
+
+// Data line D4 is on port B's bit 4, D5 on 3, D6 on 2 and D7 on 1.
+static uint8_t nibbleBits(uint8_t n) {
+  uint8_t out = 0;
+  if (n & 0x1) out |= _BV(4);
+  if (n & 0x2) out |= _BV(3);
+  if (n & 0x4) out |= _BV(2);
+  if (n & 0x8) out |= _BV(1);
+  return out;
+}
+
+static void sent(TwiTransaction *t) {
+  ((TwiLCD *)t->context)->pump();
+}
+
+static void polled(TwiTransaction *t) {
+  ((TwiLCD *)t->context)->buttonsRead();
+}
+
+TwiLCD::TwiLCD(uint8_t address) {
+  out.address = address;
+  out.tx = out_buf;
+  out.rx = NULL;
+  out.rx_len = 0;
+  out.done = sent;
+  out.context = this;
+  out.status = TWI_OK;
+  poll.address = address;
+  poll.tx = &gpioa_register;
+  poll.tx_len = 1;
+  poll.rx = &gpioa;
+  poll.rx_len = 1;
+  poll.done = polled;
+  poll.context = this;
+  poll.status = TWI_OK;
+  gpioa = 0xff;
+  buttons = 0;
+  interrupting = reread = false;
+  op_head = op_tail = 0;
+  port_a_stale = port_b_stale = false;
+  rows = 2;
+}
+
+void TwiLCD::setRegister(uint8_t reg, uint8_t value) {
+  out_buf[0] = reg;
+  out_buf[1] = value;
+  out.tx_len = 2;
+  Twi.run(&out);
+}
+
+// A single strobe of the top four data lines, for while the display is in 8 bit mode.
+void TwiLCD::nibble(uint8_t n) {
+  uint8_t b = port_b | nibbleBits(n);
+  out_buf[0] = MCP_OLATB;
+  out_buf[1] = b | B_E;
+  out_buf[2] = b;
+  out.tx_len = 3;
+  Twi.run(&out);
+}
+
+void TwiLCD::begin(uint8_t cols, uint8_t r) {
+  rows = (r > sizeof(row_offsets)) ? sizeof(row_offsets) : r;
+  // After a reset of our own, the MCP23017 may still have its registers banked the
+  // way we leave them. This is IOCON then (and an unused interrupt enable if not),
+  // so clearing it gets to the power-on layout either way. Then bank them, and have
+  // a transaction write the same register over and over.
+  setRegister(MCP_IOCON_BANKED, 0);
+  setRegister(MCP_IOCON_UNBANKED, IOCON_BANK | IOCON_SEQOP);
+  port_a = A_RED | A_GREEN;
+  port_b = B_BLUE;
+  setRegister(MCP_OLATA, port_a);
+  setRegister(MCP_OLATB, port_b);
+  setRegister(MCP_IODIRA, BUTTON_MASK);
+  setRegister(MCP_GPPUA, BUTTON_MASK);
+  setRegister(MCP_IODIRB, 0);
+  // Whatever state the display was left in, three 8 bit function sets get it to
+  // 8 bit mode, and from there it can be told to take 4 bits at a time.
+  delay(50);
+  nibble(0x3);
+  delay(5);
+  nibble(0x3);
+  delay(1);
+  nibble(0x3);
+  delay(1);
+  nibble(0x2);
+  put(LCD_FUNCTION_4BIT | (rows > 1 ? LCD_FUNCTION_2LINE : 0), true);
+  put(LCD_DISPLAY_ON, true);
+  put(LCD_ENTRY_LEFT, true);
+  clear();
+  Twi.run(&poll);
+}
+
+void TwiLCD::interruptOnButtons() {
+  // INTA is active low and driven, and each change of a button (rather than a
+  // difference from DEFVAL) sets it off. Reading GPIOA lets it go again, so read
+  // it once now, in case something set it off already.
+  setRegister(MCP_INTCONA, 0);
+  setRegister(MCP_GPINTENA, BUTTON_MASK);
+  interrupting = true;
+  Twi.run(&poll);
+}
+
+void TwiLCD::buttonsChanged() {
+  // If a read is already queued, it will see this change. But it may already have
+  // read GPIOA, and so let INTA go, with nothing to say that it fell again since.
+  if (!Twi.queue(&poll)) reread = true;
+}
+
+void TwiLCD::buttonsRead() {
+  if (poll.status == TWI_OK) buttons = ~gpioa & BUTTON_MASK;
+  if (reread) {
+    reread = false;
+    Twi.queue(&poll);
+  }
+}
+
+// Wait for everything in the queue to go out.
+void TwiLCD::drain() {
+  while(op_head != op_tail || Twi.busy(&out))
+    Twi.wait(&out);
+}
+
+void TwiLCD::clear() {
+  put(LCD_CLEAR, true);
+  drain();
+  delay(LCD_CLEAR_MS);
+}
+
+void TwiLCD::home() {
+  put(LCD_HOME, true);
+  drain();
+  delay(LCD_CLEAR_MS);
+}
+
+void TwiLCD::setCursor(uint8_t col, uint8_t row) {
+  if (row >= rows) row = rows - 1;
+  put(LCD_SET_DDRAM | (col + row_offsets[row]), true);
+}
+
+void TwiLCD::setBacklight(uint8_t status) {
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    port_a = ((status & RED) ? 0 : A_RED) | ((status & GREEN) ? 0 : A_GREEN);
+    port_b = (status & BLUE) ? 0 : B_BLUE;
+    port_a_stale = port_b_stale = true;
+    pump();
+  }
+}
+
+size_t TwiLCD::write(uint8_t c) {
+  put(c, false);
+  return 1;
+}
+
+uint8_t TwiLCD::readButtons() {
+  // A read that failed would have left INTA down, so go and try again.
+  if (!interrupting || poll.status != TWI_OK) Twi.queue(&poll);
+  return buttons;
+}
+
+void TwiLCD::put(uint8_t op, boolean command) {
+  uint8_t next = (op_head + 1) & QUEUE_MASK;
+  // If it's full, the next lot to go out makes room.
+  while(next == op_tail)
+    Twi.wait(&out);
+  ops[op_head] = op;
+  if (command)
+    commands[op_head >> 3] |= _BV(op_head & 7);
+  else
+    commands[op_head >> 3] &= ~_BV(op_head & 7);
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    op_head = next;
+    pump();
+  }
+}
+
+void TwiLCD::pump() {
+  if (Twi.busy(&out)) return;
+  uint8_t n = 0;
+  if (port_a_stale) {
+    out_buf[n++] = MCP_OLATA;
+    out_buf[n++] = port_a;
+    port_a_stale = false;
+  } else if (op_tail != op_head || port_b_stale) {
+    // The latch goes back to the backlight alone first, which is harmless, and then
+    // each character or command is its two halves, each strobed in on the fall of E.
+    out_buf[n++] = MCP_OLATB;
+    out_buf[n++] = port_b;
+    port_b_stale = false;
+    for(uint8_t i = 0; i < TWILCD_BATCH && op_tail != op_head; i++) {
+      uint8_t op = ops[op_tail];
+      uint8_t b = port_b | ((commands[op_tail >> 3] & _BV(op_tail & 7)) ? 0 : B_RS);
+      uint8_t hi = b | nibbleBits(op >> 4);
+      uint8_t lo = b | nibbleBits(op & 0xf);
+      out_buf[n++] = hi | B_E;
+      out_buf[n++] = hi;
+      out_buf[n++] = lo | B_E;
+      out_buf[n++] = lo;
+      op_tail = (op_tail + 1) & QUEUE_MASK;
+    }
+  }
+  if (n == 0) return;
+  out.tx_len = n;
+  Twi.queue(&out);
+}
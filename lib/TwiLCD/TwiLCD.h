@@ -0,0 +1,112 @@
+/*
+
+ TwiLCD - a character LCD behind an MCP23017, on AsyncTWI, for the J1772 Hydra
+ Copyright 2026 Nicholas W. Sayer
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program; if not, write to the Free Software Foundation, Inc.,
+ 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef TwiLCD_h
+#define TwiLCD_h
+
+#include <Arduino.h>
+#include <AsyncTWI.h>
+
+// The Adafruit RGB LCD shield (or backpack): an HD44780 character display in 4 bit
+// mode, a three colour backlight and five buttons, all on an MCP23017. It's wired
+// the way LiquidTWI2 expects, and this does what LiquidTWI2 did with it, but over
+// AsyncTWI: characters and cursor moves are put in a queue and go out from the
+// TWI interrupt, several to a transaction, while the sketch carries on. Only
+// begin(), clear() and home() wait for the display.
+//
+// readButtons() doesn't wait either. It returns what the last read of the buttons
+// found, and starts another one, so the answer is as old as the time since the
+// last call (or the time one read takes, if that's longer).
+//
+// Better, if the MCP23017's INTA is wired to a pin change interrupt, is to call
+// interruptOnButtons() after begin(), and buttonsChanged() from that interrupt
+// whenever INTA goes low. The buttons are then only read when one of them has
+// changed, and readButtons() is nothing but a look at what was read last.
+
+// The characters and commands that can wait to go out. This must be a power of two.
+#define TWILCD_QUEUE 32
+// How many of them go in one transaction. Each is four bytes on the wire.
+#define TWILCD_BATCH 8
+
+// The backlight colours: one bit each for red, green and blue.
+#define OFF 0x0
+#define RED 0x1
+#define GREEN 0x2
+#define YELLOW 0x3
+#define BLUE 0x4
+#define VIOLET 0x5
+#define TEAL 0x6
+#define WHITE 0x7
+
+// The buttons, as readButtons() reports them.
+#define BUTTON_UP 0x08
+#define BUTTON_DOWN 0x04
+#define BUTTON_LEFT 0x10
+#define BUTTON_RIGHT 0x02
+#define BUTTON_SELECT 0x01
+
+class TwiLCD : public Print
+{
+  public:
+    TwiLCD(uint8_t address);
+    // Set up the MCP23017 and the display, and clear it. The TWI must already be begun.
+    // The bottom two lines of a four line display are addressed the way a 20 column
+    // one lays them out.
+    void begin(uint8_t cols, uint8_t rows);
+    void clear();
+    void home();
+    void setCursor(uint8_t col, uint8_t row);
+    void setBacklight(uint8_t status);
+    uint8_t readButtons();
+    // Have INTA go low whenever a button changes, and stop polling them.
+    void interruptOnButtons();
+    // Called from the interrupt on INTA, to read the buttons (which lets INTA go again).
+    void buttonsChanged();
+    virtual size_t write(uint8_t c);
+    using Print::write;
+    // Send the next lot of whatever's waiting, if the last lot has gone. Called from
+    // the TWI interrupt as each one finishes.
+    void pump();
+    // Called from the TWI interrupt when a read of the buttons finishes.
+    void buttonsRead();
+
+  private:
+    uint8_t rows;
+    TwiTransaction out, poll;
+    uint8_t out_buf[2 + 4 * TWILCD_BATCH];
+    uint8_t gpioa;
+    volatile uint8_t buttons;
+    boolean interrupting;
+    volatile boolean reread; // they changed again while a read was already under way
+    // The queue, and a bit for each entry that's a command rather than a character.
+    uint8_t ops[TWILCD_QUEUE];
+    uint8_t commands[TWILCD_QUEUE / 8];
+    volatile uint8_t op_head, op_tail;
+    // What the two ports' latches should hold, less the display's own lines (that is,
+    // the backlight), and whether they need to be sent.
+    uint8_t port_a, port_b;
+    volatile boolean port_a_stale, port_b_stale;
+    void put(uint8_t op, boolean command);
+    void drain();
+    void setRegister(uint8_t reg, uint8_t value);
+    void nibble(uint8_t n);
+};
+
+#endif